@@ -1,7 +1,9 @@
 #include "ak8963.h"
 #include "util/io/i2c.h"
 #include "util/io/spi.h"
+#include "util/io/reg_shadow.h"
 #include "util/logger.h"
+#include "util/tv.h"
 #include <unistd.h>
 
 #define AK_ADDRESS 0x0c // I2C Address of AK8963.
@@ -21,35 +23,77 @@
 #define AK_ASAY 0x11 // AK8963 ASA Y.
 #define AK_ASAZ 0x12 // AK8963 ASA Z.
 
+#define AK_RESET_POLL_US 100 // Interval of CNTL2 polls while resetting.
+#define AK_RESET_TIMEOUT_US 20000 // Each poll through MPU waits for a sample tick.
+#define AK_POWER_DOWN_US 100 // Time in power-down before another mode can be set.
+
 
 #define AK8963_USE_SPI // Uncommend to enable I2C spi.
 
 #ifdef AK8963_USE_SPI
 // Use SPI.
 #include "mpu6050.h"
-#define AK_WRITE(reg, data) mpu_slave_write(AK_ADDRESS, reg, data)
-#define AK_READ(reg, data) mpu_slave_read(AK_ADDRESS, reg, data)
-#define AK_READ_ARRAY(reg, data, n) mpu_slave_read_array(AK_ADDRESS, reg, data, n)
-#define AK_WRITE_BIT(reg, data, n, offset) mpu_slave_write_bit(AK_ADDRESS, reg, data, n, offset)
-#define AK_READ_BIT(reg, data, n, offset) mpu_slave_read_bit(AK_ADDRESS, reg, data, n, offset)
+
+static struct MPU *_mpu; // MPU whose I2C master reaches AK8963, set in ak_init.
+
+#define AK_WRITE(reg, data) mpu_slave_write(_mpu, AK_ADDRESS, reg, data)
+#define AK_READ(reg, data) mpu_slave_read(_mpu, AK_ADDRESS, reg, data)
+#define AK_READ_ARRAY(reg, data, n) mpu_slave_read_array(_mpu, AK_ADDRESS, reg, data, n)
+#define AK_WRITE_BIT(reg, data, n, offset) mpu_slave_write_bit(_mpu, AK_ADDRESS, reg, data, n, offset)
+#define AK_READ_BIT(reg, data, n, offset) mpu_slave_read_bit(_mpu, AK_ADDRESS, reg, data, n, offset)
+#define AK_SET_SHADOW(shadow) mpu_slave_set_shadow(_mpu, AK_ADDRESS, shadow)
 
 #else
 // Use I2C.
-#define AK_WRITE(reg, data) i2c_write(AK_ADDRESS, reg, data)
-#define AK_READ(reg, data) i2c_read(AK_ADDRESS, reg, data)
-#define AK_READ_ARRAY(reg, data, n) i2c_read_array(AK_ADDRESS, reg, data, n)
-#define AK_WRITE_BIT(reg, data, n, offset) i2c_write_bit(AK_ADDRESS, reg, data, n, offset)
-#define AK_READ_BIT(reg, data, n, offset) i2c_read_bit(AK_ADDRESS, reg, data, n, offset)
+#define AK_I2C_BUS "/dev/i2c-1"
+
+static struct I2CBus *_i2c; // Opened in ak_init and kept for every access.
+
+#define AK_WRITE(reg, data) i2c_write(_i2c, AK_ADDRESS, reg, data)
+#define AK_READ(reg, data) i2c_read(_i2c, AK_ADDRESS, reg, data)
+#define AK_READ_ARRAY(reg, data, n) i2c_read_array(_i2c, AK_ADDRESS, reg, data, n)
+#define AK_WRITE_BIT(reg, data, n, offset) i2c_write_bit(_i2c, AK_ADDRESS, reg, data, n, offset)
+#define AK_READ_BIT(reg, data, n, offset) i2c_read_bit(_i2c, AK_ADDRESS, reg, data, n, offset)
+#define AK_SET_SHADOW(shadow) i2c_set_shadow(_i2c, AK_ADDRESS, shadow)
 #endif // AK8963_USE_SPI
+
+static struct RegShadow *_shadow; // Register shadow of AK8963.
 //-----
 
 /**
  * @brief Initiator of AK module.
  * 
+ * @param mpu 
+ *      MPU whose I2C master reaches AK8963, in master mode. Ignored on I2C.
  * @return 0 if success else -1.
  */
-int ak_init(){
+int ak_init(struct MPU *mpu){
     LOG("Initiating AK8963.\n");
+#ifdef AK8963_USE_SPI
+    if (_mpu != mpu && _shadow != NULL) {
+        // Move the shadow to the I2C master of the new MPU.
+        AK_SET_SHADOW(NULL);
+        reg_shadow_invalidate(_shadow);
+        _mpu = mpu;
+        AK_SET_SHADOW(_shadow);
+    }
+    _mpu = mpu;
+#else
+    if (_i2c == NULL && (_i2c = i2c_open(AK_I2C_BUS)) == NULL) {
+        LOG_ERROR("Failed to open I2C bus.\n");
+        return -1;
+    }
+#endif // AK8963_USE_SPI
+    if (_shadow == NULL) {
+        if ((_shadow = reg_shadow_init()) == NULL) {
+            LOG_ERROR("Failed to create register shadow.\n");
+            return -1;
+        }
+        // Status, data and soft reset registers.
+        reg_shadow_set_volatile(_shadow, AK_ST1, AK_ST2 - AK_ST1 + 1);
+        reg_shadow_set_volatile(_shadow, AK_CNTL2, 1);
+        AK_SET_SHADOW(_shadow);
+    }
     // Check WIA.
     uint8_t wia;
     if (AK_READ(AK_WIA, &wia) != 0) {
@@ -60,12 +104,13 @@ int ak_init(){
         LOG_ERROR("WIA doesn't match.(Expect: 0x48, got: 0x%02x)\n", wia);
         return -1;
     }
-    usleep(1000);
 
     // Reset.
     LOG("Resetting...\n");
-    ak_reset();
-    usleep(1000);
+    if (ak_reset() != 0) {
+        LOG_ERROR("Failed to reset.\n");
+        return -1;
+    }
     LOG("Done.\n");
     return 0;
 }
@@ -76,7 +121,25 @@ int ak_init(){
  * @return 0 if success else -1.
  */
 int ak_reset() {
-    return AK_WRITE_BIT(AK_CNTL2, 1, 1, 0);
+    if (AK_WRITE_BIT(AK_CNTL2, 1, 1, 0) != 0) {
+        return -1;
+    }
+    // Every register is back to default.
+    reg_shadow_invalidate(_shadow);
+    // SRST clears by itself once the reset is done.
+    struct timeval start, now;
+    gettimeofday(&start, NULL);
+    while (1) {
+        uint8_t cntl2;
+        if (AK_READ(AK_CNTL2, &cntl2) == 0 && !(cntl2 & 0x01)) {
+            return 0;
+        }
+        gettimeofday(&now, NULL);
+        if (tv_get_diff_usec_ul(&start, &now) > AK_RESET_TIMEOUT_US) {
+            return -1;
+        }
+        usleep(AK_RESET_POLL_US);
+    }
 }
 
 /**
@@ -142,6 +205,8 @@ int ak_read_single(int16_t *x, int16_t *y, int16_t *z){
         // NOT READY
         return -1;
     }
+    // Mode went back to power-down after the measurement.
+    reg_shadow_invalidate(_shadow);
     ak_set_mode(AK_MODE_SINGLE_MEASUREMENT);
     return 0;
 }
@@ -200,6 +265,10 @@ int ak_get_bit(uint8_t *bit) {
 }
 
 int ak_set_mode(uint8_t mode) {
+    if (mode != AK_MODE_POWER_DOWN) {
+        // Modes are changed through power-down, which has to last Twat.
+        usleep(AK_POWER_DOWN_US);
+    }
     return AK_WRITE_BIT(AK_CNTL1, mode, 4, 0);
 }
 
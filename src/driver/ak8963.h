@@ -25,7 +25,9 @@ enum AK_MODE {
     AK_MODE_FUSE_ROM_ACCESS = 0x0f
 };
 
-int ak_init();
+struct MPU;
+
+int ak_init(struct MPU *mpu);
 
 int ak_reset();
 
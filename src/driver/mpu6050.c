@@ -1,17 +1,19 @@
 #include "mpu6050.h"
 #include "util/io/i2c.h"
 #include "util/io/spi.h"
+#include "util/io/reg_shadow.h"
+#include "util/io/gpio.h"
 
 #include "util/logger.h"
 #include "util/debug.h"
+#include "util/tv.h"
 
+#include <stdlib.h>
 #include <unistd.h>
+#include <time.h>
 
 //-----
-static uint8_t _dev_addr = 0x68; // Device address found.
-#define MPU_ADDRESS _dev_addr
-#define MPU_ADDRESS_AD0_HI 0x69
-#define MPU_ADDRESS_AD0_LO 0x68
+#define MPU_ADDRESS mpu->dev_addr
 
 //----- Register addresses-----
 
@@ -64,6 +66,11 @@ static uint8_t _dev_addr = 0x68; // Device address found.
 #define MPU_USER_CTRL 0x6a
 #define MPU_I2C_DELAY_CTRL 0x67
 #define MPU_I2C_MST_CTRL 0x24
+#define MPU_I2C_MST_STATUS 0x36
+#define MPU_EXT_SENS_DATA_23 0x60
+#define MPU_SIGNAL_PATH_RESET 0x68
+#define MPU_FIFO_COUNTH 0x72
+#define MPU_FIFO_R_W 0x74
 
 #define MPU_I2C_SLV0_ADDR 0x25
 #define MPU_I2C_SLV0_REG  0x26
@@ -95,27 +102,36 @@ static uint8_t _dev_addr = 0x68; // Device address found.
 
 #define MPU_WHO_AM_I 0x75
 
+#define MPU_FIFO_CHUNK (18 * MPU_FIFO_FRAME_SIZE) // Whole frames fitting one 255 byte read.
+
 #define MPU_USE_SPI
 
 #ifdef MPU_USE_SPI
 // Use SPI.
-#define MPU_SPI_DEVICE "/dev/spidev0.0"
-
-#define MPU_WRITE(reg, data) spi_write(MPU_SPI_DEVICE, reg, data)
-#define MPU_READ(reg, data) spi_read(MPU_SPI_DEVICE, reg, data)
-#define MPU_WRITE_ARRAY(reg, data, n) spi_write_array(MPU_SPI_DEVICE, reg, data, n)
-#define MPU_READ_ARRAY(reg, data, n) spi_read_array(MPU_SPI_DEVICE, reg, data, n)
-#define MPU_WRITE_BIT(reg, data, n, offset) spi_write_bit(MPU_SPI_DEVICE, reg, data, n, offset)
-#define MPU_READ_BIT(reg, data, n, offset) spi_read_bit(MPU_SPI_DEVICE, reg, data, n, offset)
+#define MPU_SPI_MODE 0 // SPI_MODE_0
+#define MPU_SPI_BITS 8
+#define MPU_SPI_SPEED 1000000 // 1MHz for configuration registers.
+#define MPU_SPI_DATA_SPEED 20000000 // 20MHz for sensor and interrupt registers, read only.
+
+#define MPU_WRITE(reg, data) spi_write(mpu->spi, reg, data)
+#define MPU_READ(reg, data) spi_read(mpu->spi, reg, data)
+#define MPU_WRITE_ARRAY(reg, data, n) spi_write_array(mpu->spi, reg, data, n)
+#define MPU_READ_ARRAY(reg, data, n) spi_read_array(mpu->spi, reg, data, n)
+#define MPU_READ_DATA(reg, data, n) spi_read_array_at(mpu->spi, SPI_PROFILE_DATA, reg, data, n)
+#define MPU_WRITE_BIT(reg, data, n, offset) spi_write_bit(mpu->spi, reg, data, n, offset)
+#define MPU_READ_BIT(reg, data, n, offset) spi_read_bit(mpu->spi, reg, data, n, offset)
+#define MPU_SET_SHADOW(shadow) spi_set_shadow(mpu->spi, shadow)
 
 #else
 // Use I2C.
-#define MPU_WRITE(reg, data) i2c_write(MPU_ADDRESS, reg, data)
-#define MPU_READ(reg, data) i2c_read(MPU_ADDRESS, reg, data)
-#define MPU_WRITE_ARRAY(reg, data, n) i2c_write_array(MPU_ADDRESS, reg, data, n)
-#define MPU_READ_ARRAY(reg, data, n) i2c_read_array(MPU_ADDRESS, reg, data, n)
-#define MPU_WRITE_BIT(reg, data, n, offset) i2c_write_bit(MPU_ADDRESS, reg, data, n, offset)
-#define MPU_READ_BIT(reg, data, n, offset) i2c_read_bit(MPU_ADDRESS, reg, data, n, offset)
+#define MPU_WRITE(reg, data) i2c_write(mpu->i2c, MPU_ADDRESS, reg, data)
+#define MPU_READ(reg, data) i2c_read(mpu->i2c, MPU_ADDRESS, reg, data)
+#define MPU_WRITE_ARRAY(reg, data, n) i2c_write_array(mpu->i2c, MPU_ADDRESS, reg, data, n)
+#define MPU_READ_ARRAY(reg, data, n) i2c_read_array(mpu->i2c, MPU_ADDRESS, reg, data, n)
+#define MPU_READ_DATA(reg, data, n) i2c_read_array(mpu->i2c, MPU_ADDRESS, reg, data, n)
+#define MPU_WRITE_BIT(reg, data, n, offset) i2c_write_bit(mpu->i2c, MPU_ADDRESS, reg, data, n, offset)
+#define MPU_READ_BIT(reg, data, n, offset) i2c_read_bit(mpu->i2c, MPU_ADDRESS, reg, data, n, offset)
+#define MPU_SET_SHADOW(shadow) i2c_set_shadow(mpu->i2c, MPU_ADDRESS, shadow)
 #endif // MPU_USE_SPI
 
 // Real velue = Reading / scale
@@ -134,65 +150,310 @@ const float ACCEL_SCALE_TABLE[4] = {
     2048.0f
 };
 
-static float scale_g; // Resolution/Sensitivity value of Gyro.
-static float scale_a; // Resolution/Sensitivity value of Accelerometer.
+#define MPU_SLAVE_POLL_US 50 // Interval of I2C_MST_STATUS polls in blocking slave access.
+#define MPU_SLAVE_TIMEOUT_US 10000 // SLV4 waits for a sample tick, up to 1ms at 1kHz, plus the transfer.
+#define MPU_READY_POLL_US 100 // Interval of polls while a reset bit is set.
+#define MPU_RESET_TIMEOUT_US 100000 // Start-up time of MPU9250 is 100ms at most.
+#define MPU_EDGE_MAX_AGE_NS 100000000ULL // Older INT edges aren't counted forward, clocks drift apart.
+
+// State of one chip, created by mpu_open.
+struct MPU {
+#ifdef MPU_USE_SPI
+    struct SPIDevice *spi; // Opened in mpu_open and kept for every access.
+    struct SPITransaction *read_all_trans; // Burst read of mpu_read_raw, built in mpu_open.
+    uint8_t read_all_buf[22]; // Filled by read_all_trans. ACCEL: 6, TEMP: 2, GYRO:6, EXT MAG: 8.
+    struct SPITransaction *count_trans; // Read of FIFO_COUNTH ~ FIFO_COUNTL, built in mpu_open.
+    struct SPITransaction *fifo_trans; // Reads of FIFO_R_W, rebuilt by every mpu_read_fifo.
+#else
+    struct I2CBus *i2c; // Opened in mpu_open and kept for every access.
+    uint8_t dev_addr; // Address selected by AD0.
+#endif // MPU_USE_SPI
+    uint8_t count_buf[2]; // FIFO_COUNTH and FIFO_COUNTL of last mpu_read_fifo.
+
+    uint64_t edge_ns; // Newest INT edge seen by mpu_wait_data_ready, 0 if none.
+    uint64_t period_ns; // Sample interval, 0 until computed after a rate change.
+    uint64_t timestamp_ns; // Time of the newest sample at the last read.
+
+    struct GPIOEdge *drdy; // Rising edges of INT pin, NULL if data ready interrupt is disabled.
+
+    float scale_g; // Resolution/Sensitivity value of Gyro.
+    float scale_a; // Resolution/Sensitivity value of Accelerometer.
+
+    struct RegShadow *shadow; // Register shadow of MPU.
+    struct RegShadow *slave_shadows[128]; // Register shadow of each slave behind the I2C master.
+
+    bool mag_auto_read; // True if SLV0 keeps reading AK8963 into EXT_SENS_DATA.
+    uint8_t mst_dly; // I2C_MST_DLY kept in I2C_SLV4_CTRL.
+    bool fifo_enabled; // True if samples are counted by FIFO frames, else by sample times.
+    uint32_t mag_samples; // Samples taken since EXT_SENS_DATA was last taken as new.
+    uint64_t mag_count_ns; // Newest sample counted by time, 0 to start counting at next read.
+
+    // Single transfer of SLV4 in progress.
+    struct {
+        bool busy;
+        bool read; // True if reading else writing.
+        uint8_t dev_addr;
+        uint8_t reg_addr;
+        uint8_t data; // Byte to write, or byte read when done.
+        struct timeval start; // Time the transfer began.
+    } slv4;
+};
+
+static int mpu_init_shadow(struct MPU *mpu);
+
+static int mpu_wait_reset(struct MPU *mpu);
+
+static int mpu_wait_clear(struct MPU *mpu, uint8_t reg_addr, uint8_t mask, unsigned long timeout_us);
+
+static void mpu_decode_raw(struct MPU *mpu, const uint8_t *buf, int16_t *raw, bool *mag_ready);
+
+static bool mpu_mag_is_new(struct MPU *mpu);
+
+static int mpu_decode_fifo(struct MPU *mpu, const uint8_t *buf, int n, struct MPUSample *samples);
+
+static int mpu_get_fifo_frames(struct MPU *mpu, int max_samples);
+
+static int mpu_get_sample_rate(struct MPU *mpu, float *rate_hz);
+
+static uint64_t mpu_get_newest_sample_ns(struct MPU *mpu, uint64_t read_ns);
+
+static uint64_t mpu_now_ns();
+
+static int mpu_set_slave0(struct MPU *mpu, uint8_t dev_addr, uint8_t reg_addr, uint8_t len);
+
+static int mpu_slave_begin(struct MPU *mpu, uint8_t dev_addr, uint8_t reg_addr, uint8_t data, bool read);
+
+static int mpu_slave_wait(struct MPU *mpu, uint8_t *data);
+
+#ifdef MPU_USE_SPI
+static int mpu_build_transactions(struct MPU *mpu);
+
+static int mpu_build_fifo_read(struct MPU *mpu, uint8_t *buf, int len);
+#else
+static int mpu_read_fifo_data(struct MPU *mpu, uint8_t *buf, int len);
+#endif // MPU_USE_SPI
 
 //-----
 
 /**
- * @brief Initiator of mpu module.
+ * @brief Open an MPU and initiate it. Each chip is a separate handle,
+ * e.g. redundant IMUs on two chip selects.
  * 
- * @return 0 if success else -1.
+ * @param path 
+ *      SPI device, e.g. "/dev/spidev0.0", or I2C bus, e.g. "/dev/i2c-1".
+ * @param dev_addr 
+ *      MPU_ADDRESS_AD0_LO or MPU_ADDRESS_AD0_HI on I2C, ignored on SPI.
+ * @return Handle of MPU, NULL if fail.
  */
-int mpu_init(){
-    LOG("Initiating MPU module.\n");
+struct MPU *mpu_open(const char *path, uint8_t dev_addr) {
+    LOG("Initiating MPU on %s.\n", path);
+    struct MPU *mpu = calloc(1, sizeof(struct MPU));
+    if (mpu == NULL) {
+        LOG_ERROR("Failed to allocate MPU.\n");
+        return NULL;
+    }
+#ifdef MPU_USE_SPI
+    if ((mpu->spi = spi_open(path, MPU_SPI_MODE, MPU_SPI_BITS, MPU_SPI_SPEED)) == NULL) {
+        LOG_ERROR("Failed to open SPI device.\n");
+        goto ERROR;
+    }
+    if (spi_set_profile_speed(mpu->spi, SPI_PROFILE_DATA, MPU_SPI_DATA_SPEED) != 0) {
+        LOG_ERROR("Failed to set data clock.\n");
+        goto ERROR;
+    }
+    if (mpu_build_transactions(mpu) != 0) {
+        LOG_ERROR("Failed to build read transactions.\n");
+        goto ERROR;
+    }
+    if ((mpu->fifo_trans = spi_transaction_init(MPU_FIFO_SIZE / MPU_FIFO_CHUNK + 1)) == NULL) {
+        LOG_ERROR("Failed to create FIFO transaction.\n");
+        goto ERROR;
+    }
+#else
+    mpu->dev_addr = dev_addr;
+    if ((mpu->i2c = i2c_open(path)) == NULL) {
+        LOG_ERROR("Failed to open I2C bus.\n");
+        goto ERROR;
+    }
+#endif // MPU_USE_SPI
+    if (mpu_init_shadow(mpu) != 0) {
+        LOG_ERROR("Failed to create register shadow.\n");
+        goto ERROR;
+    }
     // Check WHO AM I
 
     uint8_t who_am_i;
     if (MPU_READ(MPU_WHO_AM_I, &who_am_i) != 0) {
         LOG_ERROR("Failed to read.\n");
-        return -1;
+        goto ERROR;
     }
     if (who_am_i != 0x71) {
         LOG_ERROR("WHO AM I doesn't match.(who_am_i: 0x%02x)\n", who_am_i);
-        return -1;
+        goto ERROR;
     }
-    usleep(1000);
 
     LOG("Resetting.\n");
-    mpu_reset();
+    if (mpu_reset(mpu) != 0) {
+        goto ERROR;
+    }
 
     MPU_WRITE(MPU_PWR_MGMT, 0x01);
-    usleep(1000);
     MPU_WRITE(MPU_INT_PIN_CFG, 0x30);
-    usleep(1000);
 
-    scale_a = ACCEL_SCALE_TABLE[0];
+    mpu->scale_a = ACCEL_SCALE_TABLE[0];
     
-    scale_g = GYRO_SCALE_TABLE[0];
+    mpu->scale_g = GYRO_SCALE_TABLE[0];
 
     LOG("Done.\n");
-    return 0;
+    return mpu;
+
+    ERROR:
+    mpu_close(mpu);
+    return NULL;
+}
+
+/**
+ * @brief Release INT pin, close the bus and free the handle.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ */
+void mpu_close(struct MPU *mpu) {
+    if (mpu == NULL) {
+        return;
+    }
+    if (mpu->drdy != NULL) {
+        gpio_edge_release(mpu->drdy);
+    }
+#ifdef MPU_USE_SPI
+    spi_transaction_destroy(mpu->read_all_trans);
+    spi_transaction_destroy(mpu->count_trans);
+    spi_transaction_destroy(mpu->fifo_trans);
+    if (mpu->spi != NULL) {
+        spi_close(mpu->spi);
+    }
+#else
+    if (mpu->i2c != NULL) {
+        i2c_close(mpu->i2c);
+    }
+#endif // MPU_USE_SPI
+    reg_shadow_destroy(mpu->shadow);
+    free(mpu);
 }
 
 /**
  * @brief Reset MPU module.
  * 
+ * @param mpu 
+ *      Handle of MPU.
  * @return 0 if success, else -1.
  */
-int mpu_reset() {
+int mpu_reset(struct MPU *mpu) {
     if (MPU_WRITE_BIT(MPU_PWR_MGMT, 1, 1, 7) != 0) {
         LOG_ERROR("Failed to reset.\n");
         return -1;
     }
-    usleep(1000);
+    // Every register is back to default.
+    reg_shadow_invalidate(mpu->shadow);
+    mpu->mag_auto_read = false;
+    mpu->mst_dly = 0;
+    mpu->fifo_enabled = false;
+    mpu->slv4.busy = false;
+    mpu->period_ns = 0;
+    mpu->edge_ns = 0;
+    if (mpu_wait_reset(mpu) != 0) {
+        LOG_ERROR("MPU isn't back from reset.\n");
+        return -1;
+    }
     return 0;
 }
 
+/**
+ * @brief Read all data at once without scaling.
+ * Magnetometer is read from EXT_SENS_DATA, see mpu_enable_mag_auto_read.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @param raw 
+ *      Accelerometer, gyroscope and magnetometer counts, indexed by MPU_RAW_*.
+ *      Magnetometer is left untouched if there's no new reading.
+ * @param mag_ready 
+ *      True if AK8963 get new reading else false.
+ * @return 0 if success else -1.
+ */
+int mpu_read_raw(struct MPU *mpu, int16_t raw[MPU_RAW_AXES], bool *mag_ready) {
+    return mpu_read_raw_all(&mpu, 1, &raw, mag_ready, NULL);
+}
+
+/**
+ * @brief mpu_read_raw for several MPUs, e.g. redundant IMUs. On SPI the
+ * burst reads go out back to back while the bus is held, so the readings
+ * are taken as close together as possible.
+ * 
+ * @param mpu 
+ *      Handles of MPUs.
+ * @param n 
+ *      Number of MPUs, up to MPU_MAX_BATCH.
+ * @param raw 
+ *      Destination of each MPU, see mpu_read_raw.
+ * @param mag_ready 
+ *      Set for each MPU, see mpu_read_raw.
+ * @param ret 
+ *      Set to 0 if each MPU was read else -1. NULL to ignore.
+ * @return 0 if all MPUs were read else -1.
+ */
+int mpu_read_raw_all(struct MPU **mpu, int n, int16_t **raw, bool *mag_ready, int *ret) {
+    if (n > MPU_MAX_BATCH) {
+        LOG_ERROR("Too many MPUs.(n: %d)\n", n);
+        return -1;
+    }
+    int i, result = 0;
+    int r[MPU_MAX_BATCH];
+#ifdef MPU_USE_SPI
+    struct SPIDevice *spi[MPU_MAX_BATCH];
+    struct SPITransaction *t[MPU_MAX_BATCH];
+    for (i = 0; i < n; i++) {
+        spi[i] = mpu[i]->spi;
+        t[i] = mpu[i]->read_all_trans;
+    }
+    spi_transaction_submit_all(spi, t, n, r);
+    uint64_t read_ns = mpu_now_ns();
+    for (i = 0; i < n; i++) {
+        mpu[i]->timestamp_ns = mpu_get_newest_sample_ns(mpu[i], read_ns);
+    }
+#else
+    uint8_t bufs[MPU_MAX_BATCH][22]; // byte count: ACCEL: 6, TEMP: 2, GYRO:6, EXT MAG: 8.
+    for (i = 0; i < n; i++) {
+        r[i] = i2c_read_array(mpu[i]->i2c, mpu[i]->dev_addr, MPU_ACCEL_XOUT_H, bufs[i], sizeof(bufs[i]));
+        mpu[i]->timestamp_ns = mpu_get_newest_sample_ns(mpu[i], mpu_now_ns());
+    }
+#endif // MPU_USE_SPI
+    for (i = 0; i < n; i++) {
+        mag_ready[i] = false;
+        if (ret != NULL) {
+            ret[i] = r[i] == 0 ? 0 : -1;
+        }
+        if (r[i] != 0) {
+            LOG_ERROR("Failed to read.\n");
+            result = -1;
+            continue;
+        }
+#ifdef MPU_USE_SPI
+        mpu_decode_raw(mpu[i], mpu[i]->read_all_buf, raw[i], &mag_ready[i]);
+#else
+        mpu_decode_raw(mpu[i], bufs[i], raw[i], &mag_ready[i]);
+#endif // MPU_USE_SPI
+    }
+    return result;
+}
+
 /**
  * @brief Read all data at once.
  * Values are already scaled in the function.
+ * Magnetometer is read from EXT_SENS_DATA, see mpu_enable_mag_auto_read.
  * 
+ * @param mpu 
+ *      Handle of MPU.
  * @param ax Accelerometer x axis value. 
  * @param ay Accelerometer y axis value. 
  * @param az Accelerometer z axis value. 
@@ -206,74 +467,60 @@ int mpu_reset() {
  *      True if AK8963 get new reading else false.
  * @return 0 if success else -1.
  */
-int mpu_read_all(
+int mpu_read_all(struct MPU *mpu,
     float *ax, float *ay, float *az,
     float *gx, float *gy, float *gz,
     float *mx, float *my, float *mz,
     bool *mag_ready) {
 
-    // 0x0c: Address of AK8963.
-    if (MPU_WRITE(MPU_I2C_SLV0_ADDR, 0x0c | 0x80) != 0) {
-        LOG_ERROR("Failed to write addr.\n");
-        return -1;
-    }
-    // Start from AK_XOUTL
-    if (MPU_WRITE(MPU_I2C_SLV0_REG, 0x02) != 0) {
-        LOG_ERROR("Failed to write reg.\n");
+    int16_t raw[MPU_RAW_AXES];
+    if (mpu_read_raw(mpu, raw, mag_ready) != 0) {
         return -1;
     }
-    if (MPU_WRITE(MPU_I2C_SLV0_CTRL, (0x88)) != 0) {
-        LOG_ERROR("Failed to write ctrl.\n");
-        return -1;
+    *ax = (float)raw[MPU_RAW_AX + 0] / mpu->scale_a;
+    *ay = (float)raw[MPU_RAW_AX + 1] / mpu->scale_a;
+    *az = (float)raw[MPU_RAW_AX + 2] / mpu->scale_a;
+
+    *gx = (float)raw[MPU_RAW_GX + 0] / mpu->scale_g;
+    *gy = (float)raw[MPU_RAW_GX + 1] / mpu->scale_g;
+    *gz = (float)raw[MPU_RAW_GX + 2] / mpu->scale_g;
+
+    if (*mag_ready) {
+        *mx = (float)raw[MPU_RAW_MX + 0];
+        *my = (float)raw[MPU_RAW_MX + 1];
+        *mz = (float)raw[MPU_RAW_MX + 2];
     }
+    return 0;
+}
 
-    uint8_t buf[22]; // byte count: ACCEL: 6, TEMP: 2, GYRO:6, EXT MAG: 8.
-    int16_t _ax, _ay, _az, _gx, _gy, _gz, _mx, _my, _mz; // Temperary variables.
-
-    MPU_READ_ARRAY(MPU_ACCEL_XOUT_H, buf, sizeof(buf));
-
-
-    _ax = ((int16_t)buf[0] << 8) | buf[1];
-    _ay = ((int16_t)buf[2] << 8) | buf[3];
-    _az = ((int16_t)buf[4] << 8) | buf[5];    
-    
-    _gx = ((int16_t)buf[8] << 8) | buf[9];
-    _gy = ((int16_t)buf[10] << 8) | buf[11];
-    _gz = ((int16_t)buf[12] << 8) | buf[13];
-
-    *ax = (float)_ax / scale_a;
-    *ay = (float)_ay / scale_a;
-    *az = (float)_az / scale_a;
-
-    *gx = (float)_gx / scale_g;
-    *gy = (float)_gy / scale_g;
-    *gz = (float)_gz / scale_g;
-    
-    *mag_ready = false;
+/**
+ * @brief Get sensitivity of accelerometer for raw readings.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @return Counts per g.
+ */
+float mpu_get_accel_scale(struct MPU *mpu) {
+    return mpu->scale_a;
+}
 
-    if (buf[14] & 0x01) {
-        // Data ready in ST1.
-        if (!(buf[21] &0x08)) {
-            // No overflow in ST2
-            _mx = ((int16_t)buf[16]) << 8 | buf[15];
-            _my = ((int16_t)buf[18]) << 8 | buf[17];
-            _mz = ((int16_t)buf[20]) << 8 | buf[19];
-            *mx = (float)_mx;
-            *my = (float)_my;
-            *mz = (float)_mz;
-            *mag_ready = true;
-        } else {
-            LOG_ERROR("Overflow!\n");
-        }
-    }
-    
-    return 0;
+/**
+ * @brief Get sensitivity of gyroscope for raw readings.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @return Counts per degree/s.
+ */
+float mpu_get_gyro_scale(struct MPU *mpu) {
+    return mpu->scale_g;
 }
 
 /**
  * @brief Get the sensor value in G.
  * Values are already scaled in the function.
  * 
+ * @param mpu 
+ *      Handle of MPU.
  * @param x
  *      X axis.
  * @param y
@@ -282,10 +529,10 @@ int mpu_read_all(
  *      Z axis.
  * @return 0 if success else -1.
  */
-int mpu_read_accel(float *x, float *y, float *z){
+int mpu_read_accel(struct MPU *mpu, float *x, float *y, float *z){
     uint8_t data[6];
     
-    if (MPU_READ_ARRAY(MPU_ACCEL_XOUT_H, data, 6) != 0){
+    if (MPU_READ_DATA(MPU_ACCEL_XOUT_H, data, 6) != 0){
         LOG_ERROR("Failed to read Accelerometer data.\n");
         return -1;
     }
@@ -294,9 +541,9 @@ int mpu_read_accel(float *x, float *y, float *z){
     _y = ((int16_t)data[2] << 8) | data[3];
     _z = ((int16_t)data[4] << 8) | data[5];
 
-    *x = (float)_x / scale_a;
-    *y = (float)_y / scale_a;
-    *z = (float)_z / scale_a;
+    *x = (float)_x / mpu->scale_a;
+    *y = (float)_y / mpu->scale_a;
+    *z = (float)_z / mpu->scale_a;
 
     return 0;
 }
@@ -305,6 +552,8 @@ int mpu_read_accel(float *x, float *y, float *z){
  * @brief Get the sensor value in degree/s.
  * Values are already scaled in the function.
  * 
+ * @param mpu 
+ *      Handle of MPU.
  * @param x
  *      X axis.
  * @param y
@@ -313,10 +562,10 @@ int mpu_read_accel(float *x, float *y, float *z){
  *      Z axis.
  * @return 0 if success else -1.
  */
-int mpu_read_gyro(float *x, float *y, float *z){
+int mpu_read_gyro(struct MPU *mpu, float *x, float *y, float *z){
     uint8_t data[6];
     
-    if (MPU_READ_ARRAY(MPU_GYRO_XOUT_H, data, 6) != 0){
+    if (MPU_READ_DATA(MPU_GYRO_XOUT_H, data, 6) != 0){
         LOG_ERROR("Failed to read Gyro data.\n");
         return -1;
     }
@@ -325,9 +574,9 @@ int mpu_read_gyro(float *x, float *y, float *z){
     _y = ((int16_t)data[2] << 8) | data[3];
     _z = ((int16_t)data[4] << 8) | data[5];
 
-    *x = (float)_x / scale_g;
-    *y = (float)_y / scale_g;
-    *z = (float)_z / scale_g;
+    *x = (float)_x / mpu->scale_g;
+    *y = (float)_y / mpu->scale_g;
+    *z = (float)_z / mpu->scale_g;
     
     return 0;
 }
@@ -335,6 +584,8 @@ int mpu_read_gyro(float *x, float *y, float *z){
 /**
  * @brief Set the gyro offset in degree/s.
  * 
+ * @param mpu 
+ *      Handle of MPU.
  * @param x
  *      x offset.
  * @param y
@@ -343,7 +594,7 @@ int mpu_read_gyro(float *x, float *y, float *z){
  *      z offset.
  * @return 0 if success else -1.
  */
-int mpu_set_gyro_offsets(int16_t x, int16_t y, int16_t z){
+int mpu_set_gyro_offsets(struct MPU *mpu, int16_t x, int16_t y, int16_t z){
     uint8_t buffer[6];
     union {
         int16_t d;
@@ -372,6 +623,8 @@ int mpu_set_gyro_offsets(int16_t x, int16_t y, int16_t z){
 /**
  * @brief Read the gyro offset in degree/s.
  *
+ * @param mpu 
+ *      Handle of MPU.
  * @param x
  *      x data destination.
  * @param y
@@ -380,7 +633,7 @@ int mpu_set_gyro_offsets(int16_t x, int16_t y, int16_t z){
  *      z data destination.
  * @return 0 if success else -1.
  */
-int mpu_read_gyro_offsets(int16_t *x, int16_t *y, int16_t *z){
+int mpu_read_gyro_offsets(struct MPU *mpu, int16_t *x, int16_t *y, int16_t *z){
     uint8_t data[6];
     
     if (MPU_READ_ARRAY(MPU_XG_OFFSET_H, data, 6) != 0){
@@ -398,32 +651,40 @@ int mpu_read_gyro_offsets(int16_t *x, int16_t *y, int16_t *z){
 /**
  * @brief Set the divider of sample rate.
  * 
+ * @param mpu 
+ *      Handle of MPU.
  * @param sdiv
  *      Sample_rate = Interval_sample_rate / (1 + sdiv)
  * @return 0 if success, else -1.
  */
-int mpu_set_sample_rate_div(uint8_t sdiv) {
+int mpu_set_sample_rate_div(struct MPU *mpu, uint8_t sdiv) {
+    mpu->period_ns = 0;
     return MPU_WRITE(MPU_SMPLRT_DIV, sdiv);
 }
 
 /**
  * @brief Get the divider of sample rate.
  * 
+ * @param mpu 
+ *      Handle of MPU.
  * @param sdiv
  *      Sample_rate = Interval_sample_rate / (1 + sdiv)
  * @return 0 if success, else -1.
  */
-int mpu_get_sample_rate_div(uint8_t *sdiv) {
+int mpu_get_sample_rate_div(struct MPU *mpu, uint8_t *sdiv) {
     return MPU_READ(MPU_SMPLRT_DIV, sdiv);
 }
 
 /**
  * @brief Set bits of DLPF in CONFIG register.
  * 
+ * @param mpu 
+ *      Handle of MPU.
  * @param dlpf 
  * @return 0 if success, else -1.
  */
-int mpu_set_dlpf(uint8_t dlpf) {
+int mpu_set_dlpf(struct MPU *mpu, uint8_t dlpf) {
+    mpu->period_ns = 0;
     return MPU_WRITE_BIT(MPU_CONFIG, dlpf, 3, 0);
 }
 
@@ -431,86 +692,103 @@ int mpu_set_dlpf(uint8_t dlpf) {
 /**
  * @brief Get bits of DLPF in CONFIG register.
  * 
+ * @param mpu 
+ *      Handle of MPU.
  * @param dlpf 
  * @return 0 if success, else -1.
  */
-int mpu_get_dlpf(uint8_t *dlpf) {
+int mpu_get_dlpf(struct MPU *mpu, uint8_t *dlpf) {
     return MPU_READ_BIT(MPU_CONFIG, dlpf, 3, 0);
 }
 
 /**
  * @brief Set fchoice of FCHOICE in ACCEL CONFIG 2 register.
  * 
+ * @param mpu 
+ *      Handle of MPU.
  * @param fchoice 
  * @return 0 if success, else -1.
  */
-int mpu_set_accel_fchoice(uint8_t fchoice) {
+int mpu_set_accel_fchoice(struct MPU *mpu, uint8_t fchoice) {
     return MPU_WRITE_BIT(MPU_ACCEL_CONFIG_2, fchoice, 1, 3);
 }
 
 /**
  * @brief Get fchoice of FCHOICE in ACCEL CONFIG 2 register.
  * 
+ * @param mpu 
+ *      Handle of MPU.
  * @param fchoice 
  * @return 0 if success, else -1.
  */
-int mpu_get_accel_fchoice(uint8_t *fchoice) {
+int mpu_get_accel_fchoice(struct MPU *mpu, uint8_t *fchoice) {
     return MPU_READ_BIT(MPU_ACCEL_CONFIG_2, fchoice, 1, 3);
 }
 
 /**
  * @brief Set DLPF In ACCEL CONFIG 2 register.
  * 
+ * @param mpu 
+ *      Handle of MPU.
  * @param dlpf 
  * @return 0 if success else -1.
  */
-int mpu_set_accel_dlpf(uint8_t dlpf) {
+int mpu_set_accel_dlpf(struct MPU *mpu, uint8_t dlpf) {
     return MPU_WRITE_BIT(MPU_ACCEL_CONFIG_2, dlpf, 3, 0);
 }
 
 /**
  * @brief Get DLPF In ACCEL CONFIG 2 register.
  * 
+ * @param mpu 
+ *      Handle of MPU.
  * @param dlpf 
  * @return 0 if success else -1.
  */
-int mpu_get_accel_dlpf(uint8_t *dlpf) {
+int mpu_get_accel_dlpf(struct MPU *mpu, uint8_t *dlpf) {
     return MPU_READ_BIT(MPU_ACCEL_CONFIG_2, dlpf, 3, 0);
 }
 
 /**
  * @brief Set FCHOICE In GYRO CONFIG register.
  * 
+ * @param mpu 
+ *      Handle of MPU.
  * @param fchoice
  * @return 0 if success else -1.
  */
-int mpu_set_gyro_fchoice(uint8_t fchoice) {
+int mpu_set_gyro_fchoice(struct MPU *mpu, uint8_t fchoice) {
+    mpu->period_ns = 0;
     return MPU_WRITE_BIT(MPU_GYRO_CONFIG, fchoice, 2, 0);
 }
 
 /**
  * @brief Get FCHOICE In GYRO CONFIG register.
  * 
+ * @param mpu 
+ *      Handle of MPU.
  * @param fchoice
  * @return 0 if success else -1.
  */
-int mpu_get_gyro_fchoice(uint8_t *fchoice) {
+int mpu_get_gyro_fchoice(struct MPU *mpu, uint8_t *fchoice) {
     return MPU_READ_BIT(MPU_GYRO_CONFIG, fchoice, 2, 0);
 }
 
 /**
  * @brief Set fullscale of accelerometer.
  * 
+ * @param mpu 
+ *      Handle of MPU.
  * @param fs
  *      Defined in MPU datasheet and enum.
  * @return Scale of reading. Real_Value = Read / scale. 0.0f if fail.
  */
-int mpu_set_accel_fullscale(uint8_t fs) {
+int mpu_set_accel_fullscale(struct MPU *mpu, uint8_t fs) {
     if (MPU_WRITE_BIT(MPU_ACCEL_CONFIG, fs, 2, 3) != 0) {
         return -1;
     }
-    scale_a = ACCEL_SCALE_TABLE[fs];
-    DEBUG("scale_a=%f.\n", scale_a);
+    mpu->scale_a = ACCEL_SCALE_TABLE[fs];
+    DEBUG("scale_a=%f.\n", mpu->scale_a);
 
     return 0;
 }
@@ -518,92 +796,105 @@ int mpu_set_accel_fullscale(uint8_t fs) {
 /**
  * @brief Get fullscale of accelerometer.
  * 
+ * @param mpu 
+ *      Handle of MPU.
  * @param fs
  *      Defined in MPU datasheet and enum.
  * @return 0 if success, else -1.
  */
-int mpu_get_accel_fullscale(uint8_t *fs) {
+int mpu_get_accel_fullscale(struct MPU *mpu, uint8_t *fs) {
     return MPU_READ_BIT(MPU_ACCEL_CONFIG, fs, 2, 3);
 }
 
 /**
  * @brief Set fullscale of gyro.
  * 
+ * @param mpu 
+ *      Handle of MPU.
  * @param fs
  *      Defined in MPU datasheet and enum.
  * @return Scale of reading. Real_Value = Read / scale. 0.0f if fail.
  */
-int mpu_set_gyro_fullscale(uint8_t fs) {
+int mpu_set_gyro_fullscale(struct MPU *mpu, uint8_t fs) {
     if (MPU_WRITE_BIT(MPU_GYRO_CONFIG, fs, 2, 3) != 0) {
         return -1;
     }
-    scale_g = GYRO_SCALE_TABLE[fs];
-    DEBUG("scale_g=%f\n", scale_g);
+    mpu->scale_g = GYRO_SCALE_TABLE[fs];
+    DEBUG("scale_g=%f\n", mpu->scale_g);
 
     return 0;
 }
 /**
  * @brief Get fullscale of gyro.
  * 
+ * @param mpu 
+ *      Handle of MPU.
  * @param fs
  *      Defined in MPU datasheet and enum.
  * @return 0 if success, else -1.
  */
-int mpu_get_gyro_fullscale(uint8_t * fs) {
+int mpu_get_gyro_fullscale(struct MPU *mpu, uint8_t * fs) {
     return MPU_READ_BIT(MPU_GYRO_CONFIG, fs, 2, 3);
 }
 
 /**
  * @brief Enable direct access to AK8963.
  * 
+ * @param mpu 
+ *      Handle of MPU.
  * @return 0 if success, else -1.
  */
-int mpu_enable_bypass() {
+int mpu_enable_bypass(struct MPU *mpu) {
     return MPU_WRITE_BIT(0x37, 1, 1, 1);
 }
 
 /**
  * @brief Disable direct access to AK8963.
  * 
+ * @param mpu 
+ *      Handle of MPU.
  * @return 0 if success, else -1.
  */
-int mpu_disable_bypass() {
+int mpu_disable_bypass(struct MPU *mpu) {
     return MPU_WRITE_BIT(0x37, 0, 1, 1);
 }
 
 /**
  * @brief Enable master mode of MPU.
  * 
+ * @param mpu 
+ *      Handle of MPU.
  * @return 0 if success else -1.
  */
-int mpu_enable_master_mode() {
+int mpu_enable_master_mode(struct MPU *mpu) {
     int ret = -1;
     
-    if ((ret = mpu_disable_bypass()) != 0) {
+    if ((ret = mpu_disable_bypass(mpu)) != 0) {
         LOG_ERROR("Failed to disable bypass.(ret: %d)\n", ret);
         goto EXIT;
     }
-    usleep(1000);
     
-    // Reset I2C_MST
-    if ((ret = MPU_WRITE(MPU_USER_CTRL, 0x02)) != 0) {
+    // Reset I2C_MST, FIFO_EN is kept.
+    if ((ret = MPU_WRITE_BIT(MPU_USER_CTRL, 1, 1, 1)) != 0) {
         LOG_ERROR("Failed to reset I2C master mode.\n");
         goto EXIT;
     }
-    usleep(1000);
+    // I2C_MST_RST clears by itself.
+    if ((ret = mpu_wait_clear(mpu, MPU_USER_CTRL, 0x02, MPU_SLAVE_TIMEOUT_US)) != 0) {
+        LOG_ERROR("I2C master isn't back from reset.\n");
+        goto EXIT;
+    }
 
-    if ((ret = MPU_WRITE(MPU_USER_CTRL, 0x20)) != 0) {
+    if ((ret = MPU_WRITE_BIT(MPU_USER_CTRL, 1, 1, 5)) != 0) {
         LOG_ERROR("Failed to set USER_CTRL.\n");
         goto EXIT;
     }
-    usleep(1000);
     
     // Set 0x02 for 320kHz I2C speed. 
     if ((ret = MPU_WRITE(MPU_I2C_MST_CTRL, 0x02)) != 0) {
         LOG_ERROR("Failed to set I2C_MST_CTRL.\n");
         goto EXIT;
     }
-    usleep(1000);
     
     // if ((ret = MPU_WRITE(MPU_I2C_DELAY_CTRL, 0x80)) != 0) {
     //     LOG_ERROR("Failed to set I2C_DELAY_CTRL.\n");
@@ -621,6 +912,49 @@ int mpu_enable_master_mode() {
     return ret;
 }
 
+/**
+ * @brief Let SLV0 read ST1 ~ ST2 of AK8963 into EXT_SENS_DATA by itself,
+ * so mpu_read_all is a single burst read. Master mode must be enabled and
+ * AK8963 in continuous measurement mode.
+ * Call it after the sample rate is configured.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @param rate_hz 
+ *      Rate of AK8963 measurement, e.g. 100. SLV0 reads at the closest
+ *      rate sample rate can be divided to.
+ * @return 0 if success else -1.
+ */
+int mpu_enable_mag_auto_read(struct MPU *mpu, float rate_hz) {
+    float sample_rate;
+    if (mpu_get_sample_rate(mpu, &sample_rate) != 0) {
+        LOG_ERROR("Failed to get sample rate.\n");
+        return -1;
+    }
+    // Slaves with delay enabled are read every (1 + I2C_MST_DLY) samples.
+    int dly = (int)(sample_rate / rate_hz + 0.5f) - 1;
+    mpu->mst_dly = dly < 0 ? 0 : dly > 31 ? 31 : dly;
+    if (MPU_WRITE(MPU_I2C_SLV4_CTRL, mpu->mst_dly) != 0) {
+        LOG_ERROR("Failed to set I2C_MST_DLY.\n");
+        return -1;
+    }
+    // DELAY_ES_SHADOW: EXT_SENS_DATA is updated when all bytes arrived. I2C_SLV0_DLY_EN.
+    if (MPU_WRITE(MPU_I2C_DELAY_CTRL, 0x81) != 0) {
+        LOG_ERROR("Failed to set I2C_DELAY_CTRL.\n");
+        return -1;
+    }
+    // 0x0c: Address of AK8963. Start from AK_ST1, read 8 bytes.
+    if (mpu_set_slave0(mpu, 0x0c, 0x02, 8) != 0) {
+        LOG_ERROR("Failed to set SLV0.\n");
+        return -1;
+    }
+    mpu->mag_auto_read = true;
+    mpu->mag_samples = 0;
+    mpu->mag_count_ns = 0;
+    LOG("AK8963 is read every %d samples, %.1f Hz.\n", mpu->mst_dly + 1, sample_rate / (mpu->mst_dly + 1));
+    return 0;
+}
+
 /**
  * @brief Check if MPU is using SPI interface.
  * 
@@ -643,93 +977,415 @@ bool mpu_is_using_i2c() {
     return !mpu_is_using_spi();
 }
 
-//----- SLAVE0 RW Function.
-int mpu_slave_write(uint8_t dev_addr, uint8_t reg_addr, uint8_t data) {
-    if (MPU_WRITE(MPU_I2C_SLV4_ADDR, dev_addr) != 0) {
-        LOG_ERROR("Failed to write addr.\n");
+//----- FIFO Function.
+
+/**
+ * @brief Push accel, temperature and gyro of every sample into FIFO.
+ * FIFO keeps the oldest samples when full, so frames stay aligned.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @return 0 if success else -1.
+ */
+int mpu_enable_fifo(struct MPU *mpu) {
+    // FIFO_MODE: Don't overwrite when full.
+    if (MPU_WRITE_BIT(MPU_CONFIG, 1, 1, 6) != 0) {
+        LOG_ERROR("Failed to set FIFO mode.\n");
         return -1;
     }
-    usleep(1000);
-    if (MPU_WRITE(MPU_I2C_SLV4_REG, reg_addr) != 0) {
-        LOG_ERROR("Failed to write reg.\n");
+    // TEMP_OUT, GYRO_XOUT, GYRO_YOUT, GYRO_ZOUT, ACCEL.
+    if (MPU_WRITE(MPU_FIFO_EN, 0xf8) != 0) {
+        LOG_ERROR("Failed to select FIFO data.\n");
         return -1;
     }
-    usleep(1000);
-    if (MPU_WRITE(MPU_I2C_SLV4_DO, data) != 0) {
-        LOG_ERROR("Failed to write data.\n");
+    if (MPU_WRITE_BIT(MPU_USER_CTRL, 1, 1, 6) != 0) {
+        LOG_ERROR("Failed to enable FIFO.\n");
         return -1;
     }
-    usleep(1000);
-    if (MPU_WRITE(MPU_I2C_SLV4_CTRL, 0x80) != 0) {
-        LOG_ERROR("Failed to write ctrl.\n");
+    mpu->fifo_enabled = true;
+    return mpu_reset_fifo(mpu);
+}
+
+/**
+ * @brief Stop pushing samples into FIFO.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @return 0 if success else -1.
+ */
+int mpu_disable_fifo(struct MPU *mpu) {
+    if (MPU_WRITE_BIT(MPU_USER_CTRL, 0, 1, 6) != 0) {
+        LOG_ERROR("Failed to disable FIFO.\n");
         return -1;
     }
-    usleep(1000);
-    return 0;
+    mpu->fifo_enabled = false;
+    mpu->mag_count_ns = 0;
+    return MPU_WRITE(MPU_FIFO_EN, 0x00);
+}
+
+/**
+ * @brief Drop every byte in FIFO.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @return 0 if success else -1.
+ */
+int mpu_reset_fifo(struct MPU *mpu) {
+    // FIFO_RST clears by itself.
+    return MPU_WRITE_BIT(MPU_USER_CTRL, 1, 1, 2);
 }
 
-int mpu_slave_read(uint8_t dev_addr, uint8_t reg_addr, uint8_t *data) {
-    if (MPU_WRITE(MPU_I2C_SLV4_ADDR, dev_addr | 0x80) != 0) {
-        LOG_ERROR("Failed to write addr.\n");
+/**
+ * @brief Drain the samples pushed since last call, oldest first.
+ * A partial frame stays in FIFO for the next call. If FIFO overflowed,
+ * the whole frames are returned and FIFO is reset to get aligned again.
+ * Values are raw counts.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @param samples 
+ *      Destination.
+ * @param max_samples 
+ *      Capacity of samples, MPU_FIFO_MAX_FRAMES to drain a full FIFO.
+ * @return Number of samples, -1 if fail.
+ */
+int mpu_read_fifo(struct MPU *mpu, struct MPUSample *samples, int max_samples) {
+    int n;
+    mpu_read_fifo_all(&mpu, 1, &samples, max_samples, &n);
+    return n;
+}
+
+/**
+ * @brief mpu_read_fifo for several MPUs, e.g. redundant IMUs. On SPI the
+ * FIFO counts are read back to back while the bus is held, then the FIFOs.
+ * 
+ * @param mpu 
+ *      Handles of MPUs.
+ * @param n 
+ *      Number of MPUs, up to MPU_MAX_BATCH.
+ * @param samples 
+ *      Destination of each MPU.
+ * @param max_samples 
+ *      Capacity of each destination.
+ * @param n_samples 
+ *      Set to number of samples of each MPU, -1 if it failed.
+ * @return 0 if all MPUs were read else -1.
+ */
+int mpu_read_fifo_all(struct MPU **mpu, int n, struct MPUSample **samples, int max_samples, int *n_samples) {
+    if (n > MPU_MAX_BATCH) {
+        LOG_ERROR("Too many MPUs.(n: %d)\n", n);
         return -1;
     }
-    usleep(1000);
-    if (MPU_WRITE(MPU_I2C_SLV4_REG, reg_addr) != 0) {
-        LOG_ERROR("Failed to write reg.\n");
-        return -1;
+    int i, result = 0;
+    int r[MPU_MAX_BATCH];
+    uint8_t bufs[MPU_MAX_BATCH][MPU_FIFO_MAX_FRAMES * MPU_FIFO_FRAME_SIZE];
+#ifdef MPU_USE_SPI
+    struct SPIDevice *spi[MPU_MAX_BATCH];
+    struct SPITransaction *t[MPU_MAX_BATCH];
+    for (i = 0; i < n; i++) {
+        spi[i] = mpu[i]->spi;
+        t[i] = mpu[i]->count_trans;
+    }
+    spi_transaction_submit_all(spi, t, n, r);
+    // Frames in FIFO are counted at this time.
+    uint64_t read_ns = mpu_now_ns();
+    for (i = 0; i < n; i++) {
+        mpu[i]->timestamp_ns = mpu_get_newest_sample_ns(mpu[i], read_ns);
+        // Empty transaction is skipped by submit.
+        n_samples[i] = r[i] == 0 ? mpu_get_fifo_frames(mpu[i], max_samples) : -1;
+        t[i] = mpu[i]->fifo_trans;
+        spi_transaction_clear(t[i]);
+        if (n_samples[i] > 0 && mpu_build_fifo_read(mpu[i], bufs[i], n_samples[i] * MPU_FIFO_FRAME_SIZE) != 0) {
+            n_samples[i] = -1;
+        }
     }
-    usleep(1000);
-    if (MPU_WRITE(MPU_I2C_SLV4_CTRL, 0x80) != 0) {
-        LOG_ERROR("Failed to write ctrl.\n");
+    spi_transaction_submit_all(spi, t, n, r);
+#else
+    for (i = 0; i < n; i++) {
+        r[i] = -1;
+        if (i2c_read_array(mpu[i]->i2c, mpu[i]->dev_addr, MPU_FIFO_COUNTH, mpu[i]->count_buf, 2) != 0) {
+            n_samples[i] = -1;
+            continue;
+        }
+        mpu[i]->timestamp_ns = mpu_get_newest_sample_ns(mpu[i], mpu_now_ns());
+        n_samples[i] = mpu_get_fifo_frames(mpu[i], max_samples);
+        r[i] = mpu_read_fifo_data(mpu[i], bufs[i], n_samples[i] * MPU_FIFO_FRAME_SIZE);
+    }
+#endif // MPU_USE_SPI
+    for (i = 0; i < n; i++) {
+        if (n_samples[i] < 0 || r[i] != 0) {
+            LOG_ERROR("Failed to read FIFO.\n");
+            n_samples[i] = -1;
+            result = -1;
+            continue;
+        }
+        n_samples[i] = mpu_decode_fifo(mpu[i], bufs[i], n_samples[i], samples[i]);
+    }
+    return result;
+}
+
+/**
+ * @brief Get time the newest sample was taken when MPU was last read by
+ * mpu_read_raw or mpu_read_fifo. It's counted from the INT edge seen by
+ * mpu_wait_data_ready if there's one, else it's the time of the read.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @return CLOCK_MONOTONIC time in ns.
+ */
+uint64_t mpu_get_timestamp_ns(struct MPU *mpu) {
+    return mpu->timestamp_ns;
+}
+
+//----- Data Ready Interrupt Function.
+
+/**
+ * @brief Pulse INT pin for every new sample and watch it on a GPIO line.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @param gpio_chip 
+ *      GPIO chip of INT pin, e.g. "/dev/gpiochip0".
+ * @param gpio_line 
+ *      Line offset of INT pin.
+ * @return 0 if success else -1.
+ */
+int mpu_enable_data_ready_int(struct MPU *mpu, const char *gpio_chip, int gpio_line) {
+    if (mpu->drdy == NULL && (mpu->drdy = gpio_edge_request(gpio_chip, gpio_line, GPIO_EDGE_RISING, "mpu-drdy")) == NULL) {
+        LOG_ERROR("Failed to request INT pin.\n");
         return -1;
     }
-    usleep(1000);
-    if (MPU_READ(MPU_I2C_SLV4_DI, data) != 0) {
-        LOG_ERROR("Failed to read.\n");
+    // Active high, push-pull, 50us pulse instead of latch, so no edge is lost to a late read.
+    if (MPU_WRITE(MPU_INT_PIN_CFG, 0x10) != 0 || MPU_WRITE(MPU_INT_ENABLE, 0x01) != 0) {
+        LOG_ERROR("Failed to enable data ready interrupt.\n");
+        mpu_disable_data_ready_int(mpu);
         return -1;
     }
-    usleep(1000);
+    // Drop edges from before the interrupt was configured.
+    struct GPIOEvent events[GPIO_EDGE_BUFFER];
+    while (gpio_edge_read(mpu->drdy, events, GPIO_EDGE_BUFFER) > 0);
     return 0;
 }
 
-int mpu_slave_read_array(uint8_t dev_addr, uint8_t reg_addr, uint8_t *buf, int len) {
-    if (MPU_WRITE(MPU_I2C_SLV0_ADDR, dev_addr | 0x80) != 0) {
-        LOG_ERROR("Failed to write addr.\n");
+/**
+ * @brief Stop data ready interrupt and release INT pin.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ */
+void mpu_disable_data_ready_int(struct MPU *mpu) {
+    MPU_WRITE(MPU_INT_ENABLE, 0x00);
+    MPU_WRITE(MPU_INT_PIN_CFG, 0x30);
+    if (mpu->drdy != NULL) {
+        gpio_edge_release(mpu->drdy);
+        mpu->drdy = NULL;
+    }
+}
+
+/**
+ * @brief Check if mpu_wait_data_ready can be used.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @return True if data ready interrupt is enabled.
+ */
+bool mpu_data_ready_int_is_enabled(struct MPU *mpu) {
+    return mpu->drdy != NULL;
+}
+
+/**
+ * @brief Block until a new sample is taken, without busy loop.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @param timeout_ms 
+ *      Timeout in ms, -1 to wait forever.
+ * @param timestamp_ns 
+ *      Set to kernel timestamp (CLOCK_MONOTONIC) of the newest sample. NULL to ignore.
+ * @return Number of samples taken since last call, 0 if timeout, -1 if fail.
+ */
+int mpu_wait_data_ready(struct MPU *mpu, int timeout_ms, uint64_t *timestamp_ns) {
+    if (mpu->drdy == NULL) {
         return -1;
     }
-    usleep(1000);
-    if (MPU_WRITE(MPU_I2C_SLV0_REG, reg_addr) != 0) {
-        LOG_ERROR("Failed to write reg.\n");
+    struct GPIOEvent events[GPIO_EDGE_BUFFER];
+    int n;
+    while ((n = gpio_edge_read(mpu->drdy, events, GPIO_EDGE_BUFFER)) == 0) {
+        int ret = gpio_edge_wait(mpu->drdy, timeout_ms);
+        if (ret <= 0) {
+            return ret;
+        }
+    }
+    if (n < 0) {
         return -1;
     }
-    usleep(1000);
-    if (MPU_WRITE(MPU_I2C_SLV0_CTRL, (0x80 | len)) != 0) {
-        LOG_ERROR("Failed to write ctrl.\n");
+    mpu->edge_ns = events[n - 1].timestamp_ns;
+    if (timestamp_ns != NULL) {
+        *timestamp_ns = mpu->edge_ns;
+    }
+    return n;
+}
+
+//----- SLAVE RW Function.
+// Slaves behind the I2C master are accessed one byte at a time by SLV4.
+// mpu_slave_begin_* start a transfer and mpu_slave_poll steps it, so the
+// control loop never sleeps on a slave. The other mpu_slave_* block with
+// bounded polling.
+
+/**
+ * @brief Attach a register shadow to a slave behind the I2C master.
+ * mpu_slave_* functions consult the shadow afterward. Shadow is owned by caller.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @param dev_addr 
+ *      Address of slave.
+ * @param shadow 
+ *      The shadow, NULL to detach.
+ */
+void mpu_slave_set_shadow(struct MPU *mpu, uint8_t dev_addr, struct RegShadow *shadow) {
+    mpu->slave_shadows[dev_addr & 0x7f] = shadow;
+}
+
+/**
+ * @brief Start writing one register of a slave by SLV4.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @param dev_addr 
+ *      Address of slave.
+ * @param reg_addr 
+ *      Register.
+ * @param data 
+ *      Data to write.
+ * @return 0 if started, -1 if fail or SLV4 is busy.
+ */
+int mpu_slave_begin_write(struct MPU *mpu, uint8_t dev_addr, uint8_t reg_addr, uint8_t data) {
+    return mpu_slave_begin(mpu, dev_addr, reg_addr, data, false);
+}
+
+/**
+ * @brief Start reading one register of a slave by SLV4.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @param dev_addr 
+ *      Address of slave.
+ * @param reg_addr 
+ *      Register.
+ * @return 0 if started, -1 if fail or SLV4 is busy.
+ */
+int mpu_slave_begin_read(struct MPU *mpu, uint8_t dev_addr, uint8_t reg_addr) {
+    return mpu_slave_begin(mpu, dev_addr, reg_addr, 0, true);
+}
+
+/**
+ * @brief Step the transfer started by mpu_slave_begin_*, never blocks.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @param data 
+ *      Set to the byte read when a read is done. NULL to ignore.
+ * @return 1 if done, 0 if still in progress, -1 if NACK, timeout or fail.
+ */
+int mpu_slave_poll(struct MPU *mpu, uint8_t *data) {
+    if (!mpu->slv4.busy) {
         return -1;
     }
-    usleep(1000);
-    if (MPU_READ_ARRAY(MPU_EXT_SENS_DATA_00, buf, len) != 0) {
+    uint8_t status;
+    if (MPU_READ(MPU_I2C_MST_STATUS, &status) != 0) {
+        LOG_ERROR("Failed to read status.\n");
+        goto ERROR;
+    }
+    if (status & 0x10) {
+        // I2C_SLV4_NACK
+        LOG_ERROR("Slave 0x%02x didn't acknowledge.\n", mpu->slv4.dev_addr);
+        goto ERROR;
+    }
+    if (!(status & 0x40)) {
+        // I2C_SLV4_DONE isn't set yet.
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        if (tv_get_diff_usec_ul(&mpu->slv4.start, &now) > MPU_SLAVE_TIMEOUT_US) {
+            LOG_ERROR("Slave 0x%02x timeout.\n", mpu->slv4.dev_addr);
+            goto ERROR;
+        }
+        return 0;
+    }
+    if (mpu->slv4.read && MPU_READ(MPU_I2C_SLV4_DI, &mpu->slv4.data) != 0) {
         LOG_ERROR("Failed to read.\n");
+        goto ERROR;
+    }
+    reg_shadow_update(mpu->slave_shadows[mpu->slv4.dev_addr], mpu->slv4.reg_addr, &mpu->slv4.data, 1);
+    if (data != NULL) {
+        *data = mpu->slv4.data;
+    }
+    mpu->slv4.busy = false;
+    return 1;
+
+    ERROR:
+    mpu->slv4.busy = false;
+    return -1;
+}
+
+/**
+ * @brief Check if a transfer of SLV4 is in progress.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @return True if mpu_slave_poll has to be called before a new transfer.
+ */
+bool mpu_slave_is_busy(struct MPU *mpu) {
+    return mpu->slv4.busy;
+}
+
+int mpu_slave_write(struct MPU *mpu, uint8_t dev_addr, uint8_t reg_addr, uint8_t data) {
+    uint8_t cached;
+    if (reg_shadow_get(mpu->slave_shadows[dev_addr & 0x7f], reg_addr, &cached) && cached == data) {
+        return 0;
+    }
+    if (mpu_slave_begin_write(mpu, dev_addr, reg_addr, data) != 0) {
+        LOG_ERROR("Failed to begin write.\n");
         return -1;
     }
-    usleep(1000);
+    return mpu_slave_wait(mpu, NULL);
+}
+
+int mpu_slave_read(struct MPU *mpu, uint8_t dev_addr, uint8_t reg_addr, uint8_t *data) {
+    if (reg_shadow_get(mpu->slave_shadows[dev_addr & 0x7f], reg_addr, data)) {
+        return 0;
+    }
+    if (mpu_slave_begin_read(mpu, dev_addr, reg_addr) != 0) {
+        LOG_ERROR("Failed to begin read.\n");
+        return -1;
+    }
+    return mpu_slave_wait(mpu, data);
+}
+
+int mpu_slave_read_array(struct MPU *mpu, uint8_t dev_addr, uint8_t reg_addr, uint8_t *buf, int len) {
+    int i;
+    for (i = 0; i < len; i++) {
+        if (mpu_slave_read(mpu, dev_addr, reg_addr + i, &buf[i]) != 0) {
+            return -1;
+        }
+    }
     return 0;
 }
 
-int mpu_slave_write_bit(uint8_t dev_addr, uint8_t reg_addr, uint8_t data, uint8_t n_bit, uint8_t offset) {
+int mpu_slave_write_bit(struct MPU *mpu, uint8_t dev_addr, uint8_t reg_addr, uint8_t data, uint8_t n_bit, uint8_t offset) {
     uint8_t mask, data_mask;
     mask = (1 << n_bit) - 1;
     data_mask = mask << offset;
     data = (data & mask) << offset;
     
     uint8_t orig_data;
-    if (mpu_slave_read(dev_addr, reg_addr, &orig_data) != 0) {
+    if (mpu_slave_read(mpu, dev_addr, reg_addr, &orig_data) != 0) {
         printf("Failed to read.\n");
         return -1;
     }
     orig_data &= ~data_mask;
     orig_data |= data;
-    if (mpu_slave_write(dev_addr, reg_addr, orig_data) != 0) {
+    if (mpu_slave_write(mpu, dev_addr, reg_addr, orig_data) != 0) {
         printf("Failed to write.\n");
         return -1;
     }
@@ -737,9 +1393,9 @@ int mpu_slave_write_bit(uint8_t dev_addr, uint8_t reg_addr, uint8_t data, uint8_
     return 0;
 }
 
-int mpu_slave_read_bit(uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint8_t n_bit, uint8_t offset) {
+int mpu_slave_read_bit(struct MPU *mpu, uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint8_t n_bit, uint8_t offset) {
     uint8_t orig_data;
-    if (mpu_slave_read(dev_addr, reg_addr, &orig_data) != 0) {
+    if (mpu_slave_read(mpu, dev_addr, reg_addr, &orig_data) != 0) {
         printf("Failed to read.\n");
         return -1;
     }
@@ -749,4 +1405,423 @@ int mpu_slave_read_bit(uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint8_
     return 0;
 }
 
-//-----
\ No newline at end of file
+//-----
+
+/**
+ * @brief Create the register shadow of MPU and attach it.
+ * Self-clearing, status and data registers are volatile.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @return 0 if success else -1.
+ */
+static int mpu_init_shadow(struct MPU *mpu) {
+    if ((mpu->shadow = reg_shadow_init()) == NULL) {
+        return -1;
+    }
+    reg_shadow_set_volatile(mpu->shadow, MPU_I2C_SLV4_CTRL, 1); // I2C_SLV4_EN clears after transfer.
+    reg_shadow_set_volatile(mpu->shadow, MPU_I2C_SLV4_DI, 1);
+    reg_shadow_set_volatile(mpu->shadow, MPU_I2C_MST_STATUS, 1);
+    reg_shadow_set_volatile(mpu->shadow, MPU_INT_STATUS, MPU_EXT_SENS_DATA_23 - MPU_INT_STATUS + 1);
+    reg_shadow_set_volatile(mpu->shadow, MPU_SIGNAL_PATH_RESET, 1);
+    reg_shadow_set_volatile(mpu->shadow, MPU_USER_CTRL, 1); // Reset bits clear by themselves.
+    reg_shadow_set_volatile(mpu->shadow, MPU_PWR_MGMT, 1); // H_RESET clears by itself.
+    reg_shadow_set_volatile(mpu->shadow, MPU_FIFO_COUNTH, MPU_FIFO_R_W - MPU_FIFO_COUNTH + 1);
+    MPU_SET_SHADOW(mpu->shadow);
+    return 0;
+}
+
+/**
+ * @brief Poll MPU until H_RESET is cleared and WHO_AM_I reads back.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @return 0 if success else -1 on timeout.
+ */
+static int mpu_wait_reset(struct MPU *mpu) {
+    struct timeval start, now;
+    gettimeofday(&start, NULL);
+    while (1) {
+        uint8_t pwr_mgmt, who_am_i;
+        // Nothing read during the reset is kept.
+        reg_shadow_invalidate(mpu->shadow);
+        if (MPU_READ(MPU_PWR_MGMT, &pwr_mgmt) == 0 && !(pwr_mgmt & 0x80) &&
+            MPU_READ(MPU_WHO_AM_I, &who_am_i) == 0 && who_am_i == 0x71) {
+            return 0;
+        }
+        gettimeofday(&now, NULL);
+        if (tv_get_diff_usec_ul(&start, &now) > MPU_RESET_TIMEOUT_US) {
+            return -1;
+        }
+        usleep(MPU_READY_POLL_US);
+    }
+}
+
+/**
+ * @brief Poll a volatile register until bits of mask are cleared.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @param reg_addr 
+ *      Register.
+ * @param mask 
+ *      Bits which clear by themselves.
+ * @param timeout_us 
+ *      Max time to wait.
+ * @return 0 if success else -1 on timeout.
+ */
+static int mpu_wait_clear(struct MPU *mpu, uint8_t reg_addr, uint8_t mask, unsigned long timeout_us) {
+    struct timeval start, now;
+    gettimeofday(&start, NULL);
+    while (1) {
+        uint8_t data;
+        if (MPU_READ(reg_addr, &data) == 0 && !(data & mask)) {
+            return 0;
+        }
+        gettimeofday(&now, NULL);
+        if (tv_get_diff_usec_ul(&start, &now) > timeout_us) {
+            return -1;
+        }
+        usleep(MPU_READY_POLL_US);
+    }
+}
+
+/**
+ * @brief Get the rate samples are taken, which clocks the I2C master too.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @param rate_hz 
+ *      Sample rate.
+ * @return 0 if success else -1.
+ */
+static int mpu_get_sample_rate(struct MPU *mpu, float *rate_hz) {
+    uint8_t fchoice_b, dlpf, sdiv;
+    if (mpu_get_gyro_fchoice(mpu, &fchoice_b) != 0 || mpu_get_dlpf(mpu, &dlpf) != 0 || mpu_get_sample_rate_div(mpu, &sdiv) != 0) {
+        return -1;
+    }
+    if (fchoice_b != 0) {
+        // DLPF bypassed.
+        *rate_hz = 32000.0f;
+    } else if (dlpf == 0 || dlpf == 7) {
+        // SMPLRT_DIV only works with DLPF_CFG 1 ~ 6.
+        *rate_hz = 8000.0f;
+    } else {
+        *rate_hz = 1000.0f / (1 + sdiv);
+    }
+    return 0;
+}
+
+/**
+ * @brief Get time of the newest sample in MPU at a read. The INT edge
+ * waited for last is counted forward by the sample interval, as samples
+ * may be taken between the wait and the read.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @param read_ns 
+ *      Time of the read.
+ * @return CLOCK_MONOTONIC time in ns, read_ns if no recent edge is known.
+ */
+static uint64_t mpu_get_newest_sample_ns(struct MPU *mpu, uint64_t read_ns) {
+    float rate_hz;
+    if (mpu->period_ns == 0 && mpu_get_sample_rate(mpu, &rate_hz) == 0) {
+        mpu->period_ns = 1e9f / rate_hz;
+    }
+    if (mpu->edge_ns == 0 || mpu->edge_ns > read_ns || read_ns - mpu->edge_ns > MPU_EDGE_MAX_AGE_NS) {
+        return read_ns;
+    }
+    if (mpu->period_ns == 0) {
+        return mpu->edge_ns;
+    }
+    return mpu->edge_ns + (read_ns - mpu->edge_ns) / mpu->period_ns * mpu->period_ns;
+}
+
+/**
+ * @brief Get monotonic time, the clock of GPIO edge timestamps.
+ * 
+ * @return Time in ns.
+ */
+static uint64_t mpu_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Write SLV4 registers and start the transfer.
+ * ADDR, REG, DO and CTRL are adjacent, so it's one write.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @param dev_addr 
+ *      Address of slave.
+ * @param reg_addr 
+ *      Register.
+ * @param data 
+ *      Data to write, ignored if reading.
+ * @param read 
+ *      True to read else write.
+ * @return 0 if success else -1.
+ */
+static int mpu_slave_begin(struct MPU *mpu, uint8_t dev_addr, uint8_t reg_addr, uint8_t data, bool read) {
+    if (mpu->slv4.busy) {
+        LOG_ERROR("SLV4 is busy.\n");
+        return -1;
+    }
+    uint8_t regs[4] = {(dev_addr & 0x7f) | (read ? 0x80 : 0), reg_addr, data, 0x80 | mpu->mst_dly};
+    if (MPU_WRITE_ARRAY(MPU_I2C_SLV4_ADDR, regs, sizeof(regs)) != 0) {
+        return -1;
+    }
+    mpu->slv4.busy = true;
+    mpu->slv4.read = read;
+    mpu->slv4.dev_addr = dev_addr & 0x7f;
+    mpu->slv4.reg_addr = reg_addr;
+    mpu->slv4.data = data;
+    gettimeofday(&mpu->slv4.start, NULL);
+    return 0;
+}
+
+/**
+ * @brief Poll the transfer of SLV4 until it ends.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @param data 
+ *      Set to the byte read. NULL to ignore.
+ * @return 0 if success else -1.
+ */
+static int mpu_slave_wait(struct MPU *mpu, uint8_t *data) {
+    int ret;
+    while ((ret = mpu_slave_poll(mpu, data)) == 0) {
+        usleep(MPU_SLAVE_POLL_US);
+    }
+    return ret == 1 ? 0 : -1;
+}
+
+/**
+ * @brief Let SLV0 read len bytes from a slave every time it runs.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @param dev_addr 
+ *      Address of slave.
+ * @param reg_addr 
+ *      First register.
+ * @param len 
+ *      Bytes to read into EXT_SENS_DATA, up to 15.
+ * @return 0 if success else -1.
+ */
+static int mpu_set_slave0(struct MPU *mpu, uint8_t dev_addr, uint8_t reg_addr, uint8_t len) {
+    if (MPU_WRITE(MPU_I2C_SLV0_ADDR, dev_addr | 0x80) != 0 ||
+        MPU_WRITE(MPU_I2C_SLV0_REG, reg_addr) != 0 ||
+        MPU_WRITE(MPU_I2C_SLV0_CTRL, 0x80 | len) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Unpack the burst read of ACCEL_XOUT_H ~ EXT_SENS_DATA_07.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @param buf 
+ *      22 bytes read. ACCEL: 6, TEMP: 2, GYRO:6, EXT MAG: 8.
+ * @param raw 
+ *      Destination, see mpu_read_raw.
+ * @param mag_ready 
+ *      True if AK8963 get new reading else false.
+ */
+static void mpu_decode_raw(struct MPU *mpu, const uint8_t *buf, int16_t *raw, bool *mag_ready) {
+    raw[MPU_RAW_AX + 0] = ((int16_t)buf[0] << 8) | buf[1];
+    raw[MPU_RAW_AX + 1] = ((int16_t)buf[2] << 8) | buf[3];
+    raw[MPU_RAW_AX + 2] = ((int16_t)buf[4] << 8) | buf[5];
+    
+    raw[MPU_RAW_GX + 0] = ((int16_t)buf[8] << 8) | buf[9];
+    raw[MPU_RAW_GX + 1] = ((int16_t)buf[10] << 8) | buf[11];
+    raw[MPU_RAW_GX + 2] = ((int16_t)buf[12] << 8) | buf[13];
+    
+    *mag_ready = false;
+
+    if (!mpu_mag_is_new(mpu)) {
+        // SLV0 hasn't read AK8963 since last call.
+        return;
+    }
+    if (buf[14] & 0x01) {
+        // Data ready in ST1.
+        if (!(buf[21] &0x08)) {
+            // No overflow in ST2
+            raw[MPU_RAW_MX + 0] = ((int16_t)buf[16]) << 8 | buf[15];
+            raw[MPU_RAW_MX + 1] = ((int16_t)buf[18]) << 8 | buf[17];
+            raw[MPU_RAW_MX + 2] = ((int16_t)buf[20]) << 8 | buf[19];
+            *mag_ready = true;
+        } else {
+            LOG_ERROR("Overflow!\n");
+        }
+    }
+}
+
+/**
+ * @brief Check if SLV0 has read AK8963 since EXT_SENS_DATA was last taken.
+ * SLV0 runs once every mst_dly + 1 samples, so data is new once that many
+ * samples were taken. Samples are counted by FIFO frames if FIFO is
+ * enabled, else by the sample times of reads. Data is judged by when it was
+ * read, not by its value, so equal consecutive readings are kept.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @return True if EXT_SENS_DATA holds a reading not taken yet.
+ */
+static bool mpu_mag_is_new(struct MPU *mpu) {
+    if (!mpu->mag_auto_read) {
+        return false;
+    }
+    if (!mpu->fifo_enabled) {
+        if (mpu->mag_count_ns == 0 || mpu->timestamp_ns < mpu->mag_count_ns) {
+            mpu->mag_count_ns = mpu->timestamp_ns;
+        } else if (mpu->period_ns == 0) {
+            // Rate unknown, count one sample per read of a newer one.
+            mpu->mag_samples += mpu->timestamp_ns > mpu->mag_count_ns;
+            mpu->mag_count_ns = mpu->timestamp_ns;
+        } else {
+            uint64_t n = (mpu->timestamp_ns - mpu->mag_count_ns) / mpu->period_ns;
+            mpu->mag_samples += n;
+            mpu->mag_count_ns += n * mpu->period_ns;
+        }
+    }
+    uint32_t interval = mpu->mst_dly + 1;
+    if (mpu->mag_samples < interval) {
+        return false;
+    }
+    // Keep the phase of SLV0, samples beyond one interval don't make more readings.
+    mpu->mag_samples %= interval;
+    return true;
+}
+
+/**
+ * @brief Get whole frames to read from count_buf.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @param max_samples 
+ *      Capacity of destination.
+ * @return Number of frames.
+ */
+static int mpu_get_fifo_frames(struct MPU *mpu, int max_samples) {
+    int count = ((mpu->count_buf[0] & 0x1f) << 8) | mpu->count_buf[1];
+    int n = count / MPU_FIFO_FRAME_SIZE;
+    return n > max_samples ? max_samples : n;
+}
+
+/**
+ * @brief Unpack frames read from FIFO, and resynchronize if it overflowed.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @param buf 
+ *      Frames read.
+ * @param n 
+ *      Number of frames.
+ * @param samples 
+ *      Destination.
+ * @return n, -1 if FIFO overflowed and failed to reset.
+ */
+static int mpu_decode_fifo(struct MPU *mpu, const uint8_t *buf, int n, struct MPUSample *samples) {
+    int count = ((mpu->count_buf[0] & 0x1f) << 8) | mpu->count_buf[1];
+    bool overflow = count > MPU_FIFO_MAX_FRAMES * MPU_FIFO_FRAME_SIZE;
+    // Frames are one sample interval apart, the last whole frame in FIFO is the newest.
+    // After an overflow the newest ones were dropped, so times are too late.
+    int newest = count / MPU_FIFO_FRAME_SIZE - 1;
+    int i;
+    for (i = 0; i < n; i++) {
+        const uint8_t *frame = buf + i * MPU_FIFO_FRAME_SIZE;
+        samples[i].a[0] = (int16_t)((frame[0] << 8) | frame[1]);
+        samples[i].a[1] = (int16_t)((frame[2] << 8) | frame[3]);
+        samples[i].a[2] = (int16_t)((frame[4] << 8) | frame[5]);
+        samples[i].temp = (int16_t)((frame[6] << 8) | frame[7]);
+        samples[i].g[0] = (int16_t)((frame[8] << 8) | frame[9]);
+        samples[i].g[1] = (int16_t)((frame[10] << 8) | frame[11]);
+        samples[i].g[2] = (int16_t)((frame[12] << 8) | frame[13]);
+        samples[i].timestamp_ns = mpu->timestamp_ns - (uint64_t)(newest - i) * mpu->period_ns;
+    }
+    // Samples dropped by an overflow aren't counted, the magnetometer is late by one read at most.
+    mpu->mag_samples += n;
+
+    if (overflow) {
+        // Bytes after the last whole frame are a partial sample.
+        LOG_ERROR("FIFO overflow, resynchronizing.\n");
+        if (mpu_reset_fifo(mpu) != 0) {
+            return -1;
+        }
+    }
+    return n;
+}
+
+#ifdef MPU_USE_SPI
+/**
+ * @brief Build the transactions submitted by mpu_read_raw and mpu_read_fifo.
+ * SLV0 is set once by mpu_enable_mag_auto_read, so reading all data is one
+ * burst read with the data clock.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @return 0 if success else -1.
+ */
+static int mpu_build_transactions(struct MPU *mpu) {
+    if ((mpu->read_all_trans = spi_transaction_init(1)) == NULL ||
+        (mpu->count_trans = spi_transaction_init(1)) == NULL) {
+        return -1;
+    }
+    if (spi_transaction_add_read(mpu->read_all_trans, SPI_PROFILE_DATA, MPU_ACCEL_XOUT_H, mpu->read_all_buf, sizeof(mpu->read_all_buf)) < 0 ||
+        spi_transaction_add_read(mpu->count_trans, SPI_PROFILE_DATA, MPU_FIFO_COUNTH, mpu->count_buf, sizeof(mpu->count_buf)) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Queue reads of len bytes from FIFO_R_W into fifo_trans, chunks
+ * are sent as one message.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @param buf 
+ *      Destination.
+ * @param len 
+ *      Bytes to read, at most MPU_FIFO_SIZE.
+ * @return 0 if success else -1.
+ */
+static int mpu_build_fifo_read(struct MPU *mpu, uint8_t *buf, int len) {
+    int offset;
+    for (offset = 0; offset < len; offset += MPU_FIFO_CHUNK) {
+        int n = len - offset < MPU_FIFO_CHUNK ? len - offset : MPU_FIFO_CHUNK;
+        if (spi_transaction_add_read(mpu->fifo_trans, SPI_PROFILE_DATA, MPU_FIFO_R_W, buf + offset, n) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+#else
+/**
+ * @brief Read len bytes from FIFO_R_W.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @param buf 
+ *      Destination.
+ * @param len 
+ *      Bytes to read, at most MPU_FIFO_SIZE.
+ * @return 0 if success else -1.
+ */
+static int mpu_read_fifo_data(struct MPU *mpu, uint8_t *buf, int len) {
+    int offset;
+    for (offset = 0; offset < len; offset += MPU_FIFO_CHUNK) {
+        int n = len - offset < MPU_FIFO_CHUNK ? len - offset : MPU_FIFO_CHUNK;
+        if (MPU_READ_DATA(MPU_FIFO_R_W, buf + offset, n) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+#endif // MPU_USE_SPI
\ No newline at end of file
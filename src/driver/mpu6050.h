@@ -39,73 +39,144 @@ enum MPU_ACCEL_FS{
 
 extern const float ACCEL_SCALE_TABLE[4];
 
+// I2C address selected by AD0, ignored on SPI.
+#define MPU_ADDRESS_AD0_LO 0x68
+#define MPU_ADDRESS_AD0_HI 0x69
+
+#define MPU_FIFO_SIZE 512
+#define MPU_FIFO_FRAME_SIZE 14 // ACCEL: 6, TEMP: 2, GYRO: 6.
+#define MPU_FIFO_MAX_FRAMES (MPU_FIFO_SIZE / MPU_FIFO_FRAME_SIZE)
+
+#define MPU_MAX_BATCH 4 // Max MPUs read by one mpu_read_*_all.
+
+// Raw block of mpu_read_raw.
+#define MPU_RAW_AXES 9 // Accelerometer, gyroscope and AK8963 magnetometer, X,Y,Z each.
+#define MPU_RAW_AX 0
+#define MPU_RAW_GX 3
+#define MPU_RAW_MX 6 // In AK8963 axes, X and Y are swapped against MPU.
+
+// One sample taken from FIFO, in raw counts. See mpu_get_accel_scale and mpu_get_gyro_scale.
+struct MPUSample {
+    int16_t a[3]; // Acceleration X,Y,Z.
+    int16_t g[3]; // Angular velocity X,Y,Z.
+    int16_t temp; // Temperature.
+    uint64_t timestamp_ns; // CLOCK_MONOTONIC time the sample was taken.
+};
+
 //-----
+struct MPU;
+
+struct MPU *mpu_open(const char *path, uint8_t dev_addr);
 
-int mpu_init();
+void mpu_close(struct MPU *mpu);
 
-int mpu_reset();
+int mpu_reset(struct MPU *mpu);
 
-int mpu_read_all(
+int mpu_read_raw(struct MPU *mpu, int16_t raw[MPU_RAW_AXES], bool *mag_ready);
+
+int mpu_read_raw_all(struct MPU **mpu, int n, int16_t **raw, bool *mag_ready, int *ret);
+
+int mpu_read_all(struct MPU *mpu,
     float *ax, float *ay, float *az,
     float *gx, float *gy, float *gz,
     float *mx, float *my, float *mz,
     bool *mag_ready);
 
-int mpu_read_accel(float *x, float *y, float *z);
+float mpu_get_accel_scale(struct MPU *mpu);
+
+float mpu_get_gyro_scale(struct MPU *mpu);
 
-int mpu_read_gyro(float *x, float *y, float *z);
+int mpu_read_accel(struct MPU *mpu, float *x, float *y, float *z);
 
-int mpu_set_gyro_offsets(int16_t x, int16_t y, int16_t z);
+int mpu_read_gyro(struct MPU *mpu, float *x, float *y, float *z);
 
-int mpu_read_gyro_offsets(int16_t *x, int16_t *y, int16_t *z);
+int mpu_set_gyro_offsets(struct MPU *mpu, int16_t x, int16_t y, int16_t z);
 
-int mpu_set_sample_rate_div(uint8_t sdiv);
+int mpu_read_gyro_offsets(struct MPU *mpu, int16_t *x, int16_t *y, int16_t *z);
 
-int mpu_get_sample_rate_div(uint8_t *sdiv);
+int mpu_set_sample_rate_div(struct MPU *mpu, uint8_t sdiv);
 
-int mpu_set_dlpf(uint8_t dlpf);
+int mpu_get_sample_rate_div(struct MPU *mpu, uint8_t *sdiv);
 
-int mpu_get_dlpf(uint8_t *dlpf);
+int mpu_set_dlpf(struct MPU *mpu, uint8_t dlpf);
 
-int mpu_set_accel_fchoice(uint8_t fchoice);
+int mpu_get_dlpf(struct MPU *mpu, uint8_t *dlpf);
 
-int mpu_get_accel_fchoice(uint8_t *fchoice);
+int mpu_set_accel_fchoice(struct MPU *mpu, uint8_t fchoice);
 
-int mpu_set_accel_dlpf(uint8_t dlpf);
+int mpu_get_accel_fchoice(struct MPU *mpu, uint8_t *fchoice);
 
-int mpu_get_accel_dlpf(uint8_t *dlpf);
+int mpu_set_accel_dlpf(struct MPU *mpu, uint8_t dlpf);
 
-int mpu_set_gyro_fchoice(uint8_t fchoice);
+int mpu_get_accel_dlpf(struct MPU *mpu, uint8_t *dlpf);
 
-int mpu_get_gyro_fchoice(uint8_t *fchoice);
+int mpu_set_gyro_fchoice(struct MPU *mpu, uint8_t fchoice);
 
-int mpu_set_accel_fullscale(uint8_t fs);
+int mpu_get_gyro_fchoice(struct MPU *mpu, uint8_t *fchoice);
 
-int mpu_get_accel_fullscale(uint8_t *fs);
+int mpu_set_accel_fullscale(struct MPU *mpu, uint8_t fs);
 
-int mpu_set_gyro_fullscale(uint8_t fs);
+int mpu_get_accel_fullscale(struct MPU *mpu, uint8_t *fs);
 
-int mpu_get_gyro_fullscale(uint8_t *fs);
+int mpu_set_gyro_fullscale(struct MPU *mpu, uint8_t fs);
 
-int mpu_enable_bypass();
+int mpu_get_gyro_fullscale(struct MPU *mpu, uint8_t *fs);
 
-int mpu_disable_bypass();
+int mpu_enable_bypass(struct MPU *mpu);
 
-int mpu_enable_master_mode();
+int mpu_disable_bypass(struct MPU *mpu);
+
+int mpu_enable_master_mode(struct MPU *mpu);
+
+int mpu_enable_mag_auto_read(struct MPU *mpu, float rate_hz);
 
 bool mpu_is_using_spi();
 
 bool mpu_is_using_i2c();
 
-//----- SLAVE0 RW Function.
-int mpu_slave_write(uint8_t dev_addr, uint8_t reg_addr, uint8_t data);
+//----- FIFO Function.
+int mpu_enable_fifo(struct MPU *mpu);
+
+int mpu_disable_fifo(struct MPU *mpu);
+
+int mpu_reset_fifo(struct MPU *mpu);
+
+int mpu_read_fifo(struct MPU *mpu, struct MPUSample *samples, int max_samples);
+
+int mpu_read_fifo_all(struct MPU **mpu, int n, struct MPUSample **samples, int max_samples, int *n_samples);
+
+uint64_t mpu_get_timestamp_ns(struct MPU *mpu);
+
+//----- Data Ready Interrupt Function.
+int mpu_enable_data_ready_int(struct MPU *mpu, const char *gpio_chip, int gpio_line);
+
+void mpu_disable_data_ready_int(struct MPU *mpu);
+
+bool mpu_data_ready_int_is_enabled(struct MPU *mpu);
+
+int mpu_wait_data_ready(struct MPU *mpu, int timeout_ms, uint64_t *timestamp_ns);
+
+//----- SLAVE RW Function.
+struct RegShadow;
+
+int mpu_slave_begin_write(struct MPU *mpu, uint8_t dev_addr, uint8_t reg_addr, uint8_t data);
+
+int mpu_slave_begin_read(struct MPU *mpu, uint8_t dev_addr, uint8_t reg_addr);
+
+int mpu_slave_poll(struct MPU *mpu, uint8_t *data);
+
+bool mpu_slave_is_busy(struct MPU *mpu);
+
+void mpu_slave_set_shadow(struct MPU *mpu, uint8_t dev_addr, struct RegShadow *shadow);
+
+int mpu_slave_write(struct MPU *mpu, uint8_t dev_addr, uint8_t reg_addr, uint8_t data);
 
-int mpu_slave_read(uint8_t dev_addr, uint8_t reg_addr, uint8_t *data);
+int mpu_slave_read(struct MPU *mpu, uint8_t dev_addr, uint8_t reg_addr, uint8_t *data);
 
-int mpu_slave_read_array(uint8_t dev_addr, uint8_t reg_addr, uint8_t *buf, int len);
+int mpu_slave_read_array(struct MPU *mpu, uint8_t dev_addr, uint8_t reg_addr, uint8_t *buf, int len);
 
-int mpu_slave_write_bit(uint8_t dev_addr, uint8_t reg_addr, uint8_t data, uint8_t n_bit, uint8_t offset);
+int mpu_slave_write_bit(struct MPU *mpu, uint8_t dev_addr, uint8_t reg_addr, uint8_t data, uint8_t n_bit, uint8_t offset);
 
-int mpu_slave_read_bit(uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint8_t n_bit, uint8_t offset);
+int mpu_slave_read_bit(struct MPU *mpu, uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint8_t n_bit, uint8_t offset);
 
 #endif // _MPU6050_H_
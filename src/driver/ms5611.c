@@ -0,0 +1,314 @@
+#include "ms5611.h"
+#include "util/io/i2c.h"
+#include "util/tv.h"
+#include "util/logger.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#define MS_ADDRESS 0x77 // I2C Address of MS5611, CSB low.
+#define MS_I2C_BUS "/dev/i2c-1"
+
+//----- Commands.
+#define MS_CMD_RESET 0x1e
+#define MS_CMD_CONVERT_D1 0x40 // Pressure, plus 2 * OSR.
+#define MS_CMD_CONVERT_D2 0x50 // Temperature, plus 2 * OSR.
+#define MS_CMD_ADC_READ 0x00
+#define MS_CMD_PROM_READ 0xa0 // Plus 2 * index of word.
+
+#define MS_TEMP_INTERVAL 8 // Pressure conversions per temperature conversion. Temperature changes slowly.
+
+static struct I2CBus *_i2c; // Opened in ms_init and kept for every access.
+
+#define MS_COMMAND(cmd) i2c_write_array(_i2c, MS_ADDRESS, cmd, NULL, 0)
+#define MS_READ_ARRAY(cmd, data, n) i2c_read_array(_i2c, MS_ADDRESS, cmd, data, n)
+
+// Max conversion time of each OSR in us.
+static const unsigned long CONVERSION_TIME_TABLE[5] = {600, 1170, 2280, 4540, 9040};
+
+enum MS_STATE {
+    MS_STATE_IDLE = 0, // No conversion running.
+    MS_STATE_CONVERTING_D1, // Pressure conversion running.
+    MS_STATE_CONVERTING_D2 // Temperature conversion running.
+};
+
+static uint16_t _prom[8]; // Factory data, C1 ~ C6 in 1 ~ 6 and CRC in 7.
+static enum MS_OSR _osr; // Oversampling ratio of both conversions.
+static enum MS_STATE _state; // State of conversion pipeline.
+static struct timeval _conversion_tv; // Time the running conversion started.
+static int _n_pressure; // Pressure conversions since last temperature conversion.
+static uint32_t _d1; // Digital pressure value.
+static uint32_t _d2; // Digital temperature value.
+static float _pressure; // Compensated pressure in mbar.
+static float _temp; // Compensated temperature in degree C.
+
+static int ms_read_prom();
+
+static uint8_t ms_crc4(const uint16_t *prom);
+
+static int ms_start_conversion(enum MS_STATE state);
+
+static int ms_read_adc(uint32_t *value);
+
+static void ms_compensate();
+
+//-----
+
+/**
+ * @brief Initiator of MS5611 module.
+ * Factory data is read and checked by its CRC.
+ * 
+ * @return 0 if success else -1.
+ */
+int ms_init() {
+    LOG("Initiating MS5611.\n");
+    if (_i2c == NULL && (_i2c = i2c_open(MS_I2C_BUS)) == NULL) {
+        LOG_ERROR("Failed to open I2C bus.\n");
+        return -1;
+    }
+    if (!i2c_device_exists(_i2c, MS_ADDRESS)) {
+        LOG_ERROR("Failed to find MS5611 module.\n");
+        return -1;
+    }
+    
+    LOG("Resetting.\n");
+    if (ms_reset() != 0) {
+        LOG_ERROR("Failed to reset.\n");
+        return -1;
+    }
+    
+    if (ms_read_prom() != 0) {
+        LOG_ERROR("Failed to read PROM.\n");
+        return -1;
+    }
+    
+    _osr = MS_OSR_4096;
+    _pressure = 0;
+    _temp = 0;
+    LOG("Done.\n");
+    return 0;
+}
+
+/**
+ * @brief Reset MS5611, which reloads PROM. Running conversion is dropped.
+ * 
+ * @return 0 if success else -1.
+ */
+int ms_reset() {
+    if (MS_COMMAND(MS_CMD_RESET) != 0) {
+        return -1;
+    }
+    // PROM reload takes 2.8ms.
+    usleep(3000);
+    _state = MS_STATE_IDLE;
+    _n_pressure = 0;
+    return 0;
+}
+
+/**
+ * @brief Set oversampling ratio of the conversions started afterward.
+ * 
+ * @param osr 
+ *      Oversampling ratio.
+ * @return 0 if success else -1.
+ */
+int ms_set_osr(enum MS_OSR osr) {
+    if (osr < MS_OSR_256 || osr > MS_OSR_4096) {
+        LOG_ERROR("Invalid OSR %d.\n", osr);
+        return -1;
+    }
+    _osr = osr;
+    return 0;
+}
+
+/**
+ * @brief Step the conversion pipeline, never waits for the ADC.
+ * Either starts a conversion, or reads the finished one and starts the
+ * next. A temperature conversion is done every MS_TEMP_INTERVAL pressure
+ * conversions.
+ * 
+ * @return 1 if pressure and temperature are updated, 0 if not yet, -1 if fail.
+ */
+int ms_update() {
+    if (_state == MS_STATE_IDLE) {
+        // Temperature first, pressure compensation needs it.
+        _n_pressure = 0;
+        return ms_start_conversion(MS_STATE_CONVERTING_D2);
+    }
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    if (tv_get_diff_usec_ul(&_conversion_tv, &now) < CONVERSION_TIME_TABLE[_osr]) {
+        return 0;
+    }
+
+    if (_state == MS_STATE_CONVERTING_D2) {
+        if (ms_read_adc(&_d2) != 0) {
+            goto ERROR;
+        }
+        if (ms_start_conversion(MS_STATE_CONVERTING_D1) != 0) {
+            goto ERROR;
+        }
+        return 0;
+    }
+
+    if (ms_read_adc(&_d1) != 0) {
+        goto ERROR;
+    }
+    ms_compensate();
+    if (++_n_pressure >= MS_TEMP_INTERVAL) {
+        _n_pressure = 0;
+        if (ms_start_conversion(MS_STATE_CONVERTING_D2) != 0) {
+            goto ERROR;
+        }
+    } else if (ms_start_conversion(MS_STATE_CONVERTING_D1) != 0) {
+        goto ERROR;
+    }
+    return 1;
+
+    ERROR:
+    // Start over from temperature.
+    _state = MS_STATE_IDLE;
+    return -1;
+}
+
+/**
+ * @brief Get pressure of the last pressure conversion.
+ * 
+ * @return Pressure in mbar.
+ */
+float ms_get_pressure() {
+    return _pressure;
+}
+
+/**
+ * @brief Get temperature of the last temperature conversion.
+ * 
+ * @return Temperature in degree C.
+ */
+float ms_get_temperature() {
+    return _temp;
+}
+
+//-----
+
+/**
+ * @brief Read 8 words of PROM and check them by CRC.
+ * 
+ * @return 0 if success else -1.
+ */
+static int ms_read_prom() {
+    int i;
+    bool all_zero = true;
+    for (i = 0; i < 8; i++) {
+        uint8_t buf[2];
+        if (MS_READ_ARRAY(MS_CMD_PROM_READ + 2 * i, buf, 2) != 0) {
+            return -1;
+        }
+        _prom[i] = (buf[0] << 8) | buf[1];
+        if (_prom[i] != 0) {
+            all_zero = false;
+        }
+    }
+    // All zero passes CRC as well, e.g. a bus stuck low.
+    uint8_t crc = ms_crc4(_prom);
+    if (all_zero || crc != (_prom[7] & 0x0f)) {
+        LOG_ERROR("PROM CRC doesn't match.(expect: 0x%x, got: 0x%x)\n", _prom[7] & 0x0f, crc);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief CRC-4 of PROM, from application note AN520.
+ * 
+ * @param prom 
+ *      8 words of PROM. CRC bits of the last word are ignored.
+ * @return CRC in lower 4 bits.
+ */
+static uint8_t ms_crc4(const uint16_t *prom) {
+    uint16_t rem = 0;
+    int i;
+    for (i = 0; i < 16; i++) {
+        uint16_t word = i >> 1 == 7 ? prom[7] & 0xff00 : prom[i >> 1];
+        rem ^= i % 2 == 1 ? word & 0x00ff : word >> 8;
+        int bit;
+        for (bit = 0; bit < 8; bit++) {
+            rem = rem & 0x8000 ? (rem << 1) ^ 0x3000 : rem << 1;
+        }
+    }
+    return (rem >> 12) & 0x0f;
+}
+
+/**
+ * @brief Start a conversion with current OSR.
+ * 
+ * @param state 
+ *      MS_STATE_CONVERTING_D1 for pressure or MS_STATE_CONVERTING_D2 for temperature.
+ * @return 0 if success else -1.
+ */
+static int ms_start_conversion(enum MS_STATE state) {
+    uint8_t cmd = (state == MS_STATE_CONVERTING_D1 ? MS_CMD_CONVERT_D1 : MS_CMD_CONVERT_D2) + 2 * _osr;
+    if (MS_COMMAND(cmd) != 0) {
+        LOG_ERROR("Failed to start conversion.\n");
+        _state = MS_STATE_IDLE;
+        return -1;
+    }
+    gettimeofday(&_conversion_tv, NULL);
+    _state = state;
+    return 0;
+}
+
+/**
+ * @brief Read the result of finished conversion.
+ * 
+ * @param value 
+ *      24 bit result.
+ * @return 0 if success else -1.
+ */
+static int ms_read_adc(uint32_t *value) {
+    uint8_t buf[3];
+    if (MS_READ_ARRAY(MS_CMD_ADC_READ, buf, 3) != 0) {
+        LOG_ERROR("Failed to read ADC.\n");
+        return -1;
+    }
+    *value = ((uint32_t)buf[0] << 16) | ((uint32_t)buf[1] << 8) | buf[2];
+    if (*value == 0) {
+        // Read before conversion finished, or conversion was interrupted.
+        LOG_ERROR("ADC isn't ready.\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Compute pressure and temperature from D1 and D2 with second order
+ * temperature compensation, following the datasheet.
+ * 
+ */
+static void ms_compensate() {
+    int64_t dt = (int64_t)_d2 - ((int64_t)_prom[5] << 8);
+    int64_t temp = 2000 + ((dt * _prom[6]) >> 23);
+    int64_t off = ((int64_t)_prom[2] << 16) + ((_prom[4] * dt) >> 7);
+    int64_t sens = ((int64_t)_prom[1] << 15) + ((_prom[3] * dt) >> 8);
+
+    if (temp < 2000) {
+        // Low temperature.
+        int64_t t2 = (dt * dt) >> 31;
+        int64_t off2 = 5 * (temp - 2000) * (temp - 2000) / 2;
+        int64_t sens2 = 5 * (temp - 2000) * (temp - 2000) / 4;
+        if (temp < -1500) {
+            // Very low temperature.
+            off2 += 7 * (temp + 1500) * (temp + 1500);
+            sens2 += 11 * (temp + 1500) * (temp + 1500) / 2;
+        }
+        temp -= t2;
+        off -= off2;
+        sens -= sens2;
+    }
+
+    int64_t p = ((((int64_t)_d1 * sens) >> 21) - off) >> 15;
+    _temp = temp / 100.0f;
+    _pressure = p / 100.0f;
+}
\ No newline at end of file
@@ -2,10 +2,11 @@
  * @file ms5611.h
  * @author LIN 
  * @brief Driver for MS5611 barometer.
+ * Conversions run as a state machine stepped by ms_update once per loop:
+ * a conversion is started, and its result is read by a later call after
+ * the ADC time, so no call waits for the ADC.
  * 
- * 
- * 
- * @version 0.1
+ * @version 0.2
  * @date 2021-08-20
  * 
  * @copyright Copyright (c) 2021
@@ -14,5 +15,26 @@
 #ifndef _MS5611_H_
 #define _MS5611_H_
 
+//-----Enums-----
+// Oversampling ratio. Higher is less noisy and slower, 0.6ms ~ 9.04ms.
+enum MS_OSR {
+    MS_OSR_256 = 0,
+    MS_OSR_512 = 1,
+    MS_OSR_1024 = 2,
+    MS_OSR_2048 = 3,
+    MS_OSR_4096 = 4
+};
+
+int ms_init();
+
+int ms_reset();
+
+int ms_set_osr(enum MS_OSR osr);
+
+int ms_update();
+
+float ms_get_pressure();
+
+float ms_get_temperature();
 
-#endif // _MS5611_H_
+#endif // _MS5611_H_
\ No newline at end of file
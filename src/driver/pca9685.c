@@ -1,21 +1,29 @@
 #include "pca9685.h"
 
 #include "util/io/i2c.h"
+#include "util/io/reg_shadow.h"
+#include "util/io/bus_worker.h"
 #include "util/macro.h"
 #include "util/logger.h"
 #include "util/debug.h"
+#include "util/tv.h"
 
 #include <stdlib.h>
 #include <unistd.h>
 
 #define PCA_ADDRESS 0x40
+#define PCA_I2C_BUS "/dev/i2c-1"
 
-#define PCA_WRITE(reg, data) i2c_write(PCA_ADDRESS, reg, data)
-#define PCA_READ(reg, data) i2c_read(PCA_ADDRESS, reg, data)
-#define PCA_WRITE_ARRAY(reg, data, n) i2c_write_array(PCA_ADDRESS, reg, data, n)
-#define PCA_READ_ARRAY(reg, data, n) i2c_read_array(PCA_ADDRESS, reg, data, n)
-#define PCA_WRITE_BIT(reg, data, n, offset) i2c_write_bit(PCA_ADDRESS, reg, data, n, offset)
-#define PCA_READ_BIT(reg, data, n, offset) i2c_read_bit(PCA_ADDRESS, reg, data, n, offset)
+static struct I2CBus *_i2c; // Opened in pca_init and kept for every access.
+
+static struct BusWorker *_worker; // Writes PWM values without blocking the control loop.
+
+#define PCA_WRITE(reg, data) i2c_write(_i2c, PCA_ADDRESS, reg, data)
+#define PCA_READ(reg, data) i2c_read(_i2c, PCA_ADDRESS, reg, data)
+#define PCA_WRITE_ARRAY(reg, data, n) i2c_write_array(_i2c, PCA_ADDRESS, reg, data, n)
+#define PCA_READ_ARRAY(reg, data, n) i2c_read_array(_i2c, PCA_ADDRESS, reg, data, n)
+#define PCA_WRITE_BIT(reg, data, n, offset) i2c_write_bit(_i2c, PCA_ADDRESS, reg, data, n, offset)
+#define PCA_READ_BIT(reg, data, n, offset) i2c_read_bit(_i2c, PCA_ADDRESS, reg, data, n, offset)
 
 #define PCA_MODE1 0x00
 #define PCA_MODE2 0x01
@@ -27,13 +35,34 @@
 #define PCA_LED_ON_H(index) (PCA_LED0_ON_H + 4 * (index))
 #define PCA_LED_OFF_L(index) (PCA_LED0_OFF_L + 4 * (index))
 #define PCA_LED_OFF_H(index) (PCA_LED0_OFF_H + 4 * (index))
+#define PCA_ALL_LED_ON_L 0xfa
+#define PCA_ALL_LED_OFF_L 0xfc
 #define PCA_PRE_SCALE 0xfe
 #define PCA_CLOCK_FREQ 25000000.0f // 25MHz default clock
 
+#define PCA_MODE1_AI 0x20 // Register pointer increments after each byte.
+#define PCA_OSC_STARTUP_US 500 // Oscillator needs 500us after leaving sleep before RESTART.
+
 static int _freq; // Frequency value cached.
 
+static struct RegShadow *_shadow; // Register shadow of PCA.
+
+//----- Output stage. pca_write_* stage widths, pca_commit posts the changed ones.
+static int _committed[16]; // Width last posted of each channel, -1 if unknown.
+static int _staged[16]; // Width to be committed of each channel.
+static uint16_t _dirty; // Channels whose staged width differs from committed.
+static struct timeval _commit_deadline_tv; // Earliest time of next commit, one PWM period after the last deadline.
+static int _in_flight; // Posted writes the worker hasn't done, shared with worker.
+static bool _commit_failed; // Set by worker if a posted write failed.
+static unsigned long _n_commits; // Commits posted.
+static unsigned long _n_suppressed; // Channel writes never posted, unchanged or replaced before commit.
+
 void pca_atexit();
 
+static void pca_set_committed(int width);
+
+static void pca_commit_done(int ret, void *arg);
+
 /**
  * @brief Initiator of PCA module.
  * 
@@ -41,10 +70,27 @@ void pca_atexit();
  */
 int pca_init() {
     LOG("Initiating PCA9685.\n");
-    if (!i2c_device_exists(PCA_ADDRESS)) {
+    if (_i2c == NULL && (_i2c = i2c_open(PCA_I2C_BUS)) == NULL) {
+        LOG_ERROR("Failed to open I2C bus.\n");
+        return -1;
+    }
+    if (!i2c_device_exists(_i2c, PCA_ADDRESS)) {
         LOG_ERROR("Failed to find PCA module.\n");
         return -1;
     }
+    if (_shadow == NULL) {
+        if ((_shadow = reg_shadow_init()) == NULL) {
+            LOG_ERROR("Failed to create register shadow.\n");
+            return -1;
+        }
+        // RESTART bit is set and cleared by PCA.
+        reg_shadow_set_volatile(_shadow, PCA_MODE1, 1);
+        i2c_set_shadow(_i2c, PCA_ADDRESS, _shadow);
+    }
+    if (_worker == NULL && (_worker = bus_worker_open(_i2c)) == NULL) {
+        LOG_ERROR("Failed to start bus worker.\n");
+        return -1;
+    }
     
     LOG("Resetting.\n");
     if (pca_reset() != 0) {
@@ -66,35 +112,30 @@ int pca_init() {
 
 /**
  * @brief Reset & initialize.
+ * Auto increment is enabled, so several channels are written by one transfer.
  * 
  * @return 0 if success else -1.
  */
 int pca_reset() {
-    if (PCA_WRITE(PCA_MODE1, 0) != 0) {
+    // Pending PWM writes must not land after the reset.
+    bus_worker_flush(_worker);
+    // Write every register regardless of what was written before.
+    reg_shadow_invalidate(_shadow);
+    if (PCA_WRITE(PCA_MODE1, PCA_MODE1_AI) != 0) {
         return -1;
     }
     if (PCA_WRITE(PCA_MODE2, 0x04) != 0) {
         return -1;
     }
     
-    usleep(1000);
-    int i = 0;
-    for (i = 0; i < 16; i++) {
-        // 0 delay time for every channel
-        if (PCA_WRITE(PCA_LED_ON_L(i), 0) != 0) {
-            return -1;
-        }
-        if (PCA_WRITE(PCA_LED_ON_H(i), 0) != 0) {
-            return -1;
-        }
-        if (PCA_WRITE(PCA_LED_OFF_L(i), 0) != 0) {
-            return -1;
-        }
-        if (PCA_WRITE(PCA_LED_OFF_H(i), 0) != 0) {
-            return -1;
-        }
+    // 0 delay time and 0 width for every channel at once.
+    uint8_t all_led[4] = {0, 0, 0, 0};
+    if (PCA_WRITE_ARRAY(PCA_ALL_LED_ON_L, all_led, sizeof(all_led)) != 0) {
+        return -1;
     }
-    usleep(1000);
+    // ALL_LED wrote every LED register.
+    reg_shadow_invalidate(_shadow);
+    pca_set_committed(0);
     return 0;
 } 
 
@@ -108,39 +149,37 @@ int pca_reset() {
 int pca_set_frequency(int freq) {
     uint8_t pre_scale = (PCA_CLOCK_FREQ / 4096 / freq) - 1;
     uint8_t old_mode;
+    bus_worker_flush(_worker);
     if (PCA_READ(PCA_MODE1, &old_mode) != 0) {
         LOG_ERROR("Failed to read mode.\n");
         return -1;
     }
-    usleep(1000);
     
     // Setup sleep mode (Bit 4) since prescale can only be set in sleep mode.
     if (PCA_WRITE(PCA_MODE1, old_mode | 0x10) != 0) {
         LOG_ERROR("Failed to set sleep mode.\n");
         return -1;
     }
-    usleep(1000);
     
     // Set frequency.
     if (PCA_WRITE(PCA_PRE_SCALE, pre_scale) != 0) {
         LOG_ERROR("Failed to set pre scale.\n");
         return -1;
     }
-    usleep(1000);
     
     // Restore mode.
     if(PCA_WRITE(PCA_MODE1, old_mode) != 0) {
         LOG_ERROR("Failed to restore mode.\n");
         return -1;
     }
-    usleep(1000);
+    // Nothing on the chip tells the oscillator is stable, so this one is a fixed wait.
+    usleep(PCA_OSC_STARTUP_US);
     
     // Restart
-    if (PCA_WRITE(PCA_PRE_SCALE, old_mode | 0x80) != 0) {
+    if (PCA_WRITE(PCA_MODE1, old_mode | 0x80) != 0) {
         LOG_ERROR("Failed to restart.\n");
         return -1;
     }
-    usleep(1000);
 
     // Update cach.
     _freq = freq;
@@ -149,6 +188,7 @@ int pca_set_frequency(int freq) {
 
 /**
  * @brief Directly set PWM value.
+ * The write is posted to bus worker and done after return.
  * 
  * @param chan
  *      Channel of PCA.
@@ -157,20 +197,158 @@ int pca_set_frequency(int freq) {
  * @return 0 if success else -1.
  */
 int pca_write_pwm(int chan, int width) {
+    return pca_write_pwm_range(chan, &width, 1);
+}
+
+/**
+ * @brief Set PWM values of adjacent channels.
+ * Values are staged and committed by pca_commit, see there.
+ * 
+ * @param first_chan 
+ *      First channel of PCA.
+ * @param widths 
+ *      Width of PWM from 0 to 4095 for each channel.
+ * @param n 
+ *      Number of channels.
+ * @return 0 if success else -1.
+ */
+int pca_write_pwm_range(int first_chan, const int *widths, int n) {
     // Check channel.
-    if (chan > 15 || chan < 0) {
+    if (first_chan < 0 || n < 1 || first_chan + n > 16) {
         LOG_ERROR("Trying to set unexist channel.\n");
         return -1;
     }
 
-    // Write value.
-    if (PCA_WRITE(PCA_LED_OFF_L(chan), (width & 0xff)) != 0) {
-        return -1;
+    int i;
+    for (i = 0; i < n; i++) {
+        int chan = first_chan + i;
+        int width = widths[i] & 0x0fff;
+        if (width == _staged[chan] || (_dirty & (1 << chan))) {
+            // Unchanged, or the staged width is replaced before it's posted.
+            _n_suppressed++;
+        }
+        _staged[chan] = width;
+        if (width != _committed[chan]) {
+            _dirty |= 1 << chan;
+        } else {
+            _dirty &= ~(1 << chan);
+        }
     }
-    if (PCA_WRITE(PCA_LED_OFF_H(chan), ((width >> 8) & 0xff)) != 0) {
-        return -1;
+    return pca_commit();
+}
+
+/**
+ * @brief Post the staged widths which differ from the committed ones.
+ * Each run of adjacent changed channels is one transfer of LED_ON and
+ * LED_OFF through auto increment, done by bus worker after return.
+ * At most one commit is done per PWM period, since PCA only latches new
+ * values at the end of a period. The deadline of next commit advances by
+ * one period so a call a bit early doesn't slip the phase, and is
+ * resynced only when more than a period late. Writes staged meanwhile are
+ * committed by a later call, so call it once per loop even if nothing is
+ * written.
+ * 
+ * @return 0 if success or deferred else -1.
+ */
+int pca_commit() {
+    if (__atomic_exchange_n(&_commit_failed, false, __ATOMIC_ACQ_REL)) {
+        // Registers are unknown, write every channel again.
+        int i;
+        for (i = 0; i < 16; i++) {
+            _committed[i] = -1;
+        }
+        _dirty = 0xffff;
+    }
+    if (_dirty == 0 || __atomic_load_n(&_in_flight, __ATOMIC_ACQUIRE) > 0) {
+        // Nothing to do, or the last commit is still being written.
+        return 0;
+    }
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    if (_freq > 0 && timercmp(&now, &_commit_deadline_tv, <)) {
+        return 0;
     }
 
+    int first = 0;
+    while (first < 16) {
+        if (!(_dirty & (1 << first))) {
+            first++;
+            continue;
+        }
+        int last = first;
+        while (last + 1 < 16 && (_dirty & (1 << (last + 1)))) {
+            last++;
+        }
+        uint8_t buf[16 * 4];
+        int chan;
+        for (chan = first; chan <= last; chan++) {
+            uint8_t *led = &buf[4 * (chan - first)];
+            // 0 delay time, so OFF count is the width.
+            led[0] = 0;
+            led[1] = 0;
+            led[2] = _staged[chan] & 0xff;
+            led[3] = (_staged[chan] >> 8) & 0x0f;
+        }
+        __atomic_add_fetch(&_in_flight, 1, __ATOMIC_ACQ_REL);
+        if (bus_worker_post_write(_worker, PCA_ADDRESS, PCA_LED_ON_L(first), buf, 4 * (last - first + 1), pca_commit_done, NULL) != 0) {
+            __atomic_sub_fetch(&_in_flight, 1, __ATOMIC_ACQ_REL);
+            return -1;
+        }
+        for (chan = first; chan <= last; chan++) {
+            _committed[chan] = _staged[chan];
+            _dirty &= ~(1 << chan);
+        }
+        first = last + 1;
+    }
+    if (_freq > 0) {
+        struct timeval period = {0, 1000000L / _freq};
+        struct timeval late;
+        timersub(&now, &_commit_deadline_tv, &late);
+        if (timercmp(&late, &period, >)) {
+            // Nothing was committed for a while, start again from now.
+            _commit_deadline_tv = now;
+        }
+        timeradd(&_commit_deadline_tv, &period, &_commit_deadline_tv);
+    }
+    _n_commits++;
+    return 0;
+}
+
+/**
+ * @brief Get number of commits posted.
+ * 
+ * @return Commits since pca_init.
+ */
+unsigned long pca_get_commits() {
+    return _n_commits;
+}
+
+/**
+ * @brief Get number of channel writes that never reached the bus, because
+ * the width was unchanged or replaced within a PWM period.
+ * 
+ * @return Suppressed writes since pca_init.
+ */
+unsigned long pca_get_suppressed_writes() {
+    return _n_suppressed;
+}
+
+/**
+ * @brief Turn every channel fully off with one write of ALL_LED_OFF.
+ * Pending writes are done first, so none of them turns a channel on again.
+ * 
+ * @return 0 if success else -1.
+ */
+int pca_write_all_off() {
+    bus_worker_flush(_worker);
+    // Full OFF bit of ALL_LED_OFF_H.
+    uint8_t all_led_off[2] = {0, 0x10};
+    if (PCA_WRITE_ARRAY(PCA_ALL_LED_OFF_L, all_led_off, sizeof(all_led_off)) != 0) {
+        return -1;
+    }
+    // ALL_LED wrote every LED register.
+    reg_shadow_invalidate(_shadow);
+    pca_set_committed(0);
     return 0;
 }
 
@@ -184,10 +362,33 @@ int pca_write_pwm(int chan, int width) {
  * @return 0 if success else -1.
  */
 int pca_write_throttle(int chan, float throttle) {
-    throttle = LIMIT_MAX_MIN(throttle, 100.0f, 0.0f);
-    int pwm_value = (4095.0f / 100.0f) * throttle;
+    return pca_write_throttle_range(chan, &throttle, 1);
+}
 
-    return pca_write_pwm(chan, pwm_value);
+/**
+ * @brief Set throttle of adjacent channels with one transfer.
+ * 
+ * @param first_chan 
+ *      First channel of PCA.
+ * @param throttles 
+ *      Throttle value from 0.0 to 100.0 for each channel.
+ * @param n 
+ *      Number of channels.
+ * @return 0 if success else -1.
+ */
+int pca_write_throttle_range(int first_chan, const float *throttles, int n) {
+    int pwm_values[16];
+    if (n < 1 || n > 16) {
+        LOG_ERROR("Trying to set unexist channel.\n");
+        return -1;
+    }
+    int i;
+    for (i = 0; i < n; i++) {
+        float throttle = LIMIT_MAX_MIN(throttles[i], 100.0f, 0.0f);
+        pwm_values[i] = (4095.0f / 100.0f) * throttle;
+    }
+
+    return pca_write_pwm_range(first_chan, pwm_values, n);
 }
 
 /**
@@ -213,8 +414,39 @@ int pca_write_servo(int chan, int micro) {
  */
 void pca_atexit() {
     LOG("Disabling all PWM output.\n");
+    pca_write_all_off();
+    LOG("%lu commits, %lu channel writes suppressed.\n", _n_commits, _n_suppressed);
+}
+
+//-----
+
+/**
+ * @brief Mark every channel as written with width, e.g. after ALL_LED write.
+ * Worker must be flushed.
+ * 
+ * @param width 
+ *      Width of every channel.
+ */
+static void pca_set_committed(int width) {
     int i;
     for (i = 0; i < 16; i++) {
-        pca_write_pwm(i, 0);
+        _committed[i] = _staged[i] = width;
+    }
+    _dirty = 0;
+}
+
+/**
+ * @brief Called by bus worker after a commit is written.
+ * 
+ * @param ret 
+ *      0 if written else -1.
+ * @param arg 
+ *      Not used.
+ */
+static void pca_commit_done(int ret, void *arg) {
+    if (ret != 0) {
+        LOG_ERROR("Failed to commit PWM.\n");
+        __atomic_store_n(&_commit_failed, true, __ATOMIC_RELEASE);
     }
+    __atomic_sub_fetch(&_in_flight, 1, __ATOMIC_ACQ_REL);
 }
\ No newline at end of file
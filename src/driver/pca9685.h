@@ -22,8 +22,20 @@ int pca_set_frequency(int freq);
 
 int pca_write_pwm(int chan, int width);
 
+int pca_write_pwm_range(int first_chan, const int *widths, int n);
+
+int pca_write_all_off();
+
+int pca_commit();
+
+unsigned long pca_get_commits();
+
+unsigned long pca_get_suppressed_writes();
+
 int pca_write_throttle(int chan, float throttle);
 
+int pca_write_throttle_range(int first_chan, const float *throttles, int n);
+
 int pca_write_servo(int chan, int micro);
 
 
@@ -0,0 +1,212 @@
+#include "ak8963_sim.h"
+
+#include "util/io/bus_sim.h"
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define AK_SIM_WIA 0x00
+#define AK_SIM_INFO 0x01
+#define AK_SIM_ST1 0x02
+#define AK_SIM_HXL 0x03
+#define AK_SIM_ST2 0x09
+#define AK_SIM_CNTL1 0x0a
+#define AK_SIM_CNTL2 0x0b
+#define AK_SIM_ASAX 0x10
+#define AK_SIM_N_REGS 0x13
+
+#define AK_SIM_MODE_POWER_DOWN 0x00
+#define AK_SIM_MODE_SINGLE 0x01
+#define AK_SIM_MODE_CONT_8HZ 0x02
+#define AK_SIM_MODE_CONT_100HZ 0x06
+
+#define AK_SIM_MAX_UT 4912.0f // Measurement range in uT.
+
+static uint8_t _regs[AK_SIM_N_REGS]; // Register file.
+static float _mag[3]; // Field in uT.
+static uint64_t _next_sample_ns; // Time of next sample in continuous mode.
+
+static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const struct BusSimDevice _dev = {
+    .name = "AK8963",
+    .read = ak_sim_read,
+    .write = ak_sim_write
+};
+
+static void ak_sim_reset();
+
+static void ak_sim_sample();
+
+static void ak_sim_update();
+
+static uint64_t ak_sim_now_ns();
+
+/**
+ * @brief Reset the model to power-on state.
+ * 
+ * @return The model, attach it with bus_sim_attach.
+ */
+const struct BusSimDevice *ak_sim_init() {
+    pthread_mutex_lock(&_mutex);
+    ak_sim_reset();
+    pthread_mutex_unlock(&_mutex);
+    return &_dev;
+}
+
+/**
+ * @brief Set field measured by the model.
+ * 
+ * @param x 
+ *      uT.
+ * @param y 
+ *      uT.
+ * @param z 
+ *      uT.
+ */
+void ak_sim_set_mag(float x, float y, float z) {
+    pthread_mutex_lock(&_mutex);
+    _mag[0] = x;
+    _mag[1] = y;
+    _mag[2] = z;
+    pthread_mutex_unlock(&_mutex);
+}
+
+/**
+ * @brief Read registers with auto increment.
+ * Reading ST2 ends the data read and clears data ready.
+ * 
+ * @param dev 
+ *      The model.
+ * @param reg_addr 
+ *      First register.
+ * @param buffer 
+ *      Buffer to hold read data.
+ * @param n 
+ *      Length of buffer.
+ * @return 0 if success else -1.
+ */
+int ak_sim_read(const struct BusSimDevice *dev, uint8_t reg_addr, uint8_t *buffer, int n) {
+    pthread_mutex_lock(&_mutex);
+    ak_sim_update();
+    int i;
+    for (i = 0; i < n; i++) {
+        uint8_t reg = reg_addr + i;
+        buffer[i] = reg < AK_SIM_N_REGS ? _regs[reg] : 0;
+        if (reg == AK_SIM_ST2) {
+            _regs[AK_SIM_ST1] = 0;
+        }
+    }
+    pthread_mutex_unlock(&_mutex);
+    return 0;
+}
+
+/**
+ * @brief Write registers with auto increment.
+ * 
+ * @param dev 
+ *      The model.
+ * @param reg_addr 
+ *      First register.
+ * @param buffer 
+ *      Data to write.
+ * @param n 
+ *      Length of data.
+ * @return 0 if success else -1.
+ */
+int ak_sim_write(const struct BusSimDevice *dev, uint8_t reg_addr, const uint8_t *buffer, int n) {
+    pthread_mutex_lock(&_mutex);
+    int i;
+    for (i = 0; i < n; i++) {
+        uint8_t reg = reg_addr + i;
+        switch (reg) {
+        case AK_SIM_CNTL1:
+            _regs[reg] = buffer[i];
+            _next_sample_ns = ak_sim_now_ns();
+            if ((buffer[i] & 0x0f) == AK_SIM_MODE_SINGLE) {
+                // Measure at once and go back to power-down.
+                ak_sim_sample();
+                _regs[reg] &= ~0x0f;
+            }
+            break;
+        case AK_SIM_CNTL2:
+            if (buffer[i] & 0x01) {
+                ak_sim_reset();
+            }
+            break;
+        case 0x0c: // ASTC
+        case 0x0f: // I2CDIS
+            _regs[reg] = buffer[i];
+            break;
+        default:
+            // Read only.
+            break;
+        }
+    }
+    pthread_mutex_unlock(&_mutex);
+    return 0;
+}
+
+//-----
+
+static void ak_sim_reset() {
+    memset(_regs, 0, sizeof(_regs));
+    _regs[AK_SIM_WIA] = 0x48;
+    _regs[AK_SIM_INFO] = 0x9a;
+    // ASA of 128 means no adjustment.
+    _regs[AK_SIM_ASAX] = 128;
+    _regs[AK_SIM_ASAX + 1] = 128;
+    _regs[AK_SIM_ASAX + 2] = 128;
+    _next_sample_ns = 0;
+}
+
+/**
+ * @brief Latch _mag into data registers and set data ready.
+ */
+static void ak_sim_sample() {
+    bool bit16 = _regs[AK_SIM_CNTL1] & 0x10;
+    float scale = bit16 ? 1.0f / 0.15f : 1.0f / 0.6f; // LSB per uT.
+    bool overflow = false;
+    int i;
+    for (i = 0; i < 3; i++) {
+        if (_mag[i] > AK_SIM_MAX_UT || _mag[i] < -AK_SIM_MAX_UT) {
+            overflow = true;
+        }
+        int16_t raw = _mag[i] * scale;
+        _regs[AK_SIM_HXL + 2 * i] = raw & 0xff;
+        _regs[AK_SIM_HXL + 2 * i + 1] = (raw >> 8) & 0xff;
+    }
+    // Data overrun if the previous sample wasn't read.
+    _regs[AK_SIM_ST1] = 0x01 | (_regs[AK_SIM_ST1] & 0x01 ? 0x02 : 0);
+    _regs[AK_SIM_ST2] = (bit16 ? 0x10 : 0) | (overflow ? 0x08 : 0);
+}
+
+/**
+ * @brief Take samples due in continuous mode.
+ */
+static void ak_sim_update() {
+    uint64_t period_ns;
+    switch (_regs[AK_SIM_CNTL1] & 0x0f) {
+    case AK_SIM_MODE_CONT_8HZ:
+        period_ns = 125000000ULL;
+        break;
+    case AK_SIM_MODE_CONT_100HZ:
+        period_ns = 10000000ULL;
+        break;
+    default:
+        return;
+    }
+    uint64_t now = ak_sim_now_ns();
+    if (now < _next_sample_ns) {
+        return;
+    }
+    ak_sim_sample();
+    _next_sample_ns = now + period_ns;
+}
+
+static uint64_t ak_sim_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,31 @@
+/**
+ * @file ak8963_sim.h
+ * @author agent
+ * @brief Register level model of AK8963 for bus_sim.
+ * Measurement modes, data ready, overflow and soft reset behave like the
+ * chip. Field is set by ak_sim_set_mag.
+ * 
+ * @version 0.1
+ * @date 2026-10-17
+ * 
+ * @copyright Copyright (c) 2026
+ * 
+ */
+#ifndef _AK8963_SIM_H_
+#define _AK8963_SIM_H_
+
+#include <stdint.h>
+
+#define AK_SIM_ADDRESS 0x0c
+
+struct BusSimDevice;
+
+const struct BusSimDevice *ak_sim_init();
+
+void ak_sim_set_mag(float x, float y, float z);
+
+int ak_sim_read(const struct BusSimDevice *dev, uint8_t reg_addr, uint8_t *buffer, int n);
+
+int ak_sim_write(const struct BusSimDevice *dev, uint8_t reg_addr, const uint8_t *buffer, int n);
+
+#endif // _AK8963_SIM_H_
@@ -0,0 +1,471 @@
+#include "mpu9250_sim.h"
+
+#include "util/io/bus_sim.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#define MPU_SIM_SMPLRT_DIV 0x19
+#define MPU_SIM_CONFIG 0x1a
+#define MPU_SIM_GYRO_CONFIG 0x1b
+#define MPU_SIM_ACCEL_CONFIG 0x1c
+#define MPU_SIM_FIFO_EN 0x23
+#define MPU_SIM_SLV0_ADDR 0x25 // SLV0 ~ SLV3 are 3 registers apart.
+#define MPU_SIM_SLV4_ADDR 0x31
+#define MPU_SIM_SLV4_REG 0x32
+#define MPU_SIM_SLV4_DO 0x33
+#define MPU_SIM_SLV4_CTRL 0x34
+#define MPU_SIM_SLV4_DI 0x35
+#define MPU_SIM_I2C_MST_STATUS 0x36
+#define MPU_SIM_INT_STATUS 0x3a
+#define MPU_SIM_ACCEL_XOUT_H 0x3b
+#define MPU_SIM_TEMP_OUT_H 0x41
+#define MPU_SIM_GYRO_XOUT_H 0x43
+#define MPU_SIM_EXT_SENS_DATA_00 0x49
+#define MPU_SIM_EXT_SENS_DATA_23 0x60
+#define MPU_SIM_I2C_MST_DELAY_CTRL 0x67
+#define MPU_SIM_USER_CTRL 0x6a
+#define MPU_SIM_PWR_MGMT_1 0x6b
+#define MPU_SIM_FIFO_COUNTH 0x72
+#define MPU_SIM_FIFO_COUNTL 0x73
+#define MPU_SIM_FIFO_R_W 0x74
+#define MPU_SIM_WHO_AM_I 0x75
+#define MPU_SIM_N_REGS 0x80
+#define MPU_SIM_FIFO_SIZE 512
+
+// State of one chip, every instance is a separate device.
+struct MPUSim {
+    struct BusSimDevice dev; // Attached to bus_sim, ctx points to this.
+    uint8_t regs[MPU_SIM_N_REGS]; // Register file.
+    float accel[3]; // Acceleration in g.
+    float gyro[3]; // Angular velocity in degree per second.
+    float temp; // Temperature in degree C.
+
+    uint8_t fifo[MPU_SIM_FIFO_SIZE]; // Ring buffer of FIFO.
+    int fifo_head; // Index of the oldest byte.
+    int fifo_count; // Bytes in FIFO.
+    int64_t fifo_time_ns; // Time of the last sample pushed into FIFO.
+    bool fifo_overflow; // FIFO_OFLOW_INT, cleared when INT_STATUS is read.
+
+    int64_t mst_time_ns; // Time of the last sample tick of the I2C master.
+    uint32_t mst_ticks; // Sample ticks of the I2C master since reset.
+    uint8_t aux_addr; // Address of auxiliary device behind the I2C master.
+    const struct BusSimDevice *aux; // Auxiliary device, NULL if none.
+
+    pthread_mutex_t mutex;
+};
+
+static int mpu_sim_read(const struct BusSimDevice *dev, uint8_t reg_addr, uint8_t *buffer, int n);
+
+static int mpu_sim_write(const struct BusSimDevice *dev, uint8_t reg_addr, const uint8_t *buffer, int n);
+
+static void mpu_sim_reset(struct MPUSim *s);
+
+static uint8_t mpu_sim_sensor_byte(const struct MPUSim *s, uint8_t reg);
+
+static int64_t mpu_sim_now_ns();
+
+static int64_t mpu_sim_period_ns(const struct MPUSim *s);
+
+static void mpu_sim_run_slaves(struct MPUSim *s);
+
+static void mpu_sim_run_slave4(struct MPUSim *s);
+
+static void mpu_sim_reset_fifo(struct MPUSim *s);
+
+static void mpu_sim_fill_fifo(struct MPUSim *s);
+
+/**
+ * @brief Create a model in power-on state. Sensors read 1g on z axis.
+ * Every call creates another chip, e.g. for a redundant IMU.
+ * 
+ * @param aux_addr 
+ *      Address of auxiliary device.
+ * @param aux 
+ *      Auxiliary device reached by the I2C master, NULL if none.
+ * @return The model, attach it with bus_sim_attach. NULL if fail.
+ */
+const struct BusSimDevice *mpu_sim_init(uint8_t aux_addr, const struct BusSimDevice *aux) {
+    struct MPUSim *s = calloc(1, sizeof(struct MPUSim));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->dev.name = "MPU-9250";
+    s->dev.read = mpu_sim_read;
+    s->dev.write = mpu_sim_write;
+    s->dev.ctx = s;
+    pthread_mutex_init(&s->mutex, NULL);
+
+    pthread_mutex_lock(&s->mutex);
+    s->aux_addr = aux_addr;
+    s->aux = aux;
+    memset(s->gyro, 0, sizeof(s->gyro));
+    s->accel[0] = 0;
+    s->accel[1] = 0;
+    s->accel[2] = 1.0f;
+    s->temp = 25.0f;
+    mpu_sim_reset(s);
+    pthread_mutex_unlock(&s->mutex);
+    return &s->dev;
+}
+
+/**
+ * @brief Set acceleration measured by the model.
+ * 
+ * @param dev 
+ *      The model.
+ * @param x 
+ *      g.
+ * @param y 
+ *      g.
+ * @param z 
+ *      g.
+ */
+void mpu_sim_set_accel(const struct BusSimDevice *dev, float x, float y, float z) {
+    struct MPUSim *s = dev->ctx;
+    pthread_mutex_lock(&s->mutex);
+    s->accel[0] = x;
+    s->accel[1] = y;
+    s->accel[2] = z;
+    pthread_mutex_unlock(&s->mutex);
+}
+
+/**
+ * @brief Set angular velocity measured by the model.
+ * 
+ * @param dev 
+ *      The model.
+ * @param x 
+ *      Degree per second.
+ * @param y 
+ *      Degree per second.
+ * @param z 
+ *      Degree per second.
+ */
+void mpu_sim_set_gyro(const struct BusSimDevice *dev, float x, float y, float z) {
+    struct MPUSim *s = dev->ctx;
+    pthread_mutex_lock(&s->mutex);
+    s->gyro[0] = x;
+    s->gyro[1] = y;
+    s->gyro[2] = z;
+    pthread_mutex_unlock(&s->mutex);
+}
+
+/**
+ * @brief Set temperature measured by the model.
+ * 
+ * @param dev 
+ *      The model.
+ * @param temp 
+ *      Degree C.
+ */
+void mpu_sim_set_temp(const struct BusSimDevice *dev, float temp) {
+    struct MPUSim *s = dev->ctx;
+    pthread_mutex_lock(&s->mutex);
+    s->temp = temp;
+    pthread_mutex_unlock(&s->mutex);
+}
+
+//-----
+
+/**
+ * @brief Read registers with auto increment.
+ * EXT_SENS_DATA is refreshed from enabled slaves before it's read.
+ * A read of FIFO_R_W doesn't increment and pops n bytes.
+ * 
+ * @param dev 
+ *      The model.
+ * @param reg_addr 
+ *      First register.
+ * @param buffer 
+ *      Buffer to hold read data.
+ * @param n 
+ *      Length of buffer.
+ * @return 0 if success else -1.
+ */
+static int mpu_sim_read(const struct BusSimDevice *dev, uint8_t reg_addr, uint8_t *buffer, int n) {
+    struct MPUSim *s = dev->ctx;
+    pthread_mutex_lock(&s->mutex);
+    if (reg_addr <= MPU_SIM_EXT_SENS_DATA_23 && reg_addr + n > MPU_SIM_EXT_SENS_DATA_00) {
+        mpu_sim_run_slaves(s);
+    }
+    if (reg_addr <= MPU_SIM_FIFO_R_W && reg_addr + n > MPU_SIM_FIFO_COUNTH) {
+        mpu_sim_fill_fifo(s);
+    }
+    int i;
+    if (reg_addr == MPU_SIM_FIFO_R_W) {
+        for (i = 0; i < n; i++) {
+            // Empty FIFO reads the last byte again.
+            buffer[i] = s->fifo[s->fifo_head];
+            if (s->fifo_count > 0) {
+                s->fifo_head = (s->fifo_head + 1) % MPU_SIM_FIFO_SIZE;
+                s->fifo_count--;
+            }
+        }
+        pthread_mutex_unlock(&s->mutex);
+        return 0;
+    }
+    for (i = 0; i < n; i++) {
+        uint8_t reg = (reg_addr + i) & 0x7f;
+        if (reg == MPU_SIM_INT_STATUS) {
+            buffer[i] = 0x01 | (s->fifo_overflow ? 0x10 : 0); // RAW_DATA_RDY_INT, FIFO_OFLOW_INT
+            s->fifo_overflow = false;
+        } else if (reg == MPU_SIM_FIFO_COUNTH) {
+            buffer[i] = (s->fifo_count >> 8) & 0x1f;
+        } else if (reg == MPU_SIM_FIFO_COUNTL) {
+            buffer[i] = s->fifo_count & 0xff;
+        } else if (reg >= MPU_SIM_ACCEL_XOUT_H && reg < MPU_SIM_EXT_SENS_DATA_00) {
+            buffer[i] = mpu_sim_sensor_byte(s, reg);
+        } else {
+            buffer[i] = s->regs[reg];
+        }
+        if (reg == MPU_SIM_I2C_MST_STATUS) {
+            // Cleared on read.
+            s->regs[reg] = 0;
+        }
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return 0;
+}
+
+/**
+ * @brief Write registers with auto increment.
+ * 
+ * @param dev 
+ *      The model.
+ * @param reg_addr 
+ *      First register.
+ * @param buffer 
+ *      Data to write.
+ * @param n 
+ *      Length of data.
+ * @return 0 if success else -1.
+ */
+static int mpu_sim_write(const struct BusSimDevice *dev, uint8_t reg_addr, const uint8_t *buffer, int n) {
+    struct MPUSim *s = dev->ctx;
+    pthread_mutex_lock(&s->mutex);
+    int i;
+    for (i = 0; i < n; i++) {
+        uint8_t reg = (reg_addr + i) & 0x7f;
+        uint8_t data = buffer[i];
+        if (reg == MPU_SIM_WHO_AM_I || reg == MPU_SIM_SLV4_DI || reg == MPU_SIM_I2C_MST_STATUS ||
+            (reg >= MPU_SIM_INT_STATUS && reg <= MPU_SIM_EXT_SENS_DATA_23)) {
+            // Read only.
+            continue;
+        }
+        if (reg == MPU_SIM_PWR_MGMT_1 && (data & 0x80)) {
+            mpu_sim_reset(s);
+            continue;
+        }
+        if (reg == MPU_SIM_USER_CTRL) {
+            if (data & 0x04) {
+                mpu_sim_reset_fifo(s);
+            }
+            // Reset bits clear by themselves.
+            data &= ~0x07;
+        }
+        if ((reg == MPU_SIM_FIFO_EN && !s->regs[reg] && data) ||
+            (reg == MPU_SIM_USER_CTRL && !(s->regs[reg] & 0x40) && (data & 0x40))) {
+            // Sampling into FIFO starts now.
+            mpu_sim_reset_fifo(s);
+        }
+        s->regs[reg] = data;
+        if (reg == MPU_SIM_SLV4_CTRL && (data & 0x80)) {
+            mpu_sim_run_slave4(s);
+        }
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return 0;
+}
+
+static void mpu_sim_reset(struct MPUSim *s) {
+    memset(s->regs, 0, sizeof(s->regs));
+    s->regs[MPU_SIM_PWR_MGMT_1] = 0x01;
+    s->regs[MPU_SIM_WHO_AM_I] = 0x71;
+    mpu_sim_reset_fifo(s);
+    s->fifo_overflow = false;
+    s->mst_time_ns = mpu_sim_now_ns();
+    s->mst_ticks = 0;
+}
+
+static int64_t mpu_sim_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Drop every byte in FIFO and restart the sample clock.
+ */
+static void mpu_sim_reset_fifo(struct MPUSim *s) {
+    s->fifo_head = 0;
+    s->fifo_count = 0;
+    s->fifo_time_ns = mpu_sim_now_ns();
+}
+
+/**
+ * @brief Sample period, 8kHz without DLPF else 1kHz / (1 + SMPLRT_DIV).
+ */
+static int64_t mpu_sim_period_ns(const struct MPUSim *s) {
+    uint8_t dlpf = s->regs[MPU_SIM_CONFIG] & 0x07;
+    return dlpf == 0 || dlpf == 7 ? 125000 : 1000000LL * (1 + s->regs[MPU_SIM_SMPLRT_DIV]);
+}
+
+/**
+ * @brief Push the samples taken since the last call into FIFO. Each frame
+ * holds the registers selected by FIFO_EN in address order.
+ */
+static void mpu_sim_fill_fifo(struct MPUSim *s) {
+    uint8_t fifo_en = s->regs[MPU_SIM_FIFO_EN];
+    if (!(s->regs[MPU_SIM_USER_CTRL] & 0x40) || !(fifo_en & 0xf8)) {
+        return;
+    }
+    int64_t period_ns = mpu_sim_period_ns(s);
+    int64_t now = mpu_sim_now_ns();
+    int64_t n_samples = (now - s->fifo_time_ns) / period_ns;
+    s->fifo_time_ns += n_samples * period_ns;
+    if (n_samples > MPU_SIM_FIFO_SIZE) {
+        // Older samples are overwritten or dropped anyway.
+        n_samples = MPU_SIM_FIFO_SIZE;
+    }
+
+    uint8_t frame[14];
+    int len = 0;
+    if (fifo_en & 0x08) {
+        int reg;
+        for (reg = MPU_SIM_ACCEL_XOUT_H; reg < MPU_SIM_TEMP_OUT_H; reg++) {
+            frame[len++] = mpu_sim_sensor_byte(s, reg);
+        }
+    }
+    if (fifo_en & 0x80) {
+        frame[len++] = mpu_sim_sensor_byte(s, MPU_SIM_TEMP_OUT_H);
+        frame[len++] = mpu_sim_sensor_byte(s, MPU_SIM_TEMP_OUT_H + 1);
+    }
+    int axis;
+    for (axis = 0; axis < 3; axis++) {
+        if (fifo_en & (0x40 >> axis)) {
+            frame[len++] = mpu_sim_sensor_byte(s, MPU_SIM_GYRO_XOUT_H + 2 * axis);
+            frame[len++] = mpu_sim_sensor_byte(s, MPU_SIM_GYRO_XOUT_H + 2 * axis + 1);
+        }
+    }
+
+    int64_t k;
+    for (k = 0; k < n_samples; k++) {
+        int i;
+        for (i = 0; i < len; i++) {
+            if (s->fifo_count == MPU_SIM_FIFO_SIZE) {
+                s->fifo_overflow = true;
+                if (s->regs[MPU_SIM_CONFIG] & 0x40) {
+                    // FIFO_MODE: Additional writes are dropped.
+                    return;
+                }
+                s->fifo_head = (s->fifo_head + 1) % MPU_SIM_FIFO_SIZE;
+                s->fifo_count--;
+            }
+            s->fifo[(s->fifo_head + s->fifo_count) % MPU_SIM_FIFO_SIZE] = frame[i];
+            s->fifo_count++;
+        }
+    }
+}
+
+/**
+ * @brief Get one byte of ACCEL_OUT, TEMP_OUT or GYRO_OUT.
+ * 
+ * @param reg 
+ *      0x3b ~ 0x48.
+ * @return Byte of the register.
+ */
+static uint8_t mpu_sim_sensor_byte(const struct MPUSim *s, uint8_t reg) {
+    int index = (reg - MPU_SIM_ACCEL_XOUT_H) / 2;
+    float value;
+    if (index < 3) {
+        // 16384 LSB/g at +-2g, halved by each full scale step.
+        value = s->accel[index] * (16384 >> ((s->regs[MPU_SIM_ACCEL_CONFIG] >> 3) & 0x03));
+    } else if (index == 3) {
+        value = (s->temp - 21.0f) * 333.87f;
+    } else {
+        // 131 LSB/dps at 250dps, halved by each full scale step.
+        value = s->gyro[index - 4] * 131.0f / (1 << ((s->regs[MPU_SIM_GYRO_CONFIG] >> 3) & 0x03));
+    }
+    if (value > 32767.0f) {
+        value = 32767.0f;
+    } else if (value < -32768.0f) {
+        value = -32768.0f;
+    }
+    int16_t raw = value;
+    return (reg - MPU_SIM_ACCEL_XOUT_H) % 2 == 0 ? (raw >> 8) & 0xff : raw & 0xff;
+}
+
+/**
+ * @brief Fill EXT_SENS_DATA from SLV0 ~ SLV3 in order, once for the sample
+ * ticks since the last call. A slave delayed by I2C_MST_DELAY_CTRL runs only
+ * every 1 + I2C_MST_DLY ticks, others run at every tick.
+ */
+static void mpu_sim_run_slaves(struct MPUSim *s) {
+    int64_t period_ns = mpu_sim_period_ns(s);
+    int64_t n_ticks = (mpu_sim_now_ns() - s->mst_time_ns) / period_ns;
+    if (n_ticks <= 0) {
+        // Still the same sample, EXT_SENS_DATA is kept.
+        return;
+    }
+    s->mst_time_ns += n_ticks * period_ns;
+    uint32_t ticks = s->mst_ticks;
+    s->mst_ticks += n_ticks;
+    if (!(s->regs[MPU_SIM_USER_CTRL] & 0x20)) {
+        // I2C_MST_EN is off.
+        return;
+    }
+    uint32_t interval = 1 + (s->regs[MPU_SIM_SLV4_CTRL] & 0x1f);
+    // Delayed slaves ran if a multiple of interval is among the ticks.
+    bool delayed_due = n_ticks >= interval || s->mst_ticks / interval != ticks / interval;
+    int offset = 0;
+    int slv;
+    for (slv = 0; slv < 4; slv++) {
+        uint8_t addr = s->regs[MPU_SIM_SLV0_ADDR + 3 * slv];
+        uint8_t reg = s->regs[MPU_SIM_SLV0_ADDR + 3 * slv + 1];
+        uint8_t ctrl = s->regs[MPU_SIM_SLV0_ADDR + 3 * slv + 2];
+        int len = ctrl & 0x0f;
+        if (!(ctrl & 0x80) || !(addr & 0x80) || len == 0) {
+            continue;
+        }
+        if (offset + len > MPU_SIM_EXT_SENS_DATA_23 - MPU_SIM_EXT_SENS_DATA_00 + 1) {
+            break;
+        }
+        if ((s->regs[MPU_SIM_I2C_MST_DELAY_CTRL] & (1 << slv)) && !delayed_due) {
+            // Keeps its place in EXT_SENS_DATA.
+            offset += len;
+            continue;
+        }
+        if (s->aux != NULL && (addr & 0x7f) == s->aux_addr) {
+            s->aux->read(s->aux, reg, &s->regs[MPU_SIM_EXT_SENS_DATA_00 + offset], len);
+        } else {
+            memset(&s->regs[MPU_SIM_EXT_SENS_DATA_00 + offset], 0, len);
+        }
+        offset += len;
+    }
+}
+
+/**
+ * @brief Run the single transfer of SLV4 and report it in I2C_MST_STATUS.
+ */
+static void mpu_sim_run_slave4(struct MPUSim *s) {
+    uint8_t addr = s->regs[MPU_SIM_SLV4_ADDR];
+    uint8_t reg = s->regs[MPU_SIM_SLV4_REG];
+    
+    s->regs[MPU_SIM_SLV4_CTRL] &= ~0x80;
+    if (!(s->regs[MPU_SIM_USER_CTRL] & 0x20)) {
+        return;
+    }
+    if (s->aux == NULL || (addr & 0x7f) != s->aux_addr) {
+        s->regs[MPU_SIM_I2C_MST_STATUS] |= 0x10; // I2C_SLV4_NACK
+        return;
+    }
+    if (addr & 0x80) {
+        s->aux->read(s->aux, reg, &s->regs[MPU_SIM_SLV4_DI], 1);
+    } else {
+        s->aux->write(s->aux, reg, &s->regs[MPU_SIM_SLV4_DO], 1);
+    }
+    s->regs[MPU_SIM_I2C_MST_STATUS] |= 0x40; // I2C_SLV4_DONE
+}
@@ -0,0 +1,31 @@
+/**
+ * @file mpu9250_sim.h
+ * @author agent
+ * @brief Register level model of MPU-9250 for bus_sim.
+ * Answers WHO_AM_I, scales sensor data by the configured full scale and
+ * runs the I2C master (SLV0 ~ SLV4) against an auxiliary model.
+ * 
+ * @version 0.1
+ * @date 2026-10-17
+ * 
+ * @copyright Copyright (c) 2026
+ * 
+ */
+#ifndef _MPU9250_SIM_H_
+#define _MPU9250_SIM_H_
+
+#include <stdint.h>
+
+#define MPU_SIM_ADDRESS 0x68
+
+struct BusSimDevice;
+
+const struct BusSimDevice *mpu_sim_init(uint8_t aux_addr, const struct BusSimDevice *aux);
+
+void mpu_sim_set_accel(const struct BusSimDevice *dev, float x, float y, float z);
+
+void mpu_sim_set_gyro(const struct BusSimDevice *dev, float x, float y, float z);
+
+void mpu_sim_set_temp(const struct BusSimDevice *dev, float temp);
+
+#endif // _MPU9250_SIM_H_
@@ -0,0 +1,196 @@
+#include "ms5611_sim.h"
+
+#include "util/io/bus_sim.h"
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define MS_SIM_CMD_RESET 0x1e
+#define MS_SIM_CMD_CONVERT_D1 0x40
+#define MS_SIM_CMD_CONVERT_D2 0x50
+#define MS_SIM_CMD_ADC_READ 0x00
+#define MS_SIM_CMD_PROM_READ 0xa0
+
+// Example coefficients C1 ~ C6 of the datasheet, CRC is filled by ms_sim_init.
+static uint16_t _prom[8] = {0, 40127, 36924, 23317, 23282, 33464, 28312, 0};
+
+// Max conversion time of each OSR in ns.
+static const uint64_t CONVERSION_TIME_TABLE[5] = {600000, 1170000, 2280000, 4540000, 9040000};
+
+static float _pressure; // Pressure in mbar.
+static float _temp; // Temperature in degree C.
+static uint8_t _conversion; // Command of the running conversion, 0 if none.
+static uint64_t _conversion_end_ns; // Time the running conversion finishes.
+
+static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int ms_sim_read(const struct BusSimDevice *dev, uint8_t reg_addr, uint8_t *buffer, int n);
+
+static int ms_sim_write(const struct BusSimDevice *dev, uint8_t reg_addr, const uint8_t *buffer, int n);
+
+static const struct BusSimDevice _dev = {
+    .name = "MS5611",
+    .read = ms_sim_read,
+    .write = ms_sim_write
+};
+
+static uint32_t ms_sim_adc(uint8_t conversion);
+
+static uint8_t ms_sim_crc4();
+
+static uint64_t ms_sim_now_ns();
+
+/**
+ * @brief Reset the model to 1013.25 mbar and 25 degree C.
+ * 
+ * @return The model, attach it with bus_sim_attach.
+ */
+const struct BusSimDevice *ms_sim_init() {
+    pthread_mutex_lock(&_mutex);
+    _prom[7] = (_prom[7] & 0xfff0) | ms_sim_crc4();
+    _pressure = 1013.25f;
+    _temp = 25.0f;
+    _conversion = 0;
+    pthread_mutex_unlock(&_mutex);
+    return &_dev;
+}
+
+/**
+ * @brief Set pressure measured by the model.
+ * 
+ * @param mbar 
+ *      Pressure in mbar.
+ */
+void ms_sim_set_pressure(float mbar) {
+    pthread_mutex_lock(&_mutex);
+    _pressure = mbar;
+    pthread_mutex_unlock(&_mutex);
+}
+
+/**
+ * @brief Set temperature measured by the model.
+ * Second order compensation isn't inverted, so keep it at 20 degree C or
+ * above for exact pressure.
+ * 
+ * @param temp 
+ *      Degree C.
+ */
+void ms_sim_set_temp(float temp) {
+    pthread_mutex_lock(&_mutex);
+    _temp = temp;
+    pthread_mutex_unlock(&_mutex);
+}
+
+//-----
+
+/**
+ * @brief Read PROM words or the result of the last conversion.
+ * 
+ * @param dev 
+ *      The model.
+ * @param reg_addr 
+ *      Command.
+ * @param buffer 
+ *      Buffer to hold read data.
+ * @param n 
+ *      Length of buffer.
+ * @return 0 if success else -1.
+ */
+static int ms_sim_read(const struct BusSimDevice *dev, uint8_t reg_addr, uint8_t *buffer, int n) {
+    pthread_mutex_lock(&_mutex);
+    memset(buffer, 0, n);
+    if (reg_addr >= MS_SIM_CMD_PROM_READ && reg_addr <= MS_SIM_CMD_PROM_READ + 14 && n <= 2) {
+        uint16_t word = _prom[(reg_addr - MS_SIM_CMD_PROM_READ) / 2];
+        buffer[0] = word >> 8;
+        if (n > 1) {
+            buffer[1] = word & 0xff;
+        }
+    } else if (reg_addr == MS_SIM_CMD_ADC_READ && n <= 3) {
+        uint32_t adc = 0;
+        if (_conversion != 0 && ms_sim_now_ns() >= _conversion_end_ns) {
+            adc = ms_sim_adc(_conversion);
+        }
+        // Result is read once.
+        _conversion = 0;
+        int i;
+        for (i = 0; i < n; i++) {
+            buffer[i] = adc >> (16 - 8 * i);
+        }
+    }
+    pthread_mutex_unlock(&_mutex);
+    return 0;
+}
+
+/**
+ * @brief Run a command.
+ * 
+ * @param dev 
+ *      The model.
+ * @param reg_addr 
+ *      Command.
+ * @param buffer 
+ *      Not used, commands have no data.
+ * @param n 
+ *      Not used.
+ * @return 0 if success else -1.
+ */
+static int ms_sim_write(const struct BusSimDevice *dev, uint8_t reg_addr, const uint8_t *buffer, int n) {
+    pthread_mutex_lock(&_mutex);
+    uint8_t osr = (reg_addr & 0x0f) / 2;
+    if (reg_addr == MS_SIM_CMD_RESET) {
+        _conversion = 0;
+    } else if (((reg_addr & 0xf0) == MS_SIM_CMD_CONVERT_D1 || (reg_addr & 0xf0) == MS_SIM_CMD_CONVERT_D2) && osr <= 4) {
+        // A new command drops the running conversion.
+        _conversion = reg_addr;
+        _conversion_end_ns = ms_sim_now_ns() + CONVERSION_TIME_TABLE[osr];
+    }
+    pthread_mutex_unlock(&_mutex);
+    return 0;
+}
+
+/**
+ * @brief Get D1 or D2 by inverting the first order compensation.
+ * 
+ * @param conversion 
+ *      Command which started the conversion.
+ * @return 24 bit result.
+ */
+static uint32_t ms_sim_adc(uint8_t conversion) {
+    int64_t temp = (int64_t)(_temp * 100.0f);
+    int64_t dt = ((temp - 2000) << 23) / _prom[6];
+    int64_t d2 = dt + ((int64_t)_prom[5] << 8);
+    if ((conversion & 0xf0) == MS_SIM_CMD_CONVERT_D2) {
+        return d2 < 0 ? 0 : d2 > 0xffffff ? 0xffffff : d2;
+    }
+    int64_t off = ((int64_t)_prom[2] << 16) + ((_prom[4] * dt) >> 7);
+    int64_t sens = ((int64_t)_prom[1] << 15) + ((_prom[3] * dt) >> 8);
+    int64_t p = (int64_t)(_pressure * 100.0f);
+    int64_t d1 = (((p << 15) + off) << 21) / sens;
+    return d1 < 0 ? 0 : d1 > 0xffffff ? 0xffffff : d1;
+}
+
+/**
+ * @brief CRC-4 of PROM, from application note AN520.
+ * 
+ * @return CRC in lower 4 bits.
+ */
+static uint8_t ms_sim_crc4() {
+    uint16_t rem = 0;
+    int i;
+    for (i = 0; i < 16; i++) {
+        uint16_t word = i >> 1 == 7 ? _prom[7] & 0xff00 : _prom[i >> 1];
+        rem ^= i % 2 == 1 ? word & 0x00ff : word >> 8;
+        int bit;
+        for (bit = 0; bit < 8; bit++) {
+            rem = rem & 0x8000 ? (rem << 1) ^ 0x3000 : rem << 1;
+        }
+    }
+    return (rem >> 12) & 0x0f;
+}
+
+static uint64_t ms_sim_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,30 @@
+/**
+ * @file ms5611_sim.h
+ * @author agent
+ * @brief Command level model of MS5611 for bus_sim.
+ * PROM holds the example coefficients of the datasheet with a valid CRC.
+ * ADC reads 0 until the conversion time of its OSR has passed, like the
+ * chip. Pressure and temperature are set by ms_sim_set_*.
+ * 
+ * @version 0.1
+ * @date 2026-10-17
+ * 
+ * @copyright Copyright (c) 2026
+ * 
+ */
+#ifndef _MS5611_SIM_H_
+#define _MS5611_SIM_H_
+
+#include <stdint.h>
+
+#define MS_SIM_ADDRESS 0x77
+
+struct BusSimDevice;
+
+const struct BusSimDevice *ms_sim_init();
+
+void ms_sim_set_pressure(float mbar);
+
+void ms_sim_set_temp(float temp);
+
+#endif // _MS5611_SIM_H_
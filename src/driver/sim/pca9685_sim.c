@@ -0,0 +1,162 @@
+#include "pca9685_sim.h"
+
+#include "util/io/bus_sim.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#define PCA_SIM_MODE1 0x00
+#define PCA_SIM_MODE2 0x01
+#define PCA_SIM_LED0_ON_L 0x06
+#define PCA_SIM_LED15_OFF_H 0x45
+#define PCA_SIM_ALL_LED_ON_L 0xfa
+#define PCA_SIM_ALL_LED_OFF_H 0xfd
+#define PCA_SIM_PRE_SCALE 0xfe
+
+#define PCA_SIM_MODE1_RESTART 0x80
+#define PCA_SIM_MODE1_AI 0x20
+#define PCA_SIM_MODE1_SLEEP 0x10
+
+static uint8_t _regs[256]; // Register file.
+
+static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int pca_sim_read(const struct BusSimDevice *dev, uint8_t reg_addr, uint8_t *buffer, int n);
+
+static int pca_sim_write(const struct BusSimDevice *dev, uint8_t reg_addr, const uint8_t *buffer, int n);
+
+static const struct BusSimDevice _dev = {
+    .name = "PCA9685",
+    .read = pca_sim_read,
+    .write = pca_sim_write
+};
+
+static void pca_sim_write_reg(uint8_t reg, uint8_t data);
+
+/**
+ * @brief Reset the model to power-on state.
+ * 
+ * @return The model, attach it with bus_sim_attach.
+ */
+const struct BusSimDevice *pca_sim_init() {
+    pthread_mutex_lock(&_mutex);
+    memset(_regs, 0, sizeof(_regs));
+    _regs[PCA_SIM_MODE1] = PCA_SIM_MODE1_SLEEP | 0x01; // SLEEP, ALLCALL
+    _regs[PCA_SIM_MODE2] = 0x04; // OUTDRV
+    _regs[PCA_SIM_PRE_SCALE] = 0x1e; // 200Hz
+    int chan;
+    for (chan = 0; chan < 16; chan++) {
+        _regs[PCA_SIM_LED0_ON_L + 4 * chan + 3] = 0x10; // Full off.
+    }
+    pthread_mutex_unlock(&_mutex);
+    return &_dev;
+}
+
+/**
+ * @brief Get output of a channel.
+ * 
+ * @param chan 
+ *      0 ~ 15.
+ * @return High time in 1/4096 of period, 0 ~ 4096.
+ */
+int pca_sim_get_pwm(int chan) {
+    pthread_mutex_lock(&_mutex);
+    uint8_t *led = &_regs[PCA_SIM_LED0_ON_L + 4 * (chan & 0x0f)];
+    int on = led[0] | (led[1] & 0x0f) << 8;
+    int off = led[2] | (led[3] & 0x0f) << 8;
+    int pwm;
+    if (led[3] & 0x10) {
+        pwm = 0;
+    } else if (led[1] & 0x10) {
+        pwm = 4096;
+    } else {
+        pwm = (off - on + 4096) % 4096;
+    }
+    pthread_mutex_unlock(&_mutex);
+    return pwm;
+}
+
+/**
+ * @brief Get output frequency from PRE_SCALE.
+ * 
+ * @return Frequency in Hz.
+ */
+float pca_sim_get_frequency() {
+    return 25000000.0f / 4096 / (_regs[PCA_SIM_PRE_SCALE] + 1);
+}
+
+//-----
+
+/**
+ * @brief Read registers. Register pointer increments only if MODE1.AI is set.
+ * 
+ * @param dev 
+ *      The model.
+ * @param reg_addr 
+ *      First register.
+ * @param buffer 
+ *      Buffer to hold read data.
+ * @param n 
+ *      Length of buffer.
+ * @return 0 if success else -1.
+ */
+static int pca_sim_read(const struct BusSimDevice *dev, uint8_t reg_addr, uint8_t *buffer, int n) {
+    pthread_mutex_lock(&_mutex);
+    uint8_t reg = reg_addr;
+    int i;
+    for (i = 0; i < n; i++) {
+        // ALL_LED registers read as 0.
+        buffer[i] = reg >= PCA_SIM_ALL_LED_ON_L && reg <= PCA_SIM_ALL_LED_OFF_H ? 0 : _regs[reg];
+        if (_regs[PCA_SIM_MODE1] & PCA_SIM_MODE1_AI) {
+            reg++;
+        }
+    }
+    pthread_mutex_unlock(&_mutex);
+    return 0;
+}
+
+/**
+ * @brief Write registers. Register pointer increments only if MODE1.AI is set.
+ * 
+ * @param dev 
+ *      The model.
+ * @param reg_addr 
+ *      First register.
+ * @param buffer 
+ *      Data to write.
+ * @param n 
+ *      Length of data.
+ * @return 0 if success else -1.
+ */
+static int pca_sim_write(const struct BusSimDevice *dev, uint8_t reg_addr, const uint8_t *buffer, int n) {
+    pthread_mutex_lock(&_mutex);
+    uint8_t reg = reg_addr;
+    int i;
+    for (i = 0; i < n; i++) {
+        pca_sim_write_reg(reg, buffer[i]);
+        if (_regs[PCA_SIM_MODE1] & PCA_SIM_MODE1_AI) {
+            reg++;
+        }
+    }
+    pthread_mutex_unlock(&_mutex);
+    return 0;
+}
+
+static void pca_sim_write_reg(uint8_t reg, uint8_t data) {
+    if (reg == PCA_SIM_MODE1) {
+        // Writing 1 to RESTART clears it.
+        _regs[reg] = data & ~PCA_SIM_MODE1_RESTART;
+    } else if (reg == PCA_SIM_PRE_SCALE) {
+        // Only writable in sleep mode, minimum 3.
+        if (_regs[PCA_SIM_MODE1] & PCA_SIM_MODE1_SLEEP) {
+            _regs[reg] = data < 3 ? 3 : data;
+        }
+    } else if (reg >= PCA_SIM_ALL_LED_ON_L && reg <= PCA_SIM_ALL_LED_OFF_H) {
+        int chan;
+        for (chan = 0; chan < 16; chan++) {
+            _regs[PCA_SIM_LED0_ON_L + 4 * chan + (reg - PCA_SIM_ALL_LED_ON_L)] = data;
+        }
+    } else if (reg <= PCA_SIM_LED15_OFF_H) {
+        _regs[reg] = data;
+    }
+}
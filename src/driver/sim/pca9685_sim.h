@@ -0,0 +1,29 @@
+/**
+ * @file pca9685_sim.h
+ * @author agent
+ * @brief Register level model of PCA9685 for bus_sim.
+ * Auto increment, sleep gated prescale and ALL_LED registers behave like
+ * the chip. Outputs are read back by pca_sim_get_*.
+ * 
+ * @version 0.1
+ * @date 2026-10-17
+ * 
+ * @copyright Copyright (c) 2026
+ * 
+ */
+#ifndef _PCA9685_SIM_H_
+#define _PCA9685_SIM_H_
+
+#include <stdint.h>
+
+#define PCA_SIM_ADDRESS 0x40
+
+struct BusSimDevice;
+
+const struct BusSimDevice *pca_sim_init();
+
+int pca_sim_get_pwm(int chan);
+
+float pca_sim_get_frequency();
+
+#endif // _PCA9685_SIM_H_
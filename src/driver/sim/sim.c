@@ -0,0 +1,88 @@
+#include "sim.h"
+
+#include "util/io/bus_sim.h"
+#include "util/logger.h"
+
+// Paths opened by the drivers.
+#define SIM_SPI_DEVICE "/dev/spidev0.0"
+#define SIM_SPI_DEVICE_REDUNDANT "/dev/spidev0.1"
+#define SIM_I2C_BUS "/dev/i2c-1"
+#define SIM_GPIO_CHIP "/dev/gpiochip0"
+
+static uint64_t _gpio_values; // Last values written to the GPIO chip.
+
+static int sim_gpio_read(const struct BusSimDevice *dev, uint8_t reg_addr, uint8_t *buffer, int n);
+
+static int sim_gpio_write(const struct BusSimDevice *dev, uint8_t reg_addr, const uint8_t *buffer, int n);
+
+static const struct BusSimDevice _gpio_dev = {
+    .name = "GPIO",
+    .read = sim_gpio_read,
+    .write = sim_gpio_write
+};
+
+/**
+ * @brief Attach models of every chip. Call before any driver is initiated.
+ * MPU-9250 answers on SPI and I2C, AK8963 behind its I2C master and on I2C
+ * for bypass mode, PCA9685 and MS5611 on I2C. A redundant MPU-9250 without
+ * magnetometer answers on the second chip select and AD0 high.
+ * 
+ * @return 0 if success else -1.
+ */
+int sim_init() {
+    LOG("Initiating simulated hardware.\n");
+    const struct BusSimDevice *ak = ak_sim_init();
+    const struct BusSimDevice *mpu = mpu_sim_init(AK_SIM_ADDRESS, ak);
+    const struct BusSimDevice *mpu_redundant = mpu_sim_init(0, NULL);
+    const struct BusSimDevice *pca = pca_sim_init();
+    const struct BusSimDevice *ms = ms_sim_init();
+
+    if (mpu == NULL || mpu_redundant == NULL) {
+        LOG_ERROR("Failed to create MPU models.\n");
+        return -1;
+    }
+    if (bus_sim_attach(SIM_SPI_DEVICE, BUS_SIM_NO_ADDR, mpu) != 0 ||
+        bus_sim_attach(SIM_SPI_DEVICE_REDUNDANT, BUS_SIM_NO_ADDR, mpu_redundant) != 0 ||
+        bus_sim_attach(SIM_I2C_BUS, MPU_SIM_ADDRESS, mpu) != 0 ||
+        bus_sim_attach(SIM_I2C_BUS, MPU_SIM_ADDRESS + 1, mpu_redundant) != 0 ||
+        bus_sim_attach(SIM_I2C_BUS, AK_SIM_ADDRESS, ak) != 0 ||
+        bus_sim_attach(SIM_I2C_BUS, PCA_SIM_ADDRESS, pca) != 0 ||
+        bus_sim_attach(SIM_I2C_BUS, MS_SIM_ADDRESS, ms) != 0 ||
+        bus_sim_attach(SIM_GPIO_CHIP, BUS_SIM_NO_ADDR, &_gpio_dev) != 0) {
+        LOG_ERROR("Failed to attach models.\n");
+        return -1;
+    }
+    LOG("Done.\n");
+    return 0;
+}
+
+/**
+ * @brief Get values of GPIO lines requested from the simulated chip.
+ * 
+ * @return Bit i for the i-th requested line.
+ */
+uint64_t sim_get_gpio_values() {
+    return __atomic_load_n(&_gpio_values, __ATOMIC_RELAXED);
+}
+
+//-----
+
+static int sim_gpio_read(const struct BusSimDevice *dev, uint8_t reg_addr, uint8_t *buffer, int n) {
+    uint64_t values = sim_get_gpio_values();
+    int i;
+    for (i = 0; i < n; i++) {
+        buffer[i] = reg_addr + i < 8 ? values >> (8 * (reg_addr + i)) : 0;
+    }
+    return 0;
+}
+
+static int sim_gpio_write(const struct BusSimDevice *dev, uint8_t reg_addr, const uint8_t *buffer, int n) {
+    uint64_t values = sim_get_gpio_values();
+    int i;
+    for (i = 0; i < n && reg_addr + i < 8; i++) {
+        values &= ~(0xffULL << (8 * (reg_addr + i)));
+        values |= (uint64_t)buffer[i] << (8 * (reg_addr + i));
+    }
+    __atomic_store_n(&_gpio_values, values, __ATOMIC_RELAXED);
+    return 0;
+}
@@ -0,0 +1,28 @@
+/**
+ * @file sim.h
+ * @author agent
+ * @brief Simulated hardware of the pilot.
+ * sim_init attaches models of every chip to the paths the drivers open,
+ * so the whole control stack runs without a Raspberry Pi.
+ * 
+ * @version 0.1
+ * @date 2026-10-17
+ * 
+ * @copyright Copyright (c) 2026
+ * 
+ */
+#ifndef _SIM_H_
+#define _SIM_H_
+
+#include <stdint.h>
+
+#include "ak8963_sim.h"
+#include "mpu9250_sim.h"
+#include "ms5611_sim.h"
+#include "pca9685_sim.h"
+
+int sim_init();
+
+uint64_t sim_get_gpio_values();
+
+#endif // _SIM_H_
@@ -8,6 +8,12 @@
 #include "util/logger.h"
 #include "util/system/scheduler.h"
 #include "util/system/signal_hanlder.h"
+#include "util/system/boot.h"
+#include "util/io/bus_stats.h"
+#include "util/io/bus_record.h"
+#include "util/io/bus_replay.h"
+#include "util/io/bus_arbiter.h"
+#include "driver/sim/sim.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,14 +21,48 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <signal.h>
+
+static bool _sim; // True if running on simulated hardware.
+static const char *_record_path; // Bus recording to write, NULL if not recording.
+static const char *_replay_path; // Bus recording to replay, NULL if running on hardware.
+static volatile sig_atomic_t _dump_requested; // Set by SIGUSR1, the dump runs in control loop.
 
 int init();
 
-int main() {
+void bus_dump();
+
+void request_bus_dump();
+
+int main(int argc, char **argv) {
+    boot_start();
+    int i;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--sim") == 0) {
+            _sim = true;
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            _record_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            _replay_path = argv[++i];
+        } else {
+            LOG_ERROR("Unknown argument \"%s\".\n", argv[i]);
+            return -1;
+        }
+    }
+    if (_sim && _replay_path != NULL) {
+        LOG_ERROR("--sim and --replay can't be used together.\n");
+        return -1;
+    }
+
     if (init() != 0) {
         LOG_ERROR("Failed to initiate.\n");
+        boot_dump();
         return -1;
     }
+    boot_set_armable();
+    boot_dump();
 
     LOG("Entering control loop.\n");
     while (1) {
@@ -32,6 +72,20 @@ int main() {
         
         pilot_update();
 
+        if (_dump_requested) {
+            _dump_requested = 0;
+            bus_dump();
+        }
+
+        if (_replay_path != NULL && bus_replay_is_finished()) {
+            bus_replay_report();
+            // Replays of one recording end on the same attitude, compare it between runs.
+            LOG("Attitude after replay: roll %.9g, pitch %.9g, yaw %.9g.\n",
+                ahrs_get_roll(), ahrs_get_pitch(), ahrs_get_yaw_heading());
+            bus_dump();
+            break;
+        }
+
         // LOG("Loop alive.\n");
     }
     return 0;
@@ -44,37 +98,82 @@ int init(){
         LOG_ERROR("Failed to register signal handler.\n");
         return -1;
     }
-    if (parameter_init() != 0) {
+    // kill -USR1 to print bus statistics and state of IMUs.
+    signal_set_on_sigusr1(request_bus_dump);
+    // Sensor reads and motor output of this thread go first on shared buses.
+    bus_arbiter_set_priority(BUS_PRIORITY_CONTROL);
+    if (boot_run("parameter", parameter_init) != 0) {
+        return -1;
+    }
+    if (_sim && boot_run("sim", sim_init) != 0) {
+        LOG_ERROR("Failed to initiate simulated hardware.\n");
+        return -1;
+    }
+    if (_replay_path != NULL && bus_replay_open(_replay_path) != 0) {
+        LOG_ERROR("Failed to open bus recording.\n");
+        return -1;
+    }
+    if (_record_path != NULL && bus_record_start(_record_path) != 0) {
+        LOG_ERROR("Failed to start bus recording.\n");
         return -1;
     }
     
+    // Sample rate of IMU follows the loop rate.
+    loop_init(400);
+
     LOG("Initiating modules.\n");
     
     // Initiate modules
     // if (camera_init() != 0) {
         // return -1;
     // }
-    if (measurement_init() != 0){
-        LOG_ERROR("Failed to initiate Measurement.\n");
+    // Sensors and motors don't depend on each other, their waits overlap.
+    static const struct BootStep modules[] = {
+        {"measurement", measurement_init},
+        {"pilot", pilot_init}
+    };
+    if (boot_run_parallel(modules, sizeof(modules) / sizeof(modules[0])) != 0) {
+        LOG_ERROR("Failed to initiate Measurement or Pilot.\n");
         return -1;
     }
-    if (pilot_init() != 0){
-        LOG_ERROR("Failed to initiate Pilot.\n");
-        return -1;
-    }
-    if (scheduler_init_real_time() != 0) {
+    if (boot_run("real time", scheduler_init_real_time) != 0) {
         LOG_ERROR("Failed to initiate Real Time.\n");
-        return -1;
+        if (!_sim && _replay_path == NULL) {
+            return -1;
+        }
+        // Simulation and replay run without root.
     }
 
-    if (mavlink_init() != 0) {
+    if (boot_run("mavlink", mavlink_init) != 0) {
         LOG_ERROR("Failed to initiate Remote.\n");
         return -1;
     }
     
-    // Initiate Loop
-    loop_init(400);
+    // Replay runs as fast as possible, AHRS integrates the nominal interval.
+    loop_set_free_run(_replay_path != NULL);
+    // Start every loop on a fresh sample instead of spinning.
+    if (imu_data_ready_is_enabled()) {
+        loop_set_trigger(imu_wait_sample);
+    }
 
     LOG("Done.\n");
     return 0;
+}
+
+/**
+ * @brief Print transfer and arbitration statistics of every bus.
+ * Not async-signal-safe, called from control loop.
+ */
+void bus_dump() {
+    bus_stats_dump();
+    bus_arbiter_dump();
+    imu_dump();
+}
+
+/**
+ * @brief Ask control loop to run bus_dump. Only sets a flag, so it is safe in
+ * signal handler.
+ */
+void request_bus_dump() {
+    _dump_requested = 1;
 }
\ No newline at end of file
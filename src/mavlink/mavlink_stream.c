@@ -214,7 +214,8 @@ void mavlink_stream_attitude() {
         MAV_COMP_ID_AUTOPILOT1,
         MAVLINK_COMM_0,
         &msg,
-        tv_get_msec_since_epoch(),
+        // Time attitude was sampled, CLOCK_MONOTONIC counts from boot.
+        ahrs_get_timestamp_ns() / 1000000,
         ahrs_get_roll(),
         ahrs_get_pitch(),
         -ahrs_get_yaw_heading(),
@@ -242,7 +243,7 @@ void mavlink_stream_sensor() {
         MAV_COMP_ID_AUTOPILOT1,
         MAVLINK_COMM_0,
         &msg,
-        tv_get_msec_since_epoch(),
+        imu_get_timestamp_ns() / 1000,
         imu_get_ax(),
         imu_get_ay(),
         imu_get_az(),
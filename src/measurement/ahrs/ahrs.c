@@ -3,6 +3,7 @@
 #include "quaternion.h"
 #include "madgwick.h"
 
+#include "util/loop.h"
 #include "util/logger.h"
 #include "util/debug.h"
 
@@ -10,11 +11,15 @@
 #define UPDATE_METHOD_MADGWICK
 
 #define COMPLEMENTARY_ALPHA 0.98
+#define AHRS_MAX_DT 0.1f // Longer gaps, e.g. the first update, integrate one loop interval.
 
 static struct Quaternion _q; // Quaternion.
 static float _r; // Attitude Roll in Degree.
 static float _p; // Attitude Pitch in Degree.
 static float _y; // Attitude Yaw in Degree.
+static uint64_t _timestamp_ns; // Time readings of attitude were sampled, read by other threads.
+
+static bool ahrs_get_dt(uint64_t timestamp_ns, float *dt);
 
 /**
  * @brief Initiator of ahrs, will initiate IMU and MAG also.
@@ -27,6 +32,7 @@ int ahrs_init(){
     _q.q2 = 0.0f;
     _q.q3 = 0.0f;
     _q.q4 = 0.0f;
+    _timestamp_ns = 0;
 
     LOG("Done.\n");
     return 0;
@@ -44,8 +50,13 @@ int ahrs_init(){
  * @param mx Mangetometer reading.
  * @param my Mangetometer reading.
  * @param mz Mangetometer reading.
+ * @param timestamp_ns CLOCK_MONOTONIC time readings were sampled.
  */
-void ahrs_update_9(float ax, float ay, float az, float gx, float gy, float gz, float mx, float my, float mz) {
+void ahrs_update_9(float ax, float ay, float az, float gx, float gy, float gz, float mx, float my, float mz, uint64_t timestamp_ns) {
+    float dt;
+    if (!ahrs_get_dt(timestamp_ns, &dt)) {
+        return;
+    }
 #ifdef UPDATE_METHOD_COMPLEMENTARY
     float acc_r, acc_p;
     acc_r = roll_from_accel(ax, ay, az);
@@ -54,8 +65,8 @@ void ahrs_update_9(float ax, float ay, float az, float gx, float gy, float gz, f
     acc_r = RAD_TO_DEG(acc_r);
     acc_p = RAD_TO_DEG(acc_p);
 
-    _r = complementary_filter(_r, acc_r, gx, COMPLEMENTARY_ALPHA);
-    _p = complementary_filter(_p, acc_p, gy, COMPLEMENTARY_ALPHA);
+    _r = complementary_filter(_r, acc_r, gx, COMPLEMENTARY_ALPHA, dt);
+    _p = complementary_filter(_p, acc_p, gy, COMPLEMENTARY_ALPHA, dt);
     
     _y = yaw_from_mag(_r, _p, mx, my, mz);
 
@@ -73,7 +84,8 @@ void ahrs_update_9(float ax, float ay, float az, float gx, float gy, float gz, f
         gz,
         mx,
         my,
-        mz
+        mz,
+        dt
     );
 
     quat_to_euler(&_q, &_r, &_p, &_y);
@@ -89,8 +101,13 @@ void ahrs_update_9(float ax, float ay, float az, float gx, float gy, float gz, f
  * @param gx Gyroscope reading in Rad/s.
  * @param gy Gyroscope reading in Rad/s.
  * @param gz Gyroscope reading in Rad/s.
+ * @param timestamp_ns CLOCK_MONOTONIC time readings were sampled.
  */
-void ahrs_update_6(float ax, float ay, float az, float gx, float gy, float gz) {
+void ahrs_update_6(float ax, float ay, float az, float gx, float gy, float gz, uint64_t timestamp_ns) {
+    float dt;
+    if (!ahrs_get_dt(timestamp_ns, &dt)) {
+        return;
+    }
 
     // Calculate Eular angles
 #ifdef UPDATE_METHOD_COMPLEMENTARY
@@ -98,8 +115,8 @@ void ahrs_update_6(float ax, float ay, float az, float gx, float gy, float gz) {
     acc_r = roll_from_accel(ax, ay, az);
     acc_p = pitch_from_accel(ax, ay, az);
 
-    _r = complementary_filter(_r, acc_r, gy * TO_RAD, COMPLEMENTARY_ALPHA);
-    _p = complementary_filter(_p, acc_p, gz * TO_RAD, COMPLEMENTARY_ALPHA);
+    _r = complementary_filter(_r, acc_r, gy * TO_RAD, COMPLEMENTARY_ALPHA, dt);
+    _p = complementary_filter(_p, acc_p, gz * TO_RAD, COMPLEMENTARY_ALPHA, dt);
     
 #endif // UPDATE_METHOD_COMPLEMENTARY
 
@@ -112,7 +129,8 @@ void ahrs_update_6(float ax, float ay, float az, float gx, float gy, float gz) {
         az,
         gx,
         gy,
-        gz
+        gz,
+        dt
     );
 
     quat_to_euler(&_q, &_r, &_p, &_y);
@@ -144,4 +162,37 @@ float ahrs_get_pitch() {
  */
 float ahrs_get_yaw_heading() {
     return _y;
+}
+
+/**
+ * @brief Get time the readings of current attitude were sampled.
+ * 
+ * @return CLOCK_MONOTONIC time in ns, 0 before the first update.
+ */
+uint64_t ahrs_get_timestamp_ns() {
+    return __atomic_load_n(&_timestamp_ns, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Get time between the readings of last and this update.
+ * 
+ * @param timestamp_ns 
+ *      Time readings of this update were sampled.
+ * @param dt 
+ *      Set to the interval in seconds, a loop interval if the last update is
+ *      unknown or too old, or if loop is free running.
+ * @return False if readings are the same as last update's, else true.
+ */
+static bool ahrs_get_dt(uint64_t timestamp_ns, float *dt) {
+    if (timestamp_ns == _timestamp_ns) {
+        // No new sample, don't integrate the same rate twice.
+        return false;
+    }
+    *dt = (timestamp_ns - _timestamp_ns) / 1e9f;
+    // Replay reads faster than the sensor sampled, stamps there follow the host speed.
+    if (_timestamp_ns == 0 || timestamp_ns < _timestamp_ns || *dt > AHRS_MAX_DT || loop_is_free_run()) {
+        *dt = loop_get_interval();
+    }
+    __atomic_store_n(&_timestamp_ns, timestamp_ns, __ATOMIC_RELAXED);
+    return true;
 }
\ No newline at end of file
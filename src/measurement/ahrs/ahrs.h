@@ -15,12 +15,13 @@
 #define _AHRS_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 
 int ahrs_init();
 
-void ahrs_update_9(float ax, float ay, float az, float gx, float gy, float gz, float mx, float my, float mz);
+void ahrs_update_9(float ax, float ay, float az, float gx, float gy, float gz, float mx, float my, float mz, uint64_t timestamp_ns);
 
-void ahrs_update_6(float ax, float ay, float az, float gx, float gy, float gz);
+void ahrs_update_6(float ax, float ay, float az, float gx, float gy, float gz, uint64_t timestamp_ns);
 
 float ahrs_get_roll();
 
@@ -28,4 +29,6 @@ float ahrs_get_pitch();
 
 float ahrs_get_yaw_heading();
 
+uint64_t ahrs_get_timestamp_ns();
+
 #endif // _AHRS_H_
@@ -1,9 +1,6 @@
 #include "complementary.h"
-#include "util/loop.h"
 #include <math.h>
 
-#define DELTA_TIME loop_get_interval()
-
 /**
  * @brief Complementary filter calculation.
  * 
@@ -15,10 +12,12 @@
  *      Gyro reading value in same unit of attitude.
  * @param alpha
  *      Weight.
+ * @param dt
+ *      Time since last update in seconds.
  * @return Filtered attitude in same unit.
  */
-float complementary_filter(float old_att, float acc_att, float omega, float alpha) {
-    return acc_att * (1 - alpha) + (old_att + omega * DELTA_TIME) * alpha;
+float complementary_filter(float old_att, float acc_att, float omega, float alpha, float dt) {
+    return acc_att * (1 - alpha) + (old_att + omega * dt) * alpha;
 }
 
 /**
@@ -14,7 +14,7 @@
 #ifndef _COMPLEMENTARY_H_
 #define _COMPLEMENTARY_H_
 
-float complementary_filter(float old_att, float acc_att, float omega, float alpha);
+float complementary_filter(float old_att, float acc_att, float omega, float alpha, float dt);
 
 void accel_to_attitude(float *r, float *p, float ax, float ay, float az);
 
@@ -1,13 +1,7 @@
 #include "madgwick.h"
-#include "util/loop.h"
 #include <stdio.h>
 #include <math.h>
 
-/**
- * @brief Definition to dt
- */
-#define DELTA_TIME loop_get_interval()
-
 /**
  * @brief BETA in madgwick calculation
  */
@@ -52,8 +46,10 @@ void madgwick_to_euler(struct Quaternion *q, float *r, float *p, float *y){
  *      Accelerometer reading in whatever unit.
  * @param gx,gy,gz
  *      Gyro reading in Rad/s.
+ * @param dt
+ *      Time since last update in seconds.
 */
-void madgwick_update_6(struct Quaternion *q, float ax, float ay, float az, float gx, float gy, float gz) {
+void madgwick_update_6(struct Quaternion *q, float ax, float ay, float az, float gx, float gy, float gz, float dt) {
     struct Quaternion q_prev = {
         .q1 = q->q1,
         .q2 = q->q2,
@@ -115,11 +111,11 @@ void madgwick_update_6(struct Quaternion *q, float ax, float ay, float az, float
 
     quat_normalize(&gradient, &gradient);
 
-    // q_est = q_est_prev + (q_dot - BETA * gradient) * DELTA_TIME
-    q->q1 = q->q1 + (q_dot.q1 - BETA * gradient.q1) * DELTA_TIME;
-    q->q2 = q->q2 + (q_dot.q2 - BETA * gradient.q2) * DELTA_TIME;
-    q->q3 = q->q3 + (q_dot.q3 - BETA * gradient.q3) * DELTA_TIME;
-    q->q4 = q->q4 + (q_dot.q4 - BETA * gradient.q4) * DELTA_TIME;
+    // q_est = q_est_prev + (q_dot - BETA * gradient) * dt
+    q->q1 = q->q1 + (q_dot.q1 - BETA * gradient.q1) * dt;
+    q->q2 = q->q2 + (q_dot.q2 - BETA * gradient.q2) * dt;
+    q->q3 = q->q3 + (q_dot.q3 - BETA * gradient.q3) * dt;
+    q->q4 = q->q4 + (q_dot.q4 - BETA * gradient.q4) * dt;
     
     quat_normalize(q, q);
 }
@@ -133,8 +129,10 @@ void madgwick_update_6(struct Quaternion *q, float ax, float ay, float az, float
  *      Gyro reading in Rad/s.
  * @param mx,my,mz
  *      Magnetometer reading in whatever unit.
+ * @param dt
+ *      Time since last update in seconds.
 */
-void madgwick_update_9(struct Quaternion *q, float ax, float ay, float az, float gx, float gy, float gz, float mx, float my, float mz) {
+void madgwick_update_9(struct Quaternion *q, float ax, float ay, float az, float gx, float gy, float gz, float mx, float my, float mz, float dt) {
     
     struct Quaternion q_prev = {
         .q1 = q->q1,
@@ -223,11 +221,11 @@ void madgwick_update_9(struct Quaternion *q, float ax, float ay, float az, float
 
     quat_normalize(&gradient, &gradient);
     
-    // q_est = q_est_prev + (q_dot - BETA * gradient) * DELTA_TIME
-    q->q1 = q->q1 + (q_dot.q1 - BETA * gradient.q1) * DELTA_TIME;
-    q->q2 = q->q2 + (q_dot.q2 - BETA * gradient.q2) * DELTA_TIME;
-    q->q3 = q->q3 + (q_dot.q3 - BETA * gradient.q3) * DELTA_TIME;
-    q->q4 = q->q4 + (q_dot.q4 - BETA * gradient.q4) * DELTA_TIME;
+    // q_est = q_est_prev + (q_dot - BETA * gradient) * dt
+    q->q1 = q->q1 + (q_dot.q1 - BETA * gradient.q1) * dt;
+    q->q2 = q->q2 + (q_dot.q2 - BETA * gradient.q2) * dt;
+    q->q3 = q->q3 + (q_dot.q3 - BETA * gradient.q3) * dt;
+    q->q4 = q->q4 + (q_dot.q4 - BETA * gradient.q4) * dt;
     
     quat_normalize(q, q);
 }
\ No newline at end of file
@@ -18,8 +18,8 @@
 
 void madgwick_to_euler(struct Quaternion *q, float *r, float *p, float *y);
 
-void madgwick_update_6(struct Quaternion *q, float ax, float ay, float az, float gx, float gy, float gz);
+void madgwick_update_6(struct Quaternion *q, float ax, float ay, float az, float gx, float gy, float gz, float dt);
 
-void madgwick_update_9(struct Quaternion *q, float ax, float ay, float az, float gx, float gy, float gz, float mx, float my, float mz);
+void madgwick_update_9(struct Quaternion *q, float ax, float ay, float az, float gx, float gy, float gz, float mx, float my, float mz, float dt);
 
 #endif // _MADGWICK_H_
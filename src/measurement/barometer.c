@@ -1,16 +1,23 @@
 #include "barometer.h"
-#include "util/loop.h"
+#include "util/tv.h"
+#include "util/logger.h"
 
 #include "driver/ms5611.h"
 
-#define TIME_DIFF loop_get_interval()
+#include <stdbool.h>
+#include <math.h>
 
-static float _pressure; // Pressure.
-static float _pressure_diff; // Pressure differential.
-static float _altitude; // Altitude.
+#define SEA_LEVEL_PRESSURE 1013.25f // Standard atmosphere in mbar.
+
+static float _pressure; // Pressure in mbar.
+static float _pressure_diff; // Pressure differential per second.
+static float _altitude; // Pressure altitude in meter.
 static float _climb_rate; // Climb rate from altitude diff.
 static float _temp; // Temperature.
 
+static bool _baro_enabled; // True if MS5611 is found.
+static struct timeval _sample_tv; // Time of last sample.
+
 /**
  * @brief Initiate Barometer.
  * 
@@ -22,24 +29,44 @@ int barometer_init() {
     _climb_rate = 0;
     _pressure_diff = 0;
     _temp = 0;
+    _sample_tv.tv_sec = _sample_tv.tv_usec = 0;
+    _baro_enabled = ms_init() == 0;
+    if (!_baro_enabled) {
+        // Flying doesn't need barometer, values stay 0.
+        LOG_ERROR("Failed to initiate MS5611, barometer is disabled.\n");
+    }
     return 0;
 }
 
 /**
  * @brief Update barometer reading and compute altitude.
+ * Readings change only when a conversion of MS5611 is done, at most every
+ * few loops.
  * 
  */
 void barometer_update() {
+    if (!_baro_enabled || ms_update() != 1) {
+        return;
+    }
     float _prev_alt = _altitude;
     float _prev_pres = _pressure;
     // Update sensor reading
-
-    // Filter
+    _pressure = ms_get_pressure();
+    _temp = ms_get_temperature();
 
     // Convertion
+    _altitude = 44330.0f * (1.0f - powf(_pressure / SEA_LEVEL_PRESSURE, 0.190295f));
 
-    _climb_rate = (_prev_alt - _altitude) / TIME_DIFF;
-    _pressure_diff = (_prev_pres - _pressure) / TIME_DIFF;
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    if (tv_is_updated(&_sample_tv)) {
+        float dt = tv_get_diff_usec_ul(&_sample_tv, &now) / 1e6f;
+        if (dt > 0) {
+            _climb_rate = (_altitude - _prev_alt) / dt;
+            _pressure_diff = (_pressure - _prev_pres) / dt;
+        }
+    }
+    _sample_tv = now;
 }
 
 /**
@@ -19,6 +19,8 @@ float _sample_gx[100];
 float _sample_gy[100];
 float _sample_gz[100];
 int _sample_g_index = 0;
+static uint64_t _sample_g_timestamp_ns; // Time of the last gathered gyro reading.
+static uint64_t _sample_m_timestamp_ns; // Time of the last gathered mag reading.
 
 //----- Offsets.
 float _gx_offset = 0;
@@ -60,6 +62,45 @@ void calibration_do_mag_calibration(float mx, float my, float mz, float *ca_mx,
     *ca_mz = tmp_z;
 }
 
+/**
+ * @brief Get offsets subtracted from gyro by calibration_do_gyro_calibration.
+ * 
+ * @param x 
+ * @param y 
+ * @param z 
+ */
+void calibration_get_gyro_offset(float *x, float *y, float *z) {
+    *x = _gx_offset;
+    *y = _gy_offset;
+    *z = _gz_offset;
+}
+
+/**
+ * @brief Get offsets subtracted from mag after scaling by calibration_do_mag_calibration.
+ * 
+ * @param x 
+ * @param y 
+ * @param z 
+ */
+void calibration_get_mag_offset(float *x, float *y, float *z) {
+    *x = _mx_offset;
+    *y = _my_offset;
+    *z = _mz_offset;
+}
+
+/**
+ * @brief Get scales multiplied to mag by calibration_do_mag_calibration.
+ * 
+ * @param x 
+ * @param y 
+ * @param z 
+ */
+void calibration_get_mag_scale(float *x, float *y, float *z) {
+    *x = _mx_scale;
+    *y = _my_scale;
+    *z = _mz_scale;
+}
+
 void calibration_set_mag_gathering_enable(bool enable) {
     
     if (_mag_enabled == enable) {
@@ -136,7 +177,21 @@ bool calibration_gyro_gathering_is_enabled() {
     return _gyro_enabled;
 }
 
-void calibration_gather_raw_gyro(float gx, float gy, float gz) {
+/**
+ * @brief Gather gyro reading at rest, offsets are means of the last 100 readings.
+ * 
+ * @param gx 
+ * @param gy 
+ * @param gz 
+ * @param timestamp_ns 
+ *      Time reading was sampled. A reading not newer than the last gathered one is skipped.
+ */
+void calibration_gather_raw_gyro(float gx, float gy, float gz, uint64_t timestamp_ns) {
+    if (timestamp_ns <= _sample_g_timestamp_ns) {
+        // Same samples as last loop, they would weigh twice.
+        return;
+    }
+    _sample_g_timestamp_ns = timestamp_ns;
     _sample_gx[_sample_g_index] = gx;
     _sample_gy[_sample_g_index] = gy;
     _sample_gz[_sample_g_index] = gz;
@@ -167,9 +222,24 @@ void calibration_reset_sample() {
     memset(_sample_gy, 0, sizeof(_sample_gy));
     memset(_sample_gz, 0, sizeof(_sample_gz));
     _sample_g_index = 0;
+    _sample_g_timestamp_ns = 0;
+    _sample_m_timestamp_ns = 0;
 }
 
-void calibration_gather_raw_mag(float mx, float my, float mz) {
+/**
+ * @brief Gather mag reading while rotating, offsets and scales come from extremes.
+ * 
+ * @param mx 
+ * @param my 
+ * @param mz 
+ * @param timestamp_ns 
+ *      Time reading was sampled. A reading not newer than the last gathered one is skipped.
+ */
+void calibration_gather_raw_mag(float mx, float my, float mz, uint64_t timestamp_ns) {
+    if (timestamp_ns <= _sample_m_timestamp_ns) {
+        return;
+    }
+    _sample_m_timestamp_ns = timestamp_ns;
     // Get max and min
     _sample_mx_max = mx > _sample_mx_max ? mx : _sample_mx_max;
     _sample_my_max = my > _sample_my_max ? my : _sample_my_max;
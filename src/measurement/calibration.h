@@ -17,11 +17,18 @@
 #define CALIBRATION_FILE "Calibration.json"
 
 #include <stdbool.h>
+#include <stdint.h>
 
 void calibration_do_gyro_calibration(float gx, float gy, float gz, float *ca_gx, float *ca_gy, float *ca_gz);
 
 void calibration_do_mag_calibration(float mx, float my, float mz, float *ca_mx, float *ca_my, float *ca_mz);
 
+void calibration_get_gyro_offset(float *x, float *y, float *z);
+
+void calibration_get_mag_offset(float *x, float *y, float *z);
+
+void calibration_get_mag_scale(float *x, float *y, float *z);
+
 void calibration_set_mag_gathering_enable(bool enable);
 
 void calibration_set_gyro_gathering_enable(bool enable);
@@ -30,9 +37,9 @@ bool calibration_mag_gathering_is_enabled();
 
 bool calibration_gyro_gathering_is_enabled();
 
-void calibration_gather_raw_gyro(float gx, float gy, float gz);
+void calibration_gather_raw_gyro(float gx, float gy, float gz, uint64_t timestamp_ns);
 
-void calibration_gather_raw_mag(float mx, float my, float mz);
+void calibration_gather_raw_mag(float mx, float my, float mz, uint64_t timestamp_ns);
 
 void calibration_reset_sample();
 
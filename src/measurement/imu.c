@@ -1,15 +1,21 @@
 #include "imu.h"
 #include "calibration.h"
+#include "imu_transform.h"
 
 #include <stdint.h>
-#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 #include "driver/mpu6050.h"
 #include "driver/ak8963.h"
 
+#include "pilot/pilot.h"
+
 #include "util/macro.h"
 #include "util/logger.h"
 #include "util/debug.h"
+#include "util/loop.h"
+#include "util/parameter.h"
 
 #include "util/filter/sma_filter.h"
 
@@ -19,40 +25,123 @@
 #define UPDATE_METHOD_MADGWICK
 // #define UPDATE_METHOD_COMPLEMENTARY
 
-// #define IMU_USE_MAG // Comment to disable mag during compilation.
+#define IMU_USE_FIFO // Comment to sample MPU once per loop instead of draining its FIFO.
+
+#define IMU_USE_DATA_READY // Comment to time the loop by busy loop instead of INT pin of MPU.
 
 #define SMA_BUFFER_LENGTH_A 2
 #define SMA_BUFFER_LENGTH_G 2
 #define SMA_BUFFER_LENGTH_M 3
 
-#define IMU_CFG_MPU_DLPF 0
+// Defaults of sensor settings, used if IMU_* parameters are missing or invalid.
+#define IMU_CFG_MPU_DLPF 1 // 184Hz bandwidth, internal rate 1kHz so the divider can match the loop rate.
 #define IMU_CFG_MPU_GYRO_FS MPU_GYRO_FS_2000_DPS
 #define IMU_CFG_MPU_GYRO_FCHOICE 0
 #define IMU_CFG_MPU_ACCEL_FS MPU_ACCEL_FS_8_G
 #define IMU_CFG_MPU_ACCEL_FCHOICE 0
 #define IMU_CFG_MPU_ACCEL_DLPF 0
-#define IMU_CFG_AK_16_BIT
-
-static float _raw_a[3]; // Raw/Uncalibrated measurements from Accelerometer. In X,Y,Z order.
-static float _raw_g[3]; // Raw/Uncalibrated measurements from Gyroscope(Degree/s). In X,Y,Z order.
-static float _raw_m[3]; // Raw/Uncalibrated measurements from Magnetometer. In X,Y,Z order.
+#define IMU_CFG_MPU_SMPLRT_DIV -1 // Negative to match the loop rate.
+#define IMU_CFG_AK_ENABLE 0
+#define IMU_CFG_AK_16_BIT 1
+#define IMU_CFG_MPU_INT_GPIO_CHIP "/dev/gpiochip0"
+#define IMU_CFG_MPU_INT_GPIO_LINE 24
+
+// MPUs read every loop. The first one opened reaches AK8963 and drives INT pin,
+// the others are redundant. On I2C they share one bus, with AD0 low then high.
+#define IMU_CFG_MPU_SPI_DEVICES {"/dev/spidev0.0", "/dev/spidev0.1"}
+#define IMU_CFG_MPU_I2C_BUS "/dev/i2c-1"
+
+// Voting of redundant MPUs.
+#define IMU_VOTE_SCALE 64 // Readings are compared as means in 1/64 counts.
+#define IMU_VOTE_ACCEL_G 0.5f // MPU farther than this from the median is faulty, g.
+#define IMU_VOTE_GYRO_DPS 20.0f // Same for gyroscope, degree/s. Covers bias between chips.
+#define IMU_FAULT_LOOPS 5 // Consecutive faulty loops before an MPU is dropped.
+#define IMU_RECOVER_LOOPS 400 // Consecutive good loops before a dropped MPU is trusted again.
+#define IMU_MAX_DEVICES MPU_MAX_BATCH
+
+// Axes of _raw and _cal, X,Y,Z each.
+#define IMU_AXIS_A 0
+#define IMU_AXIS_G 3
+#define IMU_AXIS_M 6
+
+// One MPU and its readings of this loop.
+struct IMUDevice {
+    struct MPU *mpu;
+    const char *path; // Device or bus opened.
+    int16_t counts[MPU_RAW_AXES]; // Raw block of last mpu_read_raw, magnetometer is kept until next reading.
+    struct MPUSample batch[MPU_FIFO_MAX_FRAMES]; // Samples drained from FIFO in this loop.
+    int n_batch; // Number of samples in batch, 0 if FIFO isn't used.
+    int32_t mean[MPU_RAW_AXES]; // Mean of batch or counts in 1/IMU_VOTE_SCALE counts.
+    uint64_t timestamp_ns; // Time mean was sampled, middle of batch.
+    bool valid; // True if read in this loop.
+    bool healthy; // False if dropped by fault detection.
+    int bad_loops; // Consecutive faulty loops.
+    int good_loops; // Consecutive good loops.
+    unsigned int faults; // Faulty loops since init.
+};
+
+static struct IMUDevice _devices[IMU_MAX_DEVICES]; // Opened MPUs, AK8963 and INT pin are on the first.
+static int _n_devices; // Number of opened MPUs.
+static int _primary; // Index of the MPU fed to AHRS unless 3 or more are voting.
+static unsigned int _failovers; // Times the primary MPU was dropped for another one.
+static bool _disagree; // True if 2 healthy MPUs disagree and the faulty one is unknown.
+
+static struct IMUTransform *_transform; // Board axes, units and calibration of raw counts.
+
+static float _raw[IMU_TRANSFORM_LANES]; // Raw/Uncalibrated measurements. Accelerometer(g), gyroscope(rad/s), magnetometer.
+static float _cal[IMU_TRANSFORM_LANES]; // Calibrated measurements, same order as _raw.
 
 static float _est_a[3]; // Filtered/Calibrated measurements from accelerometer. In X,Y,Z order.
 static float _est_g[3]; // Filtered/Calibrated measurements from gyroscope(Degree/s). In X,Y,Z order.
 static float _est_m[3]; // Filtered/Calibrated measurements from magnetometer. In X,Y,Z order.
 
-static struct SMAFilter *_sma_a[SMA_BUFFER_LENGTH_A]; // Simeple Moving Average Filter for Accelerometer.
-static struct SMAFilter *_sma_g[SMA_BUFFER_LENGTH_G]; // Simeple Moving Average Filter for Gyro.
-static struct SMAFilter *_sma_m[SMA_BUFFER_LENGTH_M]; // Simeple Moving Average Filter for Megnetometer.
+static struct SMAFilter *_sma_a[3]; // Simeple Moving Average Filter for Accelerometer. In X,Y,Z order.
+static struct SMAFilter *_sma_g[3]; // Simeple Moving Average Filter for Gyro. In X,Y,Z order.
+static struct SMAFilter *_sma_m[3]; // Simeple Moving Average Filter for Megnetometer. In X,Y,Z order.
 
 static bool _mag_data_updated; // True if magnetometer is updated in this loop else false.
 
 static bool _mag_enabled; // True if magnetometer is enabled and being used.
 
+static uint64_t _timestamp_ns; // CLOCK_MONOTONIC time readings were sampled, read by other threads.
+
+// Sensor settings, loaded from parameters.
+struct IMUConfig {
+    int32_t gyro_fs; // enum MPU_GYRO_FS.
+    int32_t gyro_dlpf; // DLPF_CFG of CONFIG, also sets the internal sample rate.
+    int32_t gyro_fchoice; // FCHOICE_B of GYRO_CONFIG, non-zero bypasses DLPF.
+    int32_t accel_fs; // enum MPU_ACCEL_FS.
+    int32_t accel_dlpf; // A_DLPFCFG of ACCEL_CONFIG_2.
+    int32_t accel_fchoice; // ACCEL_FCHOICE_B of ACCEL_CONFIG_2.
+    int32_t smplrt_div; // SMPLRT_DIV, negative to match the loop rate.
+    int32_t mag_enable; // Non-zero to use AK8963.
+    int32_t mag_16_bit; // Non-zero for 16 bit output else 14 bit.
+};
+
+static struct IMUConfig _cfg; // Settings applied to sensors.
+
+static unsigned int _cfg_generation; // Parameter generation _cfg was loaded at.
+
 int imu_init_mpu();
 
 int imu_init_ak();
 
+static void imu_load_config(struct IMUConfig *cfg);
+
+static int imu_apply_mpu_config(struct MPU *mpu, const struct IMUConfig *cfg);
+
+static int imu_apply_mpu_config_all(const struct IMUConfig *cfg);
+
+static bool imu_read_devices();
+
+static bool imu_vote(int32_t sel[MPU_RAW_AXES], uint64_t *timestamp_ns);
+
+static void imu_reload_config();
+
+static void imu_update_transform_axes();
+
+static void imu_update_calibration();
+
 /**
  * @brief Initiate IMU sensors.
  * 
@@ -61,25 +150,32 @@ int imu_init_ak();
 int imu_init() {
     LOG("Initiating IMU.\n");
 
-    if (imu_init_mpu() != 0) {
-        LOG_ERROR("Failed to initiate MPU.\n");
+    _cfg_generation = parameter_get_generation();
+    imu_load_config(&_cfg);
+
+    if ((_transform = imu_transform_init()) == NULL) {
+        LOG_ERROR("Failed to allocate transform.\n");
         return -1;
     }
-#ifdef IMU_USE_MAG
-    if (imu_init_ak() != 0) {
-        LOG_ERROR("Failed to initiate AK.\n");
+
+    if (imu_init_mpu() != 0) {
+        LOG_ERROR("Failed to initiate MPU.\n");
         return -1;
     }
-    _mag_enabled = true;
-#else
     _mag_enabled = false;
-#endif // IMU_USE_MAG
+    if (_cfg.mag_enable) {
+        if (imu_init_ak() != 0) {
+            LOG_ERROR("Failed to initiate AK.\n");
+            return -1;
+        }
+        _mag_enabled = true;
+    }
     calibration_load();
     
     LOG("Initiating variables.\n");
     int i;
     for(i = 0; i < 3; i++) {
-        _est_a[i] = _est_g[i] = _est_m[i] = _raw_a[i] = _raw_g[i] = _raw_m[i] = 0;
+        _est_a[i] = _est_g[i] = _est_m[i] = 0;
         
         _sma_a[i] = sma_init(SMA_BUFFER_LENGTH_A);
 
@@ -97,56 +193,35 @@ int imu_init() {
  * 
  */
 void imu_update() {
-    // Read new value
-    float g_calibrated[3]; // Calibrated value.
-    float m_calibrated[3]; // Calibrated value.
-
-    if (_mag_enabled) {
-
-        mpu_read_all(
-            &_raw_a[0], &_raw_a[1], &_raw_a[2],
-            &_raw_g[0], &_raw_g[1], &_raw_g[2],
-            &_raw_m[1], &_raw_m[0], &_raw_m[2], // Swap 0 and 1 since AK8963 doesn't match MPU9250's XYZ axis.
-            &_mag_data_updated);
-    } else {
-
-        _mag_data_updated = false;
-        mpu_read_accel(&_raw_a[0], &_raw_a[1], &_raw_a[2]);
-        mpu_read_gyro(&_raw_g[0], &_raw_g[1], &_raw_g[2]);
+    if (parameter_get_generation() != _cfg_generation && !pilot_is_armed()) {
+        imu_reload_config();
     }
 
-    _raw_g[0] *= TO_RAD;
-    _raw_g[1] *= TO_RAD;
-    _raw_g[2] *= TO_RAD;
-    
-    //----- Calibration.
-    calibration_do_gyro_calibration(
-        _raw_g[0], _raw_g[1], _raw_g[2],
-        &g_calibrated[0], &g_calibrated[1], &g_calibrated[2]);
-
-    if (_mag_data_updated) {
-        calibration_do_mag_calibration(
-            _raw_m[0],
-            _raw_m[1],
-            _raw_m[2],
-            &m_calibrated[0],
-            &m_calibrated[1],
-            &m_calibrated[2]
-        );
+    bool mag_ready = imu_read_devices();
+    _mag_data_updated = _mag_enabled && mag_ready;
+
+    //----- Remap, scale and calibrate.
+    int32_t sel[MPU_RAW_AXES];
+    uint64_t timestamp_ns;
+    imu_update_calibration();
+    if (imu_vote(sel, &timestamp_ns)) {
+        // Means of every sample since last loop, instead of the one at loop time.
+        imu_transform_apply_sum(_transform, sel, IMU_VOTE_SCALE, _raw, _cal);
+        __atomic_store_n(&_timestamp_ns, timestamp_ns, __ATOMIC_RELAXED);
     }
 
     //----- Filter
     int i;
     for(i = 0; i < 3; i++) {
         //----- Use SMA Filter.
-        // _est_a[i] = sma_update(_sma_a[i], _raw_a[i]);
-        // _est_g[i] = sma_update(_sma_g[i], g_calibrated[i]);
+        // _est_a[i] = sma_update(_sma_a[i], _raw[IMU_AXIS_A + i]);
+        // _est_g[i] = sma_update(_sma_g[i], _cal[IMU_AXIS_G + i]);
         //----- Or not use SMA FIlter.
-        _est_a[i] = _raw_a[i];
-        _est_g[i] = _raw_g[i];
+        _est_a[i] = _raw[IMU_AXIS_A + i];
+        _est_g[i] = _raw[IMU_AXIS_G + i];
         
         if (_mag_data_updated) {
-            _est_m[i] = sma_update(_sma_m[i], m_calibrated[i]);
+            _est_m[i] = sma_update(_sma_m[i], _cal[IMU_AXIS_M + i]);
         }
     }
 }
@@ -160,6 +235,109 @@ bool imu_mag_data_is_updated() {
     return _mag_data_updated;
 }
 
+/**
+ * @brief Get samples drained from MPU FIFO in this loop.
+ * 
+ * @param samples 
+ *      Set to the raw samples in MPU axes, oldest first. Valid until next imu_update.
+ * @return Number of samples, 0 if FIFO isn't used or empty.
+ */
+int imu_get_batch(const struct MPUSample **samples) {
+    *samples = _devices[_primary].batch;
+    return _devices[_primary].n_batch;
+}
+
+/**
+ * @brief Get number of MPUs read every loop.
+ * 
+ * @return Number of MPUs, more than 1 if redundant.
+ */
+int imu_get_device_count() {
+    return _n_devices;
+}
+
+/**
+ * @brief Get the MPU fed to AHRS. With 3 or more healthy MPUs the median
+ * of each axis is used instead.
+ * 
+ * @return Index of MPU, 0 for the first one opened.
+ */
+int imu_get_primary() {
+    return _primary;
+}
+
+/**
+ * @brief Get times the primary MPU was dropped by fault detection.
+ * 
+ * @return Number of failovers since init.
+ */
+unsigned int imu_get_failovers() {
+    return _failovers;
+}
+
+/**
+ * @brief Check if an MPU passes fault detection.
+ * 
+ * @param index 
+ *      Index of MPU.
+ * @return True if healthy else false.
+ */
+bool imu_device_is_healthy(int index) {
+    return index >= 0 && index < _n_devices && _devices[index].healthy;
+}
+
+/**
+ * @brief Print state of every MPU to stdout.
+ * Reads the vote state without locking, so call it from the control loop
+ * like imu_update. Not async-signal-safe.
+ */
+void imu_dump() {
+    printf("%-24s %-8s %10s\n", "imu", "state", "faults");
+
+    int i;
+    for (i = 0; i < _n_devices; i++) {
+        const struct IMUDevice *d = &_devices[i];
+        printf("%-24s %-8s %10u\n",
+            d->path, i == _primary ? "primary" : d->healthy ? "standby" : "failed", d->faults);
+    }
+    printf("failovers: %u\n", _failovers);
+    fflush(stdout);
+}
+
+/**
+ * @brief Check if imu_wait_sample can be used.
+ * 
+ * @return True if INT pin of MPU is watched.
+ */
+bool imu_data_ready_is_enabled() {
+    return _n_devices > 0 && mpu_data_ready_int_is_enabled(_devices[0].mpu);
+}
+
+/**
+ * @brief Block until MPU takes new samples. Used as loop trigger.
+ * 
+ * @param timeout_ms 
+ *      Timeout in ms, -1 to wait forever.
+ * @param timestamp_ns 
+ *      Set to kernel timestamp of the newest sample. NULL to ignore.
+ * @return Number of samples taken since last call, 0 if timeout, -1 if fail.
+ */
+int imu_wait_sample(int timeout_ms, uint64_t *timestamp_ns) {
+    return mpu_wait_data_ready(_devices[0].mpu, timeout_ms, timestamp_ns);
+}
+
+/**
+ * @brief Get time the readings of imu_get_* were sampled. Readings are
+ * means of the samples since last loop, so it's the middle of them.
+ * Sample times are counted from the INT edge if data ready interrupt is
+ * enabled, else from the time MPU was read.
+ * 
+ * @return CLOCK_MONOTONIC time in ns, 0 before the first reading.
+ */
+uint64_t imu_get_timestamp_ns() {
+    return __atomic_load_n(&_timestamp_ns, __ATOMIC_RELAXED);
+}
+
 void imu_set_mag_enable(bool enable) {
     _mag_enabled = enable;
 }
@@ -178,15 +356,15 @@ float imu_get_mx() {return _est_m[0];}
 float imu_get_my() {return _est_m[1];}
 float imu_get_mz() {return _est_m[2];}
 
-float imu_get_raw_ax() {return _raw_a[0];};
-float imu_get_raw_ay() {return _raw_a[1];};
-float imu_get_raw_az() {return _raw_a[2];};
-float imu_get_raw_gx() {return _raw_g[0];};
-float imu_get_raw_gy() {return _raw_g[1];};
-float imu_get_raw_gz() {return _raw_g[2];};
-float imu_get_raw_mx() {return _raw_m[0];};
-float imu_get_raw_my() {return _raw_m[1];};
-float imu_get_raw_mz() {return _raw_m[2];};
+float imu_get_raw_ax() {return _raw[IMU_AXIS_A + 0];};
+float imu_get_raw_ay() {return _raw[IMU_AXIS_A + 1];};
+float imu_get_raw_az() {return _raw[IMU_AXIS_A + 2];};
+float imu_get_raw_gx() {return _raw[IMU_AXIS_G + 0];};
+float imu_get_raw_gy() {return _raw[IMU_AXIS_G + 1];};
+float imu_get_raw_gz() {return _raw[IMU_AXIS_G + 2];};
+float imu_get_raw_mx() {return _raw[IMU_AXIS_M + 0];};
+float imu_get_raw_my() {return _raw[IMU_AXIS_M + 1];};
+float imu_get_raw_mz() {return _raw[IMU_AXIS_M + 2];};
 
 //-----
 
@@ -197,42 +375,45 @@ float imu_get_raw_mz() {return _raw_m[2];};
  */
 int imu_init_mpu() {
     LOG("Initiating MPU.\n");
-    if (mpu_init() != 0) {
-        LOG_ERROR("Failed to init mpu.\n");
-        return -1;
-    }
-    usleep(1000);
-    if (mpu_set_dlpf(IMU_CFG_MPU_DLPF) != 0) {
-        LOG_ERROR("Failed to set DLPF.\n");
-        return -1;
-    }
-    usleep(1000);
-    if (mpu_set_gyro_fullscale(IMU_CFG_MPU_GYRO_FS) != 0) {
-        LOG_ERROR("Failed to set gyro fullscale.\n");
-        return -1;
+    static const char *spi_devices[] = IMU_CFG_MPU_SPI_DEVICES;
+    static const uint8_t i2c_addrs[] = {MPU_ADDRESS_AD0_LO, MPU_ADDRESS_AD0_HI};
+    int n = mpu_is_using_spi() ? sizeof(spi_devices) / sizeof(spi_devices[0]) : sizeof(i2c_addrs);
+    int i;
+    _n_devices = 0;
+    for (i = 0; i < n && _n_devices < IMU_MAX_DEVICES; i++) {
+        struct IMUDevice *d = &_devices[_n_devices];
+        d->path = mpu_is_using_spi() ? spi_devices[i] : IMU_CFG_MPU_I2C_BUS;
+        if ((d->mpu = mpu_open(d->path, mpu_is_using_spi() ? 0 : i2c_addrs[i])) == NULL) {
+            // Flying on the others, the missing one isn't checked again.
+            LOG_ERROR("Failed to init mpu on %s.\n", d->path);
+            continue;
+        }
+        d->healthy = true;
+        _n_devices++;
     }
-    usleep(1000);
-    if (mpu_set_gyro_fchoice(IMU_CFG_MPU_GYRO_FCHOICE) != 0) {
-        LOG_ERROR("Failed to set gyro fchoice.\n");
+    if (_n_devices == 0) {
+        LOG_ERROR("No MPU.\n");
         return -1;
     }
-    usleep(1000);
-    if (mpu_set_accel_fullscale(IMU_CFG_MPU_ACCEL_FS) != 0) {
-        LOG_ERROR("Failed to set accel fullscale.\n");
+    _primary = 0;
+    if (imu_apply_mpu_config_all(&_cfg) != 0) {
         return -1;
     }
-    usleep(1000);
-    if (mpu_set_accel_fchoice(IMU_CFG_MPU_ACCEL_FCHOICE != 0)) {
-        LOG_ERROR("Failed to set accel fchoice.\n");
-        return -1;
+#ifdef IMU_USE_FIFO
+    for (i = 0; i < _n_devices; i++) {
+        if (mpu_enable_fifo(_devices[i].mpu) != 0) {
+            LOG_ERROR("Failed to enable FIFO.\n");
+            return -1;
+        }
     }
-    usleep(1000);
-    if (mpu_set_accel_dlpf(IMU_CFG_MPU_ACCEL_DLPF) != 0) {
-        LOG_ERROR("Failed to set accel dlpf.\n");
-        return -1;
+#endif // IMU_USE_FIFO
+#ifdef IMU_USE_DATA_READY
+    if (mpu_enable_data_ready_int(_devices[0].mpu, IMU_CFG_MPU_INT_GPIO_CHIP, IMU_CFG_MPU_INT_GPIO_LINE) != 0) {
+        // Loop keeps timing itself.
+        LOG_ERROR("Failed to enable data ready interrupt, using busy loop.\n");
     }
-    usleep(1000);
-    LOG("Done.\n");
+#endif // IMU_USE_DATA_READY
+    LOG("%d MPU(s) in use.\n", _n_devices);
     return 0;
 }
 
@@ -244,35 +425,522 @@ int imu_init_mpu() {
 int imu_init_ak() {
     LOG("Initiating AK8963.\n");
     
-    if (mpu_enable_master_mode() != 0) {
+    struct MPU *mpu = _devices[0].mpu;
+    if (mpu_enable_master_mode(mpu) != 0) {
         LOG_ERROR("Failed to enable master mode.\n");
         return -1;
     }
     
-    usleep(1000);
-    if (ak_init() != 0) {
+    if (ak_init(mpu) != 0) {
         LOG_ERROR("Failed to init ak.\n");
         return -1;
     }
-    usleep(1000);
-#ifdef IMU_CFG_AK_16_BIT
-    if (ak_set_16_bit() != 0) {
-        LOG_ERROR("Failed to set 16 bit mode.\n");
-        return -1;
-    }
-#else
-    if (ak_set_14_bit() != 0) {
-        LOG_ERROR("Failed to set 14 bit mode.\n");
-        return -1;
+    if (_cfg.mag_16_bit) {
+        if (ak_set_16_bit() != 0) {
+            LOG_ERROR("Failed to set 16 bit mode.\n");
+            return -1;
+        }
+    } else {
+        if (ak_set_14_bit() != 0) {
+            LOG_ERROR("Failed to set 14 bit mode.\n");
+            return -1;
+        }
     }
-#endif // IMU_CFG_AK_16_BIT
-    usleep(1000);
 
     if (ak_set_mode(AK_MODE_CONTINUOUS_MEASUREMENT_100HZ) != 0) {
         LOG_ERROR("Failed to set mode.\n");
         return -1;
     }
-    usleep(1000);
+    if (mpu_enable_mag_auto_read(mpu, 100) != 0) {
+        LOG_ERROR("Failed to enable auto read.\n");
+        return -1;
+    }
     LOG("Done.\n");
     return 0;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Get an integer parameter within range.
+ * 
+ * @param index 
+ *      Parameter.
+ * @param min 
+ *      Minimum valid value.
+ * @param max 
+ *      Maximum valid value.
+ * @param def 
+ *      Returned if parameter is missing, not integer or out of range.
+ * @return Value of parameter.
+ */
+static int32_t imu_get_param(enum PARAMETER index, int32_t min, int32_t max, int32_t def) {
+    int32_t value;
+    const char *key = parameter_keys[index];
+    if (parameter_get_type(key) != PARAMETER_TYPE_INT32 || parameter_get_value(key, &value) != 0) {
+        return def;
+    }
+    if (value < min || value > max) {
+        LOG_ERROR("%s=%d is out of range %d ~ %d, using %d.\n", key, value, min, max, def);
+        return def;
+    }
+    return value;
+}
+
+/**
+ * @brief Load sensor settings from parameters.
+ * 
+ * @param cfg 
+ *      Settings.
+ */
+static void imu_load_config(struct IMUConfig *cfg) {
+    cfg->gyro_fs = imu_get_param(PARAMETER_IMU_GYRO_FS, 0, 3, IMU_CFG_MPU_GYRO_FS);
+    cfg->gyro_dlpf = imu_get_param(PARAMETER_IMU_GYRO_DLPF, 0, 7, IMU_CFG_MPU_DLPF);
+    cfg->gyro_fchoice = imu_get_param(PARAMETER_IMU_GYRO_FCHOICE, 0, 3, IMU_CFG_MPU_GYRO_FCHOICE);
+    cfg->accel_fs = imu_get_param(PARAMETER_IMU_ACCEL_FS, 0, 3, IMU_CFG_MPU_ACCEL_FS);
+    cfg->accel_dlpf = imu_get_param(PARAMETER_IMU_ACCEL_DLPF, 0, 7, IMU_CFG_MPU_ACCEL_DLPF);
+    cfg->accel_fchoice = imu_get_param(PARAMETER_IMU_ACCEL_FCHOICE, 0, 1, IMU_CFG_MPU_ACCEL_FCHOICE);
+    cfg->smplrt_div = imu_get_param(PARAMETER_IMU_SMPLRT_DIV, -1, 255, IMU_CFG_MPU_SMPLRT_DIV);
+    cfg->mag_enable = imu_get_param(PARAMETER_IMU_MAG_EN, 0, 1, IMU_CFG_AK_ENABLE);
+    cfg->mag_16_bit = imu_get_param(PARAMETER_IMU_MAG_16BIT, 0, 1, IMU_CFG_AK_16_BIT);
+}
+
+/**
+ * @brief Get SMPLRT_DIV of settings. If matched to the loop rate, it's the
+ * largest divider which still samples at least once per loop.
+ * 
+ * @param cfg 
+ *      Settings.
+ * @return Divider.
+ */
+static uint8_t imu_get_sample_rate_div(const struct IMUConfig *cfg) {
+    // Divider only works with DLPF_CFG 1 ~ 6, otherwise internal rate is 8k or 32kHz.
+    bool div_works = cfg->gyro_fchoice == 0 && cfg->gyro_dlpf != 0 && cfg->gyro_dlpf != 7;
+    if (cfg->smplrt_div >= 0) {
+        if (cfg->smplrt_div > 0 && !div_works) {
+            LOG_ERROR("SMPLRT_DIV %d is ignored with DLPF %d and GYRO_FCHOICE %d, MPU samples at 8kHz or more.\n",
+                cfg->smplrt_div, cfg->gyro_dlpf, cfg->gyro_fchoice);
+        }
+        return cfg->smplrt_div;
+    }
+    if (!div_works) {
+        LOG_ERROR("Can't match SMPLRT_DIV to loop rate with DLPF %d and GYRO_FCHOICE %d, MPU samples at 8kHz or more.\n",
+            cfg->gyro_dlpf, cfg->gyro_fchoice);
+        return 0;
+    }
+    float loop_rate = loop_get_rate();
+    if (!(loop_rate > 0) || loop_rate >= 1000.0f) {
+        return 0;
+    }
+    int sdiv = (int)(1000.0f / loop_rate) - 1;
+    return sdiv > 255 ? 255 : sdiv;
+}
+
+/**
+ * @brief Write settings of gyro and accelerometer to MPU.
+ * 
+ * @param mpu 
+ *      Handle of MPU.
+ * @param cfg 
+ *      Settings.
+ * @return 0 if success else -1.
+ */
+static int imu_apply_mpu_config(struct MPU *mpu, const struct IMUConfig *cfg) {
+    if (mpu_set_dlpf(mpu, cfg->gyro_dlpf) != 0) {
+        LOG_ERROR("Failed to set DLPF.\n");
+        return -1;
+    }
+    if (mpu_set_gyro_fullscale(mpu, cfg->gyro_fs) != 0) {
+        LOG_ERROR("Failed to set gyro fullscale.\n");
+        return -1;
+    }
+    if (mpu_set_gyro_fchoice(mpu, cfg->gyro_fchoice) != 0) {
+        LOG_ERROR("Failed to set gyro fchoice.\n");
+        return -1;
+    }
+    if (mpu_set_accel_fullscale(mpu, cfg->accel_fs) != 0) {
+        LOG_ERROR("Failed to set accel fullscale.\n");
+        return -1;
+    }
+    if (mpu_set_accel_fchoice(mpu, cfg->accel_fchoice) != 0) {
+        LOG_ERROR("Failed to set accel fchoice.\n");
+        return -1;
+    }
+    if (mpu_set_accel_dlpf(mpu, cfg->accel_dlpf) != 0) {
+        LOG_ERROR("Failed to set accel dlpf.\n");
+        return -1;
+    }
+    uint8_t sdiv = imu_get_sample_rate_div(cfg);
+    if (mpu_set_sample_rate_div(mpu, sdiv) != 0) {
+        LOG_ERROR("Failed to set sample rate divider.\n");
+        return -1;
+    }
+    LOG(
+        "MPU: GYRO_FS: %d, DLPF: %d, GYRO_FCHOICE: %d, ACCEL_FS: %d, ACCEL_DLPF: %d, ACCEL_FCHOICE: %d, SMPLRT_DIV: %d\n",
+        cfg->gyro_fs, cfg->gyro_dlpf, cfg->gyro_fchoice,
+        cfg->accel_fs, cfg->accel_dlpf, cfg->accel_fchoice, sdiv);
+    return 0;
+}
+
+/**
+ * @brief Write settings of gyro and accelerometer to every MPU.
+ * 
+ * @param cfg 
+ *      Settings.
+ * @return 0 if success else -1.
+ */
+static int imu_apply_mpu_config_all(const struct IMUConfig *cfg) {
+    int i;
+    for (i = 0; i < _n_devices; i++) {
+        if (imu_apply_mpu_config(_devices[i].mpu, cfg) != 0) {
+            return -1;
+        }
+    }
+    imu_update_transform_axes();
+    return 0;
+}
+
+/**
+ * @brief Apply parameters changed since last load. Only called while disarmed,
+ * since sensors stall for a few ms and FIFO is flushed.
+ * 
+ */
+static void imu_reload_config() {
+    struct IMUConfig cfg;
+    _cfg_generation = parameter_get_generation();
+    imu_load_config(&cfg);
+
+    bool mpu_changed = 
+        cfg.gyro_fs != _cfg.gyro_fs || cfg.gyro_dlpf != _cfg.gyro_dlpf ||
+        cfg.gyro_fchoice != _cfg.gyro_fchoice || cfg.accel_fs != _cfg.accel_fs ||
+        cfg.accel_dlpf != _cfg.accel_dlpf || cfg.accel_fchoice != _cfg.accel_fchoice ||
+        cfg.smplrt_div != _cfg.smplrt_div;
+    bool mag_changed = cfg.mag_enable != _cfg.mag_enable || cfg.mag_16_bit != _cfg.mag_16_bit;
+    _cfg = cfg;
+
+    if (mpu_changed) {
+        LOG("Applying MPU settings.\n");
+        if (imu_apply_mpu_config_all(&_cfg) != 0) {
+            LOG_ERROR("Failed to apply MPU settings.\n");
+        }
+#ifdef IMU_USE_FIFO
+        // Drop samples taken with the old fullscale.
+        int i;
+        for (i = 0; i < _n_devices; i++) {
+            if (mpu_reset_fifo(_devices[i].mpu) != 0) {
+                LOG_ERROR("Failed to reset FIFO.\n");
+            }
+        }
+#endif // IMU_USE_FIFO
+        // Delay of auto read follows the sample rate.
+        if (_mag_enabled && !mag_changed && mpu_enable_mag_auto_read(_devices[0].mpu, 100) != 0) {
+            LOG_ERROR("Failed to enable auto read.\n");
+        }
+    }
+    if (mag_changed) {
+        _mag_enabled = false;
+        if (_cfg.mag_enable) {
+            LOG("Applying AK settings.\n");
+            if (imu_init_ak() != 0) {
+                LOG_ERROR("Failed to initiate AK.\n");
+            } else {
+                _mag_enabled = true;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Map raw counts to board axes and units. Scales follow fullscale of MPU.
+ * 
+ */
+static void imu_update_transform_axes() {
+    // Every MPU has the same settings.
+    float scale_a = 1.0f / mpu_get_accel_scale(_devices[0].mpu);
+    float scale_g = TO_RAD / mpu_get_gyro_scale(_devices[0].mpu);
+    int i;
+    for (i = 0; i < 3; i++) {
+        imu_transform_set_axis(_transform, IMU_AXIS_A + i, MPU_RAW_AX + i, scale_a);
+        imu_transform_set_axis(_transform, IMU_AXIS_G + i, MPU_RAW_GX + i, scale_g);
+    }
+    // Swap X and Y since AK8963 doesn't match MPU9250's XYZ axis.
+    imu_transform_set_axis(_transform, IMU_AXIS_M + 0, MPU_RAW_MX + 1, 1.0f);
+    imu_transform_set_axis(_transform, IMU_AXIS_M + 1, MPU_RAW_MX + 0, 1.0f);
+    imu_transform_set_axis(_transform, IMU_AXIS_M + 2, MPU_RAW_MX + 2, 1.0f);
+}
+
+/**
+ * @brief Copy calibration to transform, since it changes while gathering.
+ * 
+ */
+static void imu_update_calibration() {
+    float offset[3], scale[3];
+    int i;
+    calibration_get_gyro_offset(&offset[0], &offset[1], &offset[2]);
+    for (i = 0; i < 3; i++) {
+        imu_transform_set_calibration(_transform, IMU_AXIS_G + i, 1.0f, offset[i]);
+    }
+    calibration_get_mag_offset(&offset[0], &offset[1], &offset[2]);
+    calibration_get_mag_scale(&scale[0], &scale[1], &scale[2]);
+    for (i = 0; i < 3; i++) {
+        imu_transform_set_calibration(_transform, IMU_AXIS_M + i, scale[i], offset[i]);
+    }
+}
+
+/**
+ * @brief Read every MPU, FIFOs first, then blocks of the MPUs without
+ * samples and of the one reaching AK8963. Each step is one batch of back to
+ * back transfers, so the MPUs are sampled at about the same time.
+ * 
+ * @return True if AK8963 got a new reading else false.
+ */
+static bool imu_read_devices() {
+    struct MPU *mpu[IMU_MAX_DEVICES];
+    int i, n;
+    for (i = 0; i < _n_devices; i++) {
+        _devices[i].valid = true;
+        _devices[i].n_batch = 0;
+    }
+#ifdef IMU_USE_FIFO
+    struct MPUSample *samples[IMU_MAX_DEVICES];
+    int n_samples[IMU_MAX_DEVICES];
+    for (i = 0; i < _n_devices; i++) {
+        mpu[i] = _devices[i].mpu;
+        samples[i] = _devices[i].batch;
+    }
+    mpu_read_fifo_all(mpu, _n_devices, samples, MPU_FIFO_MAX_FRAMES, n_samples);
+    for (i = 0; i < _n_devices; i++) {
+        _devices[i].valid = n_samples[i] >= 0;
+        _devices[i].n_batch = n_samples[i] > 0 ? n_samples[i] : 0;
+    }
+#endif // IMU_USE_FIFO
+
+    // FIFO only has accelerometer and gyroscope.
+    int16_t *raw[IMU_MAX_DEVICES];
+    int index[IMU_MAX_DEVICES];
+    for (i = 0, n = 0; i < _n_devices; i++) {
+        if (_devices[i].valid && (_devices[i].n_batch == 0 || (i == 0 && _mag_enabled))) {
+            mpu[n] = _devices[i].mpu;
+            raw[n] = _devices[i].counts;
+            index[n++] = i;
+        }
+    }
+    bool mag_ready[IMU_MAX_DEVICES];
+    int ret[IMU_MAX_DEVICES];
+    if (n == 0 || mpu_read_raw_all(mpu, n, raw, mag_ready, ret) == 0) {
+        return n > 0 && index[0] == 0 && mag_ready[0];
+    }
+    for (i = 0; i < n; i++) {
+        if (ret[i] != 0 && _devices[index[i]].n_batch == 0) {
+            _devices[index[i]].valid = false;
+        }
+    }
+    return index[0] == 0 && ret[0] == 0 && mag_ready[0];
+}
+
+/**
+ * @brief Get mean of readings in 1/IMU_VOTE_SCALE counts, so MPUs with
+ * different number of samples compare.
+ * 
+ * @param d 
+ *      The MPU.
+ */
+static void imu_update_mean(struct IMUDevice *d) {
+    int i, j;
+    for (i = 0; i < 3; i++) {
+        // Magnetometer is read once.
+        d->mean[MPU_RAW_MX + i] = (int32_t)d->counts[MPU_RAW_MX + i] * IMU_VOTE_SCALE;
+    }
+    if (d->n_batch == 0) {
+        d->timestamp_ns = mpu_get_timestamp_ns(d->mpu);
+        for (i = 0; i < 3; i++) {
+            d->mean[MPU_RAW_AX + i] = (int32_t)d->counts[MPU_RAW_AX + i] * IMU_VOTE_SCALE;
+            d->mean[MPU_RAW_GX + i] = (int32_t)d->counts[MPU_RAW_GX + i] * IMU_VOTE_SCALE;
+        }
+        return;
+    }
+    int32_t sum_a[3] = {0, 0, 0}, sum_g[3] = {0, 0, 0};
+    for (j = 0; j < d->n_batch; j++) {
+        for (i = 0; i < 3; i++) {
+            sum_a[i] += d->batch[j].a[i];
+            sum_g[i] += d->batch[j].g[i];
+        }
+    }
+    for (i = 0; i < 3; i++) {
+        d->mean[MPU_RAW_AX + i] = sum_a[i] * IMU_VOTE_SCALE / d->n_batch;
+        d->mean[MPU_RAW_GX + i] = sum_g[i] * IMU_VOTE_SCALE / d->n_batch;
+    }
+    // Samples are evenly spaced.
+    const struct MPUSample *first = &d->batch[0], *last = &d->batch[d->n_batch - 1];
+    d->timestamp_ns = first->timestamp_ns + (last->timestamp_ns - first->timestamp_ns) / 2;
+}
+
+/**
+ * @brief Check if readings look like a dead chip or bus, every accelerometer
+ * and gyroscope axis the same, e.g. all 0x00 or all 0xff.
+ * 
+ * @param d 
+ *      The MPU.
+ * @return True if dead else false.
+ */
+static bool imu_is_dead(const struct IMUDevice *d) {
+    int i;
+    for (i = 1; i < 6; i++) {
+        if (d->mean[MPU_RAW_AX + i] != d->mean[MPU_RAW_AX]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Get median of a few values, mean of the middle two if even.
+ * 
+ * @param v 
+ *      Values, sorted in place.
+ * @param n 
+ *      Number of values, at least 1.
+ * @return Median.
+ */
+static int32_t imu_median(int32_t *v, int n) {
+    int i, j;
+    for (i = 1; i < n; i++) {
+        int32_t x = v[i];
+        for (j = i; j > 0 && v[j - 1] > x; j--) {
+            v[j] = v[j - 1];
+        }
+        v[j] = x;
+    }
+    return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+/**
+ * @brief Count a loop of an MPU as faulty or good. MPUs are dropped after
+ * IMU_FAULT_LOOPS faulty loops and taken back after IMU_RECOVER_LOOPS good ones.
+ * 
+ * @param index 
+ *      Index of MPU.
+ * @param fault 
+ *      True if faulty in this loop.
+ */
+static void imu_update_health(int index, bool fault) {
+    struct IMUDevice *d = &_devices[index];
+    if (fault) {
+        d->faults++;
+        d->good_loops = 0;
+        if (++d->bad_loops == IMU_FAULT_LOOPS && d->healthy) {
+            LOG_ERROR("MPU %d on %s is faulty.\n", index, d->path);
+            d->healthy = false;
+        }
+    } else {
+        d->bad_loops = 0;
+        if (++d->good_loops == IMU_RECOVER_LOOPS && !d->healthy) {
+            LOG("MPU %d on %s recovered.\n", index, d->path);
+            d->healthy = true;
+        }
+    }
+}
+
+/**
+ * @brief Detect faulty MPUs, fail over if the primary one is dropped, and
+ * pick the readings of this loop. 3 or more healthy MPUs vote by median of
+ * each axis, and the ones far from it are faulty. With fewer, only dead or
+ * unreadable MPUs are detected and the primary one is used.
+ * 
+ * @param sel 
+ *      Set to the picked means in 1/IMU_VOTE_SCALE counts, indexed by MPU_RAW_*.
+ * @param timestamp_ns 
+ *      Set to the time the picked means were sampled.
+ * @return True if sel is set, false if no MPU was read in this loop.
+ */
+static bool imu_vote(int32_t sel[MPU_RAW_AXES], uint64_t *timestamp_ns) {
+    int voters[IMU_MAX_DEVICES];
+    bool fault[IMU_MAX_DEVICES];
+    int i, k, n = 0;
+    for (i = 0; i < _n_devices; i++) {
+        fault[i] = !_devices[i].valid;
+        if (fault[i]) {
+            continue;
+        }
+        imu_update_mean(&_devices[i]);
+        if ((fault[i] = imu_is_dead(&_devices[i]))) {
+            continue;
+        }
+        if (_devices[i].healthy) {
+            voters[n++] = i;
+        }
+    }
+
+    //----- Distance from median of the healthy ones.
+    int32_t limit[6];
+    for (k = 0; k < 3; k++) {
+        limit[MPU_RAW_AX + k] = IMU_VOTE_ACCEL_G * mpu_get_accel_scale(_devices[0].mpu) * IMU_VOTE_SCALE;
+        limit[MPU_RAW_GX + k] = IMU_VOTE_GYRO_DPS * mpu_get_gyro_scale(_devices[0].mpu) * IMU_VOTE_SCALE;
+    }
+    bool disagree = false;
+    for (k = 0; k < 6 && n >= 2; k++) {
+        int32_t v[IMU_MAX_DEVICES];
+        for (i = 0; i < n; i++) {
+            v[i] = _devices[voters[i]].mean[k];
+        }
+        sel[k] = imu_median(v, n);
+        for (i = 0; i < _n_devices; i++) {
+            if (fault[i] || ABS(_devices[i].mean[k] - sel[k]) <= limit[k]) {
+                continue;
+            }
+            if (n >= 3 || !_devices[i].healthy) {
+                fault[i] = true;
+            } else {
+                // Either of two can be wrong.
+                disagree = true;
+            }
+        }
+    }
+    if (disagree != _disagree) {
+        if (disagree) {
+            LOG_ERROR("MPUs disagree, keeping MPU %d.\n", _primary);
+        }
+        _disagree = disagree;
+    }
+
+    //----- Health and failover.
+    for (i = 0; i < _n_devices; i++) {
+        imu_update_health(i, fault[i]);
+    }
+    if (!_devices[_primary].healthy) {
+        for (i = 0; i < _n_devices; i++) {
+            if (_devices[i].healthy) {
+                LOG_ERROR("Failing over from MPU %d to MPU %d.\n", _primary, i);
+                _primary = i;
+                _failovers++;
+                break;
+            }
+        }
+    }
+
+    //----- Pick readings.
+    int src = -1;
+    if (n < 3) {
+        // Primary, else any MPU read fine until health catches up.
+        if (!fault[_primary]) {
+            src = _primary;
+        }
+        for (i = 0; i < _n_devices && src < 0; i++) {
+            if (!fault[i]) {
+                src = i;
+            }
+        }
+        if (src < 0) {
+            return false;
+        }
+        for (k = 0; k < 6; k++) {
+            sel[k] = _devices[src].mean[k];
+        }
+    } else {
+        // Medians mix MPUs sampled in the same batch, the primary's time stands for them.
+        src = fault[_primary] ? voters[0] : _primary;
+    }
+    *timestamp_ns = _devices[src].timestamp_ns;
+    for (k = MPU_RAW_MX; k < MPU_RAW_MX + 3; k++) {
+        sel[k] = _devices[0].mean[k];
+    }
+    return true;
+}
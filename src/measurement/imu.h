@@ -2,6 +2,9 @@
 #define _IMU_H_
 
 #include <stdbool.h>
+#include <stdint.h>
+
+struct MPUSample;
 
 int imu_init();
 
@@ -13,6 +16,24 @@ void imu_set_mag_enable(bool enable);
 
 bool imu_mag_is_enabled();
 
+int imu_get_batch(const struct MPUSample **samples);
+
+int imu_get_device_count();
+
+int imu_get_primary();
+
+unsigned int imu_get_failovers();
+
+bool imu_device_is_healthy(int index);
+
+void imu_dump();
+
+bool imu_data_ready_is_enabled();
+
+int imu_wait_sample(int timeout_ms, uint64_t *timestamp_ns);
+
+uint64_t imu_get_timestamp_ns();
+
 float imu_get_ax();
 float imu_get_ay();
 float imu_get_az();
@@ -0,0 +1,181 @@
+#include "imu_transform.h"
+
+#include <stdlib.h>
+
+// #define IMU_TRANSFORM_USE_SCALAR // Uncomment to use the scalar kernel even if SSE2 is available.
+
+// x86 only, there's no NEON kernel and ARM builds take the scalar one.
+#if defined(__SSE2__) && !defined(IMU_TRANSFORM_USE_SCALAR)
+#include <emmintrin.h>
+#define IMU_TRANSFORM_SSE
+typedef __m128 imu_vec_t;
+// Converted counts of output axes i ~ i + 3, gathered in registers.
+#define IMU_VEC_GATHER(raw, s, i) _mm_cvtepi32_ps(_mm_set_epi32((raw)[(s)[(i) + 3]], (raw)[(s)[(i) + 2]], (raw)[(s)[(i) + 1]], (raw)[(s)[i]]))
+#define IMU_VEC_MUL_N(v, k) _mm_mul_ps(v, _mm_set1_ps(k))
+#endif
+
+struct IMUTransform {
+    int source[IMU_TRANSFORM_LANES]; // Raw axis of each output axis, padding reads axis 0 with scale 0.
+    float scale[IMU_TRANSFORM_LANES]; // Sign and unit of each output axis.
+    float gain[IMU_TRANSFORM_LANES]; // Calibration gain.
+    float bias[IMU_TRANSFORM_LANES]; // Calibration bias, subtracted after gain.
+};
+
+#if defined(IMU_TRANSFORM_SSE)
+static inline void imu_transform_lanes(const struct IMUTransform *t, int i, imu_vec_t v, float *raw_out, float *cal_out);
+#else
+static inline void imu_transform_axis(const struct IMUTransform *t, int i, float v, float *raw_out, float *cal_out);
+#endif
+
+//-----
+
+/**
+ * @brief Initiator of IMUTransform, every axis maps to itself with scale 1
+ * and no calibration.
+ * 
+ * @return Address of newly created IMUTransform, NULL if fail.
+ */
+struct IMUTransform *imu_transform_init() {
+    struct IMUTransform *t = malloc(sizeof(struct IMUTransform));
+    if (t == NULL) {
+        return NULL;
+    }
+    int i;
+    for (i = 0; i < IMU_TRANSFORM_LANES; i++) {
+        t->source[i] = i < IMU_TRANSFORM_AXES ? i : 0;
+        t->scale[i] = i < IMU_TRANSFORM_AXES ? 1.0f : 0.0f;
+        t->gain[i] = 1.0f;
+        t->bias[i] = 0.0f;
+    }
+    return t;
+}
+
+/**
+ * @brief Destroy IMUTransform.
+ * 
+ * @param t 
+ */
+void imu_transform_destroy(struct IMUTransform *t) {
+    free(t);
+}
+
+/**
+ * @brief Set where an output axis comes from.
+ * 
+ * @param t 
+ * @param axis 
+ *      Output axis, 0 ~ IMU_TRANSFORM_AXES - 1.
+ * @param source 
+ *      Raw axis, 0 ~ IMU_TRANSFORM_AXES - 1.
+ * @param scale 
+ *      Multiplied to raw counts, negative to flip the axis.
+ */
+void imu_transform_set_axis(struct IMUTransform *t, int axis, int source, float scale) {
+    t->source[axis] = source;
+    t->scale[axis] = scale;
+}
+
+/**
+ * @brief Set calibration of an output axis.
+ * 
+ * @param t 
+ * @param axis 
+ *      Output axis, 0 ~ IMU_TRANSFORM_AXES - 1.
+ * @param gain 
+ *      Multiplied to scaled value.
+ * @param bias 
+ *      Subtracted after gain.
+ */
+void imu_transform_set_calibration(struct IMUTransform *t, int axis, float gain, float bias) {
+    t->gain[axis] = gain;
+    t->bias[axis] = bias;
+}
+
+/**
+ * @brief Convert one raw block.
+ * 
+ * @param t 
+ * @param raw 
+ *      IMU_TRANSFORM_AXES raw counts.
+ * @param raw_out 
+ *      Remapped and scaled values, IMU_TRANSFORM_LANES long.
+ * @param cal_out 
+ *      Calibrated values, IMU_TRANSFORM_LANES long.
+ */
+void imu_transform_apply(const struct IMUTransform *t, const int16_t *raw, float *raw_out, float *cal_out) {
+    int i;
+#if defined(IMU_TRANSFORM_SSE)
+    for (i = 0; i < IMU_TRANSFORM_LANES; i += 4) {
+        imu_transform_lanes(t, i, IMU_VEC_GATHER(raw, t->source, i), raw_out, cal_out);
+    }
+#else
+    for (i = 0; i < IMU_TRANSFORM_AXES; i++) {
+        imu_transform_axis(t, i, (float)raw[t->source[i]], raw_out, cal_out);
+    }
+#endif
+}
+
+/**
+ * @brief Convert the mean of several raw blocks, e.g. samples drained from FIFO.
+ * 
+ * @param t 
+ * @param sum 
+ *      IMU_TRANSFORM_AXES sums of raw counts.
+ * @param n 
+ *      Number of blocks in every sum.
+ * @param raw_out 
+ *      Remapped and scaled values, IMU_TRANSFORM_LANES long.
+ * @param cal_out 
+ *      Calibrated values, IMU_TRANSFORM_LANES long.
+ */
+void imu_transform_apply_sum(const struct IMUTransform *t, const int32_t *sum, int n, float *raw_out, float *cal_out) {
+    float k = 1.0f / n;
+    int i;
+#if defined(IMU_TRANSFORM_SSE)
+    for (i = 0; i < IMU_TRANSFORM_LANES; i += 4) {
+        imu_transform_lanes(t, i, IMU_VEC_MUL_N(IMU_VEC_GATHER(sum, t->source, i), k), raw_out, cal_out);
+    }
+#else
+    for (i = 0; i < IMU_TRANSFORM_AXES; i++) {
+        imu_transform_axis(t, i, (float)sum[t->source[i]] * k, raw_out, cal_out);
+    }
+#endif
+}
+
+//-----
+
+#if defined(IMU_TRANSFORM_SSE)
+/**
+ * @brief Scale and calibrate 4 axes at once.
+ * 
+ * @param t 
+ * @param i 
+ *      First output axis, multiple of 4.
+ * @param v 
+ *      Counts of output axes i ~ i + 3.
+ * @param raw_out 
+ * @param cal_out 
+ */
+static inline void imu_transform_lanes(const struct IMUTransform *t, int i, imu_vec_t v, float *raw_out, float *cal_out) {
+    v = _mm_mul_ps(v, _mm_loadu_ps(t->scale + i));
+    _mm_storeu_ps(raw_out + i, v);
+    _mm_storeu_ps(cal_out + i, _mm_sub_ps(_mm_mul_ps(v, _mm_loadu_ps(t->gain + i)), _mm_loadu_ps(t->bias + i)));
+}
+#else
+/**
+ * @brief Scale and calibrate one axis.
+ * 
+ * @param t 
+ * @param i 
+ *      Output axis.
+ * @param v 
+ *      Counts of output axis i.
+ * @param raw_out 
+ * @param cal_out 
+ */
+static inline void imu_transform_axis(const struct IMUTransform *t, int i, float v, float *raw_out, float *cal_out) {
+    v *= t->scale[i];
+    raw_out[i] = v;
+    cal_out[i] = v * t->gain[i] - t->bias[i];
+}
+#endif
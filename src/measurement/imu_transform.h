@@ -0,0 +1,41 @@
+/**
+ * @file imu_transform.h
+ * @author agent
+ * @brief Conversion of raw IMU counts to calibrated values.
+ * One call maps every axis of accelerometer, gyroscope and magnetometer:
+ *      raw_out[i] = raw[source[i]] * scale[i]
+ *      cal_out[i] = raw_out[i] * gain[i] - bias[i]
+ * source and the sign of scale remap the board axes, scale also converts
+ * units, gain and bias are the calibration. The only vector kernel is
+ * SSE2 on x86, e.g. for sim and replay on a PC. ARM, including the
+ * Raspberry Pi flight target, runs the scalar kernel.
+ * 
+ * @version 0.1
+ * @date 2026-10-17
+ * 
+ * @copyright Copyright (c) 2026
+ * 
+ */
+#ifndef _IMU_TRANSFORM_H_
+#define _IMU_TRANSFORM_H_
+
+#include <stdint.h>
+
+#define IMU_TRANSFORM_AXES 9 // Accelerometer, gyroscope and magnetometer, X,Y,Z each.
+#define IMU_TRANSFORM_LANES 12 // Length of output arrays, rounded up to an SSE2 vector. Scalar kernel leaves padding untouched.
+
+struct IMUTransform;
+
+struct IMUTransform *imu_transform_init();
+
+void imu_transform_destroy(struct IMUTransform *t);
+
+void imu_transform_set_axis(struct IMUTransform *t, int axis, int source, float scale);
+
+void imu_transform_set_calibration(struct IMUTransform *t, int axis, float gain, float bias);
+
+void imu_transform_apply(const struct IMUTransform *t, const int16_t *raw, float *raw_out, float *cal_out);
+
+void imu_transform_apply_sum(const struct IMUTransform *t, const int32_t *sum, int n, float *raw_out, float *cal_out);
+
+#endif // _IMU_TRANSFORM_H_
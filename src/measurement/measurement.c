@@ -1,19 +1,21 @@
 #include "measurement.h"
 #include "calibration.h"
 #include "util/logger.h"
+#include "util/system/boot.h"
 
 /**
  * @brief This function will initiate all modules which are able to initiate in measurement.
+ * IMU on SPI and barometer on I2C are initiated in parallel.
  * 
  * @return 0 if success else -1.
  */
 int measurement_init() {
-    if (imu_init() != 0) {
-        LOG_ERROR("Failed to initiate IMU.\n");
-        return -1;
-    }
-    if (barometer_init() != 0) {
-        LOG_ERROR("Failed to initiate Altitude.\n");
+    static const struct BootStep sensors[] = {
+        {"imu", imu_init},
+        {"barometer", barometer_init}
+    };
+    if (boot_run_parallel(sensors, sizeof(sensors) / sizeof(sensors[0])) != 0) {
+        LOG_ERROR("Failed to initiate sensors.\n");
         return -1;
     }
     if (battery_init() != 0) {
@@ -35,6 +37,8 @@ void measurement_update() {
     barometer_update();
     
     imu_update();
+    // Every stage is stamped with the time readings were sampled, not processed.
+    uint64_t timestamp_ns = imu_get_timestamp_ns();
     
     if(imu_mag_data_is_updated()) {
         ahrs_update_9(
@@ -46,7 +50,8 @@ void measurement_update() {
             imu_get_gz(),
             imu_get_mx(),
             imu_get_my(),
-            imu_get_mz()
+            imu_get_mz(),
+            timestamp_ns
         );
     } else {
         ahrs_update_6(
@@ -55,21 +60,24 @@ void measurement_update() {
             imu_get_az(),
             imu_get_gx(),
             imu_get_gy(),
-            imu_get_gz()
+            imu_get_gz(),
+            timestamp_ns
         );
     }
     if (calibration_gyro_gathering_is_enabled()) {
         calibration_gather_raw_gyro(
             imu_get_raw_gx(),
             imu_get_raw_gy(),
-            imu_get_raw_gz());
+            imu_get_raw_gz(),
+            timestamp_ns);
     }
     if (calibration_mag_gathering_is_enabled()) {
         if (imu_mag_data_is_updated()) {
             calibration_gather_raw_mag(
                 imu_get_raw_mx(),
                 imu_get_raw_my(),
-                imu_get_raw_mz());
+                imu_get_raw_mz(),
+                timestamp_ns);
         }
     }
     battery_update();
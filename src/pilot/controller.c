@@ -22,6 +22,12 @@
 #define PIN_M4_CW  13
 #define PIN_M4_CCW 6
 
+#define MOTOR_GPIO_CHIP "/dev/gpiochip0" // "/dev/gpiomem" sets pins without syscall.
+
+// Bit of each direction pin in _motor_lines. Motor index from 0 to 3.
+#define LINE_CW(m)  (1ULL << (2 * (m)))
+#define LINE_CCW(m) (1ULL << (2 * (m) + 1))
+
 /**
  * All controlling diagram:
  * Altitude
@@ -62,6 +68,15 @@ static float _output_pid_alt;  // Output of altitude hold PID
 
 //----- Variables
 
+static const int _motor_pins[8] = {
+    PIN_M1_CW, PIN_M1_CCW,
+    PIN_M2_CW, PIN_M2_CCW,
+    PIN_M3_CW, PIN_M3_CCW,
+    PIN_M4_CW, PIN_M4_CCW
+};
+
+static struct GPIOLines *_motor_lines; // Direction pins of all motors.
+
 void load_param_ax();
 void load_param_ay();
 void load_param_az();
@@ -179,22 +194,11 @@ int controller_init() {
     pca_set_frequency(freq);
 
     LOG("Initiating GPIO.\n");
-    gpio_set_export(PIN_M1_CCW);
-    gpio_set_export(PIN_M1_CW);
-    gpio_set_export(PIN_M2_CCW);
-    gpio_set_export(PIN_M2_CW);
-    gpio_set_export(PIN_M3_CCW);
-    gpio_set_export(PIN_M3_CW);
-    gpio_set_export(PIN_M4_CCW);
-    gpio_set_export(PIN_M4_CW);
-    gpio_set_direction(PIN_M1_CW, "out");
-    gpio_set_direction(PIN_M1_CCW, "out");
-    gpio_set_direction(PIN_M2_CW, "out");
-    gpio_set_direction(PIN_M2_CCW, "out");
-    gpio_set_direction(PIN_M3_CW, "out");
-    gpio_set_direction(PIN_M3_CCW, "out");
-    gpio_set_direction(PIN_M4_CW, "out");
-    gpio_set_direction(PIN_M4_CCW, "out");
+    _motor_lines = gpio_lines_request(MOTOR_GPIO_CHIP, _motor_pins, 8, "raspi-pilot");
+    if (_motor_lines == NULL) {
+        LOG_ERROR("Failed to request motor direction pins.\n");
+        return -1;
+    }
 
     LOG("Done.\n");
     return 0;
@@ -220,36 +224,26 @@ void controller_update(uint8_t mode, float thr, float avz, float heading) {
         _thr[2] = LIMIT_MAX_MIN(_thr[2], 100.0, -100.0);
         _thr[3] = LIMIT_MAX_MIN(_thr[3], 100.0, -100.0);
 
-        pca_write_throttle(0, fabsf(_thr[0]));
-        pca_write_throttle(1, fabsf(_thr[1]));
-        pca_write_throttle(2, fabsf(_thr[2]));
-        pca_write_throttle(3, fabsf(_thr[3]));
+        // Every motor in one transfer.
+        float abs_thr[4] = {fabsf(_thr[0]), fabsf(_thr[1]), fabsf(_thr[2]), fabsf(_thr[3])};
+        pca_write_throttle_range(0, abs_thr, 4);
         
         // Turn on direction.
         static uint32_t prev_thr[4]; // Be used to detect direction change.
-        
-        if ((prev_thr[0] ^ *(uint32_t*)&_thr[0]) & 0x80000000) {
-
-            gpio_write(PIN_M1_CW,  _thr[0] > 0 ? 1 : 0);
-            gpio_write(PIN_M1_CCW, _thr[0] > 0 ? 0 : 1);
+        uint64_t dir_mask = 0; // Direction pins to update.
+        uint64_t dir_values = 0; // New values of direction pins.
+        int i;
+        for (i = 0; i < 4; i++) {
+            if ((prev_thr[i] ^ *(uint32_t*)&_thr[i]) & 0x80000000) {
+                // Motor 3 and 4 are mounted reversed.
+                bool cw = i < 2 ? _thr[i] > 0 : !(_thr[i] > 0);
+                dir_mask |= LINE_CW(i) | LINE_CCW(i);
+                dir_values |= cw ? LINE_CW(i) : LINE_CCW(i);
+            }
         }
-
-        if ((prev_thr[1] ^ *(uint32_t*)&_thr[1]) & 0x80000000) {
-
-            gpio_write(PIN_M2_CW,  _thr[1] > 0 ? 1 : 0);
-            gpio_write(PIN_M2_CCW, _thr[1] > 0 ? 0 : 1);
-        }
-        
-        if ((prev_thr[2] ^ *(uint32_t*)&_thr[2]) & 0x80000000) {
-
-            gpio_write(PIN_M3_CW,  _thr[2] > 0 ? 0 : 1);
-            gpio_write(PIN_M3_CCW, _thr[2] > 0 ? 1 : 0);
-        }
-
-        if ((prev_thr[3] ^ *(uint32_t*)&_thr[3]) & 0x80000000) {
-
-            gpio_write(PIN_M4_CW,  _thr[3] > 0 ? 0 : 1);
-            gpio_write(PIN_M4_CCW, _thr[3] > 0 ? 1 : 0);
+        if (dir_mask != 0) {
+            // Every changed pin in one write.
+            gpio_lines_write(_motor_lines, dir_mask, dir_values);
         }
 
         prev_thr[0] = *(uint32_t*)&_thr[0];
@@ -258,10 +252,10 @@ void controller_update(uint8_t mode, float thr, float avz, float heading) {
         prev_thr[3] = *(uint32_t*)&_thr[3];
 
     } else {
-        pca_write_pwm(0, 0);
-        pca_write_pwm(1, 0);
-        pca_write_pwm(2, 0);
-        pca_write_pwm(3, 0);
+        // Same range as above so a pending throttle is replaced. ALL_LED_OFF
+        // would stop the gimbal servo too.
+        static const int zeros[4] = {0, 0, 0, 0};
+        pca_write_pwm_range(0, zeros, 4);
     }
 }
 
@@ -277,8 +271,7 @@ void controller_reset() {
     pid_reset(pidsetting_avz);
     pid_reset(pidsetting_va);
     pid_reset(pidsetting_alt);
-    gpio_write(PIN_M1_CW, 0);
-    gpio_write(PIN_M1_CCW, 0);
+    gpio_lines_write(_motor_lines, LINE_CW(0) | LINE_CCW(0), 0);
 }
 
 //-----
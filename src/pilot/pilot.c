@@ -6,6 +6,7 @@
 #include "util/debug.h"
 #include "util/macro.h"
 #include "util/parameter.h"
+#include "util/tv.h"
 
 #include "driver/pca9685.h"
 #include "mavlink/mavlink_main.h"
@@ -19,6 +20,7 @@
 
 #define DEFAULT_MODE PILOT_MODE_PREFLIGHT
 #define DEAD_BAND 50
+#define NOD_USEC 1000000 // Time camera stays up when nodding at init.
 
 static int _mode = DEFAULT_MODE;
 static bool _heading_is_locked;
@@ -40,6 +42,8 @@ static float _avz_range; // Range of angular velocity z.
 static int _deadband; // Manual control deadband.
 static float _gimbal_velocity_x;
 static float _gimbal_position_x;
+static bool _nodding; // True while camera nods after init.
+static struct timeval _nod_tv; // Time the nod began.
 
 //-----
 
@@ -89,10 +93,11 @@ int pilot_init(){
     _prev_btn_state = 0;
     LOG("Done.\n");
 
-    // Nod the camera.
-    pca_write_servo(15, 2000);
-    usleep(1000000);
-    pca_write_servo(15, 1000);
+    // Nod the camera, pilot_update brings it back so init doesn't wait.
+    _gimbal_position_x = 2000.0f;
+    pca_write_servo(15, _gimbal_position_x);
+    gettimeofday(&_nod_tv, NULL);
+    _nodding = true;
     
     //----- Ready
     pilot_set_mode(PILOT_MODE_STABILIZE);
@@ -115,10 +120,21 @@ void pilot_update(){
     } 
     
     // Control the gimbal
+    if (_nodding) {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        if (tv_get_diff_usec_ul(&_nod_tv, &now) >= NOD_USEC) {
+            _gimbal_position_x = 1000.0f;
+            _nodding = false;
+        }
+    }
     _gimbal_position_x += _gimbal_velocity_x * loop_get_interval();
     _gimbal_position_x = LIMIT_MAX_MIN(_gimbal_position_x, 2000, 1000);
     pca_write_servo(15, _gimbal_position_x);
 
+    // Outputs deferred to the next PWM period go out here.
+    pca_commit();
+
     pilot_unlock_mutex();
     
     if (pilot_is_armed() && mavlink_get_active_connections() == 0) {
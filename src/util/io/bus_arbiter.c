@@ -0,0 +1,220 @@
+#include "bus_arbiter.h"
+#include "bus_stats.h"
+
+#include "util/logger.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+struct BusArbiterCounter {
+    uint64_t calls;
+    uint64_t contended;
+    uint64_t total_wait_ns;
+    uint64_t max_wait_ns;
+};
+
+struct BusArbiter {
+    char path[BUS_STATS_NAME_LEN]; // Path of bus.
+    pthread_mutex_t mutex; // Priority inheriting lock held during a transfer.
+    int waiting[BUS_PRIORITY_COUNT]; // Threads waiting for the bus in each class.
+    struct BusArbiterCounter counters[BUS_PRIORITY_COUNT]; // Written while holding mutex, with atomic stores for readers.
+};
+
+static struct BusArbiter _arbiters[BUS_ARBITER_MAX_BUSES]; // Never released.
+static int _n_arbiters; // Number of arbiters created.
+
+static __thread enum BUS_PRIORITY _priority = BUS_PRIORITY_NORMAL; // Class of calling thread.
+
+static pthread_mutex_t _arbiters_mutex = PTHREAD_MUTEX_INITIALIZER; // Guards creation only.
+
+static bool bus_arbiter_is_preempted(struct BusArbiter *a, enum BUS_PRIORITY priority);
+
+//-----
+
+/**
+ * @brief Get the arbiter of bus. Getting the same path again returns the same arbiter.
+ * 
+ * @param path 
+ *      Path of bus. e.g. "/dev/i2c-1".
+ * @return Arbiter, NULL if too many buses.
+ */
+struct BusArbiter *bus_arbiter_get(const char *path) {
+    struct BusArbiter *a = NULL;
+    pthread_mutex_lock(&_arbiters_mutex);
+    int i;
+    for (i = 0; i < _n_arbiters; i++) {
+        if (strcmp(_arbiters[i].path, path) == 0) {
+            a = &_arbiters[i];
+            goto EXIT;
+        }
+    }
+    if (_n_arbiters >= BUS_ARBITER_MAX_BUSES) {
+        LOG_ERROR("Too many buses.\n");
+        goto EXIT;
+    }
+    a = &_arbiters[_n_arbiters];
+    strncpy(a->path, path, sizeof(a->path) - 1);
+    a->path[sizeof(a->path) - 1] = '\0';
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+    pthread_mutex_init(&a->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    __atomic_store_n(&_n_arbiters, _n_arbiters + 1, __ATOMIC_RELEASE);
+
+    EXIT:
+    pthread_mutex_unlock(&_arbiters_mutex);
+    return a;
+}
+
+/**
+ * @brief Set priority class of calling thread.
+ * 
+ * @param priority 
+ *      Class of every transfer made by calling thread afterward.
+ */
+void bus_arbiter_set_priority(enum BUS_PRIORITY priority) {
+    _priority = priority;
+}
+
+/**
+ * @brief Get priority class of calling thread.
+ * 
+ * @return Class of calling thread.
+ */
+enum BUS_PRIORITY bus_arbiter_get_priority() {
+    return _priority;
+}
+
+/**
+ * @brief Take the bus for one transfer. Not recursive.
+ * 
+ * @param a 
+ *      Arbiter of bus, NULL to do nothing.
+ */
+void bus_arbiter_lock(struct BusArbiter *a) {
+    if (a == NULL) {
+        return;
+    }
+    enum BUS_PRIORITY priority = _priority;
+    struct BusArbiterCounter *c = &a->counters[priority];
+    if (!bus_arbiter_is_preempted(a, priority) && pthread_mutex_trylock(&a->mutex) == 0) {
+        // Fast path, nobody else wants the bus.
+        __atomic_store_n(&c->calls, c->calls + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    uint64_t begin = bus_stats_begin();
+    __atomic_add_fetch(&a->waiting[priority], 1, __ATOMIC_SEQ_CST);
+    while (1) {
+        pthread_mutex_lock(&a->mutex);
+        if (!bus_arbiter_is_preempted(a, priority)) {
+            break;
+        }
+        // Let the more urgent transfer go first.
+        pthread_mutex_unlock(&a->mutex);
+        sched_yield();
+    }
+    __atomic_sub_fetch(&a->waiting[priority], 1, __ATOMIC_SEQ_CST);
+
+    uint64_t wait = bus_stats_begin() - begin;
+    __atomic_store_n(&c->calls, c->calls + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->contended, c->contended + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->total_wait_ns, c->total_wait_ns + wait, __ATOMIC_RELAXED);
+    if (wait > c->max_wait_ns) {
+        __atomic_store_n(&c->max_wait_ns, wait, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Release the bus.
+ * 
+ * @param a 
+ *      Arbiter of bus, NULL to do nothing.
+ */
+void bus_arbiter_unlock(struct BusArbiter *a) {
+    if (a == NULL) {
+        return;
+    }
+    pthread_mutex_unlock(&a->mutex);
+}
+
+/**
+ * @brief Get number of arbiters.
+ * 
+ * @return Number of arbiters.
+ */
+int bus_arbiter_count() {
+    return __atomic_load_n(&_n_arbiters, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Get wait statistics of a class on a bus.
+ * Counters are read without locking and may be off by one transfer.
+ * 
+ * @param index 
+ *      0 ~ bus_arbiter_count() - 1.
+ * @param priority 
+ *      Class to report.
+ * @param report 
+ *      Destination.
+ * @return 0 if success else -1.
+ */
+int bus_arbiter_query(int index, enum BUS_PRIORITY priority, struct BusArbiterReport *report) {
+    if (index < 0 || index >= bus_arbiter_count() || priority >= BUS_PRIORITY_COUNT) {
+        return -1;
+    }
+    struct BusArbiterCounter *c = &_arbiters[index].counters[priority];
+    report->path = _arbiters[index].path;
+    report->calls = __atomic_load_n(&c->calls, __ATOMIC_RELAXED);
+    report->contended = __atomic_load_n(&c->contended, __ATOMIC_RELAXED);
+    report->total_wait_ns = __atomic_load_n(&c->total_wait_ns, __ATOMIC_RELAXED);
+    report->max_wait_ns = __atomic_load_n(&c->max_wait_ns, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * @brief Print wait statistics of every bus to stdout.
+ * Not async-signal-safe, a signal handler should only request the dump.
+ */
+void bus_arbiter_dump() {
+    static const char *class_names[BUS_PRIORITY_COUNT] = {"control", "normal", "background"};
+
+    printf("%-24s %-10s %10s %10s %9s %9s (us)\n",
+        "bus", "class", "calls", "contended", "avg wait", "max wait");
+
+    int i, p, n = bus_arbiter_count();
+    for (i = 0; i < n; i++) {
+        for (p = 0; p < BUS_PRIORITY_COUNT; p++) {
+            struct BusArbiterReport r;
+            if (bus_arbiter_query(i, p, &r) != 0 || r.calls == 0) {
+                continue;
+            }
+            printf("%-24s %-10s %10llu %10llu %9.1f %9.1f\n",
+                r.path, class_names[p],
+                (unsigned long long)r.calls, (unsigned long long)r.contended,
+                r.contended ? r.total_wait_ns / 1000.0 / r.contended : 0.0, r.max_wait_ns / 1000.0);
+        }
+    }
+    fflush(stdout);
+}
+
+//-----
+
+/**
+ * @brief Check if a more urgent class is waiting for the bus.
+ * 
+ * @return True if the bus should be left to others.
+ */
+static bool bus_arbiter_is_preempted(struct BusArbiter *a, enum BUS_PRIORITY priority) {
+    int p;
+    for (p = 0; p < (int)priority; p++) {
+        if (__atomic_load_n(&a->waiting[p], __ATOMIC_SEQ_CST) > 0) {
+            return true;
+        }
+    }
+    return false;
+}
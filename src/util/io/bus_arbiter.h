@@ -0,0 +1,57 @@
+/**
+ * @file bus_arbiter.h
+ * @author agent
+ * @brief Arbitration of buses shared by several threads.
+ * Each bus has a priority inheriting lock held for one transfer, so a low
+ * priority thread holding the bus is boosted while the control loop waits.
+ * Every thread has a priority class. A transfer waits while a transfer of
+ * a more urgent class is waiting for the same bus.
+ * 
+ * @version 0.1
+ * @date 2026-10-17
+ * 
+ * @copyright Copyright (c) 2026
+ * 
+ */
+#ifndef _BUS_ARBITER_H_
+#define _BUS_ARBITER_H_
+
+#include <stdint.h>
+
+#define BUS_ARBITER_MAX_BUSES 8
+
+//-----Enums-----
+enum BUS_PRIORITY {
+    BUS_PRIORITY_CONTROL = 0, // Transfers of the control loop and actuator output.
+    BUS_PRIORITY_NORMAL = 1, // Default of every thread.
+    BUS_PRIORITY_BACKGROUND = 2, // Calibration, diagnostics, etc.
+    BUS_PRIORITY_COUNT
+};
+
+struct BusArbiter;
+
+struct BusArbiterReport {
+    const char *path; // Path of bus.
+    uint64_t calls; // Transfers.
+    uint64_t contended; // Transfers that waited for the bus.
+    uint64_t total_wait_ns; // Sum of wait time.
+    uint64_t max_wait_ns; // Longest wait.
+};
+
+struct BusArbiter *bus_arbiter_get(const char *path);
+
+void bus_arbiter_set_priority(enum BUS_PRIORITY priority);
+
+enum BUS_PRIORITY bus_arbiter_get_priority();
+
+void bus_arbiter_lock(struct BusArbiter *a);
+
+void bus_arbiter_unlock(struct BusArbiter *a);
+
+int bus_arbiter_count();
+
+int bus_arbiter_query(int index, enum BUS_PRIORITY priority, struct BusArbiterReport *report);
+
+void bus_arbiter_dump();
+
+#endif // _BUS_ARBITER_H_
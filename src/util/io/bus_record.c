@@ -0,0 +1,118 @@
+#include "bus_record.h"
+
+#include "util/logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define BUS_RECORD_BUFFER 65536 // stdio buffer of the file.
+
+static FILE *_file; // Recording file, NULL if not recording.
+static bool _enabled; // True while recording.
+static bool _announced[BUS_STATS_MAX_DEVICES]; // True if device record is written.
+static uint64_t _prev_ns; // Time of previous transfer.
+
+static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Start recording every transfer to file.
+ * Recording stops at exit.
+ * 
+ * @param path 
+ *      Path of recording file, overwritten if exists.
+ * @return 0 if success else -1.
+ */
+int bus_record_start(const char *path) {
+    pthread_mutex_lock(&_mutex);
+    int ret = -1;
+    if (_file != NULL) {
+        LOG_ERROR("Already recording.\n");
+        goto EXIT;
+    }
+    if ((_file = fopen(path, "wb")) == NULL) {
+        LOG_ERROR("Failed to open \"%s\".\n", path);
+        goto EXIT;
+    }
+    setvbuf(_file, NULL, _IOFBF, BUS_RECORD_BUFFER);
+
+    uint8_t header[BUS_RECORD_HEADER_SIZE] = {0};
+    memcpy(header, BUS_RECORD_MAGIC, 4);
+    header[4] = BUS_RECORD_VERSION & 0xff;
+    header[5] = BUS_RECORD_VERSION >> 8;
+    fwrite(header, 1, sizeof(header), _file);
+
+    memset(_announced, 0, sizeof(_announced));
+    _prev_ns = bus_stats_begin();
+    atexit(bus_record_stop);
+    __atomic_store_n(&_enabled, true, __ATOMIC_RELEASE);
+    LOG("Recording bus transfers to \"%s\".\n", path);
+    ret = 0;
+
+    EXIT:
+    pthread_mutex_unlock(&_mutex);
+    return ret;
+}
+
+/**
+ * @brief Stop recording and close the file.
+ */
+void bus_record_stop() {
+    pthread_mutex_lock(&_mutex);
+    __atomic_store_n(&_enabled, false, __ATOMIC_RELEASE);
+    if (_file != NULL) {
+        fclose(_file);
+        _file = NULL;
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+/**
+ * @brief Append a finished transfer. Returns at once if not recording.
+ * 
+ * @param id 
+ *      Id of device in bus_stats.
+ * @param dir 
+ *      Direction of transfer.
+ * @param reg_addr 
+ *      Register accessed.
+ * @param payload 
+ *      Data written or read, without register address.
+ * @param n 
+ *      Length of payload.
+ */
+void bus_record_transfer(int id, enum BUS_STATS_DIR dir, uint8_t reg_addr, const uint8_t *payload, int n) {
+    if (!__atomic_load_n(&_enabled, __ATOMIC_ACQUIRE) || id < 0 || id >= BUS_STATS_MAX_DEVICES) {
+        return;
+    }
+    pthread_mutex_lock(&_mutex);
+    if (_file == NULL) {
+        goto EXIT;
+    }
+    if (!_announced[id]) {
+        const char *name = bus_stats_get_name(id);
+        uint8_t d[3] = {BUS_RECORD_DEVICE, id, strlen(name)};
+        fwrite(d, 1, sizeof(d), _file);
+        fwrite(name, 1, d[2], _file);
+        _announced[id] = true;
+    }
+    uint64_t now = bus_stats_begin();
+    uint64_t dt_us = (now - _prev_ns) / 1000;
+    if (dt_us > UINT32_MAX) {
+        dt_us = UINT32_MAX;
+    }
+    // Keep the remainder so that timestamps don't drift.
+    _prev_ns = now - (now - _prev_ns) % 1000;
+
+    uint8_t t[BUS_RECORD_TRANSFER_SIZE] = {
+        BUS_RECORD_TRANSFER, id, dir, reg_addr,
+        n & 0xff, (n >> 8) & 0xff,
+        dt_us & 0xff, (dt_us >> 8) & 0xff, (dt_us >> 16) & 0xff, (dt_us >> 24) & 0xff
+    };
+    fwrite(t, 1, sizeof(t), _file);
+    fwrite(payload, 1, n, _file);
+
+    EXIT:
+    pthread_mutex_unlock(&_mutex);
+}
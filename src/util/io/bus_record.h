@@ -0,0 +1,46 @@
+/**
+ * @file bus_record.h
+ * @author agent
+ * @brief Recording of every SPI, I2C and GPIO transfer to a binary file.
+ * The file is replayed by bus_replay.
+ * 
+ * File layout, little endian:
+ *  Header:   magic "RPBR", u16 version, u16 reserved.
+ *  Device:   u8 BUS_RECORD_DEVICE, u8 id, u8 name length, name.
+ *  Transfer: u8 BUS_RECORD_TRANSFER, u8 id, u8 direction, u8 register,
+ *            u16 length, u32 us since previous transfer, payload.
+ * A device record comes before the first transfer of its id. Ids are
+ * those of bus_stats.
+ * 
+ * @version 0.1
+ * @date 2026-10-17
+ * 
+ * @copyright Copyright (c) 2026
+ * 
+ */
+#ifndef _BUS_RECORD_H_
+#define _BUS_RECORD_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bus_stats.h"
+
+#define BUS_RECORD_MAGIC "RPBR"
+#define BUS_RECORD_VERSION 1
+#define BUS_RECORD_HEADER_SIZE 8
+#define BUS_RECORD_TRANSFER_SIZE 10 // Size of transfer record without payload.
+
+//-----Enums-----
+enum BUS_RECORD_TYPE {
+    BUS_RECORD_DEVICE = 1,
+    BUS_RECORD_TRANSFER = 2
+};
+
+int bus_record_start(const char *path);
+
+void bus_record_stop();
+
+void bus_record_transfer(int id, enum BUS_STATS_DIR dir, uint8_t reg_addr, const uint8_t *payload, int n);
+
+#endif // _BUS_RECORD_H_
@@ -0,0 +1,226 @@
+#include "bus_replay.h"
+#include "bus_record.h"
+#include "bus_sim.h"
+
+#include "util/logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct BusReplayTransfer {
+    uint8_t dir; // BUS_STATS_DIR of transfer.
+    uint8_t reg_addr; // Register accessed.
+    uint16_t n; // Length of payload.
+    const uint8_t *payload; // Data in the loaded file.
+};
+
+struct BusReplayDevice {
+    struct BusSimDevice sim; // Model attached to bus_sim, ctx points to this.
+    char name[BUS_STATS_NAME_LEN]; // Recorded name, "path" or "path@0xNN".
+    struct BusReplayTransfer *transfers; // Transfers of this device in order.
+    int n_transfers; // Number of transfers.
+    int cap; // Capacity of transfers.
+    int cursor; // Index after the last read served.
+};
+
+static uint8_t *_data; // Whole recording.
+static struct BusReplayDevice _devices[BUS_STATS_MAX_DEVICES]; // Indexed by recorded id.
+static bool _finished; // True once a read runs past the recording.
+static uint64_t _duration_us; // Recorded time from start to last transfer.
+static struct timespec _start; // Wall time replay started.
+
+static int bus_replay_read(const struct BusSimDevice *dev, uint8_t reg_addr, uint8_t *buffer, int n);
+
+static int bus_replay_write(const struct BusSimDevice *dev, uint8_t reg_addr, const uint8_t *buffer, int n);
+
+static int bus_replay_add(struct BusReplayDevice *d, const struct BusReplayTransfer *t);
+
+static int bus_replay_attach(struct BusReplayDevice *d);
+
+//-----
+
+/**
+ * @brief Load recording and attach its devices to bus_sim.
+ * Call before the drivers open their devices.
+ * 
+ * @param path 
+ *      Path of file written by bus_record.
+ * @return 0 if success else -1.
+ */
+int bus_replay_open(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        LOG_ERROR("Failed to open \"%s\".\n", path);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    _data = malloc(size > 0 ? size : 1);
+    long r_cnt = fread(_data, 1, size, f);
+    fclose(f);
+    if (r_cnt != size || size < BUS_RECORD_HEADER_SIZE) {
+        LOG_ERROR("Failed to read \"%s\".\n", path);
+        goto ERROR;
+    }
+    if (memcmp(_data, BUS_RECORD_MAGIC, 4) != 0 || (_data[4] | _data[5] << 8) != BUS_RECORD_VERSION) {
+        LOG_ERROR("\"%s\" isn't a bus recording of version %d.\n", path, BUS_RECORD_VERSION);
+        goto ERROR;
+    }
+
+    long i = BUS_RECORD_HEADER_SIZE;
+    while (i < size) {
+        uint8_t type = _data[i];
+        if (type == BUS_RECORD_DEVICE && i + 3 <= size && i + 3 + _data[i + 2] <= size) {
+            int id = _data[i + 1];
+            int len = _data[i + 2];
+            if (id >= BUS_STATS_MAX_DEVICES || len >= BUS_STATS_NAME_LEN) {
+                break;
+            }
+            memcpy(_devices[id].name, _data + i + 3, len);
+            _devices[id].name[len] = '\0';
+            i += 3 + len;
+        } else if (type == BUS_RECORD_TRANSFER && i + BUS_RECORD_TRANSFER_SIZE <= size) {
+            const uint8_t *p = _data + i;
+            struct BusReplayTransfer t = {
+                .dir = p[2],
+                .reg_addr = p[3],
+                .n = p[4] | p[5] << 8,
+                .payload = p + BUS_RECORD_TRANSFER_SIZE
+            };
+            if (p[1] >= BUS_STATS_MAX_DEVICES || _devices[p[1]].name[0] == '\0' || i + BUS_RECORD_TRANSFER_SIZE + t.n > size) {
+                break;
+            }
+            _duration_us += (uint32_t)(p[6] | p[7] << 8 | p[8] << 16 | (uint32_t)p[9] << 24);
+            if (bus_replay_add(&_devices[p[1]], &t) != 0) {
+                goto ERROR;
+            }
+            i += BUS_RECORD_TRANSFER_SIZE + t.n;
+        } else {
+            break;
+        }
+    }
+    if (i != size) {
+        // Keep what is parsed, e.g. a recording cut by power loss.
+        LOG_ERROR("Recording is broken at byte %ld, ignoring the rest.\n", i);
+    }
+
+    int id;
+    for (id = 0; id < BUS_STATS_MAX_DEVICES; id++) {
+        if (_devices[id].name[0] != '\0' && bus_replay_attach(&_devices[id]) != 0) {
+            goto ERROR;
+        }
+    }
+    _finished = false;
+    clock_gettime(CLOCK_MONOTONIC, &_start);
+    LOG("Replaying %.3f s of bus transfers from \"%s\".\n", _duration_us * 1e-6, path);
+    return 0;
+
+    ERROR:
+    bus_sim_detach_all();
+    for (id = 0; id < BUS_STATS_MAX_DEVICES; id++) {
+        free(_devices[id].transfers);
+    }
+    memset(_devices, 0, sizeof(_devices));
+    free(_data);
+    _data = NULL;
+    return -1;
+}
+
+/**
+ * @brief Check if a device has been read past the end of the recording.
+ * 
+ * @return True if finished else false.
+ */
+bool bus_replay_is_finished() {
+    return _finished;
+}
+
+/**
+ * @brief Print recorded time and time taken by the replay.
+ */
+void bus_replay_report() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double wall = (now.tv_sec - _start.tv_sec) + (now.tv_nsec - _start.tv_nsec) * 1e-9;
+    double recorded = _duration_us * 1e-6;
+    LOG("Replayed %.3f s of recording in %.3f s (%.1fx).\n", recorded, wall, wall > 0 ? recorded / wall : 0);
+}
+
+//-----
+
+/**
+ * @brief Serve read from the next recorded read of the same register and length.
+ * 
+ * @return 0 if success, -1 if recording is finished.
+ */
+static int bus_replay_read(const struct BusSimDevice *dev, uint8_t reg_addr, uint8_t *buffer, int n) {
+    struct BusReplayDevice *d = dev->ctx;
+    int i;
+    for (i = d->cursor; i < d->n_transfers; i++) {
+        const struct BusReplayTransfer *t = &d->transfers[i];
+        if (t->dir == BUS_STATS_READ && t->reg_addr == reg_addr && t->n == n) {
+            memcpy(buffer, t->payload, n);
+            d->cursor = i + 1;
+            return 0;
+        }
+    }
+    _finished = true;
+    return -1;
+}
+
+/**
+ * @brief Accept write. Written values aren't compared to the recording.
+ * 
+ * @return 0.
+ */
+static int bus_replay_write(const struct BusSimDevice *dev, uint8_t reg_addr, const uint8_t *buffer, int n) {
+    return 0;
+}
+
+/**
+ * @brief Append transfer to device.
+ * 
+ * @return 0 if success else -1.
+ */
+static int bus_replay_add(struct BusReplayDevice *d, const struct BusReplayTransfer *t) {
+    if (d->n_transfers == d->cap) {
+        int cap = d->cap ? d->cap * 2 : 1024;
+        struct BusReplayTransfer *transfers = realloc(d->transfers, cap * sizeof(*transfers));
+        if (transfers == NULL) {
+            LOG_ERROR("Failed to allocate memory.\n");
+            return -1;
+        }
+        d->transfers = transfers;
+        d->cap = cap;
+    }
+    d->transfers[d->n_transfers++] = *t;
+    return 0;
+}
+
+/**
+ * @brief Attach device to bus_sim on its recorded path.
+ * Sysfs GPIO isn't simulated and keeps using the kernel.
+ * 
+ * @return 0 if success else -1.
+ */
+static int bus_replay_attach(struct BusReplayDevice *d) {
+    if (strcmp(d->name, "/sys/class/gpio") == 0) {
+        return 0;
+    }
+    char path[BUS_STATS_NAME_LEN];
+    int dev_addr = BUS_SIM_NO_ADDR;
+    strcpy(path, d->name);
+    char *at = strrchr(path, '@');
+    if (at != NULL) {
+        dev_addr = strtol(at + 1, NULL, 16);
+        *at = '\0';
+    }
+    d->sim.name = d->name;
+    d->sim.read = bus_replay_read;
+    d->sim.write = bus_replay_write;
+    d->sim.ctx = d;
+    return bus_sim_attach(path, dev_addr, &d->sim);
+}
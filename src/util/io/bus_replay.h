@@ -0,0 +1,26 @@
+/**
+ * @file bus_replay.h
+ * @author agent
+ * @brief Replay of a file written by bus_record.
+ * Every recorded device is attached to bus_sim on its original path, so
+ * drivers run unchanged without hardware. A read returns the data of the
+ * next recorded read of the same register and length. Writes are accepted.
+ * 
+ * @version 0.1
+ * @date 2026-10-17
+ * 
+ * @copyright Copyright (c) 2026
+ * 
+ */
+#ifndef _BUS_REPLAY_H_
+#define _BUS_REPLAY_H_
+
+#include <stdbool.h>
+
+int bus_replay_open(const char *path);
+
+bool bus_replay_is_finished();
+
+void bus_replay_report();
+
+#endif // _BUS_REPLAY_H_
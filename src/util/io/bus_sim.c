@@ -0,0 +1,116 @@
+#include "bus_sim.h"
+
+#include "util/logger.h"
+
+#include <string.h>
+
+struct BusSimEntry {
+    char path[32]; // Path of bus or chip.
+    int dev_addr; // I2C address, BUS_SIM_NO_ADDR for SPI and GPIO.
+    const struct BusSimDevice *dev; // The model.
+};
+
+static struct BusSimEntry _entries[BUS_SIM_MAX_DEVICES]; // Attached models.
+static int _n_entries; // Number of attached models.
+
+/**
+ * @brief Attach a model to a path. Call before the device is opened.
+ * 
+ * @param path 
+ *      Path of device. e.g. "/dev/spidev0.0", "/dev/i2c-1".
+ * @param dev_addr 
+ *      I2C address, BUS_SIM_NO_ADDR for SPI and GPIO.
+ * @param dev 
+ *      The model.
+ * @return 0 if success else -1.
+ */
+int bus_sim_attach(const char *path, int dev_addr, const struct BusSimDevice *dev) {
+    if (_n_entries >= BUS_SIM_MAX_DEVICES) {
+        LOG_ERROR("Too many simulated devices.\n");
+        return -1;
+    }
+    struct BusSimEntry *e = &_entries[_n_entries++];
+    strncpy(e->path, path, sizeof(e->path) - 1);
+    e->path[sizeof(e->path) - 1] = '\0';
+    e->dev_addr = dev_addr;
+    e->dev = dev;
+    LOG("Simulating %s on %s (address: %d).\n", dev->name, path, dev_addr);
+    return 0;
+}
+
+/**
+ * @brief Detach every model. Handles already opened keep their model.
+ */
+void bus_sim_detach_all() {
+    memset(_entries, 0, sizeof(_entries));
+    _n_entries = 0;
+}
+
+/**
+ * @brief Find the model attached to path and address.
+ * 
+ * @param path 
+ *      Path of device.
+ * @param dev_addr 
+ *      I2C address, BUS_SIM_NO_ADDR for SPI and GPIO.
+ * @return The model, NULL if none.
+ */
+const struct BusSimDevice *bus_sim_find(const char *path, int dev_addr) {
+    int i;
+    for (i = 0; i < _n_entries; i++) {
+        if (_entries[i].dev_addr == dev_addr && strcmp(_entries[i].path, path) == 0) {
+            return _entries[i].dev;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Check if any model is attached to path.
+ * 
+ * @param path 
+ *      Path of bus.
+ * @return True if simulated else false.
+ */
+bool bus_sim_has_path(const char *path) {
+    int i;
+    for (i = 0; i < _n_entries; i++) {
+        if (strcmp(_entries[i].path, path) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Full duplex transfer with a model in the register protocol of
+ * spi_read_array/spi_write_array. The first byte is the register address,
+ * with bit 7 set for read.
+ * 
+ * @param dev 
+ *      The model.
+ * @param tx 
+ *      Transmitted bytes.
+ * @param rx 
+ *      Received bytes.
+ * @param n 
+ *      Length of transfer.
+ * @return n if success else -1, like ioctl(SPI_IOC_MESSAGE).
+ */
+int bus_sim_spi_transfer(const struct BusSimDevice *dev, const uint8_t *tx, uint8_t *rx, int n) {
+    if (n < 1) {
+        return -1;
+    }
+    rx[0] = 0;
+    if (n == 1) {
+        return 1;
+    }
+    int ret;
+    if (tx[0] & 0x80) {
+        ret = dev->read(dev, tx[0] & 0x7f, rx + 1, n - 1);
+    } else {
+        memset(rx + 1, 0, n - 1);
+        ret = dev->write(dev, tx[0], tx + 1, n - 1);
+    }
+    return ret == 0 ? n : -1;
+}
@@ -0,0 +1,45 @@
+/**
+ * @file bus_sim.h
+ * @author agent
+ * @brief Simulated devices behind the SPI, I2C and GPIO utilities.
+ * A device model attached to a path (and I2C address) is used by spi_open,
+ * i2c_open and gpio_lines_request instead of the kernel device. Handles
+ * opened on other paths keep using the kernel directly.
+ * 
+ * @version 0.1
+ * @date 2026-10-17
+ * 
+ * @copyright Copyright (c) 2026
+ * 
+ */
+#ifndef _BUS_SIM_H_
+#define _BUS_SIM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define BUS_SIM_NO_ADDR -1 // Address of devices on SPI and GPIO.
+#define BUS_SIM_MAX_DEVICES 16
+
+/**
+ * @brief Register level model of a device.
+ * GPIO models receive line values as a little endian uint64_t written to register 0.
+ */
+struct BusSimDevice {
+    const char *name; // Name of model.
+    int (*read)(const struct BusSimDevice *dev, uint8_t reg_addr, uint8_t *buffer, int n); // Read registers, 0 if success else -1.
+    int (*write)(const struct BusSimDevice *dev, uint8_t reg_addr, const uint8_t *buffer, int n); // Write registers, 0 if success else -1.
+    void *ctx; // State of model, NULL if the model keeps it in module.
+};
+
+int bus_sim_attach(const char *path, int dev_addr, const struct BusSimDevice *dev);
+
+void bus_sim_detach_all();
+
+const struct BusSimDevice *bus_sim_find(const char *path, int dev_addr);
+
+bool bus_sim_has_path(const char *path);
+
+int bus_sim_spi_transfer(const struct BusSimDevice *dev, const uint8_t *tx, uint8_t *rx, int n);
+
+#endif // _BUS_SIM_H_
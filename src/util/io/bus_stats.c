@@ -0,0 +1,336 @@
+#include "bus_stats.h"
+
+#include "util/logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+struct BusStatsCounter {
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint64_t histogram[BUS_STATS_BUCKETS];
+};
+
+// Counters of one thread. Written only by its thread, with atomic stores so
+// readers on other threads never see a torn 64-bit value.
+struct BusStatsBlock {
+    struct BusStatsCounter counters[BUS_STATS_MAX_DEVICES][BUS_STATS_DIR_COUNT];
+    struct BusStatsBlock *next;
+};
+
+static char _names[BUS_STATS_MAX_DEVICES][BUS_STATS_NAME_LEN]; // Name of each registered device.
+static int _n_devices; // Number of registered devices.
+
+static struct BusStatsBlock *_blocks; // Blocks of every thread, newest first. Never freed.
+static __thread struct BusStatsBlock *_block; // Block of calling thread.
+
+static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER; // Guards registration only.
+
+static struct BusStatsBlock *bus_stats_get_block();
+
+static uint64_t bus_stats_percentile(const uint64_t *histogram, uint64_t calls, int percent);
+
+static void bus_stats_add(uint64_t *counter, uint64_t n);
+
+static void bus_stats_set(uint64_t *counter, uint64_t value);
+
+static uint64_t bus_stats_get(const uint64_t *counter);
+
+/**
+ * @brief Register a device. Registering the same name returns the same id.
+ * 
+ * @param name 
+ *      Name of device. e.g. "/dev/spidev0.0".
+ * @return Id of device, -1 if too many devices.
+ */
+int bus_stats_register(const char *name) {
+    int id;
+    pthread_mutex_lock(&_mutex);
+    if ((id = bus_stats_find(name)) >= 0) {
+        goto EXIT;
+    }
+    if (_n_devices >= BUS_STATS_MAX_DEVICES) {
+        LOG_ERROR("Too many devices.\n");
+        id = -1;
+        goto EXIT;
+    }
+    id = _n_devices;
+    strncpy(_names[id], name, BUS_STATS_NAME_LEN - 1);
+    _names[id][BUS_STATS_NAME_LEN - 1] = '\0';
+    __atomic_store_n(&_n_devices, id + 1, __ATOMIC_RELEASE);
+
+    EXIT:
+    pthread_mutex_unlock(&_mutex);
+    return id;
+}
+
+/**
+ * @brief Find id of a registered device.
+ * 
+ * @param name 
+ *      Name of device.
+ * @return Id of device, -1 if not found.
+ */
+int bus_stats_find(const char *name) {
+    int i, n = bus_stats_count();
+    for (i = 0; i < n; i++) {
+        if (strcmp(_names[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Get number of registered devices.
+ * 
+ * @return Number of devices. Ids are 0 ~ count - 1.
+ */
+int bus_stats_count() {
+    return __atomic_load_n(&_n_devices, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Get name of a registered device.
+ * 
+ * @param id 
+ *      Id of device.
+ * @return Name of device, NULL if id is invalid.
+ */
+const char *bus_stats_get_name(int id) {
+    if (id < 0 || id >= bus_stats_count()) {
+        return NULL;
+    }
+    return _names[id];
+}
+
+/**
+ * @brief Get timestamp for the start of a transfer.
+ * 
+ * @return Monotonic time in ns.
+ */
+uint64_t bus_stats_begin() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Record a finished transfer.
+ * 
+ * @param id 
+ *      Id of device. Nothing is recorded if negative.
+ * @param dir 
+ *      Direction of transfer.
+ * @param begin_ns 
+ *      Return value of bus_stats_begin.
+ * @param bytes 
+ *      Bytes transferred.
+ * @param ok 
+ *      False if the transfer failed.
+ */
+void bus_stats_end(int id, enum BUS_STATS_DIR dir, uint64_t begin_ns, int bytes, bool ok) {
+    if (id < 0 || id >= BUS_STATS_MAX_DEVICES) {
+        return;
+    }
+    uint64_t ns = bus_stats_begin() - begin_ns;
+    struct BusStatsBlock *block = _block != NULL ? _block : bus_stats_get_block();
+    if (block == NULL) {
+        return;
+    }
+    struct BusStatsCounter *c = &block->counters[id][dir];
+    
+    bus_stats_add(&c->calls, 1);
+    if (!ok) {
+        bus_stats_add(&c->errors, 1);
+        return;
+    }
+    bus_stats_add(&c->bytes, bytes);
+    if (c->min_ns == 0 || ns < c->min_ns) {
+        bus_stats_set(&c->min_ns, ns);
+    }
+    if (ns > c->max_ns) {
+        bus_stats_set(&c->max_ns, ns);
+    }
+    int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    if (bucket >= BUS_STATS_BUCKETS) {
+        bucket = BUS_STATS_BUCKETS - 1;
+    }
+    bus_stats_add(&c->histogram[bucket], 1);
+}
+
+/**
+ * @brief Sum counters of every thread.
+ * Values may lag behind transfers in progress on other threads.
+ * 
+ * @param id 
+ *      Id of device.
+ * @param dir 
+ *      Direction of transfer.
+ * @param report 
+ *      Catcher of statistics.
+ * @return 0 if success, -1 if id is invalid.
+ */
+int bus_stats_query(int id, enum BUS_STATS_DIR dir, struct BusStatsReport *report) {
+    if (id < 0 || id >= bus_stats_count() || dir < 0 || dir >= BUS_STATS_DIR_COUNT) {
+        return -1;
+    }
+    uint64_t histogram[BUS_STATS_BUCKETS] = {0};
+    uint64_t ok_calls = 0;
+    memset(report, 0, sizeof(struct BusStatsReport));
+    strcpy(report->name, _names[id]);
+
+    struct BusStatsBlock *block;
+    for (block = __atomic_load_n(&_blocks, __ATOMIC_ACQUIRE); block != NULL; block = block->next) {
+        const struct BusStatsCounter *c = &block->counters[id][dir];
+        report->calls += bus_stats_get(&c->calls);
+        report->bytes += bus_stats_get(&c->bytes);
+        report->errors += bus_stats_get(&c->errors);
+        uint64_t min_ns = bus_stats_get(&c->min_ns);
+        uint64_t max_ns = bus_stats_get(&c->max_ns);
+        if (min_ns != 0 && (report->min_ns == 0 || min_ns < report->min_ns)) {
+            report->min_ns = min_ns;
+        }
+        if (max_ns > report->max_ns) {
+            report->max_ns = max_ns;
+        }
+        int i;
+        for (i = 0; i < BUS_STATS_BUCKETS; i++) {
+            uint64_t calls = bus_stats_get(&c->histogram[i]);
+            histogram[i] += calls;
+            ok_calls += calls;
+        }
+    }
+    report->p50_ns = bus_stats_percentile(histogram, ok_calls, 50);
+    report->p99_ns = bus_stats_percentile(histogram, ok_calls, 99);
+    // Bucket bounds are coarse, keep them inside the observed range.
+    if (report->p50_ns > report->max_ns) {
+        report->p50_ns = report->max_ns;
+    }
+    if (report->p99_ns > report->max_ns) {
+        report->p99_ns = report->max_ns;
+    }
+    if (report->p50_ns < report->min_ns) {
+        report->p50_ns = report->min_ns;
+    }
+    if (report->p99_ns < report->min_ns) {
+        report->p99_ns = report->min_ns;
+    }
+    return 0;
+}
+
+/**
+ * @brief Print statistics of every device to stdout.
+ * Not async-signal-safe, a signal handler should only request the dump.
+ */
+void bus_stats_dump() {
+    static const char *dir_names[BUS_STATS_DIR_COUNT] = {"R", "W"};
+
+    printf("%-24s %s %10s %12s %8s %9s %9s %9s %9s (us)\n",
+        "device", "d", "calls", "bytes", "errors", "min", "p50", "p99", "max");
+
+    int id, dir, n = bus_stats_count();
+    for (id = 0; id < n; id++) {
+        for (dir = 0; dir < BUS_STATS_DIR_COUNT; dir++) {
+            struct BusStatsReport r;
+            if (bus_stats_query(id, dir, &r) != 0 || r.calls == 0) {
+                continue;
+            }
+            printf("%-24s %s %10llu %12llu %8llu %9.1f %9.1f %9.1f %9.1f\n",
+                r.name, dir_names[dir],
+                (unsigned long long)r.calls, (unsigned long long)r.bytes, (unsigned long long)r.errors,
+                r.min_ns / 1000.0, r.p50_ns / 1000.0, r.p99_ns / 1000.0, r.max_ns / 1000.0);
+        }
+    }
+    fflush(stdout);
+}
+
+//-----
+
+/**
+ * @brief Create the block of calling thread on its first transfer.
+ * 
+ * @return Block of calling thread, NULL if fail.
+ */
+static struct BusStatsBlock *bus_stats_get_block() {
+    struct BusStatsBlock *block = calloc(1, sizeof(struct BusStatsBlock));
+    if (block == NULL) {
+        LOG_ERROR("Failed to allocate counters.\n");
+        return NULL;
+    }
+    pthread_mutex_lock(&_mutex);
+    block->next = _blocks;
+    __atomic_store_n(&_blocks, block, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&_mutex);
+
+    _block = block;
+    return block;
+}
+
+/**
+ * @brief Get latency under which the percentage of transfers finished.
+ * 
+ * @param histogram 
+ *      Log2 latency histogram.
+ * @param calls 
+ *      Sum of histogram.
+ * @param percent 
+ *      0 ~ 100.
+ * @return Upper bound of the bucket in ns, 0 if no transfer.
+ */
+static uint64_t bus_stats_percentile(const uint64_t *histogram, uint64_t calls, int percent) {
+    if (calls == 0) {
+        return 0;
+    }
+    uint64_t target = (calls * percent + 99) / 100;
+    uint64_t sum = 0;
+    int i;
+    for (i = 0; i < BUS_STATS_BUCKETS; i++) {
+        sum += histogram[i];
+        if (sum >= target) {
+            return i == 0 ? 0 : (1ULL << i) - 1;
+        }
+    }
+    return (1ULL << (BUS_STATS_BUCKETS - 1)) - 1;
+}
+
+/**
+ * @brief Add to a counter. Only the thread owning the counter writes it.
+ * 
+ * @param counter 
+ *      Counter in block of calling thread.
+ * @param n 
+ *      Value to add.
+ */
+static void bus_stats_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Set a counter. Only the thread owning the counter writes it.
+ * 
+ * @param counter 
+ *      Counter in block of calling thread.
+ * @param value 
+ *      New value.
+ */
+static void bus_stats_set(uint64_t *counter, uint64_t value) {
+    __atomic_store_n(counter, value, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Read a counter of any thread.
+ * 
+ * @param counter 
+ *      Counter in any block.
+ * @return Value of counter.
+ */
+static uint64_t bus_stats_get(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,59 @@
+/**
+ * @file bus_stats.h
+ * @author agent
+ * @brief Transfer statistics of SPI, I2C and GPIO devices.
+ * Every transfer is counted per device and per direction: calls, bytes,
+ * errors and a log2 latency histogram. Counters are kept per thread, so
+ * recording takes no lock. Readings sum every thread.
+ * 
+ * @version 0.1
+ * @date 2026-10-17
+ * 
+ * @copyright Copyright (c) 2026
+ * 
+ */
+#ifndef _BUS_STATS_H_
+#define _BUS_STATS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define BUS_STATS_MAX_DEVICES 32
+#define BUS_STATS_NAME_LEN 40 // Fits an I2C bus path and "@0xNN".
+#define BUS_STATS_BUCKETS 32 // Bucket i holds latency in [2^(i-1), 2^i) ns.
+
+//-----Enums-----
+enum BUS_STATS_DIR {
+    BUS_STATS_READ = 0,
+    BUS_STATS_WRITE = 1,
+    BUS_STATS_DIR_COUNT
+};
+
+struct BusStatsReport {
+    char name[BUS_STATS_NAME_LEN]; // Name of device.
+    uint64_t calls; // Number of transfers.
+    uint64_t bytes; // Bytes transferred.
+    uint64_t errors; // Number of failed transfers.
+    uint64_t min_ns; // Fastest transfer.
+    uint64_t p50_ns; // Median, upper bound of its histogram bucket.
+    uint64_t p99_ns; // 99th percentile, upper bound of its histogram bucket.
+    uint64_t max_ns; // Slowest transfer.
+};
+
+int bus_stats_register(const char *name);
+
+int bus_stats_find(const char *name);
+
+int bus_stats_count();
+
+const char *bus_stats_get_name(int id);
+
+uint64_t bus_stats_begin();
+
+void bus_stats_end(int id, enum BUS_STATS_DIR dir, uint64_t begin_ns, int bytes, bool ok);
+
+int bus_stats_query(int id, enum BUS_STATS_DIR dir, struct BusStatsReport *report);
+
+void bus_stats_dump();
+
+#endif // _BUS_STATS_H_
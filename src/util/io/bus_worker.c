@@ -0,0 +1,267 @@
+#include "bus_worker.h"
+#include "i2c.h"
+#include "bus_arbiter.h"
+
+#include "util/system/scheduler.h"
+#include "util/logger.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#define BUS_WORKER_MAX_BUSES 4
+
+/**
+ * @brief Pending write of one register.
+ * dev_addr and reg_addr are fixed once the slot is taken. The rest is
+ * guarded by seq: odd while the producer updates it.
+ */
+struct BusWorkerSlot {
+    uint8_t dev_addr; // Address of device.
+    uint8_t reg_addr; // First register written.
+    unsigned seq; // Sequence lock of the fields below.
+    uint8_t n; // Length of data.
+    uint8_t data[BUS_WORKER_MAX_DATA]; // Latest data posted.
+    void (*done)(int ret, void *arg); // Called by worker after the write, NULL if none.
+    void *arg; // Argument of done.
+    bool queued; // True while slot waits in ring.
+};
+
+struct BusWorker {
+    struct I2CBus *bus; // Bus written by worker.
+    int ref_count; // Number of bus_worker_open holding this worker.
+    pthread_t thread; // Worker thread.
+    sem_t sem; // Posted once per queued slot and on stop.
+    bool stop; // True to end worker after the ring is drained.
+    struct BusWorkerSlot slots[BUS_WORKER_MAX_SLOTS]; // One per register posted.
+    int n_slots; // Slots taken, written by producer only.
+    int ring[BUS_WORKER_MAX_SLOTS]; // Slot index of pending writes in posting order.
+    unsigned head; // Next ring entry to write, written by worker only.
+    unsigned tail; // Next ring entry to fill, written by producer only.
+    unsigned completed; // Ring entries written to bus.
+};
+
+static struct BusWorker *_workers[BUS_WORKER_MAX_BUSES]; // Opened workers.
+
+static pthread_mutex_t _workers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void *bus_worker_handler(void *arg);
+
+//-----
+
+/**
+ * @brief Start the worker of bus.
+ * Opening the same bus again returns the same worker.
+ * 
+ * @param bus 
+ *      Handle of bus.
+ * @return Handle of worker, NULL if fail.
+ */
+struct BusWorker *bus_worker_open(struct I2CBus *bus) {
+    struct BusWorker *w = NULL;
+    pthread_mutex_lock(&_workers_mutex);
+
+    int i;
+    for (i = 0; i < BUS_WORKER_MAX_BUSES; i++) {
+        if (_workers[i] != NULL && _workers[i]->bus == bus) {
+            w = _workers[i];
+            w->ref_count++;
+            goto EXIT;
+        }
+    }
+    for (i = 0; i < BUS_WORKER_MAX_BUSES; i++) {
+        if (_workers[i] == NULL) {
+            break;
+        }
+    }
+    if (i == BUS_WORKER_MAX_BUSES) {
+        LOG_ERROR("Too many workers opened.\n");
+        goto EXIT;
+    }
+    if ((w = calloc(1, sizeof(struct BusWorker))) == NULL) {
+        LOG_ERROR("Failed to allocate memory.\n");
+        goto EXIT;
+    }
+    w->bus = bus;
+    w->ref_count = 1;
+    sem_init(&w->sem, 0, 0);
+    if (scheduler_create_rt_thread(&w->thread, BUS_WORKER_PRIORITY, bus_worker_handler, w) != 0) {
+        // Not root, e.g. simulation. Run as normal thread.
+        if (pthread_create(&w->thread, NULL, bus_worker_handler, w) != 0) {
+            LOG_ERROR("Failed to create worker thread.\n");
+            sem_destroy(&w->sem);
+            free(w);
+            w = NULL;
+            goto EXIT;
+        }
+    }
+    _workers[i] = w;
+
+    EXIT:
+    pthread_mutex_unlock(&_workers_mutex);
+    return w;
+}
+
+/**
+ * @brief Release worker. The worker writes every pending write and ends
+ * when nobody holds it.
+ * 
+ * @param w 
+ *      Handle of worker.
+ */
+void bus_worker_close(struct BusWorker *w) {
+    if (w == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&_workers_mutex);
+    if (--w->ref_count > 0) {
+        pthread_mutex_unlock(&_workers_mutex);
+        return;
+    }
+    int i;
+    for (i = 0; i < BUS_WORKER_MAX_BUSES; i++) {
+        if (_workers[i] == w) {
+            _workers[i] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&_workers_mutex);
+
+    __atomic_store_n(&w->stop, true, __ATOMIC_RELEASE);
+    sem_post(&w->sem);
+    pthread_join(w->thread, NULL);
+    sem_destroy(&w->sem);
+    free(w);
+}
+
+/**
+ * @brief Queue a write of registers and return without waiting.
+ * 
+ * @param w 
+ *      Handle of worker.
+ * @param dev_addr 
+ *      Address of device.
+ * @param reg_addr 
+ *      Address of first register to write.
+ * @param buffer 
+ *      Data to write, copied before return.
+ * @param n 
+ *      Length of buffer, up to BUS_WORKER_MAX_DATA.
+ * @param done 
+ *      Called from worker thread with the result of i2c write, NULL if not needed.
+ * @param arg 
+ *      Argument of done.
+ * @return 0 if success else -1.
+ */
+int bus_worker_post_write(struct BusWorker *w, uint8_t dev_addr, uint8_t reg_addr, const uint8_t *buffer, uint8_t n, void (*done)(int ret, void *arg), void *arg) {
+    if (n > BUS_WORKER_MAX_DATA) {
+        LOG_ERROR("Length %d is too long.\n", n);
+        return -1;
+    }
+    int i;
+    for (i = 0; i < w->n_slots; i++) {
+        if (w->slots[i].dev_addr == dev_addr && w->slots[i].reg_addr == reg_addr) {
+            break;
+        }
+    }
+    if (i == w->n_slots) {
+        if (w->n_slots == BUS_WORKER_MAX_SLOTS) {
+            LOG_ERROR("Too many registers posted.\n");
+            return -1;
+        }
+        w->slots[i].dev_addr = dev_addr;
+        w->slots[i].reg_addr = reg_addr;
+        w->n_slots++;
+    }
+    struct BusWorkerSlot *s = &w->slots[i];
+
+    // Replace data, whether or not the slot is still pending.
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    s->n = n;
+    memcpy(s->data, buffer, n);
+    s->done = done;
+    s->arg = arg;
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+
+    if (!__atomic_exchange_n(&s->queued, true, __ATOMIC_SEQ_CST)) {
+        // A slot is in ring at most once, so ring never overflows.
+        w->ring[w->tail % BUS_WORKER_MAX_SLOTS] = i;
+        __atomic_store_n(&w->tail, w->tail + 1, __ATOMIC_RELEASE);
+        sem_post(&w->sem);
+    }
+    return 0;
+}
+
+/**
+ * @brief Wait until every posted write is on the bus.
+ * Call from the producer thread before accessing the device synchronously.
+ * 
+ * @param w 
+ *      Handle of worker, NULL to do nothing.
+ */
+void bus_worker_flush(struct BusWorker *w) {
+    if (w == NULL) {
+        return;
+    }
+    while (__atomic_load_n(&w->completed, __ATOMIC_ACQUIRE) != __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE)) {
+        usleep(50);
+    }
+}
+
+//-----
+
+/**
+ * @brief Thread writing queued slots in posting order.
+ * 
+ * @param arg 
+ *      The worker.
+ * @return NULL.
+ */
+static void *bus_worker_handler(void *arg) {
+    struct BusWorker *w = arg;
+    // Actuator output is as urgent as the control loop.
+    bus_arbiter_set_priority(BUS_PRIORITY_CONTROL);
+    while (1) {
+        sem_wait(&w->sem);
+        unsigned head = w->head;
+        if (head == __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE)) {
+            if (__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            continue;
+        }
+        struct BusWorkerSlot *s = &w->slots[w->ring[head % BUS_WORKER_MAX_SLOTS]];
+        __atomic_store_n(&w->head, head + 1, __ATOMIC_RELEASE);
+        // Posts from now on queue the slot again.
+        __atomic_store_n(&s->queued, false, __ATOMIC_SEQ_CST);
+
+        uint8_t n;
+        uint8_t data[BUS_WORKER_MAX_DATA];
+        void (*done)(int ret, void *arg);
+        void *done_arg;
+        unsigned seq;
+        do {
+            while ((seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE)) & 1) {
+                // Producer is updating the slot.
+            }
+            n = s->n;
+            memcpy(data, s->data, n);
+            done = s->done;
+            done_arg = s->arg;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq);
+
+        // Single byte writes consult the register shadow of device.
+        int ret = n == 1 ? i2c_write(w->bus, s->dev_addr, s->reg_addr, data[0]) : i2c_write_array(w->bus, s->dev_addr, s->reg_addr, data, n);
+        if (done != NULL) {
+            done(ret, done_arg);
+        } else if (ret != 0) {
+            LOG_ERROR("Failed to write.(Address: %d, register: %d)\n", s->dev_addr, s->reg_addr);
+        }
+        __atomic_add_fetch(&w->completed, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
@@ -0,0 +1,38 @@
+/**
+ * @file bus_worker.h
+ * @author agent
+ * @brief Worker thread writing registers of slow I2C devices.
+ * The control loop posts a write and returns at once. Posts go through a
+ * lock-free single producer queue, so every post to one worker must come
+ * from the same thread. A write posted while an earlier write to the same
+ * register is still pending replaces its data, and the callback of the
+ * replaced write isn't called.
+ * 
+ * @version 0.1
+ * @date 2026-10-17
+ * 
+ * @copyright Copyright (c) 2026
+ * 
+ */
+#ifndef _BUS_WORKER_H_
+#define _BUS_WORKER_H_
+
+#include <stdint.h>
+
+#define BUS_WORKER_MAX_SLOTS 64 // Max registers written through one worker.
+#define BUS_WORKER_MAX_DATA 64 // Max bytes of one posted write, e.g. every PWM channel of PCA9685.
+#define BUS_WORKER_PRIORITY 80 // Real time priority of worker, below the control loop.
+
+struct BusWorker;
+
+struct I2CBus;
+
+struct BusWorker *bus_worker_open(struct I2CBus *bus);
+
+void bus_worker_close(struct BusWorker *w);
+
+int bus_worker_post_write(struct BusWorker *w, uint8_t dev_addr, uint8_t reg_addr, const uint8_t *buffer, uint8_t n, void (*done)(int ret, void *arg), void *arg);
+
+void bus_worker_flush(struct BusWorker *w);
+
+#endif // _BUS_WORKER_H_
@@ -2,17 +2,68 @@
 
 #include "util/logger.h"
 #include "util/debug.h"
+#include "bus_stats.h"
+#include "bus_record.h"
+#include "bus_sim.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/gpio.h>
 
 #define GPIO_PATH "/sys/class/gpio/gpio"
 #define GPIO_EXPORT_PATH "/sys/class/gpio/export"
 #define GPIO_UNEXPORT_PATH "/sys/class/gpio/unexport"
 
+#define GPIO_MEM_NAME "gpiomem" // Chips named so are mapped instead of requested.
+#define GPIO_MEM_SIZE 4096 // Size of BCM283x GPIO register block.
+#define GPIO_MEM_MAX_INDEX 53
+// Word offsets of BCM283x GPIO registers.
+#define GPIO_REG_GPFSEL0 0
+#define GPIO_REG_GPSET0 7
+#define GPIO_REG_GPCLR0 10
+#define GPIO_REG_GPLEV0 13
+
+enum GPIO_BACKEND {
+    GPIO_BACKEND_CHARDEV, // Line request on /dev/gpiochip*.
+    GPIO_BACKEND_FILE, // Regular file standing in for the chip.
+    GPIO_BACKEND_SIM, // Model attached by bus_sim_attach.
+    GPIO_BACKEND_MMAP, // SET/CLR registers mapped from /dev/gpiomem or a file.
+    GPIO_BACKEND_SYSFS // /sys/class/gpio fallback.
+};
+
+struct GPIOLines {
+    enum GPIO_BACKEND backend; // Backend in use.
+    int fd; // Line request fd, or file fd for GPIO_BACKEND_FILE.
+    int n; // Number of lines.
+    int index[GPIO_V2_LINES_MAX]; // GPIO index of each line.
+    uint64_t values; // Last written value of each line, bit i for index[i].
+    int stats_id; // Id in bus_stats, -1 if not counted.
+    const struct BusSimDevice *sim; // Model of chip for GPIO_BACKEND_SIM.
+    volatile uint32_t *regs; // Mapped registers for GPIO_BACKEND_MMAP.
+    bool regs_is_file; // True if regs are mapped from a regular file.
+};
+
+struct GPIOEdge {
+    int fd; // Line request fd, or FIFO standing in for the chip.
+    int index; // GPIO index of line.
+    int stats_id; // Id in bus_stats, -1 if not counted.
+};
+
+static int _sysfs_stats_id; // Id in bus_stats + 1 of sysfs access, 0 if not registered yet.
+
+static int gpio_sysfs_stats_id();
+
+static int gpio_lines_map(struct GPIOLines *lines, const char *chip);
+
 /**
  * @brief Allow /sys/class/gpio/gpip%d to be found.
  * 
@@ -151,11 +202,16 @@ int gpio_write(int index, int val) {
         goto EXIT;
     }
     char zero_one[2] = "01";
-    if (write(fd, &zero_one[val], 1) < 0) {
+    uint64_t begin = bus_stats_begin();
+    int w_cnt = write(fd, &zero_one[val], 1);
+    bus_stats_end(gpio_sysfs_stats_id(), BUS_STATS_WRITE, begin, 1, w_cnt == 1);
+    if (w_cnt < 0) {
         LOG_ERROR("Failed to write.\n");
         ret = -1;
         goto EXIT;
     }
+    uint8_t v = val;
+    bus_record_transfer(gpio_sysfs_stats_id(), BUS_STATS_WRITE, index, &v, 1);
     EXIT:
     close(fd);
     return 0;
@@ -183,13 +239,488 @@ int gpio_read(int index, int *val) {
         goto EXIT;
     }
     char value_str[3];
-    if (read(fd, value_str, 3) < 0) {
+    uint64_t begin = bus_stats_begin();
+    int r_cnt = read(fd, value_str, 3);
+    bus_stats_end(gpio_sysfs_stats_id(), BUS_STATS_READ, begin, r_cnt, r_cnt > 0);
+    if (r_cnt < 0) {
         LOG_ERROR("Failed to read.\n");
         ret = -1;
         goto EXIT;
     }
     *val = atoi(value_str);
+    uint8_t v = *val;
+    bus_record_transfer(gpio_sysfs_stats_id(), BUS_STATS_READ, index, &v, 1);
     EXIT:
     close(fd);
     return 0;
+}
+
+//----- Line group functions.
+
+/**
+ * @brief Request a group of lines as output, all driven low.
+ * A regular file given as chip is used as stand-in, where every write
+ * rewrites one '0'/'1' character per line. A model attached to chip by
+ * bus_sim_attach receives the values of lines. A chip named "gpiomem"
+ * (e.g. "/dev/gpiomem", or a regular file as stand-in) is mapped and lines
+ * are set by SET/CLR register writes without syscall. If the chip can't be
+ * used, lines are exported through sysfs instead.
+ * 
+ * @param chip
+ *      Path of gpiochip. e.g. "/dev/gpiochip0".
+ * @param index
+ *      GPIO index of each line. Bit i of masks and values refers to index[i].
+ * @param n
+ *      Number of lines, at most 64.
+ * @param consumer
+ *      Consumer label shown by the kernel.
+ * @return Handle of lines, NULL if fail.
+ */
+struct GPIOLines *gpio_lines_request(const char *chip, const int *index, int n, const char *consumer) {
+    if (n <= 0 || n > GPIO_V2_LINES_MAX) {
+        LOG_ERROR("Invalid number of lines %d.\n", n);
+        return NULL;
+    }
+    struct GPIOLines *lines = malloc(sizeof(struct GPIOLines));
+    if (lines == NULL) {
+        LOG_ERROR("Failed to allocate lines.\n");
+        return NULL;
+    }
+    memset(lines, 0, sizeof(struct GPIOLines));
+    memcpy(lines->index, index, sizeof(int) * n);
+    lines->n = n;
+    lines->fd = -1;
+    lines->stats_id = bus_stats_register(chip);
+
+    int i;
+    if ((lines->sim = bus_sim_find(chip, BUS_SIM_NO_ADDR)) != NULL) {
+        //----- Simulated chip.
+        lines->backend = GPIO_BACKEND_SIM;
+        gpio_lines_write(lines, 0, 0);
+        return lines;
+    }
+
+    const char *name = strrchr(chip, '/');
+    if (strncmp(name != NULL ? name + 1 : chip, GPIO_MEM_NAME, strlen(GPIO_MEM_NAME)) == 0) {
+        //----- Mapped registers.
+        if (gpio_lines_map(lines, chip) != 0) {
+            goto SYSFS;
+        }
+        lines->backend = GPIO_BACKEND_MMAP;
+        gpio_lines_write(lines, ~0ULL >> (64 - n), 0);
+        return lines;
+    }
+
+    struct stat st;
+    if (stat(chip, &st) == 0 && S_ISREG(st.st_mode)) {
+        //----- File stand-in.
+        if ((lines->fd = open(chip, O_WRONLY)) < 0) {
+            LOG_ERROR("Failed to open \"%s\".\n", chip);
+            free(lines);
+            return NULL;
+        }
+        lines->backend = GPIO_BACKEND_FILE;
+        gpio_lines_write(lines, 0, 0);
+        return lines;
+    }
+
+    int chip_fd = open(chip, O_RDWR);
+    if (chip_fd >= 0) {
+        //----- Character device.
+        struct gpio_v2_line_request req;
+        memset(&req, 0, sizeof(req));
+        for (i = 0; i < n; i++) {
+            req.offsets[i] = index[i];
+        }
+        strncpy(req.consumer, consumer, GPIO_MAX_NAME_SIZE - 1);
+        req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+        req.num_lines = n;
+        if (ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req) == 0) {
+            close(chip_fd);
+            lines->fd = req.fd;
+            lines->backend = GPIO_BACKEND_CHARDEV;
+            return lines;
+        }
+        LOG_ERROR("Failed to request lines from \"%s\".\n", chip);
+        close(chip_fd);
+    } else {
+        LOG_ERROR("Failed to open \"%s\".\n", chip);
+    }
+
+    //----- Sysfs fallback.
+    SYSFS:
+    LOG("Falling back to sysfs.\n");
+    for (i = 0; i < n; i++) {
+        gpio_set_export(index[i]);
+        gpio_set_direction(index[i], "out");
+    }
+    lines->backend = GPIO_BACKEND_SYSFS;
+    return lines;
+}
+
+/**
+ * @brief Release the lines and free the handle.
+ * 
+ * @param lines
+ *      Handle of lines.
+ */
+void gpio_lines_release(struct GPIOLines *lines) {
+    if (lines == NULL) {
+        return;
+    }
+    if (lines->fd >= 0) {
+        close(lines->fd);
+    }
+    if (lines->regs != NULL) {
+        munmap((void *)lines->regs, GPIO_MEM_SIZE);
+    }
+    free(lines);
+}
+
+/**
+ * @brief Set several lines at once.
+ * 
+ * @param lines
+ *      Handle of lines.
+ * @param mask
+ *      Lines to set, bit i for index[i].
+ * @param values
+ *      Values of lines, bit i for index[i].
+ * @return 0 if success else -1.
+ */
+int gpio_lines_write(struct GPIOLines *lines, uint64_t mask, uint64_t values) {
+    uint64_t new_values = (lines->values & ~mask) | (values & mask);
+    int i;
+
+    switch (lines->backend) {
+    case GPIO_BACKEND_CHARDEV: {
+        struct gpio_v2_line_values v = {
+            .bits = values,
+            .mask = mask
+        };
+        uint64_t begin = bus_stats_begin();
+        int ret = ioctl(lines->fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &v);
+        bus_stats_end(lines->stats_id, BUS_STATS_WRITE, begin, sizeof(v), ret == 0);
+        if (ret < 0) {
+            LOG_ERROR("Failed to set values.\n");
+            return -1;
+        }
+        break;
+    }
+    case GPIO_BACKEND_FILE: {
+        char buf[GPIO_V2_LINES_MAX + 1];
+        for (i = 0; i < lines->n; i++) {
+            buf[i] = new_values & (1ULL << i) ? '1' : '0';
+        }
+        buf[lines->n] = '\n';
+        uint64_t begin = bus_stats_begin();
+        int w_cnt = pwrite(lines->fd, buf, lines->n + 1, 0);
+        bus_stats_end(lines->stats_id, BUS_STATS_WRITE, begin, lines->n + 1, w_cnt == lines->n + 1);
+        if (w_cnt != lines->n + 1) {
+            LOG_ERROR("Failed to write.\n");
+            return -1;
+        }
+        break;
+    }
+    case GPIO_BACKEND_SIM: {
+        uint8_t buf[8];
+        for (i = 0; i < 8; i++) {
+            buf[i] = new_values >> (8 * i);
+        }
+        uint64_t begin = bus_stats_begin();
+        int ret = lines->sim->write(lines->sim, 0, buf, sizeof(buf));
+        bus_stats_end(lines->stats_id, BUS_STATS_WRITE, begin, sizeof(buf), ret == 0);
+        if (ret != 0) {
+            LOG_ERROR("Failed to write.\n");
+            return -1;
+        }
+        break;
+    }
+    case GPIO_BACKEND_MMAP: {
+        uint32_t set[2] = {0, 0}; // Bits of GPSET0/1.
+        uint32_t clr[2] = {0, 0}; // Bits of GPCLR0/1.
+        for (i = 0; i < lines->n; i++) {
+            if (mask & (1ULL << i)) {
+                uint32_t bit = 1u << (lines->index[i] & 31);
+                if (values & (1ULL << i)) {
+                    set[lines->index[i] >> 5] |= bit;
+                } else {
+                    clr[lines->index[i] >> 5] |= bit;
+                }
+            }
+        }
+        uint64_t begin = bus_stats_begin();
+        int bank;
+        for (bank = 0; bank < 2; bank++) {
+            if (set[bank] != 0) {
+                lines->regs[GPIO_REG_GPSET0 + bank] = set[bank];
+            }
+            if (clr[bank] != 0) {
+                lines->regs[GPIO_REG_GPCLR0 + bank] = clr[bank];
+            }
+            if (lines->regs_is_file) {
+                // Nothing applies SET/CLR to a file, keep GPLEV readable instead.
+                lines->regs[GPIO_REG_GPLEV0 + bank] = (lines->regs[GPIO_REG_GPLEV0 + bank] | set[bank]) & ~clr[bank];
+            }
+        }
+        bus_stats_end(lines->stats_id, BUS_STATS_WRITE, begin, sizeof(set) + sizeof(clr), true);
+        break;
+    }
+    case GPIO_BACKEND_SYSFS:
+        // Counted by gpio_write.
+        for (i = 0; i < lines->n; i++) {
+            if (mask & (1ULL << i)) {
+                gpio_write(lines->index[i], values & (1ULL << i) ? 1 : 0);
+            }
+        }
+        break;
+    }
+    if (lines->backend != GPIO_BACKEND_SYSFS) {
+        uint8_t rec[8]; // Line values, little endian.
+        for (i = 0; i < 8; i++) {
+            rec[i] = new_values >> (8 * i);
+        }
+        bus_record_transfer(lines->stats_id, BUS_STATS_WRITE, 0, rec, sizeof(rec));
+    }
+
+    lines->values = new_values;
+    return 0;
+}
+
+//----- Edge event functions.
+
+/**
+ * @brief Request edge events of an input line.
+ * A FIFO given as chip stands in for it, where writers put struct
+ * gpio_v2_line_event records.
+ * 
+ * @param chip
+ *      Path of gpiochip. e.g. "/dev/gpiochip0".
+ * @param index
+ *      GPIO index of line.
+ * @param edge
+ *      Edges to report.
+ * @param consumer
+ *      Consumer label shown by the kernel.
+ * @return Handle of line, NULL if fail.
+ */
+struct GPIOEdge *gpio_edge_request(const char *chip, int index, enum GPIO_EDGE edge, const char *consumer) {
+    struct GPIOEdge *e = malloc(sizeof(struct GPIOEdge));
+    if (e == NULL) {
+        LOG_ERROR("Failed to allocate line.\n");
+        return NULL;
+    }
+    e->index = index;
+    e->stats_id = bus_stats_register(chip);
+
+    struct stat st;
+    if (stat(chip, &st) == 0 && S_ISFIFO(st.st_mode)) {
+        //----- FIFO stand-in.
+        if ((e->fd = open(chip, O_RDONLY | O_NONBLOCK)) < 0) {
+            LOG_ERROR("Failed to open \"%s\".\n", chip);
+            goto ERROR;
+        }
+        return e;
+    }
+
+    //----- Character device.
+    int chip_fd = open(chip, O_RDWR);
+    if (chip_fd < 0) {
+        LOG_ERROR("Failed to open \"%s\".\n", chip);
+        goto ERROR;
+    }
+    struct gpio_v2_line_request req;
+    memset(&req, 0, sizeof(req));
+    req.offsets[0] = index;
+    strncpy(req.consumer, consumer, GPIO_MAX_NAME_SIZE - 1);
+    req.config.flags = GPIO_V2_LINE_FLAG_INPUT
+        | (edge & GPIO_EDGE_RISING ? GPIO_V2_LINE_FLAG_EDGE_RISING : 0)
+        | (edge & GPIO_EDGE_FALLING ? GPIO_V2_LINE_FLAG_EDGE_FALLING : 0);
+    req.num_lines = 1;
+    req.event_buffer_size = GPIO_EDGE_BUFFER;
+    int ret = ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req);
+    close(chip_fd);
+    if (ret != 0) {
+        LOG_ERROR("Failed to request edge events of GPIO %d.\n", index);
+        goto ERROR;
+    }
+    e->fd = req.fd;
+    // gpio_edge_read returns at once when no event is pending.
+    fcntl(e->fd, F_SETFL, fcntl(e->fd, F_GETFL) | O_NONBLOCK);
+    return e;
+
+    ERROR:
+    free(e);
+    return NULL;
+}
+
+/**
+ * @brief Release the line and free the handle.
+ * 
+ * @param e
+ *      Handle of line.
+ */
+void gpio_edge_release(struct GPIOEdge *e) {
+    if (e == NULL) {
+        return;
+    }
+    close(e->fd);
+    free(e);
+}
+
+/**
+ * @brief Get fd to add to an epoll set. Readable when events are pending.
+ * 
+ * @param e
+ *      Handle of line.
+ * @return The fd, owned by the handle.
+ */
+int gpio_edge_get_fd(struct GPIOEdge *e) {
+    return e->fd;
+}
+
+/**
+ * @brief Wait until an event is pending.
+ * Waiting goes on with the remaining timeout when a signal interrupts it.
+ * 
+ * @param e
+ *      Handle of line.
+ * @param timeout_ms
+ *      Timeout in ms, -1 to wait forever.
+ * @return 1 if events are pending, 0 if timeout, -1 if fail or the fd is
+ *      hung up with nothing to read.
+ */
+int gpio_edge_wait(struct GPIOEdge *e, int timeout_ms) {
+    struct pollfd pfd = {
+        .fd = e->fd,
+        .events = POLLIN
+    };
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+
+    int ret;
+    while ((ret = poll(&pfd, 1, timeout_ms)) < 0 && errno == EINTR) {
+        if (timeout_ms < 0) {
+            continue;
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long remain_ms = (deadline.tv_sec - now.tv_sec) * 1000L + (deadline.tv_nsec - now.tv_nsec) / 1000000L;
+        timeout_ms = remain_ms > 0 ? (int)remain_ms : 0;
+    }
+    if (ret < 0) {
+        LOG_ERROR("Failed to poll GPIO %d.\n", e->index);
+        return -1;
+    }
+    if (ret == 0) {
+        return 0;
+    }
+    // Pending events are still read after a hang up, an error alone would wake every poll.
+    if (!(pfd.revents & POLLIN) && (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))) {
+        LOG_ERROR("GPIO %d is not readable, revents 0x%x.\n", e->index, pfd.revents);
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * @brief Read every pending event, up to max_events, with one read.
+ * Doesn't block.
+ * 
+ * @param e
+ *      Handle of line.
+ * @param events
+ *      Destination, oldest first.
+ * @param max_events
+ *      Capacity of events.
+ * @return Number of events read, -1 if fail.
+ */
+int gpio_edge_read(struct GPIOEdge *e, struct GPIOEvent *events, int max_events) {
+    struct gpio_v2_line_event buf[GPIO_EDGE_BUFFER];
+    if (max_events > GPIO_EDGE_BUFFER) {
+        max_events = GPIO_EDGE_BUFFER;
+    }
+    uint64_t begin = bus_stats_begin();
+    int r_cnt = read(e->fd, buf, sizeof(struct gpio_v2_line_event) * max_events);
+    bus_stats_end(e->stats_id, BUS_STATS_READ, begin, r_cnt > 0 ? r_cnt : 0, r_cnt >= 0 || errno == EAGAIN);
+    if (r_cnt < 0) {
+        if (errno == EAGAIN) {
+            return 0;
+        }
+        LOG_ERROR("Failed to read events of GPIO %d.\n", e->index);
+        return -1;
+    }
+    int i, n = r_cnt / sizeof(struct gpio_v2_line_event);
+    for (i = 0; i < n; i++) {
+        events[i].timestamp_ns = buf[i].timestamp_ns;
+        events[i].edge = buf[i].id == GPIO_V2_LINE_EVENT_RISING_EDGE ? GPIO_EDGE_RISING : GPIO_EDGE_FALLING;
+        events[i].seqno = buf[i].line_seqno;
+    }
+    return n;
+}
+
+//-----
+
+/**
+ * @brief Get bus_stats id of sysfs access, registered on its first use.
+ * 
+ * @return Id in bus_stats, -1 if not counted.
+ */
+static int gpio_sysfs_stats_id() {
+    if (_sysfs_stats_id == 0) {
+        _sysfs_stats_id = bus_stats_register("/sys/class/gpio") + 1;
+    }
+    return _sysfs_stats_id - 1;
+}
+
+/**
+ * @brief Map GPIO registers and set every line as output.
+ * A regular file is grown to the size of register block if needed.
+ * 
+ * @param lines
+ *      Handle of lines.
+ * @param chip
+ *      Path of gpiomem or its stand-in.
+ * @return 0 if success else -1.
+ */
+static int gpio_lines_map(struct GPIOLines *lines, const char *chip) {
+    int i;
+    for (i = 0; i < lines->n; i++) {
+        if (lines->index[i] < 0 || lines->index[i] > GPIO_MEM_MAX_INDEX) {
+            LOG_ERROR("GPIO %d can't be mapped.\n", lines->index[i]);
+            return -1;
+        }
+    }
+    int fd = open(chip, O_RDWR | O_SYNC);
+    if (fd < 0) {
+        LOG_ERROR("Failed to open \"%s\".\n", chip);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        lines->regs_is_file = true;
+        if (st.st_size < GPIO_MEM_SIZE && ftruncate(fd, GPIO_MEM_SIZE) != 0) {
+            LOG_ERROR("Failed to resize \"%s\".\n", chip);
+            close(fd);
+            return -1;
+        }
+    }
+    void *regs = mmap(NULL, GPIO_MEM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    // Mapping stays valid after close.
+    close(fd);
+    if (regs == MAP_FAILED) {
+        LOG_ERROR("Failed to map \"%s\".\n", chip);
+        return -1;
+    }
+    lines->regs = regs;
+
+    // 3 function select bits per GPIO, 001 for output.
+    for (i = 0; i < lines->n; i++) {
+        volatile uint32_t *fsel = &lines->regs[GPIO_REG_GPFSEL0 + lines->index[i] / 10];
+        int shift = (lines->index[i] % 10) * 3;
+        *fsel = (*fsel & ~(7u << shift)) | (1u << shift);
+    }
+    return 0;
 }
\ No newline at end of file
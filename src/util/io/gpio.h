@@ -2,17 +2,38 @@
  * @file gpio.h
  * @author LIN 
  * @brief Raspberry Pi GPIO utilities.
+ * gpio_lines_* request a group of lines once from /dev/gpiochip* and set
+ * them with one ioctl. /dev/gpiomem sets them by register writes without
+ * syscall. A regular file can stand in for either chip, sysfs is used as
+ * fallback.
+ * gpio_edge_* deliver rising/falling edges of an input line with the kernel
+ * timestamp, waited on by poll/epoll instead of busy loop.
  * 
- * 
- * 
- * @version 0.1
+ * @version 0.2
  * @date 2021-09-13
  * 
  * @copyright Copyright (c) 2021
  * 
  */
-#ifndef _GPIO_H_
-#define _GPIO_H_
+#ifndef _IO_GPIO_H_
+#define _IO_GPIO_H_ // _GPIO_H_ is taken by <linux/gpio.h>.
+
+#include <stdint.h>
+
+#define GPIO_EDGE_BUFFER 256 // Events kept by kernel until read.
+
+//-----Enums-----
+enum GPIO_EDGE {
+    GPIO_EDGE_RISING = 1,
+    GPIO_EDGE_FALLING = 2,
+    GPIO_EDGE_BOTH = 3
+};
+
+struct GPIOEvent {
+    uint64_t timestamp_ns; // Kernel timestamp of edge, CLOCK_MONOTONIC.
+    enum GPIO_EDGE edge; // GPIO_EDGE_RISING or GPIO_EDGE_FALLING.
+    uint32_t seqno; // Sequence number of event on the line, gaps mean lost events.
+};
 
 int gpio_set_export(int index);
 
@@ -26,4 +47,26 @@ int gpio_write(int index, int val);
 
 int gpio_read(int index, int *val);
 
-#endif // _GPIO_H_
+//----- Line group functions.
+struct GPIOLines;
+
+struct GPIOLines *gpio_lines_request(const char *chip, const int *index, int n, const char *consumer);
+
+void gpio_lines_release(struct GPIOLines *lines);
+
+int gpio_lines_write(struct GPIOLines *lines, uint64_t mask, uint64_t values);
+
+//----- Edge event functions.
+struct GPIOEdge;
+
+struct GPIOEdge *gpio_edge_request(const char *chip, int index, enum GPIO_EDGE edge, const char *consumer);
+
+void gpio_edge_release(struct GPIOEdge *e);
+
+int gpio_edge_get_fd(struct GPIOEdge *e);
+
+int gpio_edge_wait(struct GPIOEdge *e, int timeout_ms);
+
+int gpio_edge_read(struct GPIOEdge *e, struct GPIOEvent *events, int max_events);
+
+#endif // _IO_GPIO_H_
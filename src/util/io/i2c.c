@@ -1,53 +1,178 @@
 #include "i2c.h"
 #include "util/logger.h"
 #include "util/debug.h"
+#include "reg_shadow.h"
+#include "bus_stats.h"
+#include "bus_record.h"
+#include "bus_arbiter.h"
+#include "bus_sim.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 #include <sys/ioctl.h>
 
-#define I2C_PATH "/dev/i2c-1"
+#define I2C_MAX_BUSES 4
+
+struct I2CBus {
+    int fd; // File descriptor of bus, kept open until the last i2c_close. -1 if simulated.
+    bool sim; // True if the bus is simulated.
+    const struct BusSimDevice *sims[128]; // Model of each device address on simulated bus, NULL if none.
+    char path[32]; // Path of bus.
+    int ref_count; // Number of i2c_open holding this bus.
+    int slave_addr; // Slave address currently set by I2C_SLAVE, -1 if none.
+    struct RegShadow *shadows[128]; // Register shadow of each device address, NULL if not attached.
+    int stats_ids[128]; // Id in bus_stats + 1 of each device address, 0 if not registered yet.
+    struct BusArbiter *arbiter; // Held from I2C_SLAVE to the end of a transfer.
+};
+
+static struct I2CBus _buses[I2C_MAX_BUSES]; // One entry per opened bus.
+
+static pthread_mutex_t _buses_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int i2c_set_slave(struct I2CBus *bus, uint8_t dev_addr);
+
+static int i2c_stats_id(struct I2CBus *bus, uint8_t dev_addr);
+
+static int i2c_sim_write(struct I2CBus *bus, uint8_t dev_addr, const uint8_t *buf, int len);
+
+static int i2c_sim_read(struct I2CBus *bus, uint8_t dev_addr, uint8_t reg_addr, uint8_t *buf, int len);
+
+/**
+ * @brief Open I2C bus.
+ * Opening the same path again returns the same handle so that every device
+ * on a bus shares one fd. If models are attached to path by bus_sim_attach,
+ * the bus is simulated and only those addresses answer.
+ * 
+ * @param path
+ *      Path of bus. e.g. "/dev/i2c-1".
+ * @return Handle of bus, NULL if fail.
+ */
+struct I2CBus *i2c_open(const char *path) {
+    struct I2CBus *bus = NULL;
+    pthread_mutex_lock(&_buses_mutex);
+
+    int i;
+    for (i = 0; i < I2C_MAX_BUSES; i++) {
+        if (_buses[i].ref_count > 0 && strcmp(_buses[i].path, path) == 0) {
+            bus = &_buses[i];
+            bus->ref_count++;
+            goto EXIT;
+        }
+    }
+    for (i = 0; i < I2C_MAX_BUSES; i++) {
+        if (_buses[i].ref_count == 0) {
+            break;
+        }
+    }
+    if (i == I2C_MAX_BUSES) {
+        LOG_ERROR("Too many buses opened.\n");
+        goto EXIT;
+    }
+    bool sim = bus_sim_has_path(path);
+    int fd = -1;
+    if (!sim && (fd = open(path, O_RDWR)) < 0) {
+        LOG_ERROR("Failed to open \"%s\".\n", path);
+        goto EXIT;
+    }
+    bus = &_buses[i];
+    bus->fd = fd;
+    bus->sim = sim;
+    int addr;
+    for (addr = 0; addr < 128; addr++) {
+        bus->sims[addr] = sim ? bus_sim_find(path, addr) : NULL;
+    }
+    strncpy(bus->path, path, sizeof(bus->path) - 1);
+    bus->path[sizeof(bus->path) - 1] = '\0';
+    bus->ref_count = 1;
+    bus->slave_addr = -1;
+    memset(bus->shadows, 0, sizeof(bus->shadows));
+    memset(bus->stats_ids, 0, sizeof(bus->stats_ids));
+    bus->arbiter = bus_arbiter_get(path);
+
+    EXIT:
+    pthread_mutex_unlock(&_buses_mutex);
+    return bus;
+}
+
+/**
+ * @brief Release I2C bus. The fd is closed when nobody holds it.
+ * 
+ * @param bus
+ *      Handle of bus.
+ */
+void i2c_close(struct I2CBus *bus) {
+    if (bus == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&_buses_mutex);
+    if (--bus->ref_count == 0) {
+        if (bus->fd >= 0) {
+            close(bus->fd);
+        }
+        bus->fd = -1;
+        bus->path[0] = '\0';
+    }
+    pthread_mutex_unlock(&_buses_mutex);
+}
+
+/**
+ * @brief Attach a register shadow to a device on the bus.
+ * Single byte reads/writes and bit helpers of the device consult the
+ * shadow afterward. Shadow is owned by caller.
+ * 
+ * @param bus
+ *      Handle of bus.
+ * @param dev_addr
+ *      Address of device.
+ * @param shadow
+ *      The shadow, NULL to detach.
+ */
+void i2c_set_shadow(struct I2CBus *bus, uint8_t dev_addr, struct RegShadow *shadow) {
+    bus->shadows[dev_addr & 0x7f] = shadow;
+}
 
 /**
  * @brief Check if the device exists.
  * 
+ * @param bus
+ *      Handle of bus.
  * @param dev_addr
  *      I2C Address of device.
  * @return True if the device is found else false.
 */
-bool i2c_device_exists(uint8_t dev_addr){
-    bool ret = false;
-
-    int fd = -1; // I2C file descriptor.
-    int reg_addr = 0x01;    // for test
+bool i2c_device_exists(struct I2CBus *bus, uint8_t dev_addr){
+    uint8_t reg_addr = 0x01;    // for test
     
-    fd = open(I2C_PATH, O_RDWR);
-    if (fd < 0){
-        LOG_ERROR("Failed to open i2c.\n");
-        goto EXIT;
-    }
-    if (ioctl(fd, I2C_SLAVE, dev_addr) < 0){
+    bus_arbiter_lock(bus->arbiter);
+    if (i2c_set_slave(bus, dev_addr) != 0) {
+        bus_arbiter_unlock(bus->arbiter);
         LOG_ERROR("Failed to open device.\n");
-        goto EXIT;
+        return false;
     }
-    if (write(fd, &reg_addr, 1) != 1) {
+    uint64_t begin = bus_stats_begin();
+    int w_cnt = bus->sim ? i2c_sim_write(bus, dev_addr, &reg_addr, 1) : write(bus->fd, &reg_addr, 1);
+    bus_arbiter_unlock(bus->arbiter);
+    bus_stats_end(i2c_stats_id(bus, dev_addr), BUS_STATS_WRITE, begin, 1, w_cnt == 1);
+    if (w_cnt != 1) {
         LOG_ERROR("Failed to contact with device.\n");
-        goto EXIT;
+        return false;
     }
+    bus_record_transfer(i2c_stats_id(bus, dev_addr), BUS_STATS_WRITE, reg_addr, NULL, 0);
 
-    ret = true;
-    EXIT:
-    close(fd);
-    return ret;
+    return true;
 }
 
 /**
  * @brief Write data to device.
  * 
+ * @param bus
+ *      Handle of bus.
  * @param dev_addr
  *      Address of device.
  * @param reg_addr
@@ -58,28 +183,21 @@ bool i2c_device_exists(uint8_t dev_addr){
  *      Length of buffer.
  * @return 0 if success, else -1.
 */
-int i2c_write_array(uint8_t dev_addr, uint8_t reg_addr,uint8_t *buffer,  uint8_t n) {
-    if (n > 127) {
+int i2c_write_array(struct I2CBus *bus, uint8_t dev_addr, uint8_t reg_addr,uint8_t *buffer,  uint8_t n) {
+    if (n > I2C_MAX_TRANSFER - 1) {
         LOG_ERROR("Length %d is too long.\n", n);
         return -1;
     }
     
-    int ret = -1;
-    int fd; // I2C file descriptor.
-    uint8_t _buf[128]; // Buffer to write through I2C.
+    uint8_t _buf[I2C_MAX_TRANSFER]; // Buffer to write through I2C.
     int w_cnt;  // Write count.
     
-    // Open device.
-    fd = open(I2C_PATH, O_RDWR);
-    if (fd < 0){
-        LOG_ERROR("Failed to open i2c.\n");
-        goto EXIT;
-    }
-
-    // Open I2C device.
-    if ((ret = ioctl(fd, I2C_SLAVE, dev_addr)) < 0){
+    // Select device.
+    bus_arbiter_lock(bus->arbiter);
+    if (i2c_set_slave(bus, dev_addr) != 0) {
+        bus_arbiter_unlock(bus->arbiter);
         LOG_ERROR("Failed to open device. Address: %d\n", dev_addr);
-        goto EXIT;
+        return -1;
     }
     
     // Write to device
@@ -87,20 +205,27 @@ int i2c_write_array(uint8_t dev_addr, uint8_t reg_addr,uint8_t *buffer,  uint8_t
     _buf[0] = reg_addr;
     memcpy(_buf + 1, buffer, n);
     // Write out.
-    if ((w_cnt = write(fd, _buf, n + 1)) != n + 1){
+    uint64_t begin = bus_stats_begin();
+    w_cnt = bus->sim ? i2c_sim_write(bus, dev_addr, _buf, n + 1) : write(bus->fd, _buf, n + 1);
+    bus_arbiter_unlock(bus->arbiter);
+    bus_stats_end(i2c_stats_id(bus, dev_addr), BUS_STATS_WRITE, begin, n + 1, w_cnt == n + 1);
+    if (w_cnt != n + 1){
         LOG_ERROR("Write count doesn't match.(Expect: %d, got: %d)\n", n + 1, w_cnt);
-        goto EXIT;
+        return -1;
     }
+    reg_shadow_update(bus->shadows[dev_addr & 0x7f], reg_addr, buffer, n);
+    bus_record_transfer(i2c_stats_id(bus, dev_addr), BUS_STATS_WRITE, reg_addr, buffer, n);
 
-    ret = 0;
-    EXIT:
-    close(fd);
-    return ret;
+    return 0;
 }
 
 /**
  * @brief Read data from device.
+ * The register address write and the read are sent as one I2C_RDWR
+ * transaction with repeated start.
  * 
+ * @param bus
+ *      Handle of bus.
  * @param dev_addr
  *      Address of device.
  * @param reg_addr
@@ -111,41 +236,39 @@ int i2c_write_array(uint8_t dev_addr, uint8_t reg_addr,uint8_t *buffer,  uint8_t
  *      Length of buffer.
  * @return 0 if success, else -1.
 */
-int i2c_read_array(uint8_t dev_addr, uint8_t reg_addr,uint8_t *buffer,  uint8_t n) {
-    int ret = -1;
+int i2c_read_array(struct I2CBus *bus, uint8_t dev_addr, uint8_t reg_addr,uint8_t *buffer,  uint8_t n) {
+    struct i2c_msg msgs[2] = {
+        {.addr = dev_addr, .flags = 0, .len = 1, .buf = &reg_addr},
+        {.addr = dev_addr, .flags = I2C_M_RD, .len = n, .buf = buffer}
+    };
+    struct i2c_rdwr_ioctl_data rdwr = {
+        .msgs = msgs,
+        .nmsgs = 2
+    };
 
-    // Open I2C device.
-    int fd = open(I2C_PATH, O_RDWR);
-    if (fd < 0) {
-        LOG_ERROR("Failed to open i2c.\n");
-        goto EXIT;
-    }
-    // Open I2C device.
-    if ((ret = ioctl(fd, I2C_SLAVE, dev_addr)) < 0){
-        LOG_ERROR("Failed to open device.(Address: %d)\n", dev_addr);
-        goto EXIT;
-    }
-    // Write register address.
-    if (write(fd, &reg_addr, 1) != 1) {
-        LOG_ERROR("Failed to write register.(Address: %d)\n", reg_addr);
-        goto EXIT;
-    }
-    // Read.
-    int r_cnt;
-    if ((r_cnt = read(fd, buffer, n)) != n) {
-        LOG_ERROR("Read count doesn't match.(Expect: %d, got: %d).\n", n, r_cnt);
-        goto EXIT;
+    int ret;
+    uint64_t begin = bus_stats_begin();
+    // I2C_RDWR carries the address, I2C_SLAVE isn't needed.
+    bus_arbiter_lock(bus->arbiter);
+    ret = bus->sim ? i2c_sim_read(bus, dev_addr, reg_addr, buffer, n) : ioctl(bus->fd, I2C_RDWR, &rdwr);
+    bus_arbiter_unlock(bus->arbiter);
+    bus_stats_end(i2c_stats_id(bus, dev_addr), BUS_STATS_READ, begin, n + 1, ret == 2);
+    if (ret != 2) {
+        LOG_ERROR("Failed to read.(Address: %d, register: %d, ret: %d)\n", dev_addr, reg_addr, ret);
+        return -1;
     }
+    reg_shadow_update(bus->shadows[dev_addr & 0x7f], reg_addr, buffer, n);
+    bus_record_transfer(i2c_stats_id(bus, dev_addr), BUS_STATS_READ, reg_addr, buffer, n);
     
-    ret = 0;
-    EXIT:
-    close (fd);
-    return ret;
+    return 0;
 }
 
 /**
  * @brief Write 1 byte to device.
+ * Skipped if the shadow shows register already holds data.
  * 
+ * @param bus
+ *      Handle of bus.
  * @param dev_addr
  *      Address of device.
  * @param reg_addr
@@ -154,13 +277,20 @@ int i2c_read_array(uint8_t dev_addr, uint8_t reg_addr,uint8_t *buffer,  uint8_t
  *      Data to write.
  * @return 0 if success, else -1.
 */
-int i2c_write(uint8_t dev_addr, uint8_t reg_addr, uint8_t data) {
-    return i2c_write_array(dev_addr, reg_addr, &data, 1);
+int i2c_write(struct I2CBus *bus, uint8_t dev_addr, uint8_t reg_addr, uint8_t data) {
+    uint8_t cached;
+    if (reg_shadow_get(bus->shadows[dev_addr & 0x7f], reg_addr, &cached) && cached == data) {
+        return 0;
+    }
+    return i2c_write_array(bus, dev_addr, reg_addr, &data, 1);
 }
 
 /**
  * @brief Read 1 byte from device.
+ * Served from the shadow if the register is cached.
  * 
+ * @param bus
+ *      Handle of bus.
  * @param dev_addr
  *      Address of device.
  * @param reg_addr
@@ -169,13 +299,18 @@ int i2c_write(uint8_t dev_addr, uint8_t reg_addr, uint8_t data) {
  *      Catcher of read data.
  * @return 0 if success, else -1.
 */
-int i2c_read(uint8_t dev_addr, uint8_t reg_addr, uint8_t *data) {
-    return i2c_read_array(dev_addr, reg_addr, data, 1);
+int i2c_read(struct I2CBus *bus, uint8_t dev_addr, uint8_t reg_addr, uint8_t *data) {
+    if (reg_shadow_get(bus->shadows[dev_addr & 0x7f], reg_addr, data)) {
+        return 0;
+    }
+    return i2c_read_array(bus, dev_addr, reg_addr, data, 1);
 }
 
 /**
  * @brief Write bit to register.
  * 
+ * @param bus
+ *      Handle of bus.
  * @param dev_addr
  *      Address of device.
  * @param reg_addr 
@@ -188,10 +323,10 @@ int i2c_read(uint8_t dev_addr, uint8_t reg_addr, uint8_t *data) {
  *      Offset of bits.
  * @return 0 if success, else -1.
  */
-int i2c_write_bit(uint8_t dev_addr, uint8_t reg_addr, uint8_t data,  uint8_t nbit, uint8_t offset) {
+int i2c_write_bit(struct I2CBus *bus, uint8_t dev_addr, uint8_t reg_addr, uint8_t data,  uint8_t nbit, uint8_t offset) {
     int ret;
     uint8_t orig_data;
-    if ((ret = i2c_read(dev_addr, reg_addr, &orig_data)) != 0) {
+    if ((ret = i2c_read(bus, dev_addr, reg_addr, &orig_data)) != 0) {
         LOG_ERROR("Failed to read.\n");
         goto EXIT;
     };
@@ -200,7 +335,7 @@ int i2c_write_bit(uint8_t dev_addr, uint8_t reg_addr, uint8_t data,  uint8_t nbi
     orig_data &= ~(mask << offset); // Clear bits.
     orig_data |= (data & mask) << offset; // Set bits.
     
-    if ((ret = i2c_write(dev_addr, reg_addr, orig_data)) != 0) {
+    if ((ret = i2c_write(bus, dev_addr, reg_addr, orig_data)) != 0) {
         LOG_ERROR("Failed to write.\n");
         goto EXIT;
     }
@@ -212,6 +347,8 @@ int i2c_write_bit(uint8_t dev_addr, uint8_t reg_addr, uint8_t data,  uint8_t nbi
 /**
  * @brief Read bit from register.
  * 
+ * @param bus
+ *      Handle of bus.
  * @param dev_addr
  *      Address of device.
  * @param reg_addr 
@@ -224,9 +361,9 @@ int i2c_write_bit(uint8_t dev_addr, uint8_t reg_addr, uint8_t data,  uint8_t nbi
  *      Offset of bits.
  * @return 0 if success, else -1.
  */
-int i2c_read_bit(uint8_t dev_addr, uint8_t reg_addr, uint8_t *data,  uint8_t nbit, uint8_t offset) {
+int i2c_read_bit(struct I2CBus *bus, uint8_t dev_addr, uint8_t reg_addr, uint8_t *data,  uint8_t nbit, uint8_t offset) {
     uint8_t orig_data;
-    if (i2c_read(dev_addr, reg_addr, &orig_data) != 0) {
+    if (i2c_read(bus, dev_addr, reg_addr, &orig_data) != 0) {
         LOG_ERROR("Failed to read.\n");
         return -1;
     }
@@ -235,4 +372,93 @@ int i2c_read_bit(uint8_t dev_addr, uint8_t reg_addr, uint8_t *data,  uint8_t nbi
     *data = (orig_data >> offset) & mask; // Crop out unnecessary bits.
     
     return 0;
+}
+
+/**
+ * @brief Select slave with I2C_SLAVE only if it differs from the cached one.
+ * 
+ * @param bus
+ *      Handle of bus.
+ * @param dev_addr
+ *      Address of device.
+ * @return 0 if success else -1.
+ */
+static int i2c_set_slave(struct I2CBus *bus, uint8_t dev_addr) {
+    if (bus->slave_addr == dev_addr || bus->sim) {
+        return 0;
+    }
+    if (ioctl(bus->fd, I2C_SLAVE, dev_addr) < 0) {
+        bus->slave_addr = -1;
+        return -1;
+    }
+    bus->slave_addr = dev_addr;
+    return 0;
+}
+
+/**
+ * @brief Get bus_stats id of device, registered on its first transfer.
+ * 
+ * @param bus
+ *      Handle of bus.
+ * @param dev_addr
+ *      Address of device.
+ * @return Id in bus_stats, -1 if not counted.
+ */
+static int i2c_stats_id(struct I2CBus *bus, uint8_t dev_addr) {
+    int *id = &bus->stats_ids[dev_addr & 0x7f];
+    if (*id == 0) {
+        char name[sizeof(bus->path) + sizeof("@0x7f") - 1];
+        snprintf(name, sizeof(name), "%s@0x%02x", bus->path, dev_addr);
+        *id = bus_stats_register(name) + 1;
+    }
+    return *id - 1;
+}
+
+/**
+ * @brief Write to the model of device like write() on the bus.
+ * First byte of buf is the register address.
+ * 
+ * @param bus
+ *      Handle of simulated bus.
+ * @param dev_addr
+ *      Address of device.
+ * @param buf
+ *      Bytes to write.
+ * @param len
+ *      Length of buf.
+ * @return len if success, -1 if no device answers.
+ */
+static int i2c_sim_write(struct I2CBus *bus, uint8_t dev_addr, const uint8_t *buf, int len) {
+    const struct BusSimDevice *dev = bus->sims[dev_addr & 0x7f];
+    if (dev == NULL) {
+        return -1;
+    }
+    // A lone byte is a register pointer or a command, models without commands ignore n == 0.
+    if (len > 0 && dev->write(dev, buf[0], buf + 1, len - 1) != 0) {
+        return -1;
+    }
+    return len;
+}
+
+/**
+ * @brief Read from the model of device like I2C_RDWR on the bus.
+ * 
+ * @param bus
+ *      Handle of simulated bus.
+ * @param dev_addr
+ *      Address of device.
+ * @param reg_addr
+ *      Address of register to read.
+ * @param buf
+ *      Buffer to hold read data.
+ * @param len
+ *      Length of buf.
+ * @return 2 (number of messages) if success, -1 if no device answers.
+ */
+static int i2c_sim_read(struct I2CBus *bus, uint8_t dev_addr, uint8_t reg_addr, uint8_t *buf, int len) {
+    const struct BusSimDevice *dev = bus->sims[dev_addr & 0x7f];
+    if (dev == NULL || dev->read(dev, reg_addr, buf, len) != 0) {
+        return -1;
+    }
+    return 2;
 }
\ No newline at end of file
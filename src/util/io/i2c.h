@@ -2,10 +2,11 @@
  * @file i2c.h
  * @author LIN 
  * @brief Linux I2C Utilities.
+ * One fd is kept per bus. Register reads are issued as a single
+ * I2C_RDWR write/read pair with repeated start.
+ * Transfers from several threads are ordered by bus_arbiter.
  * 
- * 
- * 
- * @version 0.1
+ * @version 0.2
  * @date 2021-08-20
  * 
  * @copyright Copyright (c) 2021
@@ -17,18 +18,30 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-bool i2c_device_exists(uint8_t dev_addr);
+#define I2C_MAX_TRANSFER 128 // Max bytes of one write including register address.
+
+struct I2CBus;
+
+struct RegShadow;
+
+struct I2CBus *i2c_open(const char *path);
+
+void i2c_close(struct I2CBus *bus);
+
+void i2c_set_shadow(struct I2CBus *bus, uint8_t dev_addr, struct RegShadow *shadow);
+
+bool i2c_device_exists(struct I2CBus *bus, uint8_t dev_addr);
 
-int i2c_write_array(uint8_t dev_addr, uint8_t reg_addr,uint8_t *buffer,  uint8_t n);
+int i2c_write_array(struct I2CBus *bus, uint8_t dev_addr, uint8_t reg_addr,uint8_t *buffer,  uint8_t n);
 
-int i2c_read_array(uint8_t dev_addr, uint8_t reg_addr,uint8_t *buffer,  uint8_t n);
+int i2c_read_array(struct I2CBus *bus, uint8_t dev_addr, uint8_t reg_addr,uint8_t *buffer,  uint8_t n);
 
-int i2c_write(uint8_t dev_addr, uint8_t reg_addr, uint8_t data);
+int i2c_write(struct I2CBus *bus, uint8_t dev_addr, uint8_t reg_addr, uint8_t data);
 
-int i2c_read(uint8_t dev_addr, uint8_t reg_addr, uint8_t *data);
+int i2c_read(struct I2CBus *bus, uint8_t dev_addr, uint8_t reg_addr, uint8_t *data);
 
-int i2c_write_bit(uint8_t dev_addr, uint8_t reg_addr, uint8_t data,  uint8_t nbit, uint8_t offset);
+int i2c_write_bit(struct I2CBus *bus, uint8_t dev_addr, uint8_t reg_addr, uint8_t data,  uint8_t nbit, uint8_t offset);
 
-int i2c_read_bit(uint8_t dev_addr, uint8_t reg_addr, uint8_t *data,  uint8_t nbit, uint8_t offset);
+int i2c_read_bit(struct I2CBus *bus, uint8_t dev_addr, uint8_t reg_addr, uint8_t *data,  uint8_t nbit, uint8_t offset);
 
 #endif // _I2C_H_
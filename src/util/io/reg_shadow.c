@@ -0,0 +1,127 @@
+#include "reg_shadow.h"
+
+#include "util/logger.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct RegShadow {
+    uint8_t value[256]; // Last known value of every register.
+    bool valid[256]; // True if value is known.
+    bool is_volatile[256]; // True if register can change by itself, never cached.
+};
+
+/**
+ * @brief Create an empty register shadow.
+ * 
+ * @return Created shadow, NULL if fail.
+ */
+struct RegShadow *reg_shadow_init() {
+    struct RegShadow *shadow = malloc(sizeof(struct RegShadow));
+    if (shadow == NULL) {
+        LOG_ERROR("Failed to allocate shadow.\n");
+        return NULL;
+    }
+    memset(shadow, 0, sizeof(struct RegShadow));
+    return shadow;
+}
+
+/**
+ * @brief Destroy the shadow.
+ * 
+ * @param shadow 
+ *      The shadow.
+ */
+void reg_shadow_destroy(struct RegShadow *shadow) {
+    free(shadow);
+}
+
+/**
+ * @brief Mark registers which must always be accessed on the bus.
+ * e.g. Status, data and self-clearing registers.
+ * 
+ * @param shadow 
+ *      The shadow.
+ * @param reg_addr 
+ *      First register.
+ * @param n 
+ *      Number of registers.
+ */
+void reg_shadow_set_volatile(struct RegShadow *shadow, uint8_t reg_addr, int n) {
+    int i;
+    for (i = reg_addr; i < reg_addr + n && i < 256; i++) {
+        shadow->is_volatile[i] = true;
+        shadow->valid[i] = false;
+    }
+}
+
+/**
+ * @brief Check if register is marked volatile.
+ * 
+ * @param shadow 
+ *      The shadow, can be NULL.
+ * @param reg_addr 
+ *      Address of register.
+ * @return True if volatile or shadow is NULL else false.
+ */
+bool reg_shadow_is_volatile(struct RegShadow *shadow, uint8_t reg_addr) {
+    return shadow == NULL || shadow->is_volatile[reg_addr];
+}
+
+/**
+ * @brief Forget every cached value. Call after the device is reset.
+ * 
+ * @param shadow 
+ *      The shadow, can be NULL.
+ */
+void reg_shadow_invalidate(struct RegShadow *shadow) {
+    if (shadow == NULL) {
+        return;
+    }
+    memset(shadow->valid, 0, sizeof(shadow->valid));
+}
+
+/**
+ * @brief Get the cached value of register.
+ * 
+ * @param shadow 
+ *      The shadow, can be NULL.
+ * @param reg_addr 
+ *      Address of register.
+ * @param data 
+ *      Catcher of cached value.
+ * @return True if cached else false.
+ */
+bool reg_shadow_get(struct RegShadow *shadow, uint8_t reg_addr, uint8_t *data) {
+    if (shadow == NULL || !shadow->valid[reg_addr]) {
+        return false;
+    }
+    *data = shadow->value[reg_addr];
+    return true;
+}
+
+/**
+ * @brief Record values read from or written to consecutive registers.
+ * Volatile registers are skipped.
+ * 
+ * @param shadow 
+ *      The shadow, can be NULL.
+ * @param reg_addr 
+ *      First register.
+ * @param data 
+ *      Values.
+ * @param n 
+ *      Number of registers.
+ */
+void reg_shadow_update(struct RegShadow *shadow, uint8_t reg_addr, const uint8_t *data, int n) {
+    if (shadow == NULL) {
+        return;
+    }
+    int i;
+    for (i = 0; i < n && reg_addr + i < 256; i++) {
+        if (!shadow->is_volatile[reg_addr + i]) {
+            shadow->value[reg_addr + i] = data[i];
+            shadow->valid[reg_addr + i] = true;
+        }
+    }
+}
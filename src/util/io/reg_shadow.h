@@ -0,0 +1,37 @@
+/**
+ * @file reg_shadow.h
+ * @author agent
+ * @brief Register shadow of a device.
+ * Keeps the last known value of registers so read-modify-write helpers can
+ * skip the read, and writes of an unchanged value can be skipped. Registers
+ * marked volatile are never cached.
+ * 
+ * @version 0.1
+ * @date 2026-10-17
+ * 
+ * @copyright Copyright (c) 2026
+ * 
+ */
+#ifndef _REG_SHADOW_H_
+#define _REG_SHADOW_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct RegShadow;
+
+struct RegShadow *reg_shadow_init();
+
+void reg_shadow_destroy(struct RegShadow *shadow);
+
+void reg_shadow_set_volatile(struct RegShadow *shadow, uint8_t reg_addr, int n);
+
+bool reg_shadow_is_volatile(struct RegShadow *shadow, uint8_t reg_addr);
+
+void reg_shadow_invalidate(struct RegShadow *shadow);
+
+bool reg_shadow_get(struct RegShadow *shadow, uint8_t reg_addr, uint8_t *data);
+
+void reg_shadow_update(struct RegShadow *shadow, uint8_t reg_addr, const uint8_t *data, int n);
+
+#endif // _REG_SHADOW_H_
@@ -1,6 +1,11 @@
 #include "spi.h"
 
 #include "util/logger.h"
+#include "reg_shadow.h"
+#include "bus_stats.h"
+#include "bus_record.h"
+#include "bus_arbiter.h"
+#include "bus_sim.h"
 
 #include <stdlib.h>
 #include <unistd.h>
@@ -9,80 +14,282 @@
 #include <linux/spi/spidev.h>
 #include <string.h>
 
-static int spi_transfer(const char *dev, uint8_t *tx, uint8_t *rx, uint8_t n);
+struct SPIDevice {
+    int fd; // File descriptor, kept open until spi_close. -1 if simulated.
+    const struct BusSimDevice *sim; // Simulated device, NULL for real device.
+    struct spi_ioc_transfer xfer; // Preallocated transfer descriptor bound to tx_buf/rx_buf.
+    uint32_t speed_hz[SPI_PROFILE_COUNT]; // Clock of each profile.
+    uint32_t max_speed_hz; // Max speed set to device, the fastest profile.
+    uint8_t tx_buf[SPI_MAX_TRANSFER]; // Transmit buffer.
+    uint8_t rx_buf[SPI_MAX_TRANSFER]; // Receive buffer.
+    struct RegShadow *shadow; // Register shadow, NULL if not attached.
+    int stats_id; // Id in bus_stats, -1 if not counted.
+    struct BusArbiter *arbiter; // Shared by chip selects of one controller, held during a message.
+};
 
-bool spi_device_exists(const char *dev) {
-    uint8_t tx_buf[1] = {0x01};
-    uint8_t rx_buf[1] = {0};
+struct SPITransaction {
+    struct spi_ioc_transfer *xfers; // One descriptor per segment.
+    uint8_t **dest; // Caller buffer of each read segment, NULL for write.
+    enum SPI_PROFILE *profile; // Clock profile of each segment.
+    int max_segments; // Capacity of xfers.
+    int n_segments; // Segments queued.
+    int used; // Bytes of tx_buf/rx_buf used by queued segments.
+    uint8_t tx_buf[SPI_TRANSACTION_BUFFER]; // Transmit bytes of all segments.
+    uint8_t rx_buf[SPI_TRANSACTION_BUFFER]; // Receive bytes of all segments.
+};
 
-    return spi_transfer(dev, tx_buf, rx_buf, 1);
+static int spi_transfer(struct SPIDevice *spi, enum SPI_PROFILE profile, int n);
+
+static int spi_message(struct SPIDevice *spi, struct spi_ioc_transfer *xfers, int n);
+
+static int spi_message_locked(struct SPIDevice *spi, struct spi_ioc_transfer *xfers, int n);
+
+static int spi_transaction_transfer(struct SPIDevice *spi, struct SPITransaction *t);
+
+static struct spi_ioc_transfer *spi_transaction_add(struct SPITransaction *t, enum SPI_PROFILE profile, uint8_t reg_addr, uint8_t n);
+
+/**
+ * @brief Open SPI device and apply mode, bits per word and speed once.
+ * Every profile starts with speed_hz. If a model is attached to path by
+ * bus_sim_attach, the model is used instead.
+ * 
+ * @param path
+ *      Path of device.
+ * @param mode
+ *      SPI_MODE_0 ~ SPI_MODE_3.
+ * @param bits_per_word
+ *      Bits per word.
+ * @param speed_hz
+ *      Clock speed in Hz.
+ * @return Handle of device, NULL if fail.
+ */
+struct SPIDevice *spi_open(const char *path, uint8_t mode, uint8_t bits_per_word, uint32_t speed_hz) {
+    struct SPIDevice *spi = malloc(sizeof(struct SPIDevice));
+    if (spi == NULL) {
+        LOG_ERROR("Failed to allocate device.\n");
+        return NULL;
+    }
+    memset(spi, 0, sizeof(struct SPIDevice));
+    spi->stats_id = bus_stats_register(path);
+    spi->fd = -1;
+    int i;
+
+    // "/dev/spidev0.1" is arbitrated as "/dev/spidev0".
+    char bus_path[BUS_STATS_NAME_LEN];
+    strncpy(bus_path, path, sizeof(bus_path) - 1);
+    bus_path[sizeof(bus_path) - 1] = '\0';
+    char *dot = strrchr(bus_path, '.');
+    if (dot != NULL) {
+        *dot = '\0';
+    }
+    spi->arbiter = bus_arbiter_get(bus_path);
+
+    //----- Simulated device.
+    if ((spi->sim = bus_sim_find(path, BUS_SIM_NO_ADDR)) != NULL) {
+        goto PREPARE;
+    }
+
+    //----- Open fd.
+    spi->fd = open(path, O_RDWR);
+    if (spi->fd < 0) {
+        LOG_ERROR("Failed to open \"%s\".\n", path);
+        goto ERROR;
+    }
+
+    //----- Apply settings.
+    if (ioctl(spi->fd, SPI_IOC_WR_MODE, &mode) < 0) {
+        LOG_ERROR("Failed to set mode.\n");
+        goto ERROR;
+    }
+    if (ioctl(spi->fd, SPI_IOC_WR_BITS_PER_WORD, &bits_per_word) < 0) {
+        LOG_ERROR("Failed to set bits per word.\n");
+        goto ERROR;
+    }
+    if (ioctl(spi->fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed_hz) < 0) {
+        LOG_ERROR("Failed to set speed.\n");
+        goto ERROR;
+    }
+
+    PREPARE:
+    for (i = 0; i < SPI_PROFILE_COUNT; i++) {
+        spi->speed_hz[i] = speed_hz;
+    }
+    spi->max_speed_hz = speed_hz;
+
+    //----- Prepare spi_ioc_transfer struct.
+    spi->xfer.bits_per_word = bits_per_word;
+    spi->xfer.delay_usecs = 0;
+    spi->xfer.tx_buf = (unsigned long)spi->tx_buf;
+    spi->xfer.rx_buf = (unsigned long)spi->rx_buf;
+
+    return spi;
+
+    ERROR:
+    if (spi->fd >= 0) {
+        close(spi->fd);
+    }
+    free(spi);
+    return NULL;
 }
 
-int spi_write_array(const char *dev, uint8_t reg_addr,uint8_t *buffer,  uint8_t n) {
-    unsigned char tx_buf[255];
-    unsigned char rx_buf[255];
-    
-    tx_buf[0] = reg_addr;
-    memcpy(tx_buf + 1, buffer, n);
+/**
+ * @brief Close device and free the handle.
+ * 
+ * @param spi
+ *      Handle of device.
+ */
+void spi_close(struct SPIDevice *spi) {
+    if (spi == NULL) {
+        return;
+    }
+    if (spi->fd >= 0) {
+        close(spi->fd);
+    }
+    free(spi);
+}
+
+/**
+ * @brief Attach a register shadow to device.
+ * Single byte reads/writes and bit helpers consult the shadow afterward.
+ * Shadow is owned by caller.
+ * 
+ * @param spi
+ *      Handle of device.
+ * @param shadow
+ *      The shadow, NULL to detach.
+ */
+void spi_set_shadow(struct SPIDevice *spi, struct RegShadow *shadow) {
+    spi->shadow = shadow;
+}
+
+/**
+ * @brief Check if the device can be transferred with.
+ * 
+ * @param spi
+ *      Handle of device.
+ * @return True if transfer success else false.
+ */
+bool spi_device_exists(struct SPIDevice *spi) {
+    spi->tx_buf[0] = 0x01;
+
+    return spi_transfer(spi, SPI_PROFILE_CONFIG, 1) == 0;
+}
+
+/**
+ * @brief Set clock of a profile.
+ * Max speed of device is raised if the profile is faster than it.
+ * 
+ * @param spi
+ *      Handle of device.
+ * @param profile
+ *      Profile to set.
+ * @param speed_hz
+ *      Clock speed in Hz.
+ * @return 0 if success else -1.
+ */
+int spi_set_profile_speed(struct SPIDevice *spi, enum SPI_PROFILE profile, uint32_t speed_hz) {
+    if (profile < 0 || profile >= SPI_PROFILE_COUNT) {
+        LOG_ERROR("Invalid profile %d.\n", profile);
+        return -1;
+    }
+    if (speed_hz > spi->max_speed_hz) {
+        if (spi->sim == NULL && ioctl(spi->fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed_hz) < 0) {
+            LOG_ERROR("Failed to set speed.\n");
+            return -1;
+        }
+        spi->max_speed_hz = speed_hz;
+    }
+    spi->speed_hz[profile] = speed_hz;
+    return 0;
+}
+
+int spi_write_array(struct SPIDevice *spi, uint8_t reg_addr,uint8_t *buffer,  uint8_t n) {
+    spi->tx_buf[0] = reg_addr;
+    memcpy(spi->tx_buf + 1, buffer, n);
     
-    return spi_transfer(dev, tx_buf, rx_buf, n + 1);
+    if (spi_transfer(spi, SPI_PROFILE_CONFIG, n + 1) < 0) {
+        return -1;
+    }
+    reg_shadow_update(spi->shadow, reg_addr, buffer, n);
+    return 0;
 }
 
-int spi_read_array(const char *dev, uint8_t reg_addr,uint8_t *buffer,  uint8_t n) {
-    unsigned char tx_buf[255];
-    unsigned char rx_buf[255] = {0};
+int spi_read_array(struct SPIDevice *spi, uint8_t reg_addr,uint8_t *buffer,  uint8_t n) {
+    return spi_read_array_at(spi, SPI_PROFILE_CONFIG, reg_addr, buffer, n);
+}
 
-    tx_buf[0] = reg_addr | 0x80;
-    int ret = -1;
+/**
+ * @brief Read data from device with clock of the profile.
+ * 
+ * @param spi
+ *      Handle of device.
+ * @param profile
+ *      Clock profile of the transfer.
+ * @param reg_addr
+ *      Address of register to read.
+ * @param buffer
+ *      Buffer to hold read data.
+ * @param n
+ *      Length of buffer.
+ * @return 0 if success, else -1.
+ */
+int spi_read_array_at(struct SPIDevice *spi, enum SPI_PROFILE profile, uint8_t reg_addr, uint8_t *buffer, uint8_t n) {
+    spi->tx_buf[0] = reg_addr | 0x80;
+    memset(spi->tx_buf + 1, 0, n);
     
-    if (spi_transfer(dev, tx_buf, rx_buf, n + 1) < 0) {
+    if (spi_transfer(spi, profile, n + 1) < 0) {
         LOG_ERROR("Failed to transfer.\n");
-        goto EXIT;
-    }
-    int i;
-    for(i = 0; i < n; i++) {
-        buffer[i] = rx_buf[i + 1];
+        return -1;
     }
-    ret = 0;
-    EXIT:
-    return ret;
+    memcpy(buffer, spi->rx_buf + 1, n);
+    reg_shadow_update(spi->shadow, reg_addr, buffer, n);
+    return 0;
 }
 
 /**
  * @brief Write 1 byte to device.
+ * Skipped if the shadow shows register already holds data.
  * 
- * @param dev
- *      Path of device.
+ * @param spi
+ *      Handle of device.
  * @param reg_addr
  *      Address of register to read/write.
  * @param data
  *      Data to write.
  * @return 0 if success, else -1.
 */
-int spi_write(const char *dev, uint8_t reg_addr, uint8_t data) {
-    return spi_write_array(dev, reg_addr, &data, 1);
+int spi_write(struct SPIDevice *spi, uint8_t reg_addr, uint8_t data) {
+    uint8_t cached;
+    if (reg_shadow_get(spi->shadow, reg_addr, &cached) && cached == data) {
+        return 0;
+    }
+    return spi_write_array(spi, reg_addr, &data, 1);
 }
 
 /**
  * @brief Read 1 byte from device.
+ * Served from the shadow if the register is cached.
  * 
- * @param dev
- *      path of device.
+ * @param spi
+ *      Handle of device.
  * @param reg_addr
  *      Address of register to read.
  * @param data
  *      Catcher of read data.
  * @return 0 if success, else -1.
 */
-int spi_read(const char *dev, uint8_t reg_addr, uint8_t *data) {
-    return spi_read_array(dev, reg_addr, data, 1);
+int spi_read(struct SPIDevice *spi, uint8_t reg_addr, uint8_t *data) {
+    if (reg_shadow_get(spi->shadow, reg_addr, data)) {
+        return 0;
+    }
+    return spi_read_array(spi, reg_addr, data, 1);
 }
 
 /**
  * @brief Write bit to register.
  * 
- * @param dev
- *      Path of device.
+ * @param spi
+ *      Handle of device.
  * @param reg_addr 
  *      Address of register.
  * @param data 
@@ -93,24 +300,24 @@ int spi_read(const char *dev, uint8_t reg_addr, uint8_t *data) {
  *      Offset of bits.
  * @return 0 if success, else -1.
  */
-int spi_write_bit(const char *dev, uint8_t reg_addr, uint8_t data,  uint8_t nbit, uint8_t offset) {
+int spi_write_bit(struct SPIDevice *spi, uint8_t reg_addr, uint8_t data,  uint8_t nbit, uint8_t offset) {
     uint8_t mask, data_mask;
     mask = (1 << nbit) - 1;
     data_mask = mask << offset;
     data = (data & mask) << offset;
     
     uint8_t orig_data;
-    if (spi_read(dev, reg_addr, &orig_data) != 0) {
-        LOG_ERROR("Failed to read.\n");
-        return -1;
+    if (!reg_shadow_get(spi->shadow, reg_addr, &orig_data)) {
+        if (spi_read(spi, reg_addr, &orig_data) != 0) {
+            LOG_ERROR("Failed to read.\n");
+            return -1;
+        }
     }
-
-    usleep(1000);
     
     orig_data &= ~data_mask;
     orig_data |= data;
     
-    if (spi_write(dev, reg_addr, orig_data) < 0) {
+    if (spi_write(spi, reg_addr, orig_data) < 0) {
         LOG_ERROR("Failed to write.\n");
         return -1;
     }
@@ -121,8 +328,8 @@ int spi_write_bit(const char *dev, uint8_t reg_addr, uint8_t data,  uint8_t nbit
 /**
  * @brief Read bit from register.
  * 
- * @param dev
- *      Path of device.
+ * @param spi
+ *      Handle of device.
  * @param reg_addr 
  *      Address of register.
  * @param data 
@@ -133,9 +340,9 @@ int spi_write_bit(const char *dev, uint8_t reg_addr, uint8_t data,  uint8_t nbit
  *      Offset of bits.
  * @return 0 if success, else -1.
  */
-int spi_read_bit(const char *dev, uint8_t reg_addr, uint8_t *data,  uint8_t nbit, uint8_t offset) {
+int spi_read_bit(struct SPIDevice *spi, uint8_t reg_addr, uint8_t *data,  uint8_t nbit, uint8_t offset) {
     uint8_t orig_data;
-    if (spi_read(dev, reg_addr, &orig_data) != 0) {
+    if (spi_read(spi, reg_addr, &orig_data) != 0) {
         LOG_ERROR("Failed to read.\n");
         return -1;
     }
@@ -146,33 +353,328 @@ int spi_read_bit(const char *dev, uint8_t reg_addr, uint8_t *data,  uint8_t nbit
 }
 
 
-static int spi_transfer(const char *dev, uint8_t *tx, uint8_t *rx, uint8_t n) {
-    //----- Prepare spi_ioc_transfer struct.
-    struct spi_ioc_transfer _spi;
-    memset(&_spi, 0, sizeof(struct spi_ioc_transfer));
-    _spi.bits_per_word = 8;
-    _spi.speed_hz = 1000000;
-    _spi.len = n;
-    _spi.delay_usecs = 0;
-    _spi.tx_buf = (unsigned long)tx;
-    _spi.rx_buf = (unsigned long)rx;
+/**
+ * @brief Transfer the first n bytes of tx_buf through the preallocated descriptor.
+ * 
+ * @param spi
+ *      Handle of device.
+ * @param profile
+ *      Clock profile of the transfer.
+ * @param n
+ *      Number of bytes.
+ * @return 0 if success else -1.
+ */
+static int spi_transfer(struct SPIDevice *spi, enum SPI_PROFILE profile, int n) {
+    spi->xfer.len = n;
+    spi->xfer.speed_hz = spi->speed_hz[profile];
 
-    //----- Open fd.
-    int spi_fd = open(dev, O_RDWR);
-    int ret = -1;
-    if (spi_fd < 0) {
-        LOG_ERROR("Failed to open \"%s\".\n", dev);
-        goto EXIT;
+    int ret;
+    uint64_t begin = bus_stats_begin();
+    ret = spi_message(spi, &spi->xfer, 1);
+    bus_stats_end(spi->stats_id, spi->tx_buf[0] & 0x80 ? BUS_STATS_READ : BUS_STATS_WRITE, begin, n, ret == n);
+    if (ret != n) {
+        LOG_ERROR("Transfer length doesn't match.(expect: %d, got: %d)\n", n, ret);
+        return -1;
+    }
+    if (spi->tx_buf[0] & 0x80) {
+        bus_record_transfer(spi->stats_id, BUS_STATS_READ, spi->tx_buf[0] & 0x7f, spi->rx_buf + 1, n - 1);
+    } else {
+        bus_record_transfer(spi->stats_id, BUS_STATS_WRITE, spi->tx_buf[0], spi->tx_buf + 1, n - 1);
     }
+    return 0;
+}
 
-    //----- Transfer.
-    if ((ret = ioctl(spi_fd, SPI_IOC_MESSAGE(1), &_spi)) != n) {
-        LOG_ERROR("Transfer length doesn't match.(expect: %d, got: %d)\n", n, ret);
-        ret = -1;
-        goto EXIT;
+/**
+ * @brief Issue an SPI message to the device or its model.
+ * 
+ * @param spi
+ *      Handle of device.
+ * @param xfers
+ *      Descriptors of segments.
+ * @param n
+ *      Number of segments.
+ * @return Bytes transferred, negative if fail.
+ */
+static int spi_message(struct SPIDevice *spi, struct spi_ioc_transfer *xfers, int n) {
+    bus_arbiter_lock(spi->arbiter);
+    int len = spi_message_locked(spi, xfers, n);
+    bus_arbiter_unlock(spi->arbiter);
+    return len;
+}
+
+/**
+ * @brief Same as spi_message, but the arbiter of device is held by caller.
+ * 
+ * @param spi
+ *      Handle of device.
+ * @param xfers
+ *      Descriptors of segments.
+ * @param n
+ *      Number of segments.
+ * @return Bytes transferred, negative if fail.
+ */
+static int spi_message_locked(struct SPIDevice *spi, struct spi_ioc_transfer *xfers, int n) {
+    if (spi->sim == NULL) {
+        return ioctl(spi->fd, SPI_IOC_MESSAGE(n), xfers);
+    }
+    int i, ret, len = 0;
+    for (i = 0; i < n; i++) {
+        ret = bus_sim_spi_transfer(spi->sim,
+            (uint8_t *)(unsigned long)xfers[i].tx_buf,
+            (uint8_t *)(unsigned long)xfers[i].rx_buf,
+            xfers[i].len);
+        if (ret < 0) {
+            return -1;
+        }
+        len += ret;
+    }
+    return len;
+}
+
+//----- Transaction functions.
+
+/**
+ * @brief Create an empty transaction.
+ * A transaction can be built once and submitted repeatedly.
+ * 
+ * @param max_segments
+ *      Max number of register accesses in the transaction.
+ * @return Created transaction, NULL if fail.
+ */
+struct SPITransaction *spi_transaction_init(int max_segments) {
+    struct SPITransaction *t = malloc(sizeof(struct SPITransaction));
+    if (t == NULL) {
+        LOG_ERROR("Failed to allocate transaction.\n");
+        return NULL;
+    }
+    memset(t, 0, sizeof(struct SPITransaction));
+    t->xfers = calloc(max_segments, sizeof(struct spi_ioc_transfer));
+    t->dest = calloc(max_segments, sizeof(uint8_t *));
+    t->profile = calloc(max_segments, sizeof(enum SPI_PROFILE));
+    if (t->xfers == NULL || t->dest == NULL || t->profile == NULL) {
+        LOG_ERROR("Failed to allocate segments.\n");
+        spi_transaction_destroy(t);
+        return NULL;
+    }
+    t->max_segments = max_segments;
+    return t;
+}
+
+/**
+ * @brief Destroy the transaction.
+ * 
+ * @param t
+ *      The transaction.
+ */
+void spi_transaction_destroy(struct SPITransaction *t) {
+    if (t == NULL) {
+        return;
+    }
+    free(t->xfers);
+    free(t->dest);
+    free(t->profile);
+    free(t);
+}
+
+/**
+ * @brief Remove every queued segment.
+ * 
+ * @param t
+ *      The transaction.
+ */
+void spi_transaction_clear(struct SPITransaction *t) {
+    memset(t->xfers, 0, sizeof(struct spi_ioc_transfer) * t->max_segments);
+    t->n_segments = 0;
+    t->used = 0;
+}
+
+/**
+ * @brief Queue a register write. Data is copied at once.
+ * 
+ * @param t
+ *      The transaction.
+ * @param profile
+ *      Clock profile of the segment.
+ * @param reg_addr
+ *      Address of register to write.
+ * @param buffer
+ *      Data to write.
+ * @param n
+ *      Length of data.
+ * @return Index of segment if success else -1.
+ */
+int spi_transaction_add_write(struct SPITransaction *t, enum SPI_PROFILE profile, uint8_t reg_addr, uint8_t *buffer, uint8_t n) {
+    struct spi_ioc_transfer *xfer = spi_transaction_add(t, profile, reg_addr, n);
+    if (xfer == NULL) {
+        return -1;
     }
-    ret = 0;
-    EXIT:
-    close(spi_fd);
+    memcpy((uint8_t *)(unsigned long)xfer->tx_buf + 1, buffer, n);
+    t->dest[t->n_segments - 1] = NULL;
+    return t->n_segments - 1;
+}
+
+/**
+ * @brief Queue a register read.
+ * 
+ * @param t
+ *      The transaction.
+ * @param profile
+ *      Clock profile of the segment.
+ * @param reg_addr
+ *      Address of register to read.
+ * @param buffer
+ *      Buffer to hold read data, filled by every spi_transaction_submit.
+ * @param n
+ *      Length of buffer.
+ * @return Index of segment if success else -1.
+ */
+int spi_transaction_add_read(struct SPITransaction *t, enum SPI_PROFILE profile, uint8_t reg_addr, uint8_t *buffer, uint8_t n) {
+    struct spi_ioc_transfer *xfer = spi_transaction_add(t, profile, reg_addr | 0x80, n);
+    if (xfer == NULL) {
+        return -1;
+    }
+    t->dest[t->n_segments - 1] = buffer;
+    return t->n_segments - 1;
+}
+
+/**
+ * @brief Transfer every queued segment with one ioctl.
+ * Chip select is released between segments. Read segments are copied to
+ * their buffers after the transfer. Each segment is clocked at the speed
+ * of its profile on this device.
+ * 
+ * @param spi
+ *      Handle of device.
+ * @param t
+ *      The transaction.
+ * @return 0 if success else -1.
+ */
+int spi_transaction_submit(struct SPIDevice *spi, struct SPITransaction *t) {
+    bus_arbiter_lock(spi->arbiter);
+    int ret = spi_transaction_transfer(spi, t);
+    bus_arbiter_unlock(spi->arbiter);
     return ret;
+}
+
+/**
+ * @brief Submit transactions of several devices back to back, e.g. the same
+ * registers of redundant sensors. The arbiter is held across the devices
+ * sharing it, so no other transfer gets in between and the readings are
+ * taken as close together as chip selects allow.
+ * A failed transaction doesn't stop the others.
+ * 
+ * @param spi
+ *      Handles of devices.
+ * @param t
+ *      Transaction of each device.
+ * @param n
+ *      Number of devices.
+ * @param ret
+ *      Set to 0 if the transaction of each device succeeded else -1. NULL to ignore.
+ * @return 0 if all succeeded else -1.
+ */
+int spi_transaction_submit_all(struct SPIDevice **spi, struct SPITransaction **t, int n, int *ret) {
+    struct BusArbiter *held = NULL;
+    int i, result = 0;
+    for (i = 0; i < n; i++) {
+        if (i == 0 || spi[i]->arbiter != held) {
+            bus_arbiter_unlock(held);
+            held = spi[i]->arbiter;
+            bus_arbiter_lock(held);
+        }
+        int r = spi_transaction_transfer(spi[i], t[i]);
+        if (ret != NULL) {
+            ret[i] = r;
+        }
+        if (r != 0) {
+            result = -1;
+        }
+    }
+    bus_arbiter_unlock(held);
+    return result;
+}
+
+/**
+ * @brief Build the transaction queued for device and transfer it.
+ * The arbiter of device is held by caller.
+ * 
+ * @param spi
+ *      Handle of device.
+ * @param t
+ *      The transaction.
+ * @return 0 if success else -1.
+ */
+static int spi_transaction_transfer(struct SPIDevice *spi, struct SPITransaction *t) {
+    if (t->n_segments == 0) {
+        return 0;
+    }
+    int i;
+    enum BUS_STATS_DIR dir = BUS_STATS_WRITE; // Counted as read if any segment reads.
+    for (i = 0; i < t->n_segments; i++) {
+        t->xfers[i].speed_hz = spi->speed_hz[t->profile[i]];
+        if (t->dest[i] != NULL) {
+            dir = BUS_STATS_READ;
+        }
+    }
+    int ret;
+    uint64_t begin = bus_stats_begin();
+    ret = spi_message_locked(spi, t->xfers, t->n_segments);
+    bus_stats_end(spi->stats_id, dir, begin, t->used, ret == t->used);
+    if (ret != t->used) {
+        LOG_ERROR("Transfer length doesn't match.(expect: %d, got: %d)\n", t->used, ret);
+        return -1;
+    }
+    for (i = 0; i < t->n_segments; i++) {
+        uint8_t *tx = (uint8_t *)(unsigned long)t->xfers[i].tx_buf;
+        if (t->dest[i] != NULL) {
+            memcpy(t->dest[i], (uint8_t *)(unsigned long)t->xfers[i].rx_buf + 1, t->xfers[i].len - 1);
+            bus_record_transfer(spi->stats_id, BUS_STATS_READ, tx[0] & 0x7f, t->dest[i], t->xfers[i].len - 1);
+        } else {
+            bus_record_transfer(spi->stats_id, BUS_STATS_WRITE, tx[0], tx + 1, t->xfers[i].len - 1);
+            // Keep the shadow coherent with registers written by the transaction.
+            reg_shadow_update(spi->shadow, tx[0], tx + 1, t->xfers[i].len - 1);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Reserve a segment of n data bytes after the register address.
+ * 
+ * @param t
+ *      The transaction.
+ * @param profile
+ *      Clock profile of segment.
+ * @param reg_addr
+ *      First byte of segment.
+ * @param n
+ *      Number of data bytes.
+ * @return Descriptor of segment, NULL if transaction is full.
+ */
+static struct spi_ioc_transfer *spi_transaction_add(struct SPITransaction *t, enum SPI_PROFILE profile, uint8_t reg_addr, uint8_t n) {
+    if (t->n_segments >= t->max_segments || t->used + n + 1 > SPI_TRANSACTION_BUFFER) {
+        LOG_ERROR("Transaction is full.\n");
+        return NULL;
+    }
+    if (profile < 0 || profile >= SPI_PROFILE_COUNT) {
+        LOG_ERROR("Invalid profile %d.\n", profile);
+        return NULL;
+    }
+    if (t->n_segments > 0) {
+        // Release chip select after the previous segment.
+        t->xfers[t->n_segments - 1].cs_change = 1;
+    }
+    struct spi_ioc_transfer *xfer = &t->xfers[t->n_segments];
+    memset(xfer, 0, sizeof(struct spi_ioc_transfer));
+    xfer->tx_buf = (unsigned long)(t->tx_buf + t->used);
+    xfer->rx_buf = (unsigned long)(t->rx_buf + t->used);
+    xfer->len = n + 1;
+    // speed_hz is filled from the profile on submit, bits_per_word left 0 to use the setting of device.
+    t->profile[t->n_segments] = profile;
+    t->tx_buf[t->used] = reg_addr;
+    memset(t->tx_buf + t->used + 1, 0, n);
+
+    t->used += n + 1;
+    t->n_segments++;
+    return xfer;
 }
\ No newline at end of file
@@ -2,10 +2,14 @@
  * @file spi.h
  * @author LIN 
  * @brief Linux SPI utilities.
- * WIP
+ * Devices are opened once by spi_open and keep their fd, settings
+ * and transfer descriptor until spi_close.
+ * SPITransaction queues several register accesses into one SPI_IOC_MESSAGE.
+ * Every access picks a clock profile, e.g. slow for configuration and fast
+ * for sensor data.
+ * Messages of every chip select on one controller are ordered by bus_arbiter.
  * 
- * 
- * @version 0.1
+ * @version 0.2
  * @date 2021-09-08
  * 
  * @copyright Copyright (c) 2021
@@ -17,18 +21,59 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-bool spi_device_exists(const char *dev);
+#define SPI_MAX_TRANSFER (1 + UINT8_MAX) // Register address and the longest uint8_t length, so no length check is needed.
+#define SPI_TRANSACTION_BUFFER 512 // Bytes shared by all segments of one transaction.
+
+//-----Enums-----
+enum SPI_PROFILE {
+    SPI_PROFILE_CONFIG = 0, // Clock for configuration registers.
+    SPI_PROFILE_DATA = 1, // Clock for sensor data and status registers.
+    SPI_PROFILE_COUNT
+};
+
+struct SPIDevice;
+
+struct SPITransaction;
+
+struct RegShadow;
+
+struct SPIDevice *spi_open(const char *path, uint8_t mode, uint8_t bits_per_word, uint32_t speed_hz);
+
+void spi_close(struct SPIDevice *spi);
+
+bool spi_device_exists(struct SPIDevice *spi);
+
+int spi_set_profile_speed(struct SPIDevice *spi, enum SPI_PROFILE profile, uint32_t speed_hz);
+
+void spi_set_shadow(struct SPIDevice *spi, struct RegShadow *shadow);
+
+int spi_write_array(struct SPIDevice *spi, uint8_t reg_addr,uint8_t *buffer,  uint8_t n);
+
+int spi_read_array(struct SPIDevice *spi, uint8_t reg_addr,uint8_t *buffer,  uint8_t n);
+
+int spi_read_array_at(struct SPIDevice *spi, enum SPI_PROFILE profile, uint8_t reg_addr, uint8_t *buffer, uint8_t n);
+
+int spi_write(struct SPIDevice *spi, uint8_t reg_addr, uint8_t data);
+
+int spi_read(struct SPIDevice *spi, uint8_t reg_addr, uint8_t *data);
+
+int spi_write_bit(struct SPIDevice *spi, uint8_t reg_addr, uint8_t data,  uint8_t nbit, uint8_t offset);
+
+int spi_read_bit(struct SPIDevice *spi, uint8_t reg_addr, uint8_t *data,  uint8_t nbit, uint8_t offset);
+
+//----- Transaction functions.
+struct SPITransaction *spi_transaction_init(int max_segments);
 
-int spi_write_array(const char *dev, uint8_t reg_addr,uint8_t *buffer,  uint8_t n);
+void spi_transaction_destroy(struct SPITransaction *t);
 
-int spi_read_array(const char *dev, uint8_t reg_addr,uint8_t *buffer,  uint8_t n);
+void spi_transaction_clear(struct SPITransaction *t);
 
-int spi_write(const char *dev, uint8_t reg_addr, uint8_t data);
+int spi_transaction_add_write(struct SPITransaction *t, enum SPI_PROFILE profile, uint8_t reg_addr, uint8_t *buffer, uint8_t n);
 
-int spi_read(const char *dev, uint8_t reg_addr, uint8_t *data);
+int spi_transaction_add_read(struct SPITransaction *t, enum SPI_PROFILE profile, uint8_t reg_addr, uint8_t *buffer, uint8_t n);
 
-int spi_write_bit(const char *dev, uint8_t reg_addr, uint8_t data,  uint8_t nbit, uint8_t offset);
+int spi_transaction_submit(struct SPIDevice *spi, struct SPITransaction *t);
 
-int spi_read_bit(const char *dev, uint8_t reg_addr, uint8_t *data,  uint8_t nbit, uint8_t offset);
+int spi_transaction_submit_all(struct SPIDevice **spi, struct SPITransaction **t, int n, int *ret);
 
 #endif // _SPI_H_
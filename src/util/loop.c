@@ -4,12 +4,26 @@
 
 #include <pthread.h>
 
+#define LOOP_TRIGGER_MAX_FAILS 10 // Consecutive failed waits before busy loop takes over for good.
+
 static struct timeval _loop_tv;
 
 static float _loop_interval;
 
+static bool _loop_free_run; // True if loop runs without delay.
+
+static int (*_loop_trigger)(int timeout_ms, uint64_t *timestamp_ns); // Blocks until next sample, NULL to use busy loop.
+
+static uint64_t _loop_trigger_ns; // Timestamp of the sample which started current loop, 0 if not synchronized.
+
+static uint64_t _loop_sample_ns; // Timestamp of the newest sample.
+
+static int _loop_trigger_fails; // Consecutive failed waits of trigger.
+
 static pthread_mutex_t _loop_mutex;
 
+static int loop_wait_trigger();
+
 //-----
 
 /*
@@ -32,6 +46,13 @@ int loop_init(float rate_hz){
  * 
  */
 void loop_delay_control(){
+    if(_loop_free_run){
+        return;
+    }
+    if(_loop_trigger != NULL && loop_wait_trigger() == 0){
+        gettimeofday(&_loop_tv, NULL);
+        return;
+    }
     if(!tv_is_updated(&_loop_tv)){
         gettimeofday(&_loop_tv, NULL);
     }
@@ -55,6 +76,44 @@ void loop_delay_control(){
 
 }
 
+/**
+ * @brief Run the loop without delay, e.g. to replay a recording.
+ * loop_get_interval still returns the nominal interval.
+ * 
+ * @param free_run 
+ *      True to skip delay.
+ */
+void loop_set_free_run(bool free_run){
+    _loop_free_run = free_run;
+}
+
+/**
+ * @brief Check if loop runs without delay.
+ * 
+ * @return True if loop is free running, e.g. replaying a recording.
+ */
+bool loop_is_free_run(){
+    return _loop_free_run;
+}
+
+/**
+ * @brief Start each loop on a sample of sensor instead of busy loop.
+ * Samples are skipped until a loop interval has passed, so loop runs at
+ * the sensor rate divided by an integer. A failed wait falls back to busy
+ * loop for that loop only, busy loop takes over for good after
+ * LOOP_TRIGGER_MAX_FAILS failures in a row.
+ * 
+ * @param wait 
+ *      Blocks until samples are taken, returns the number of samples, 0 if
+ *      timeout or -1 if fail. Should go on waiting when a signal interrupts
+ *      it. NULL to use busy loop.
+ */
+void loop_set_trigger(int (*wait)(int timeout_ms, uint64_t *timestamp_ns)){
+    _loop_trigger = wait;
+    _loop_trigger_ns = 0;
+    _loop_trigger_fails = 0;
+}
+
 /**
  * @brief Setter of loop rate.
  * 
@@ -107,4 +166,44 @@ void loop_lock_mutex() {
  */
 void loop_unlock_mutex() {
     pthread_mutex_unlock(&_loop_mutex);
+}
+
+/**
+ * @brief Wait samples of trigger until a loop interval has passed.
+ * 
+ * @return 0 if success, -1 if this loop should be timed by busy loop.
+ */
+static int loop_wait_trigger(){
+    uint64_t interval_ns = (uint64_t)(1e9f * _loop_interval);
+    int timeout_ms = (int)(2e3f * _loop_interval) + 1;
+    while(1){
+        uint64_t timestamp_ns;
+        int n = _loop_trigger(timeout_ms, &timestamp_ns);
+        if(n <= 0){
+            // Next wait starts over on a fresh sample.
+            _loop_trigger_ns = 0;
+            if(++_loop_trigger_fails >= LOOP_TRIGGER_MAX_FAILS){
+                LOG_ERROR("Failed to wait loop trigger %d times, switching to busy loop.\n", _loop_trigger_fails);
+                _loop_trigger = NULL;
+            }else{
+                LOG_ERROR("Failed to wait loop trigger, using busy loop for this loop.\n");
+            }
+            return -1;
+        }
+        _loop_trigger_fails = 0;
+        if(_loop_trigger_ns == 0){
+            _loop_trigger_ns = _loop_sample_ns = timestamp_ns;
+            return 0;
+        }
+        uint64_t period_ns = (timestamp_ns - _loop_sample_ns) / n;
+        _loop_sample_ns = timestamp_ns;
+        // Half a sample period absorbs the drift between sensor clock and loop interval.
+        if(timestamp_ns - _loop_trigger_ns + period_ns / 2 >= interval_ns){
+            if(timestamp_ns - _loop_trigger_ns > interval_ns + period_ns){
+                LOG_ERROR("Loop take too long, %llu microseconds.\n", (unsigned long long)(timestamp_ns - _loop_trigger_ns) / 1000);
+            }
+            _loop_trigger_ns = timestamp_ns;
+            return 0;
+        }
+    }
 }
\ No newline at end of file
@@ -14,10 +14,19 @@
 #ifndef _LOOP_H_
 #define _LOOP_H_
 
+#include <stdbool.h>
+#include <stdint.h>
+
 int loop_init(float rate_hz);
 
 void loop_delay_control();
 
+void loop_set_free_run(bool free_run);
+
+bool loop_is_free_run();
+
+void loop_set_trigger(int (*wait)(int timeout_ms, uint64_t *timestamp_ns));
+
 void loop_set_rate(float hz_rate);
 
 float loop_get_rate();
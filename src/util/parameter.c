@@ -8,6 +8,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <json-c/json.h>
 
 #define PARAM_FILE "/root/.raspi-pilot/parameter.json"
@@ -68,13 +69,24 @@ const char *parameter_keys[] = {
     "PID_ALT_I",
     "PID_ALT_D",
     "PID_ALT_I_LIMIT",
-    "PID_ALT_O_LIMIT"
+    "PID_ALT_O_LIMIT",
+    "IMU_GYRO_FS",
+    "IMU_GYRO_DLPF",
+    "IMU_GYRO_FCHOICE",
+    "IMU_ACCEL_FS",
+    "IMU_ACCEL_DLPF",
+    "IMU_ACCEL_FCHOICE",
+    "IMU_SMPLRT_DIV",
+    "IMU_MAG_EN",
+    "IMU_MAG_16BIT"
 };
 
 static pthread_mutex_t _parameter_mutex;
 
 static json_object *_param_json;
 
+static atomic_uint _generation; // Number of successful parameter_set_value.
+
 //-----
 
 /**
@@ -219,6 +231,7 @@ int parameter_set_value_no_mutex(const char *key, void *data, bool save) {
         }
     }
     if (ret == 0) {
+        atomic_fetch_add(&_generation, 1);
         if (save) {
             // Update json.
             DEBUG("Saving File.\n");
@@ -303,6 +316,17 @@ int parameter_get_index_no_mutex(const char *key) {
     return index;
 }
 
+/**
+ * @brief Get the number of parameter changes so far. Modules applying
+ * parameters at runtime poll it from their own thread instead of being called
+ * back from the thread which set the parameter.
+ * 
+ * @return Incremented by every successful set.
+ */
+unsigned int parameter_get_generation() {
+    return atomic_load(&_generation);
+}
+
 /**
  * @brief For multi-thread usage. Lock the parameters.
  * 
@@ -67,7 +67,16 @@ enum PARAMETER {
     PARAMETER_PID_ALT_I,
     PARAMETER_PID_ALT_D,
     PARAMETER_PID_ALT_I_LIMIT,
-    PARAMETER_PID_ALT_O_LIMIT
+    PARAMETER_PID_ALT_O_LIMIT,
+    PARAMETER_IMU_GYRO_FS,
+    PARAMETER_IMU_GYRO_DLPF,
+    PARAMETER_IMU_GYRO_FCHOICE,
+    PARAMETER_IMU_ACCEL_FS,
+    PARAMETER_IMU_ACCEL_DLPF,
+    PARAMETER_IMU_ACCEL_FCHOICE,
+    PARAMETER_IMU_SMPLRT_DIV,
+    PARAMETER_IMU_MAG_EN,
+    PARAMETER_IMU_MAG_16BIT
 };
 
 int parameter_init();
@@ -94,6 +103,8 @@ int parameter_get_index(const char *key);
 
 int parameter_get_index_no_mutex(const char *key);
 
+unsigned int parameter_get_generation();
+
 void parameter_lock_mutex();
 
 void parameter_unlock_mutex();
@@ -0,0 +1,194 @@
+#include "boot.h"
+
+#include "util/logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+
+struct BootRecord {
+    const char *name; // Name of step.
+    uint64_t start_ns; // Start since boot_start.
+    uint64_t duration_ns; // Time spent in initiator.
+    int ret; // Return value of initiator.
+    bool parallel; // True if run in a parallel group.
+};
+
+struct BootThread {
+    const struct BootStep *step; // Step run by thread.
+    pthread_t thread;
+    bool started; // True if thread is created.
+    int ret; // Return value of step.
+};
+
+static uint64_t _start_ns; // Time of boot_start.
+static uint64_t _armable_ns; // Time from boot_start to armable, 0 if not yet.
+static struct BootRecord _records[BOOT_MAX_STEPS]; // Each slot is written by one thread only.
+static int _n_records; // Slots taken, may exceed BOOT_MAX_STEPS.
+
+static uint64_t boot_now_ns();
+
+static int boot_run_step(const struct BootStep *step, bool parallel);
+
+static void *boot_thread(void *arg);
+
+//-----
+
+/**
+ * @brief Start the boot clock. Called first in main.
+ *
+ */
+void boot_start() {
+    _start_ns = boot_now_ns();
+    _armable_ns = 0;
+    _n_records = 0;
+}
+
+/**
+ * @brief Run one step in calling thread and trace it.
+ *
+ * @param name
+ *      Name shown in trace.
+ * @param init
+ *      Initiator, returns 0 if success else -1.
+ * @return Return value of init.
+ */
+int boot_run(const char *name, int (*init)()) {
+    struct BootStep step = {.name = name, .init = init};
+    return boot_run_step(&step, false);
+}
+
+/**
+ * @brief Run steps in parallel threads and wait for all of them.
+ * Steps must not depend on each other. Steps on the same bus still take
+ * turns at the bus arbiter, but their waits overlap.
+ *
+ * @param steps
+ *      Steps to run.
+ * @param n
+ *      Number of steps.
+ * @return 0 if every step succeeded else -1.
+ */
+int boot_run_parallel(const struct BootStep *steps, int n) {
+    struct BootThread *threads = calloc(n, sizeof(struct BootThread));
+    if (threads == NULL) {
+        LOG_ERROR("Failed to allocate threads, running in sequence.\n");
+        int i, ret = 0;
+        for (i = 0; i < n; i++) {
+            if (boot_run_step(&steps[i], false) != 0) {
+                ret = -1;
+            }
+        }
+        return ret;
+    }
+    int i, ret = 0;
+    for (i = 0; i < n; i++) {
+        threads[i].step = &steps[i];
+        threads[i].started = pthread_create(&threads[i].thread, NULL, boot_thread, &threads[i]) == 0;
+    }
+    for (i = 0; i < n; i++) {
+        if (threads[i].started) {
+            pthread_join(threads[i].thread, NULL);
+        } else {
+            // No thread, the step runs here after the others started.
+            threads[i].ret = boot_run_step(&steps[i], false);
+        }
+        if (threads[i].ret != 0) {
+            LOG_ERROR("Failed to initiate %s.\n", steps[i].name);
+            ret = -1;
+        }
+    }
+    free(threads);
+    return ret;
+}
+
+/**
+ * @brief Mark the end of startup. Time to armable is the time from boot_start.
+ *
+ */
+void boot_set_armable() {
+    _armable_ns = boot_now_ns() - _start_ns;
+}
+
+/**
+ * @brief Get time from boot_start to armable.
+ *
+ * @return Time in ns, 0 if not armable yet.
+ */
+uint64_t boot_get_armable_ns() {
+    return _armable_ns;
+}
+
+/**
+ * @brief Print start, duration and result of every step and the time to armable.
+ *
+ */
+void boot_dump() {
+    int i, n = _n_records < BOOT_MAX_STEPS ? _n_records : BOOT_MAX_STEPS;
+    printf("%-16s %10s %10s %-8s %s\n", "step", "start(ms)", "time(ms)", "result", "run");
+    for (i = 0; i < n; i++) {
+        const struct BootRecord *r = &_records[i];
+        printf("%-16s %10.2f %10.2f %-8s %s\n",
+            r->name, r->start_ns / 1e6, r->duration_ns / 1e6,
+            r->ret == 0 ? "ok" : "failed", r->parallel ? "parallel" : "serial");
+    }
+    if (_n_records > BOOT_MAX_STEPS) {
+        printf("%d steps not traced.\n", _n_records - BOOT_MAX_STEPS);
+    }
+    printf("armable after %.2f ms\n", _armable_ns / 1e6);
+    fflush(stdout);
+}
+
+//-----
+
+/**
+ * @brief Get monotonic time.
+ *
+ * @return Time in ns.
+ */
+static uint64_t boot_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Run a step and write its record.
+ *
+ * @param step
+ *      Step to run.
+ * @param parallel
+ *      True if run in a parallel group.
+ * @return Return value of initiator.
+ */
+static int boot_run_step(const struct BootStep *step, bool parallel) {
+    // Nested groups take slots from several threads.
+    int slot = __atomic_fetch_add(&_n_records, 1, __ATOMIC_RELAXED);
+    uint64_t start = boot_now_ns();
+    int ret = step->init();
+    uint64_t end = boot_now_ns();
+    if (slot < BOOT_MAX_STEPS) {
+        struct BootRecord *r = &_records[slot];
+        r->name = step->name;
+        r->start_ns = start - _start_ns;
+        r->duration_ns = end - start;
+        r->ret = ret;
+        r->parallel = parallel;
+    }
+    return ret;
+}
+
+/**
+ * @brief Thread of one step in a parallel group.
+ *
+ * @param arg
+ *      struct BootThread of the step.
+ * @return NULL.
+ */
+static void *boot_thread(void *arg) {
+    struct BootThread *t = arg;
+    t->ret = boot_run_step(t->step, true);
+    return NULL;
+}
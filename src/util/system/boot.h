@@ -0,0 +1,40 @@
+/**
+ * @file boot.h
+ * @author agent
+ * @brief Startup of modules with a trace of every step.
+ * Steps of one group don't depend on each other and run in parallel
+ * threads, e.g. modules on different buses. Groups run one after another.
+ * Start and duration of every step and the time to armable are kept
+ * for boot_dump.
+ *
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#ifndef _BOOT_H_
+#define _BOOT_H_
+
+#include <stdint.h>
+
+#define BOOT_MAX_STEPS 32 // Steps traced, later ones still run.
+
+struct BootStep {
+    const char *name; // Name shown in trace.
+    int (*init)(); // Initiator, returns 0 if success else -1.
+};
+
+void boot_start();
+
+int boot_run(const char *name, int (*init)());
+
+int boot_run_parallel(const struct BootStep *steps, int n);
+
+void boot_set_armable();
+
+uint64_t boot_get_armable_ns();
+
+void boot_dump();
+
+#endif // _BOOT_H_
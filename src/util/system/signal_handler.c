@@ -6,8 +6,11 @@ void signal_sigint_handler(int sig);
 
 void signal_sigpipe_handler(int sig);
 
+void signal_sigusr1_handler(int sig);
+
 void (*_on_sigint)() = NULL;
 void (*_on_sigpipe)() = NULL;
+void (*_on_sigusr1)() = NULL;
 
 //-----
 int signal_handler_init() {
@@ -16,6 +19,8 @@ int signal_handler_init() {
     signal(SIGPIPE, signal_sigpipe_handler);
     
     signal(SIGINT, signal_sigint_handler);
+
+    signal(SIGUSR1, signal_sigusr1_handler);
     
     LOG("Done.\n");
     return 0;
@@ -29,6 +34,10 @@ void signal_set_on_sigpipe(void (*func)()) {
     _on_sigpipe = func;
 }
 
+void signal_set_on_sigusr1(void (*func)()) {
+    _on_sigusr1 = func;
+}
+
 //-----
 
 void signal_sigint_handler(int sig) {
@@ -44,4 +53,10 @@ void signal_sigpipe_handler(int sig) {
         _on_sigpipe();
     }
     // Do nothing.
+}
+
+void signal_sigusr1_handler(int sig) {
+    if (_on_sigusr1 != NULL) {
+        _on_sigusr1();
+    }
 }
\ No newline at end of file
@@ -20,4 +20,6 @@ void signal_set_on_sigint(void (*func)());
 
 void signal_set_on_sigpipe(void (*func)());
 
+void signal_set_on_sigusr1(void (*func)());
+
 #endif // _SIGNAL_HANLDER_H_